@@ -0,0 +1,317 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "source/depth_estimation/BatchCost.h"
+#include "source/depth_estimation/Derp.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/test/TestPyramidLevel.h"
+#include "source/util/MaskedMedian.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+
+static const float kDisparity = 0.5f;
+
+// Levels are 2:1, as the equirect-sized dsts of a real rig
+static std::unique_ptr<PyramidLevel<PixelType>> makeLevel(
+    const int width,
+    const int numCams,
+    const ColorFormat projColorFormat = ColorFormat::unorm16) {
+  std::unique_ptr<PyramidLevel<PixelType>> level =
+      makeTestPyramidLevel(cv::Size(width, width / 2), numCams);
+  level->projColorFormat = projColorFormat;
+  level->prepareProjections({0});
+  return level;
+}
+
+static std::unique_ptr<PyramidLevel<PixelType>> makeLevelWithDisparities(
+    const int width,
+    const int numCams) {
+  std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(width, numCams);
+  cv::RNG rng(2);
+  for (int dstIdx = 0; dstIdx < int(level->rigDst.size()); ++dstIdx) {
+    rng.fill(level->dstDisparity(dstIdx), cv::RNG::UNIFORM, 0.1f, 1.0f);
+  }
+  return level;
+}
+
+// Width and number of cameras
+static void levelArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"width", "cams"});
+  for (const int width : {128, 512}) {
+    for (const int numCams : {4, 16}) {
+      b->Args({width, numCams});
+    }
+  }
+}
+
+// Width and number of threads, for thread scaling curves
+static void threadArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"width", "threads"});
+  for (const int width : {512, 2048}) {
+    for (const int numThreads : {1, 2, 4, 8}) {
+      b->Args({width, numThreads});
+    }
+  }
+}
+
+// Projected color format and width
+static void colorFormatArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"format", "width"});
+  for (const ColorFormat format : {ColorFormat::unorm16, ColorFormat::half, ColorFormat::unorm8}) {
+    for (const int width : {512, 2048}) {
+      b->Args({int(format), width});
+    }
+  }
+}
+
+// Bilateral filter engine and radius
+static void engineArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"engine", "radius"});
+  for (const BilateralEngine engine :
+       {BilateralEngine::bruteForce, BilateralEngine::lut, BilateralEngine::grid}) {
+    for (const int radius : {2, 5, 10, 20}) {
+      b->Args({int(engine), radius});
+    }
+  }
+}
+
+// Masked median kernel and radius
+static void medianArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"kernel", "radius"});
+  for (const median_util::MedianKernel kernel : {median_util::MedianKernel::sort,
+                                                 median_util::MedianKernel::network,
+                                                 median_util::MedianKernel::histogram}) {
+    for (const int radius : {1, 2, 4}) {
+      b->Args({int(kernel), radius});
+    }
+  }
+}
+
+// Scalar engine, one pixel of dst 0 at a time against every src
+static void BM_ComputeCost(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(state.range(0), state.range(1));
+  const cv::Size size = level->sizeLevel;
+  for (auto _ : state) {
+    for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
+      for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+        benchmark::DoNotOptimize(computeCost(*level, 0, kDisparity, x, y));
+      }
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * size.area());
+}
+BENCHMARK(BM_ComputeCost)->Apply(levelArgs);
+
+// Batch engine, a row of dst 0 at a time against every src
+static void BM_ComputeCostsBatch(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(state.range(0), state.range(1));
+  const cv::Size size = level->sizeLevel;
+  std::vector<int> xs;
+  for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+    xs.push_back(x);
+  }
+  const std::vector<float> disparities(xs.size(), kDisparity);
+  std::vector<float> costs;
+  std::vector<float> confidences;
+  for (auto _ : state) {
+    for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
+      computeCostsBatch(*level, 0, y, xs, disparities, costs, confidences);
+      benchmark::DoNotOptimize(costs.data());
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * size.area());
+}
+BENCHMARK(BM_ComputeCostsBatch)->Apply(levelArgs);
+
+// Batch engine against the projected color format (see ColorFormat), 16 cameras
+// proj_MB is the memory of the projections of dst 0, bytes are the colors the patch kernels read
+static void BM_ComputeCostsBatchColorFormat(benchmark::State& state) {
+  const ColorFormat format = ColorFormat(state.range(0));
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(state.range(1), 16, format);
+  const cv::Size size = level->sizeLevel;
+  std::vector<int> xs;
+  for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+    xs.push_back(x);
+  }
+  const std::vector<float> disparities(xs.size(), kDisparity);
+  std::vector<float> costs;
+  std::vector<float> confidences;
+  for (auto _ : state) {
+    for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
+      computeCostsBatch(*level, 0, y, xs, disparities, costs, confidences);
+      benchmark::DoNotOptimize(costs.data());
+    }
+  }
+
+  // Each cost reads a patch footprint of every overlapping src, and the dst patch and biases
+  int numSrcs = 0;
+  for (int srcIdx = 0; srcIdx < int(level->rigSrc.size()); ++srcIdx) {
+    numSrcs += srcIdx != level->dst2srcIdxs[0] && level->dstProjOverlaps(0, srcIdx);
+  }
+  const int footprint = 2 * kSearchWindowRadius + 2;
+  const int patch = 2 * kSearchWindowRadius + 1;
+  const int64_t pixelsPerCost = numSrcs * (footprint * footprint + patch * patch + 5);
+  state.SetItemsProcessed(int64_t(state.iterations()) * size.area());
+  state.SetBytesProcessed(
+      int64_t(state.iterations()) * size.area() * pixelsPerCost * 3 * getColorFormatBytes(format));
+  state.counters["proj_MB"] = level->projectionPeakBytes / 1048576.0;
+}
+BENCHMARK(BM_ComputeCostsBatchColorFormat)->Apply(colorFormatArgs);
+
+// Patch SSD of every pixel of dst 0 against its own projection, at half pixel offsets
+static void BM_ComputeSSD(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(state.range(0), 1);
+  const cv::Mat_<PixelType>& color = level->dstProjColor(0);
+  const cv::Mat_<PixelType>& bias = level->dstProjColorBias(0);
+  const int radius = kSearchWindowRadius;
+  for (auto _ : state) {
+    for (int y = radius; y < color.rows - radius; ++y) {
+      for (int x = radius; x < color.cols - radius; ++x) {
+        benchmark::DoNotOptimize(
+            computeSSD(color, x, y, bias(y, x), color, x + 1.0f, y + 0.5f, bias(y, x), radius));
+      }
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * color.total());
+}
+BENCHMARK(BM_ComputeSSD)->Arg(128)->Arg(512)->ArgName("width");
+
+static void BM_ColorBias(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(state.range(0), 1);
+  const cv::Mat_<PixelType>& color = level->srcColor(0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(colorBias(color, kSearchWindowRadius).data);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * color.total());
+}
+BENCHMARK(BM_ColorBias)->Arg(512)->Arg(2048)->ArgName("width");
+
+// Warp of a src into a dst, shifted by a fraction of a pixel
+static void BM_Project(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevel(state.range(0), 1);
+  const cv::Mat_<PixelType>& color = level->srcColor(0);
+  cv::Mat_<cv::Vec2f> warp(color.size());
+  for (int y = 0; y < warp.rows; ++y) {
+    for (int x = 0; x < warp.cols; ++x) {
+      warp(y, x) = cv::Vec2f(x + 0.3f, y + 0.7f);
+    }
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(project(color, warp).data);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * color.total());
+}
+BENCHMARK(BM_Project)->Arg(512)->Arg(2048)->ArgName("width");
+
+// Derp's bilateral filter of every dst of a 4 camera level
+static void BM_BilateralFilter(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level =
+      makeLevelWithDisparities(state.range(0), 4);
+  for (auto _ : state) {
+    bilateralFilter(*level, state.range(1));
+  }
+  state.SetItemsProcessed(
+      int64_t(state.iterations()) * level->sizeLevel.area() * level->rigDst.size());
+}
+BENCHMARK(BM_BilateralFilter)->Apply(threadArgs)->UseRealTime();
+
+// Derp's median filter of every dst of a 4 camera level
+static void BM_MedianFilter(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level =
+      makeLevelWithDisparities(state.range(0), 4);
+  for (auto _ : state) {
+    medianFilter(*level, state.range(1));
+  }
+  state.SetItemsProcessed(
+      int64_t(state.iterations()) * level->sizeLevel.area() * level->rigDst.size());
+}
+BENCHMARK(BM_MedianFilter)->Apply(threadArgs)->UseRealTime();
+
+// Masked median kernels (see MaskedMedian.h) against the radius, on a single thread
+// sort is the implementation cv_util::maskedMedianBlur() used to have
+static void BM_MaskedMedianKernel(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevelWithDisparities(2048, 1);
+  const cv::Mat_<float>& disparity = level->dstDisparity(0);
+  const cv::Mat_<bool>& mask = level->dstFovMask(0);
+  const median_util::MaskedImage in = {disparity.ptr<float>(),
+                                       mask.ptr<uint8_t>(),
+                                       nullptr,
+                                       disparity.cols,
+                                       disparity.rows,
+                                       true};
+  cv::Mat_<float> out(disparity.size());
+  for (auto _ : state) {
+    median_util::maskedMedianRows(
+        in,
+        state.range(1),
+        0,
+        disparity.rows,
+        out.ptr<float>(),
+        median_util::MedianKernel(state.range(0)));
+    benchmark::DoNotOptimize(out.data);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * disparity.total());
+}
+BENCHMARK(BM_MaskedMedianKernel)->Apply(medianArgs);
+
+// Joint bilateral filter of a disparity map guided by its color, at the finest level radius
+static void BM_GeneralizedJointBilateralFilter(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level =
+      makeLevelWithDisparities(state.range(0), 1);
+  const cv::Mat_<PixelType>& color = level->dstColor(0);
+  const cv::Mat_<bool> mask(color.size(), true);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        generalizedJointBilateralFilter<float, PixelType>(
+            level->dstDisparity(0),
+            color,
+            color,
+            mask,
+            kBilateralSpaceRadiusMax,
+            kBilateralSigma,
+            kBilateralWeightB,
+            kBilateralWeightG,
+            kBilateralWeightR,
+            state.range(1))
+            .data);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * color.total());
+}
+BENCHMARK(BM_GeneralizedJointBilateralFilter)->Apply(threadArgs)->UseRealTime();
+
+// Joint bilateral filter engines (see BilateralEngine) against the radius, on all threads
+static void BM_BilateralFilterEngine(benchmark::State& state) {
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeLevelWithDisparities(2048, 1);
+  const cv::Mat_<PixelType>& color = level->dstColor(0);
+  const cv::Mat_<bool> mask(color.size(), true);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        generalizedJointBilateralFilter<float, PixelType>(
+            level->dstDisparity(0),
+            color,
+            color,
+            mask,
+            state.range(1),
+            kBilateralSigma,
+            kBilateralWeightB,
+            kBilateralWeightG,
+            kBilateralWeightR,
+            -1,
+            BilateralEngine(state.range(0)))
+            .data);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * color.total());
+}
+BENCHMARK(BM_BilateralFilterEngine)->Apply(engineArgs)->UseRealTime();
+
+BENCHMARK_MAIN();
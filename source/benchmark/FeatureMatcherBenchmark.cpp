@@ -0,0 +1,119 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "source/calibration/FeatureDetector.h"
+#include "source/calibration/FeatureMatcher.h"
+#include "source/test/TestRig.h"
+
+DECLARE_int32(max_corners);
+
+using namespace fb360_dep;
+using namespace fb360_dep::calibration;
+
+// The most overlapping pair of the test rig at a quarter of its resolution, with textured images
+struct MatchingInputs {
+  Camera::Rig rig;
+  std::vector<cv::Mat_<uint8_t>> images;
+  std::vector<std::vector<Keypoint>> corners;
+};
+
+static MatchingInputs makeInputs(const int maxCorners) {
+  const Camera::Rig rigFull = Camera::loadRigFromJsonString(testRigJson);
+  int best0 = 0;
+  int best1 = 1;
+  for (int i = 0; i < int(rigFull.size()); ++i) {
+    for (int j = i + 1; j < int(rigFull.size()); ++j) {
+      if (rigFull[i].overlap(rigFull[j]) > rigFull[best0].overlap(rigFull[best1])) {
+        best0 = i;
+        best1 = j;
+      }
+    }
+  }
+
+  MatchingInputs inputs;
+  cv::RNG rng(1);
+  FLAGS_max_corners = maxCorners;
+  for (const int index : {best0, best1}) {
+    inputs.rig.push_back(rigFull[index].rescale(rigFull[index].resolution / 4));
+    const Camera& camera = inputs.rig.back();
+    cv::Mat_<uint8_t> image(camera.resolution.y(), camera.resolution.x());
+    rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+    inputs.images.push_back(image);
+    inputs.corners.push_back(findCorners(camera, image, false));
+  }
+  return inputs;
+}
+
+// findMatches() on one pair, with and without the grid of corners
+// Arguments: max corners per octave, grid
+static void BM_FindMatches(benchmark::State& state) {
+  const MatchingInputs inputs = makeInputs(state.range(0));
+  FLAGS_keypoint_grid = state.range(1);
+  int64_t numMatches = 0;
+  for (auto _ : state) {
+    const Overlap overlap = findMatches(
+        inputs.images[0],
+        inputs.corners[0],
+        inputs.rig[0],
+        inputs.images[1],
+        inputs.corners[1],
+        inputs.rig[1]);
+    numMatches += overlap.matches.size();
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * inputs.corners[0].size());
+  state.counters["matches/s"] = benchmark::Counter(numMatches, benchmark::Counter::kIsRate);
+  state.counters["corners"] = inputs.corners[0].size();
+}
+BENCHMARK(BM_FindMatches)
+    ->ArgNames({"max_corners", "grid"})
+    ->Args({1000, 0})
+    ->Args({1000, 1})
+    ->Args({10000, 0})
+    ->Args({10000, 1})
+    ->Unit(benchmark::kMillisecond);
+
+// findAllMatches() on the whole test rig at a quarter of its resolution
+// Arguments: threads
+static void BM_FindAllMatches(benchmark::State& state) {
+  Camera::Rig rig;
+  std::vector<cv::Mat_<uint8_t>> images;
+  std::map<std::string, std::vector<Keypoint>> allCorners;
+  cv::RNG rng(1);
+  FLAGS_max_corners = 2000;
+  for (const Camera& camera : Camera::loadRigFromJsonString(testRigJson)) {
+    rig.push_back(camera.rescale(camera.resolution / 4));
+    images.emplace_back(rig.back().resolution.y(), rig.back().resolution.x());
+    rng.fill(images.back(), cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(images.back(), images.back(), cv::Size(5, 5), 0);
+    allCorners[rig.back().id] = findCorners(rig.back(), images.back(), false);
+  }
+  FLAGS_threads = state.range(0);
+  int64_t numMatches = 0;
+  for (auto _ : state) {
+    for (const Overlap& overlap : findAllMatches(rig, images, allCorners)) {
+      numMatches += overlap.matches.size();
+    }
+  }
+  state.counters["matches/s"] = benchmark::Counter(numMatches, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_FindAllMatches)
+    ->ArgName("threads")
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16)
+    ->Arg(64)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,117 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "source/depth_estimation/CostKernels.h"
+#include "source/depth_estimation/DerpUtil.h"
+#include "source/test/TestRig.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+
+static const float kDisparity = 0.5f;
+
+// Two overlapping cameras of the test rig, normalized as in DerpCLI
+static Camera::Rig loadTestRig() {
+  Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  Camera::normalizeRig(rig);
+  return rig;
+}
+
+// dst pixel -> world point -> src pixel through Camera, in double precision
+// Arguments: image width, image height
+static void BM_CameraDstToSrc(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const Camera::Rig rig = loadTestRig();
+  int numSeen = 0;
+  for (auto _ : state) {
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const Camera::Vector3 pWorld = dstToWorldPoint(rig[0], x, y, kDisparity, width, height);
+        Camera::Vector2 pSrc;
+        numSeen += worldToSrcPoint(pSrc, pWorld, rig[1], width, height);
+      }
+    }
+  }
+  benchmark::DoNotOptimize(numSeen);
+  state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+}
+BENCHMARK(BM_CameraDstToSrc)->Args({256, 128});
+
+// Same through a ray table and a single precision projector, one point at a time
+static void BM_RayTableDstToSrcScalar(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const Camera::Rig rig = loadTestRig();
+  const cv::Mat_<cv::Vec3f> rays = computeDstRays(rig[0], width, height);
+  const SrcProjector projector = makeSrcProjector(rig[1], rig[0], width, height);
+  const float depth = 1.0f / kDisparity;
+  float xSrc;
+  float ySrc;
+  for (auto _ : state) {
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const cv::Vec3f& ray = rays(y, x);
+        projectToSrcScalar(projector, 1, &ray[0], &ray[1], &ray[2], &depth, &xSrc, &ySrc);
+        benchmark::DoNotOptimize(xSrc);
+      }
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+}
+BENCHMARK(BM_RayTableDstToSrcScalar)->Args({256, 128});
+
+// Same a row at a time, with the SIMD projector when available
+static void BM_RayTableDstToSrcBatch(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const Camera::Rig rig = loadTestRig();
+  const cv::Mat_<cv::Vec3f> rays = computeDstRays(rig[0], width, height);
+  const SrcProjector projector = makeSrcProjector(rig[1], rig[0], width, height);
+  std::vector<float> dirX(width), dirY(width), dirZ(width);
+  const std::vector<float> depth(width, 1.0f / kDisparity);
+  std::vector<float> xSrc(width), ySrc(width);
+  for (auto _ : state) {
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        dirX[x] = rays(y, x)[0];
+        dirY[x] = rays(y, x)[1];
+        dirZ[x] = rays(y, x)[2];
+      }
+      projectToSrc(
+          projector,
+          width,
+          dirX.data(),
+          dirY.data(),
+          dirZ.data(),
+          depth.data(),
+          xSrc.data(),
+          ySrc.data());
+      benchmark::DoNotOptimize(xSrc.data());
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+}
+BENCHMARK(BM_RayTableDstToSrcBatch)->Args({256, 128});
+
+// One-time cost of a ray table, paid once per dst and level
+static void BM_ComputeDstRays(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const Camera::Rig rig = loadTestRig();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(computeDstRays(rig[0], width, height).data);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+}
+BENCHMARK(BM_ComputeDstRays)->Args({256, 128});
+
+BENCHMARK_MAIN();
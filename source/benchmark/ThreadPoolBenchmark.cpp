@@ -0,0 +1,113 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+
+// Thread-per-task pool that ThreadPool used to be, kept here as a baseline
+struct SpawnPerTaskThreadPool {
+  explicit SpawnPerTaskThreadPool(const int maxThreadsFlag)
+      : maxThreads(ThreadPool::getThreadCountFromFlag(maxThreadsFlag)) {}
+
+  template <class Fn, class... Args>
+  void spawn(Fn&& fn, Args&&... args) {
+    if (int(threads.size()) == maxThreads) {
+      join();
+    }
+    threads.emplace_back(std::forward<Fn>(fn), std::forward<Args>(args)...);
+  }
+
+  void join() {
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+
+ private:
+  const int maxThreads;
+  std::vector<std::thread> threads;
+};
+
+// Stand-in for the per-pixel work in a ping pong row: a few flops per pixel
+static void processRow(std::vector<float>& row) {
+  for (float& value : row) {
+    value = std::sqrt(value * value + 1.0f);
+  }
+}
+
+// One task per image row, as in Derp's ping pong propagation
+// Arguments: image width, image height
+template <class Pool>
+static void BM_RowTasks(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  std::vector<std::vector<float>> image(height, std::vector<float>(width, 1.0f));
+  for (auto _ : state) {
+    Pool threadPool(-1);
+    for (int y = 0; y < height; ++y) {
+      threadPool.spawn(&processRow, std::ref(image[y]));
+    }
+    threadPool.join();
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+}
+BENCHMARK_TEMPLATE(BM_RowTasks, SpawnPerTaskThreadPool)
+    ->Args({256, 128})
+    ->Args({2048, 1024})
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_RowTasks, ThreadPool)->Args({256, 128})->Args({2048, 1024})->UseRealTime();
+
+// Empty tasks: measures the scheduling overhead alone
+template <class Pool>
+static void BM_EmptyTasks(benchmark::State& state) {
+  const int numTasks = state.range(0);
+  std::atomic<int> count(0);
+  for (auto _ : state) {
+    Pool threadPool(-1);
+    for (int i = 0; i < numTasks; ++i) {
+      threadPool.spawn([&count] { ++count; });
+    }
+    threadPool.join();
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * numTasks);
+}
+BENCHMARK_TEMPLATE(BM_EmptyTasks, SpawnPerTaskThreadPool)->Arg(1024)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_EmptyTasks, ThreadPool)->Arg(1024)->UseRealTime();
+
+// 2D tiles through ThreadPool::parallelForTiles
+// Arguments: image width, image height, tile size
+static void BM_ParallelForTiles(benchmark::State& state) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const int tileSize = state.range(2);
+  std::vector<float> image(width * height, 1.0f);
+  for (auto _ : state) {
+    ThreadPool threadPool;
+    threadPool.parallelForTiles(
+        0, 0, width, height, tileSize, tileSize, [&](int xBegin, int yBegin, int xEnd, int yEnd) {
+          for (int y = yBegin; y < yEnd; ++y) {
+            for (int x = xBegin; x < xEnd; ++x) {
+              float& value = image[y * width + x];
+              value = std::sqrt(value * value + 1.0f);
+            }
+          }
+        });
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * width * height);
+}
+BENCHMARK(BM_ParallelForTiles)->Args({2048, 1024, 64})->Args({2048, 1024, 128})->UseRealTime();
+
+BENCHMARK_MAIN();
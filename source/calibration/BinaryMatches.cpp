@@ -0,0 +1,228 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/calibration/BinaryMatches.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include <folly/FileUtil.h>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+namespace {
+
+const char kMagic[8] = {'D', 'E', 'P', 'M', 'A', 'T', 'C', 'H'};
+const uint32_t kVersion = 1;
+const size_t kAlignment = 8;
+
+size_t align(const size_t size) {
+  return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+void append(std::string& buffer, const void* data, const size_t size) {
+  buffer.append(static_cast<const char*>(data), size);
+}
+
+void appendUint32(std::string& buffer, const uint32_t value) {
+  append(buffer, &value, sizeof(value));
+}
+
+void appendName(std::string& buffer, const std::string& name) {
+  buffer.append(name);
+  buffer.resize(align(buffer.size()));
+}
+
+// Walks the records of a mapping. A record that does not fit truncates the reader: it and every
+// read after it return nullptr, and counts and names read as 0 and empty
+class RecordReader {
+ public:
+  RecordReader(const char* data, const size_t size) : data(data), size(size) {}
+
+  const char* read(const size_t count) {
+    if (truncated || count > size - offset) {
+      truncated = true;
+      return nullptr;
+    }
+    const char* result = data + offset;
+    offset += count;
+    return result;
+  }
+
+  uint32_t readUint32() {
+    uint32_t value = 0;
+    if (const char* bytes = read(sizeof(value))) {
+      std::memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+  }
+
+  // Names are padded so that the next record stays aligned
+  std::string readName(const uint32_t length) {
+    const char* name = read(length);
+    read(align(offset) - offset);
+    return name ? std::string(name, length) : std::string();
+  }
+
+  bool isTruncated() const {
+    return truncated;
+  }
+
+  bool done() const {
+    return offset == size;
+  }
+
+ private:
+  const char* data;
+  const size_t size;
+  size_t offset = 0;
+  bool truncated = false;
+};
+
+} // namespace
+
+bool isBinaryMatchesFile(const std::string& path) {
+  return filesystem::path(path).extension().string() == kBinaryMatchesExtension;
+}
+
+void BinaryMatchesWriter::addImage(
+    const std::string& image,
+    const std::vector<Camera::Vector2>& corners) {
+  appendUint32(images, image.size());
+  appendUint32(images, corners.size());
+  appendName(images, image);
+  for (const Camera::Vector2& corner : corners) {
+    const double xy[2] = {corner.x(), corner.y()};
+    append(images, xy, sizeof(xy));
+  }
+  ++imageCount;
+}
+
+void BinaryMatchesWriter::addOverlap(
+    const std::string& image0,
+    const std::string& image1,
+    const std::vector<BinaryMatch>& matches) {
+  static_assert(sizeof(BinaryMatch) == 16, "BinaryMatch is written as is");
+  appendUint32(overlaps, image0.size());
+  appendUint32(overlaps, image1.size());
+  appendUint32(overlaps, matches.size());
+  appendUint32(overlaps, 0);
+  appendName(overlaps, image0);
+  appendName(overlaps, image1);
+  append(overlaps, matches.data(), matches.size() * sizeof(BinaryMatch));
+  ++overlapCount;
+}
+
+void BinaryMatchesWriter::save(const std::string& path) const {
+  std::string buffer(kMagic, sizeof(kMagic));
+  appendUint32(buffer, kVersion);
+  appendUint32(buffer, imageCount);
+  appendUint32(buffer, overlapCount);
+  appendUint32(buffer, 0);
+  buffer += images;
+  buffer += overlaps;
+
+  const filesystem::path temp = path + ".tmp";
+  CHECK(folly::writeFile(buffer, temp.string().c_str())) << "could not write " << temp;
+  filesystem::rename(temp, path);
+}
+
+BinaryMatchesFile::BinaryMatchesFile(const std::string& path) {
+  std::string error;
+  CHECK(load(path, error)) << error;
+}
+
+std::unique_ptr<BinaryMatchesFile> BinaryMatchesFile::tryLoad(
+    const std::string& path,
+    std::string& error) {
+  std::unique_ptr<BinaryMatchesFile> file(new BinaryMatchesFile());
+  if (!file->load(path, error)) {
+    return nullptr;
+  }
+  return file;
+}
+
+bool BinaryMatchesFile::load(const std::string& path, std::string& error) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = "could not open binary matches file: " + path;
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size < off_t(sizeof(kMagic))) {
+    close(fd);
+    error = "not a binary matches file: " + path;
+    return false;
+  }
+  void* mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    error = "could not map " + path;
+    return false;
+  }
+  data = static_cast<const char*>(mapping);
+  size = status.st_size;
+
+  RecordReader reader(data, size);
+  if (std::memcmp(reader.read(sizeof(kMagic)), kMagic, sizeof(kMagic)) != 0) {
+    error = "not a binary matches file: " + path;
+    return false;
+  }
+  const uint32_t version = reader.readUint32();
+  if (version != kVersion) {
+    error = "unsupported binary matches file version: " + path;
+    return false;
+  }
+  const uint32_t imageCount = reader.readUint32();
+  const uint32_t overlapCount = reader.readUint32();
+  reader.readUint32();
+
+  for (uint32_t i = 0; i < imageCount && !reader.isTruncated(); ++i) {
+    const uint32_t nameLength = reader.readUint32();
+    const uint32_t cornerCount = reader.readUint32();
+    const std::string name = reader.readName(nameLength);
+    const char* corners = reader.read(size_t(cornerCount) * 2 * sizeof(double));
+    images.push_back({name, reinterpret_cast<const double*>(corners), int(cornerCount)});
+  }
+  for (uint32_t i = 0; i < overlapCount && !reader.isTruncated(); ++i) {
+    const uint32_t nameLength0 = reader.readUint32();
+    const uint32_t nameLength1 = reader.readUint32();
+    const uint32_t matchCount = reader.readUint32();
+    reader.readUint32();
+    const std::string name0 = reader.readName(nameLength0);
+    const std::string name1 = reader.readName(nameLength1);
+    const char* matches = reader.read(size_t(matchCount) * sizeof(BinaryMatch));
+    overlaps.push_back(
+        {{{name0, name1}}, reinterpret_cast<const BinaryMatch*>(matches), int(matchCount)});
+  }
+  if (reader.isTruncated()) {
+    error = "truncated binary matches file: " + path;
+    return false;
+  }
+  if (!reader.done()) {
+    error = "trailing data in binary matches file: " + path;
+    return false;
+  }
+  return true;
+}
+
+BinaryMatchesFile::~BinaryMatchesFile() {
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+  }
+}
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "source/util/Camera.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+// Compact binary alternative to the matches JSON that MatchCorners writes and GeometricCalibration
+// reads, with the same contents: the corners of each image and the matches of each overlap
+// Files are read through a memory mapping that BinaryMatchesFile indexes without copying
+// Readers copy out what they keep, which skips the JSON parse but not the copy
+// Layout, in the byte order of the machine that wrote the file, every record 8-byte aligned:
+//   header: magic "DEPMATCH", uint32 version, uint32 image count, uint32 overlap count, uint32 0
+//   image: uint32 name length, uint32 corner count, name, corner count x (double x, double y)
+//   overlap: uint32 name lengths[2], uint32 match count, uint32 0, names, match count x BinaryMatch
+
+const std::string kBinaryMatchesExtension = ".bin";
+
+struct BinaryMatch {
+  int32_t corners[2];
+  double score;
+};
+
+// Whether path names a binary matches file rather than a JSON one
+bool isBinaryMatchesFile(const std::string& path);
+
+class BinaryMatchesWriter {
+ public:
+  void addImage(const std::string& image, const std::vector<Camera::Vector2>& corners);
+  void addOverlap(
+      const std::string& image0,
+      const std::string& image1,
+      const std::vector<BinaryMatch>& matches);
+
+  // Writes to a temporary file that is then renamed to path, so readers never see a partial file
+  void save(const std::string& path) const;
+
+ private:
+  std::string images;
+  std::string overlaps;
+  uint32_t imageCount = 0;
+  uint32_t overlapCount = 0;
+};
+
+class BinaryMatchesFile {
+ public:
+  struct Image {
+    std::string image;
+    const double* corners; // x, y of each corner
+    int cornerCount;
+
+    Camera::Vector2 corner(const int index) const {
+      return {corners[2 * index], corners[2 * index + 1]};
+    }
+  };
+
+  struct Overlap {
+    std::array<std::string, 2> images;
+    const BinaryMatch* matches;
+    int matchCount;
+  };
+
+  // Maps path and indexes its records, CHECKs that it is a well-formed binary matches file
+  explicit BinaryMatchesFile(const std::string& path);
+  ~BinaryMatchesFile();
+
+  // Same, but returns nullptr and sets error if path can't be read or is not well-formed, for
+  // files that are fine to lose, such as feature cache entries
+  static std::unique_ptr<BinaryMatchesFile> tryLoad(const std::string& path, std::string& error);
+
+  BinaryMatchesFile(const BinaryMatchesFile&) = delete;
+  BinaryMatchesFile& operator=(const BinaryMatchesFile&) = delete;
+
+  // Point into the mapping, valid as long as this file
+  std::vector<Image> images;
+  std::vector<Overlap> overlaps;
+
+ private:
+  BinaryMatchesFile() = default;
+
+  bool load(const std::string& path, std::string& error);
+
+  const char* data = nullptr;
+  size_t size = 0;
+};
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -15,7 +15,11 @@ DEFINE_double(
     match_score_threshold,
     0.75,
     "minimum zncc score required for a match to be included");
-DEFINE_string(matches, "", "path to matches .json file");
+DEFINE_string(
+    matches,
+    "",
+    "path to matches .json file, or .bin for the binary format. comma-separated paths of several "
+    "frames are calibrated together");
 DEFINE_string(rig_in, "", "input camera rig .json filename");
 DEFINE_string(rig_out, "", "output camera rig .json filename");
 DEFINE_int32(threads, -1, "number of threads (-1 = max allowed, 0 = no threading)");
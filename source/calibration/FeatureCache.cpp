@@ -0,0 +1,132 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/calibration/FeatureCache.h"
+
+#include <memory>
+
+#include <glog/logging.h>
+
+#include <folly/Format.h>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+const uint64_t kFnvPrime = 1099511628211ull;
+
+uint64_t hashBytes(const void* data, const size_t size, const uint64_t hash) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t result = hash;
+  for (size_t i = 0; i < size; ++i) {
+    result = (result ^ bytes[i]) * kFnvPrime;
+  }
+  return result;
+}
+
+uint64_t hashString(const std::string& s, const uint64_t hash) {
+  // Length first, so that consecutive strings can't trade characters
+  const uint64_t length = s.size();
+  return hashBytes(s.data(), s.size(), hashBytes(&length, sizeof(length), hash));
+}
+
+uint64_t hashImage(const cv::Mat_<uint8_t>& image, const uint64_t hash) {
+  const int32_t dims[2] = {image.rows, image.cols};
+  uint64_t result = hashBytes(dims, sizeof(dims), hash);
+  for (int y = 0; y < image.rows; ++y) {
+    result = hashBytes(image.ptr(y), image.cols, result);
+  }
+  return result;
+}
+
+// Names the single record of an entry, so that a file renamed by hand is not taken for another
+static std::string getKeyName(const uint64_t key) {
+  return folly::sformat("{:016x}", key);
+}
+
+FeatureCache::FeatureCache(const std::string& dir) : dir(dir) {
+  if (isEnabled()) {
+    filesystem::create_directories(dir);
+  }
+}
+
+std::string FeatureCache::getPath(const uint64_t key, const std::string& kind) const {
+  const std::string filename = getKeyName(key) + "." + kind + kBinaryMatchesExtension;
+  return (filesystem::path(dir) / filename).string();
+}
+
+// Unreadable entries, e.g. from a run that was killed or a disk that filled up, are misses: the
+// caller recomputes them and saves over them
+static std::unique_ptr<BinaryMatchesFile> loadEntry(const std::string& path) {
+  std::string error;
+  std::unique_ptr<BinaryMatchesFile> file = BinaryMatchesFile::tryLoad(path, error);
+  if (!file) {
+    LOG(WARNING) << "ignoring feature cache entry: " << error;
+  }
+  return file;
+}
+
+bool FeatureCache::loadCorners(const uint64_t key, std::vector<Camera::Vector2>& corners) const {
+  const std::string path = getPath(key, "corners");
+  if (!isEnabled() || !filesystem::exists(path)) {
+    return false;
+  }
+  const std::unique_ptr<BinaryMatchesFile> file = loadEntry(path);
+  if (!file) {
+    return false;
+  }
+  if (file->images.size() != 1 || file->images[0].image != getKeyName(key)) {
+    LOG(WARNING) << "ignoring corrupt feature cache entry: " << path;
+    return false;
+  }
+  const BinaryMatchesFile::Image& image = file->images[0];
+  corners.clear();
+  for (int i = 0; i < image.cornerCount; ++i) {
+    corners.push_back(image.corner(i));
+  }
+  return true;
+}
+
+void FeatureCache::saveCorners(const uint64_t key, const std::vector<Camera::Vector2>& corners)
+    const {
+  if (isEnabled()) {
+    BinaryMatchesWriter writer;
+    writer.addImage(getKeyName(key), corners);
+    writer.save(getPath(key, "corners"));
+  }
+}
+
+bool FeatureCache::loadMatches(const uint64_t key, std::vector<BinaryMatch>& matches) const {
+  const std::string path = getPath(key, "matches");
+  if (!isEnabled() || !filesystem::exists(path)) {
+    return false;
+  }
+  const std::unique_ptr<BinaryMatchesFile> file = loadEntry(path);
+  if (!file) {
+    return false;
+  }
+  if (file->overlaps.size() != 1 || file->overlaps[0].images[0] != getKeyName(key)) {
+    LOG(WARNING) << "ignoring corrupt feature cache entry: " << path;
+    return false;
+  }
+  const BinaryMatchesFile::Overlap& overlap = file->overlaps[0];
+  matches.assign(overlap.matches, overlap.matches + overlap.matchCount);
+  return true;
+}
+
+void FeatureCache::saveMatches(const uint64_t key, const std::vector<BinaryMatch>& matches)
+    const {
+  if (isEnabled()) {
+    BinaryMatchesWriter writer;
+    writer.addOverlap(getKeyName(key), getKeyName(key), matches);
+    writer.save(getPath(key, "matches"));
+  }
+}
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -0,0 +1,57 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "source/calibration/BinaryMatches.h"
+#include "source/util/Camera.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+// FNV-1a hash, chained through hash so that several values make one key
+const uint64_t kFnvOffsetBasis = 14695981039346656037ull;
+
+uint64_t hashBytes(const void* data, const size_t size, const uint64_t hash = kFnvOffsetBasis);
+uint64_t hashString(const std::string& s, const uint64_t hash = kFnvOffsetBasis);
+
+// Hash of the dimensions and pixels of image
+uint64_t hashImage(const cv::Mat_<uint8_t>& image, const uint64_t hash = kFnvOffsetBasis);
+
+// On-disk cache of the corners of each image and the matches of each pair of images that
+// MatchCorners finds, so that a run only detects and matches what an earlier run has not
+// Callers key entries by everything that determines them, e.g. image contents, cameras and flags
+// Each entry is a binary matches file in dir named after its key. An empty dir disables the cache
+// Entries that can't be read are logged and treated as missing, so that they are computed again
+class FeatureCache {
+ public:
+  explicit FeatureCache(const std::string& dir);
+
+  bool isEnabled() const {
+    return !dir.empty();
+  }
+
+  bool loadCorners(const uint64_t key, std::vector<Camera::Vector2>& corners) const;
+  void saveCorners(const uint64_t key, const std::vector<Camera::Vector2>& corners) const;
+
+  bool loadMatches(const uint64_t key, std::vector<BinaryMatch>& matches) const;
+  void saveMatches(const uint64_t key, const std::vector<BinaryMatch>& matches) const;
+
+ private:
+  std::string getPath(const uint64_t key, const std::string& kind) const;
+
+  std::string dir;
+};
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -7,6 +7,8 @@
 
 #include "source/calibration/FeatureDetector.h"
 
+#include <cfloat>
+
 #include <boost/timer/timer.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -14,6 +16,7 @@
 #include <folly/Format.h>
 
 #include "source/util/Camera.h"
+#include "source/util/StackArray.h"
 #include "source/util/ThreadPool.h"
 
 DEFINE_int32(deduplicate_radius, 3, "remove duplicate corners found at different octaves");
@@ -36,6 +39,8 @@ using ImageId = std::string;
 namespace fb360_dep {
 namespace calibration {
 
+const cv::Point2f kRefineOffset(0.0017, 0.0013); // just some unlikely offset
+
 bool isUniqueCorner(
     const std::vector<Keypoint>& corners,
     const int previousCornerCount,
@@ -87,16 +92,15 @@ std::vector<Camera::Vector2> findScaledCorners(
       cv::TermCriteria(cv::TermCriteria::EPS, 0, FLAGS_refine_corners_epsilon);
 
   // If refinement fails, opencv silently leaves the inputs untouched. So use unlikely inputs
-  const cv::Point2f kOffset(0.0017, 0.0013); // just some unlikely offset
   std::vector<cv::Point2f> cvRefined(cvCorners);
   for (cv::Point2f& p : cvRefined) {
-    p += kOffset;
+    p += kRefineOffset;
   }
   cv::cornerSubPix(gray, cvRefined, windowRadius, zeroZone, criteria);
 
   // Only keep refined points, convert out of opencv coordinate convention, scale
   for (ssize_t i = 0; i < ssize(cvRefined); ++i) {
-    if (cvRefined[i] != cvCorners[i] + kOffset) {
+    if (cvRefined[i] != cvCorners[i] + kRefineOffset) {
       cameraCorners.emplace_back((cvRefined[i].x + 0.5f) / scale, (cvRefined[i].y + 0.5f) / scale);
     }
   }
@@ -104,6 +108,234 @@ std::vector<Camera::Vector2> findScaledCorners(
   return cameraCorners;
 }
 
+namespace {
+
+// Per thread, so that hasCornerNear() stops allocating once the largest image has been seen
+struct HarrisScratch {
+  std::vector<float> dxx;
+  std::vector<float> dxy;
+  std::vector<float> dyy;
+  std::vector<float> response;
+  std::vector<int> candidates;
+  std::vector<int> corners;
+};
+
+HarrisScratch& getHarrisScratch() {
+  static thread_local HarrisScratch scratch;
+  return scratch;
+}
+
+inline int reflect101(const int i, const int size) {
+  if (size == 1) {
+    return 0;
+  }
+  const int reflected = i < 0 ? -i : i;
+  return reflected < size ? reflected : 2 * size - 2 - reflected;
+}
+
+// Same as cv::cornerHarris() with a 3 x 3 Sobel operator and cv::BORDER_REFLECT_101, into
+// scratch.response
+void computeHarrisResponse(
+    HarrisScratch& scratch,
+    const Image& image,
+    const int blockSize,
+    const float harrisParameter) {
+  const int cols = image.cols;
+  const int rows = image.rows;
+  const float scale = 1.0f / (4 * blockSize * 255);
+  scratch.dxx.resize(cols * rows);
+  scratch.dxy.resize(cols * rows);
+  scratch.dyy.resize(cols * rows);
+  scratch.response.resize(cols * rows);
+  float* const dxx = scratch.dxx.data();
+  float* const dxy = scratch.dxy.data();
+  float* const dyy = scratch.dyy.data();
+  float* const response = scratch.response.data();
+  for (int y = 0; y < rows; ++y) {
+    const uint8_t* above = image[reflect101(y - 1, rows)];
+    const uint8_t* row = image[y];
+    const uint8_t* below = image[reflect101(y + 1, rows)];
+    for (int x = 0; x < cols; ++x) {
+      const int left = reflect101(x - 1, cols);
+      const int right = reflect101(x + 1, cols);
+      const float dx = scale *
+          (above[right] - above[left] + 2 * (row[right] - row[left]) + below[right] - below[left]);
+      const float dy = scale *
+          (below[left] - above[left] + 2 * (below[x] - above[x]) + below[right] - above[right]);
+      dxx[y * cols + x] = dx * dx;
+      dxy[y * cols + x] = dx * dy;
+      dyy[y * cols + x] = dy * dy;
+    }
+  }
+
+  // Unnormalized box filter of the products, anchored at the center of the block
+  const int anchor = blockSize / 2;
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      float a = 0;
+      float b = 0;
+      float c = 0;
+      for (int yBlock = y - anchor; yBlock < y - anchor + blockSize; ++yBlock) {
+        const int yOffset = reflect101(yBlock, rows) * cols;
+        for (int xBlock = x - anchor; xBlock < x - anchor + blockSize; ++xBlock) {
+          const int i = yOffset + reflect101(xBlock, cols);
+          a += dxx[i];
+          b += dxy[i];
+          c += dyy[i];
+        }
+      }
+      response[y * cols + x] = a * c - b * b - harrisParameter * (a + c) * (a + c);
+    }
+  }
+}
+
+// Same as cv::getRectSubPix() of one pixel with cv::BORDER_REPLICATE
+inline float getPixelSubPix(const Image& image, const float x, const float y) {
+  const int x0 = std::floor(x);
+  const int y0 = std::floor(y);
+  const float a = x - x0;
+  const float b = y - y0;
+  const int xs[2] = {std::min(std::max(x0, 0), image.cols - 1),
+                     std::min(std::max(x0 + 1, 0), image.cols - 1)};
+  const int ys[2] = {std::min(std::max(y0, 0), image.rows - 1),
+                     std::min(std::max(y0 + 1, 0), image.rows - 1)};
+  return (1 - a) * (1 - b) * image(ys[0], xs[0]) + a * (1 - b) * image(ys[0], xs[1]) +
+      (1 - a) * b * image(ys[1], xs[0]) + a * b * image(ys[1], xs[1]);
+}
+
+// Same as cv::cornerSubPix() of one corner with the criteria of findScaledCorners()
+cv::Point2f refineCorner(const Image& image, const cv::Point2f& corner) {
+  const int win = FLAGS_refine_corners_radius;
+  const double eps = math_util::square(FLAGS_refine_corners_epsilon);
+  const int kMaxIterations = 100;
+  STACK_ARRAY(float, mask, 2 * win + 1);
+  for (int i = 0; i < 2 * win + 1; ++i) {
+    const float offset = float(i - win) / win;
+    mask[i] = std::exp(-offset * offset);
+  }
+
+  cv::Point2f refined = corner;
+  for (int iteration = 0; iteration < kMaxIterations; ++iteration) {
+    double a = 0;
+    double b = 0;
+    double c = 0;
+    double bb1 = 0;
+    double bb2 = 0;
+    for (int i = -win; i <= win; ++i) {
+      const float y = refined.y + i;
+      for (int j = -win; j <= win; ++j) {
+        const float x = refined.x + j;
+        const double m = mask[i + win] * mask[j + win];
+        const double tgx = getPixelSubPix(image, x + 1, y) - getPixelSubPix(image, x - 1, y);
+        const double tgy = getPixelSubPix(image, x, y + 1) - getPixelSubPix(image, x, y - 1);
+        const double gxx = tgx * tgx * m;
+        const double gxy = tgx * tgy * m;
+        const double gyy = tgy * tgy * m;
+        a += gxx;
+        b += gxy;
+        c += gyy;
+        bb1 += gxx * j + gxy * i;
+        bb2 += gxy * j + gyy * i;
+      }
+    }
+    const double det = a * c - b * b;
+    if (std::fabs(det) <= DBL_EPSILON * DBL_EPSILON) {
+      break;
+    }
+    const cv::Point2f next(
+        float(refined.x + (c * bb1 - b * bb2) / det), float(refined.y + (a * bb2 - b * bb1) / det));
+    const double err = (next - refined).dot(next - refined);
+    refined = next;
+    if (refined.x < 0 || refined.x >= image.cols || refined.y < 0 || refined.y >= image.rows) {
+      break;
+    }
+    if (err <= eps) {
+      break;
+    }
+  }
+
+  // Poor convergence leaves the corner untouched
+  if (std::fabs(refined.x - corner.x) > win || std::fabs(refined.y - corner.y) > win) {
+    return corner;
+  }
+  return refined;
+}
+
+} // namespace
+
+bool hasCornerNear(const Image& image, const Camera::Vector2& point, const double tolerance) {
+  const int cols = image.cols;
+  const int rows = image.rows;
+  HarrisScratch& scratch = getHarrisScratch();
+  computeHarrisResponse(scratch, image, int(FLAGS_harris_window_radius), FLAGS_harris_parameter);
+  const float* const response = scratch.response.data();
+
+  // Local maxima above the quality threshold, strongest first, as in cv::goodFeaturesToTrack()
+  const float threshold =
+      *std::max_element(response, response + cols * rows) * FLAGS_min_feature_quality;
+  auto thresholded = [&](const int i) { return response[i] > threshold ? response[i] : 0; };
+  scratch.candidates.resize(cols * rows);
+  int* const candidates = scratch.candidates.data();
+  int candidateCount = 0;
+  for (int y = 1; y < rows - 1; ++y) {
+    for (int x = 1; x < cols - 1; ++x) {
+      const int i = y * cols + x;
+      const float value = thresholded(i);
+      bool isMaximum = value != 0;
+      for (int yNeighbor = y - 1; isMaximum && yNeighbor <= y + 1; ++yNeighbor) {
+        for (int xNeighbor = x - 1; isMaximum && xNeighbor <= x + 1; ++xNeighbor) {
+          isMaximum = thresholded(yNeighbor * cols + xNeighbor) <= value;
+        }
+      }
+      if (isMaximum) {
+        candidates[candidateCount++] = i;
+      }
+    }
+  }
+  std::sort(candidates, candidates + candidateCount, [&](const int i0, const int i1) {
+    return response[i0] != response[i1] ? response[i0] > response[i1] : i0 > i1;
+  });
+
+  // Drop corners too close to stronger ones, and refine the ones that can end up near point
+  const int minDistance = FLAGS_min_feature_distance;
+  const double reach = tolerance + FLAGS_refine_corners_radius + 1;
+  scratch.corners.resize(candidateCount);
+  int* const corners = scratch.corners.data();
+  int cornerCount = 0;
+  for (int candidate = 0; candidate < candidateCount; ++candidate) {
+    if (FLAGS_max_corners > 0 && cornerCount == FLAGS_max_corners) {
+      break;
+    }
+    const int x = candidates[candidate] % cols;
+    const int y = candidates[candidate] / cols;
+    bool isFar = true;
+    for (int corner = 0; isFar && minDistance >= 1 && corner < cornerCount; ++corner) {
+      const int dx = corners[corner] % cols - x;
+      const int dy = corners[corner] / cols - y;
+      isFar = dx * dx + dy * dy >= minDistance * minDistance;
+    }
+    if (!isFar) {
+      continue;
+    }
+    corners[cornerCount++] = candidates[candidate];
+
+    // Coordinates of the corner are pixel centers, as in findScaledCorners()
+    if (std::abs(x + 0.5 - point.x()) > reach || std::abs(y + 0.5 - point.y()) > reach) {
+      continue;
+    }
+    const cv::Point2f start = cv::Point2f(x, y) + kRefineOffset;
+    const cv::Point2f refined = refineCorner(image, start);
+    if (refined == start) {
+      continue; // refinement failed
+    }
+    const Camera::Vector2 offset(refined.x + 0.5 - point.x(), refined.y + 0.5 - point.y());
+    if (offset.squaredNorm() <= math_util::square(tolerance)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static bool isCloseToEdge(const Camera::Vector2& point, const Image& image, const int margin) {
   if (0 <= point.x() - margin && point.x() + margin < image.cols) {
     if (0 <= point.y() - margin && point.y() + margin < image.rows) {
@@ -171,13 +403,43 @@ std::vector<Keypoint> findCorners(const Camera& camera, const Image& image, cons
   return corners;
 }
 
+std::string getDetectorParams() {
+  return folly::sformat(
+      "deduplicate_radius={} harris_parameter={} harris_window_radius={} max_corners={} "
+      "min_feature_distance={} min_feature_quality={} octave_count={} refine_corners_epsilon={} "
+      "refine_corners_radius={} same_scale={} zncc_window_radius={}",
+      FLAGS_deduplicate_radius,
+      FLAGS_harris_parameter,
+      FLAGS_harris_window_radius,
+      FLAGS_max_corners,
+      FLAGS_min_feature_distance,
+      FLAGS_min_feature_quality,
+      FLAGS_octave_count,
+      FLAGS_refine_corners_epsilon,
+      FLAGS_refine_corners_radius,
+      FLAGS_same_scale,
+      FLAGS_zncc_window_radius);
+}
+
 std::map<ImageId, std::vector<Keypoint>>
 findAllCorners(const Camera::Rig& rig, const std::vector<Image>& images, const bool useNearest) {
   std::map<ImageId, std::vector<Keypoint>> allCorners;
+  findMissingCorners(allCorners, rig, images, useNearest);
+  return allCorners;
+}
+
+void findMissingCorners(
+    std::map<ImageId, std::vector<Keypoint>>& allCorners,
+    const Camera::Rig& rig,
+    const std::vector<Image>& images,
+    const bool useNearest) {
   boost::timer::cpu_timer featureTimer;
   ThreadPool threadPool(FLAGS_threads);
   for (int currentCamera = 0; currentCamera < ssize(rig); currentCamera++) {
     const Camera& camera = rig[currentCamera];
+    if (allCorners.count(camera.id)) {
+      continue;
+    }
     std::vector<Keypoint>& keypoints = allCorners[camera.id]; // modify allCorners in main thread
     const Image& image = images[currentCamera];
     threadPool.spawn([&keypoints, &camera, &image, &useNearest] {
@@ -189,8 +451,6 @@ findAllCorners(const Camera::Rig& rig, const std::vector<Image>& images, const b
   if (FLAGS_enable_timing) {
     LOG(INFO) << folly::sformat("Find corners stage time: {}", featureTimer.format());
   }
-
-  return allCorners;
 }
 
 } // namespace calibration
@@ -26,10 +26,28 @@ std::vector<Camera::Vector2> findScaledCorners(
     const cv::Mat_<uint8_t>& maskFull,
     const std::string& cameraId = "");
 
+// Whether findScaledCorners(1, image, no mask) finds a corner within tolerance of point
+// Meant for small patches, e.g. in the inner loop of matching: nothing is allocated once each
+// thread has seen its largest image
+bool hasCornerNear(
+    const cv::Mat_<uint8_t>& image,
+    const Camera::Vector2& point,
+    const double tolerance);
+
 std::map<std::string, std::vector<Keypoint>> findAllCorners(
     const Camera::Rig& rig,
     const std::vector<cv::Mat_<uint8_t>>& images,
     const bool useNearest);
 
+// Same, only for the cameras that have no entry in allCorners yet
+void findMissingCorners(
+    std::map<std::string, std::vector<Keypoint>>& allCorners,
+    const Camera::Rig& rig,
+    const std::vector<cv::Mat_<uint8_t>>& images,
+    const bool useNearest);
+
+// Flags that findCorners() depends on, for keying cached corners
+std::string getDetectorParams();
+
 } // namespace calibration
 } // namespace fb360_dep
@@ -7,19 +7,21 @@
 
 #include "source/calibration/FeatureMatcher.h"
 
-#include <future>
-#include <queue>
-
-#include <boost/timer/timer.hpp>
+#include <numeric>
 
 #include <folly/Format.h>
 
 #include "source/calibration/FeatureDetector.h"
+#include "source/calibration/ZnccKernels.h"
+#include "source/util/Profiler.h"
+#include "source/util/StackArray.h"
+#include "source/util/ThreadPool.h"
 
 DEFINE_bool(custom_zncc, false, "uses custom ZNCC formula for patch matching");
 DEFINE_double(depth_max, 100.0, "max depth in m");
 DEFINE_double(depth_min, 1.0, "min depth in m");
 DEFINE_double(depth_samples, 1000, "number of depths to sample");
+DEFINE_bool(keypoint_grid, true, "look up corners in search boxes through a grid, not a full scan");
 DEFINE_double(max_depth_for_remap, 50, "max depth to reproject features");
 DEFINE_double(overlap_threshold, 0, "minimum overlap between matched images");
 DEFINE_double(reprojected_corner_drift_tolerance, 0.5, "in pixels");
@@ -40,6 +42,14 @@ using ImageId = std::string;
 namespace fb360_dep {
 namespace calibration {
 
+// Spacing of the pixels of a projected patch that projectCorner() maps exactly
+const int kWarpNodeSpacing = 8;
+
+// findAllMatches() splits the work into about this many chunks per thread, of at least
+// kMinMatchingChunkCorners corners each
+const int kMatchingChunksPerThread = 4;
+const int kMinMatchingChunkCorners = 32;
+
 struct BestMatch {
   int bestIdx;
   double bestScore;
@@ -73,6 +83,17 @@ struct BestMatch {
     }
   }
 
+  // Same as updating this with every score that other was updated with, when the two were updated
+  // with scores of different corners
+  void merge(const BestMatch& other) {
+    if (other.bestIdx >= 0) {
+      updateCornerScore(other.bestScore, other.bestIdx);
+    }
+    if (other.secondBestIdx >= 0) {
+      updateCornerScore(other.secondBestScore, other.secondBestIdx);
+    }
+  }
+
   // A corner is weak if its best match score falls below the score threshold
   // or if 2 (or more) highest match scores are close together (within
   // zncc_delta_threshold). Weak corners are rejected since the potiential matches
@@ -112,6 +133,43 @@ double computeZncc(const Keypoint& corner0, const Keypoint& corner1) {
   return zncc;
 }
 
+void computeZnccs(
+    std::vector<double>& scores,
+    const Keypoint& corner0,
+    const std::vector<Keypoint>& corners1,
+    const std::vector<int>& indices1) {
+  thread_local std::vector<const float*> patches1;
+  thread_local std::vector<float> dots;
+  patches1.clear();
+  for (const int index1 : indices1) {
+    CHECK_EQ(corners1[index1].normalized.size(), corner0.normalized.size());
+    patches1.push_back(corners1[index1].normalized.data());
+  }
+  dots.resize(indices1.size());
+  dotProducts(
+      corner0.normalized.data(),
+      patches1.data(),
+      ssize(indices1),
+      ssize(corner0.normalized),
+      dots.data());
+
+  // Flat patches normalize to zeros, and score as computeZncc() does: NAN with the default formula,
+  // 0 with the custom one unless both are flat
+  scores.resize(indices1.size());
+  for (int i = 0; i < ssize(indices1); ++i) {
+    const Keypoint& corner1 = corners1[indices1[i]];
+    scores[i] = dots[i];
+    if (FLAGS_custom_zncc) {
+      // The dot product is mean((p0 - p0.avg) * (p1 - p1.avg)) / (p0.stddev * p1.stddev)
+      scores[i] *= corner0.std * corner1.std / (corner0.avg * corner1.avg);
+      float denominator = std::max(corner0.std / corner0.avg, corner1.std / corner1.avg);
+      scores[i] /= (denominator * denominator);
+    } else if (corner0.std == 0 || corner1.std == 0) {
+      scores[i] = NAN;
+    }
+  }
+}
+
 // Compute a box around the pixel in camera 1 corresponding to the specified point in camera 0
 cv::Rect2f computeBox(
     const Camera& camera1,
@@ -134,7 +192,9 @@ bool tooMuchOverlap(const cv::Rect2f& box, const cv::Rect2f& lastBox) {
 // Compute what a corner in camera 0 looks like from camera 1. I.e.
 // - find the point in camera 1 corresponding to the specified point in camera 0
 // - then, for each pixel in a square around that point, read the corresponding pixel from camera 0
-// Return false if camera 1 doesn't see the specified point
+// Only the pixels of a grid of nodes kWarpNodeSpacing apart are mapped exactly, in between the
+// camera 1 to camera 0 warp is interpolated bilinearly in single precision
+// Return false if camera 1 doesn't see the specified point, or camera 0 doesn't see a node
 bool projectCorner(
     Image& projection1,
     const Camera& camera1,
@@ -153,18 +213,47 @@ bool projectCorner(
 
   CHECK_EQ(corner0.patch.cols, corner0.patch.rows);
   const int radius = corner0.patch.cols / 2;
-  projection1.create(2 * radius + 1, 2 * radius + 1);
-  for (int xOffset = -radius; xOffset <= radius; xOffset++) {
-    for (int yOffset = -radius; yOffset <= radius; yOffset++) {
-      const Camera::Vector2 pixel1 = {corner1.x() + xOffset, corner1.y() + yOffset};
-      const Camera::Vector3 world = camera1.rig(pixel1, depth1);
+  const int nodeCount = (2 * radius + kWarpNodeSpacing - 1) / kWarpNodeSpacing + 1;
+  auto nodeOffset = [&](const int node) {
+    return std::min(-radius + node * kWarpNodeSpacing, radius);
+  };
+  STACK_ARRAY(float, nodeX0, nodeCount * nodeCount);
+  STACK_ARRAY(float, nodeY0, nodeCount * nodeCount);
+  for (int yNode = 0; yNode < nodeCount; ++yNode) {
+    for (int xNode = 0; xNode < nodeCount; ++xNode) {
+      const Camera::Vector2 offset(nodeOffset(xNode), nodeOffset(yNode));
+      const Camera::Vector3 world = camera1.rig(corner1 + offset, depth1);
       Camera::Vector2 pixel0;
       if (!camera0.sees(world, pixel0)) {
         return false;
       }
+      nodeX0[yNode * nodeCount + xNode] = pixel0.x();
+      nodeY0[yNode * nodeCount + xNode] = pixel0.y();
+    }
+  }
+
+  // Interpolated pixels are convex combinations of nodes, so they are inside img0 too
+  projection1.create(2 * radius + 1, 2 * radius + 1);
+  for (int yOffset = -radius; yOffset <= radius; yOffset++) {
+    const int yNode = std::min((yOffset + radius) / kWarpNodeSpacing, nodeCount - 2);
+    const float v =
+        float(yOffset - nodeOffset(yNode)) / (nodeOffset(yNode + 1) - nodeOffset(yNode));
+    for (int xOffset = -radius; xOffset <= radius; xOffset++) {
+      const int xNode = std::min((xOffset + radius) / kWarpNodeSpacing, nodeCount - 2);
+      const float u =
+          float(xOffset - nodeOffset(xNode)) / (nodeOffset(xNode + 1) - nodeOffset(xNode));
+      const int node = yNode * nodeCount + xNode;
+      const float x0 = math_util::lerp(
+          math_util::lerp(nodeX0[node], nodeX0[node + 1], u),
+          math_util::lerp(nodeX0[node + nodeCount], nodeX0[node + nodeCount + 1], u),
+          v);
+      const float y0 = math_util::lerp(
+          math_util::lerp(nodeY0[node], nodeY0[node + 1], u),
+          math_util::lerp(nodeY0[node + nodeCount], nodeY0[node + nodeCount + 1], u),
+          v);
       projection1(yOffset + radius, xOffset + radius) = FLAGS_use_nearest
-          ? img0(int(pixel0.y()), int(pixel0.x()))
-          : cv_util::getPixelBilinear(img0, pixel0.x(), pixel0.y());
+          ? img0(int(y0), int(x0))
+          : cv_util::getPixelBilinear(img0, x0, y0);
     }
   }
   return true;
@@ -172,14 +261,7 @@ bool projectCorner(
 
 bool hasCornerNearCenter(const Image& image) {
   const Camera::Vector2 center = 0.5 * Camera::Vector2(image.cols, image.rows);
-  Camera::Vector2 best = center;
-  for (const Camera::Vector2& corner : findScaledCorners(1, image, cv::Mat_<uint8_t>())) {
-    Camera::Vector2 offset = corner - center;
-    if (offset.dot(offset) < best.dot(best)) {
-      best = offset;
-    }
-  }
-  return best.dot(best) <= math_util::square(FLAGS_reprojected_corner_drift_tolerance);
+  return hasCornerNear(image, center, FLAGS_reprojected_corner_drift_tolerance);
 }
 
 bool getNextDepthSample(
@@ -205,6 +287,25 @@ bool getNextDepthSample(
   return false;
 }
 
+std::vector<DepthSample> getDepthSamples(
+    const Camera& camera0,
+    const Camera::Vector2& corner0Coords,
+    const Camera& camera1) {
+  std::vector<DepthSample> depthSamples;
+  int depthSample = -1;
+  DepthSample sample = {0, cv::Rect2f(0, 0, 0, 0)};
+  while (getNextDepthSample(
+      depthSample, sample.disparity, sample.box, camera0, corner0Coords, camera1)) {
+    depthSamples.push_back(sample);
+  }
+  return depthSamples;
+}
+
+KeypointGrid makeKeypointGrid(const std::vector<Keypoint>& corners) {
+  // Search boxes are 2 * search_radius wide, so they touch at most 3 x 3 cells
+  return KeypointGrid(corners, std::max(FLAGS_search_radius, 1));
+}
+
 Overlap findMatches(
     const Image& img0,
     const std::vector<Keypoint>& corners0,
@@ -212,39 +313,72 @@ Overlap findMatches(
     const Image& img1,
     const std::vector<Keypoint>& corners1,
     const Camera& camera1) {
-  boost::timer::cpu_timer timer;
-  boost::timer::cpu_timer znccTimer;
-  znccTimer.stop();
-  boost::timer::cpu_timer projectCornerTimer;
-  projectCornerTimer.stop();
-
-  Image image1; // optimization: avoid reallocation by keeping this outside loop
+  return findMatches(img0, corners0, camera0, img1, corners1, makeKeypointGrid(corners1), camera1);
+}
 
-  // For each corner in corners0, compute its best and second best match in corners1. and vice versa
-  std::vector<BestMatch> bestMatches0(corners0.size());
-  std::vector<BestMatch> bestMatches1(corners1.size());
+// Work of one call to findBestMatches(), which only its thread touches
+// Times are wall clock microseconds, only measured with --enable_timing or the profiler enabled
+struct MatchingStats {
+  int64_t znccUs = 0;
+  int64_t projectCornerUs = 0;
   int callsToZncc = 0;
   int callsToProjectCorners = 0;
-  for (ssize_t index0 = 0; index0 < ssize(corners0); index0++) {
+
+  // Times add up to the time spent on all threads, not wall clock time
+  void merge(const MatchingStats& other) {
+    znccUs += other.znccUs;
+    projectCornerUs += other.projectCornerUs;
+    callsToZncc += other.callsToZncc;
+    callsToProjectCorners += other.callsToProjectCorners;
+  }
+};
+
+static int64_t nowUsIfTiming() {
+  const profiler::Profiler& instance = profiler::Profiler::instance();
+  return FLAGS_enable_timing || instance.isEnabled() ? instance.nowUs() : 0;
+}
+
+// For each corner in corners0[begin, end), compute its best and second best match in corners1, and
+// vice versa over those corners0 only
+// stats starts out empty and ends up with the work of this call
+void findBestMatches(
+    std::vector<BestMatch>& bestMatches0,
+    std::vector<BestMatch>& bestMatches1,
+    MatchingStats& stats,
+    const Image& img0,
+    const std::vector<Keypoint>& corners0,
+    const Camera& camera0,
+    const std::vector<Keypoint>& corners1,
+    const KeypointGrid& grid1,
+    const Camera& camera1,
+    const int begin,
+    const int end) {
+  CHECK_EQ(grid1.points.size(), corners1.size());
+  profiler::ScopedTimer timer("findBestMatches");
+  Image image1; // optimization: avoid reallocation by keeping this outside loop
+  std::vector<int> candidates1;
+  std::vector<double> scores;
+  for (int index0 = begin; index0 < end; index0++) {
     LOG_IF(INFO, (FLAGS_threads == 0 || FLAGS_threads == 1) && (index0 % 1000) == 0)
         << "Processing feature " << index0 << " of " << corners0.size() << " from pair "
         << camera0.id << " " << camera1.id;
 
     const Keypoint& corner0 = corners0[index0];
-    int depthSample = -1;
-    double disparity = 0;
-    cv::Rect2f box1(0, 0, 0, 0);
     bool firstProjection = true;
-    while (getNextDepthSample(depthSample, disparity, box1, camera0, corner0.coords, camera1)) {
+    for (const DepthSample& depthSample : getDepthSamples(camera0, corner0.coords, camera1)) {
+      const double disparity = depthSample.disparity;
+      const cv::Rect2f& box1 = depthSample.box;
       // only remap corner for sufficiently large disparities
       if (firstProjection || disparity > 1 / FLAGS_max_depth_for_remap) {
         // compute what the area around corner 0 would look like from camera 1
-        projectCornerTimer.resume();
-        callsToProjectCorners++;
-        if (!projectCorner(image1, camera1, img0, camera0, corner0, 1 / disparity)) {
+        const int64_t projectCornerBeginUs = nowUsIfTiming();
+        const bool isProjected =
+            projectCorner(image1, camera1, img0, camera0, corner0, 1 / disparity);
+        stats.projectCornerUs += nowUsIfTiming() - projectCornerBeginUs;
+        stats.callsToProjectCorners++;
+        if (!isProjected) {
           continue;
         }
-        projectCornerTimer.stop();
 
         // don't match if we can't rediscover the corner after it has been reprojected
         if (!hasCornerNearCenter(image1)) {
@@ -256,22 +390,46 @@ Overlap findMatches(
       Keypoint projection1(image1);
 
       // look for a corner in c1 that is in the box and looks similar
-      znccTimer.resume();
-      for (ssize_t index1 = 0; index1 < ssize(corners1); ++index1) {
-        cv::Point2f cvCoords(corners1[index1].coords.x(), corners1[index1].coords.y());
-        if (!box1.contains(cvCoords)) {
-          continue;
+      const int64_t znccBeginUs = nowUsIfTiming();
+      if (FLAGS_keypoint_grid) {
+        grid1.query(box1, candidates1);
+      } else {
+        candidates1.clear();
+        for (int index1 = 0; index1 < ssize(corners1); ++index1) {
+          if (box1.contains(grid1.points[index1])) {
+            candidates1.push_back(index1);
+          }
         }
-        double score = computeZncc(projection1, corners1[index1]);
-        bestMatches0[index0].updateCornerScore(score, index1);
-        bestMatches1[index1].updateCornerScore(score, index0);
-        callsToZncc++;
       }
-      znccTimer.stop();
+      computeZnccs(scores, projection1, corners1, candidates1);
+      for (int i = 0; i < ssize(candidates1); ++i) {
+        bestMatches0[index0].updateCornerScore(scores[i], candidates1[i]);
+        bestMatches1[candidates1[i]].updateCornerScore(scores[i], index0);
+      }
+      stats.znccUs += nowUsIfTiming() - znccBeginUs;
+      stats.callsToZncc += candidates1.size();
     }
   }
 
-  // Take match if both ends are strong and each other's best match
+  // Totals over all threads
+  static profiler::Counter& znccCalls = profiler::Profiler::instance().counter("zncc calls");
+  static profiler::Counter& znccUs = profiler::Profiler::instance().counter("zncc us");
+  static profiler::Counter& projectCornerCalls =
+      profiler::Profiler::instance().counter("projectCorner calls");
+  static profiler::Counter& projectCornerUs =
+      profiler::Profiler::instance().counter("projectCorner us");
+  znccCalls.add(stats.callsToZncc);
+  znccUs.add(stats.znccUs);
+  projectCornerCalls.add(stats.callsToProjectCorners);
+  projectCornerUs.add(stats.projectCornerUs);
+}
+
+// Take match if both ends are strong and each other's best match
+Overlap selectMatches(
+    const Camera& camera0,
+    const Camera& camera1,
+    const std::vector<BestMatch>& bestMatches0,
+    const std::vector<BestMatch>& bestMatches1) {
   Overlap overlap(camera0.id, camera1.id);
   for (const BestMatch& bestMatch0 : bestMatches0) {
     if (bestMatch0.isWeakCorner()) {
@@ -286,24 +444,50 @@ Overlap findMatches(
     }
     overlap.matches.emplace_back(bestMatch0.bestScore, bestMatch1.bestIdx, bestMatch0.bestIdx);
   }
+  return overlap;
+}
+
+Overlap findMatches(
+    const Image& img0,
+    const std::vector<Keypoint>& corners0,
+    const Camera& camera0,
+    const Image& img1,
+    const std::vector<Keypoint>& corners1,
+    const KeypointGrid& grid1,
+    const Camera& camera1) {
+  profiler::ScopedTimer timer("findMatches");
+  const int64_t beginUs = nowUsIfTiming();
+  MatchingStats stats;
+  std::vector<BestMatch> bestMatches0(corners0.size());
+  std::vector<BestMatch> bestMatches1(corners1.size());
+  findBestMatches(
+      bestMatches0,
+      bestMatches1,
+      stats,
+      img0,
+      corners0,
+      camera0,
+      corners1,
+      grid1,
+      camera1,
+      0,
+      corners0.size());
+  const Overlap overlap = selectMatches(camera0, camera1, bestMatches0, bestMatches1);
 
-  // Only report timing in single threaded mode
-  // In multithreaded mode these will clocks include time from other threads
-  // running simultaneously
-  if (FLAGS_enable_timing && FLAGS_threads == 1) {
+  if (FLAGS_enable_timing) {
     LOG(INFO) << folly::sformat(
-        "{} and {} matching complete. Overlap fraction: {}. Matches: {}. Timing: {} "
-        "Calls to ZNCC: {}. ZNCC Time: {} "
-        "Calls to ProjectCorners: {}. Project Corner Time: {} ",
+        "{} and {} matching complete. Overlap fraction: {}. Matches: {}. Time: {}s "
+        "Calls to ZNCC: {}. ZNCC Time: {}s "
+        "Calls to ProjectCorners: {}. Project Corner Time: {}s ",
         camera0.id,
         camera1.id,
         camera0.overlap(camera1),
         overlap.matches.size(),
-        timer.format(),
-        callsToZncc,
-        znccTimer.format(),
-        callsToProjectCorners,
-        projectCornerTimer.format());
+        (nowUsIfTiming() - beginUs) / 1e6,
+        stats.callsToZncc,
+        stats.znccUs / 1e6,
+        stats.callsToProjectCorners,
+        stats.projectCornerUs / 1e6);
   } else {
     LOG(INFO) << folly::sformat(
         "{} and {} matching complete. Overlap fraction: {}. Matches: {}",
@@ -315,44 +499,180 @@ Overlap findMatches(
   return overlap;
 }
 
+double estimateMatchingCost(const int numCorners0, const int numCorners1, const double overlap) {
+  // Every corner0 walks its depth samples, and the ones that camera 1 sees are compared with the
+  // corners1 in their search boxes
+  return numCorners0 * (1 + overlap * numCorners1);
+}
+
+std::string getMatcherParams() {
+  return folly::sformat(
+      "custom_zncc={} depth_max={} depth_min={} depth_samples={} match_score_threshold={} "
+      "max_depth_for_remap={} reprojected_corner_drift_tolerance={} search_overlap={} "
+      "search_radius={} use_nearest={} warp_node_spacing={} zncc_delta_threshold={}",
+      FLAGS_custom_zncc,
+      FLAGS_depth_max,
+      FLAGS_depth_min,
+      FLAGS_depth_samples,
+      FLAGS_match_score_threshold,
+      FLAGS_max_depth_for_remap,
+      FLAGS_reprojected_corner_drift_tolerance,
+      FLAGS_search_overlap,
+      FLAGS_search_radius,
+      FLAGS_use_nearest,
+      kWarpNodeSpacing,
+      FLAGS_zncc_delta_threshold);
+}
+
+std::vector<std::array<int, 2>> getMatchingPairs(const Camera::Rig& rig) {
+  std::vector<std::array<int, 2>> cameraPairs;
+  for (int c0 = 0; c0 < ssize(rig); c0++) {
+    for (int c1 = c0 + 1; c1 < ssize(rig); c1++) {
+      if (rig[c0].overlap(rig[c1]) >= FLAGS_overlap_threshold) {
+        cameraPairs.push_back({{c0, c1}});
+      }
+    }
+  }
+  return cameraPairs;
+}
+
 std::vector<Overlap> findAllMatches(
     const Camera::Rig& rig,
     const std::vector<Image>& images,
     const std::map<ImageId, std::vector<Keypoint>>& allCorners) {
-  std::vector<Overlap> overlaps;
-  boost::timer::cpu_timer matchTimer;
+  return findAllMatches(rig, images, allCorners, getMatchingPairs(rig));
+}
+
+std::vector<Overlap> findAllMatches(
+    const Camera::Rig& rig,
+    const std::vector<Image>& images,
+    const std::map<ImageId, std::vector<Keypoint>>& allCorners,
+    const std::vector<std::array<int, 2>>& cameraPairs) {
+  profiler::ScopedTimer timer("findAllMatches");
+  const int64_t beginUs = nowUsIfTiming();
+
+  // Corners of each camera are indexed once for all its pairs
+  std::map<int, KeypointGrid> grids;
+  for (const std::array<int, 2>& cameraPair : cameraPairs) {
+    const int c1 = cameraPair[1];
+    if (!grids.count(c1)) {
+      grids.emplace(c1, makeKeypointGrid(allCorners.at(rig[c1].id)));
+    }
+  }
 
   // Find matches across all pairings
-  const int threadCount = ThreadPool::getThreadCountFromFlag(FLAGS_threads);
-  std::queue<std::future<Overlap>> overlapFutures;
-  for (ssize_t c1 = 0; c1 < ssize(rig); c1++) {
-    for (ssize_t c2 = c1 + 1; c2 < ssize(rig); c2++) {
-      if (rig[c1].overlap(rig[c2]) < FLAGS_overlap_threshold) {
-        continue;
-      }
-      overlapFutures.push(std::async(
-          threadCount == 0 ? std::launch::deferred : std::launch::async,
-          &findMatches,
-          std::cref(images[c1]),
-          std::cref(allCorners.at(rig[c1].id)),
-          std::cref(rig[c1]),
-          std::cref(images[c2]),
-          std::cref(allCorners.at(rig[c2].id)),
-          std::cref(rig[c2])));
-      if (ssize(overlapFutures) >= threadCount && !overlapFutures.empty()) {
-        overlaps.emplace_back(overlapFutures.front().get());
-        overlapFutures.pop();
-      }
+  struct CameraPair {
+    int c0;
+    int c1;
+    double overlap;
+    double cost;
+    std::vector<BestMatch> bestMatches0;
+  };
+  std::vector<CameraPair> pairs;
+  double totalCost = 0;
+  for (const std::array<int, 2>& cameraPair : cameraPairs) {
+    const int c0 = cameraPair[0];
+    const int c1 = cameraPair[1];
+    const double overlap = rig[c0].overlap(rig[c1]);
+    const int numCorners0 = allCorners.at(rig[c0].id).size();
+    const int numCorners1 = allCorners.at(rig[c1].id).size();
+    const double cost = estimateMatchingCost(numCorners0, numCorners1, overlap);
+    pairs.push_back({c0, c1, overlap, cost, std::vector<BestMatch>(numCorners0)});
+    totalCost += cost;
+  }
+
+  // Pairs are split into chunks of corners0 of about the same estimated cost, a few per thread, so
+  // that a heavily overlapping pair is spread over several threads
+  struct MatchingChunk {
+    int pair;
+    int begin;
+    int end;
+    double cost;
+    std::vector<BestMatch> bestMatches1;
+    MatchingStats stats;
+  };
+  const int threadCount = std::max(ThreadPool::getThreadCountFromFlag(FLAGS_threads), 1);
+  const double chunkCost = totalCost / (kMatchingChunksPerThread * threadCount);
+  std::vector<MatchingChunk> chunks;
+  for (int pair = 0; pair < ssize(pairs); ++pair) {
+    const std::vector<Keypoint>& corners0 = allCorners.at(rig[pairs[pair].c0].id);
+    const std::vector<Keypoint>& corners1 = allCorners.at(rig[pairs[pair].c1].id);
+    const double cost = pairs[pair].cost;
+    const int maxChunkCount = std::max(ssize(corners0) / kMinMatchingChunkCorners, ssize_t(1));
+    const int chunkCount = cost > 0 ? std::min(int(std::ceil(cost / chunkCost)), maxChunkCount) : 1;
+    for (int chunk = 0; chunk < chunkCount; ++chunk) {
+      chunks.emplace_back();
+      chunks.back().pair = pair;
+      chunks.back().begin = corners0.size() * chunk / chunkCount;
+      chunks.back().end = corners0.size() * (chunk + 1) / chunkCount;
+      chunks.back().cost = cost / chunkCount;
+      chunks.back().bestMatches1.resize(corners1.size());
     }
   }
 
-  while (!overlapFutures.empty()) {
-    overlaps.emplace_back(overlapFutures.front().get());
-    overlapFutures.pop();
+  // Most expensive chunks go first, so that the last ones to finish are short
+  std::vector<int> order(chunks.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](const int i0, const int i1) {
+    return chunks[i0].cost > chunks[i1].cost;
+  });
+  ThreadPool threadPool(FLAGS_threads);
+  for (const int index : order) {
+    threadPool.spawn([&, index] {
+      MatchingChunk& chunk = chunks[index];
+      CameraPair& pair = pairs[chunk.pair];
+      findBestMatches(
+          pair.bestMatches0,
+          chunk.bestMatches1,
+          chunk.stats,
+          images[pair.c0],
+          allCorners.at(rig[pair.c0].id),
+          rig[pair.c0],
+          allCorners.at(rig[pair.c1].id),
+          grids.at(pair.c1),
+          rig[pair.c1],
+          chunk.begin,
+          chunk.end);
+    });
+  }
+  threadPool.join();
+
+  // Chunks of a pair matched disjoint corners0, so their best matches in corners1 merge exactly
+  std::vector<Overlap> overlaps;
+  MatchingStats stageStats;
+  for (int chunk = 0; chunk < ssize(chunks);) {
+    const int pairIndex = chunks[chunk].pair;
+    const CameraPair& pair = pairs[pairIndex];
+    std::vector<BestMatch> bestMatches1 = std::move(chunks[chunk].bestMatches1);
+    MatchingStats pairStats = chunks[chunk].stats;
+    for (++chunk; chunk < ssize(chunks) && chunks[chunk].pair == pairIndex; ++chunk) {
+      for (int index1 = 0; index1 < ssize(bestMatches1); ++index1) {
+        bestMatches1[index1].merge(chunks[chunk].bestMatches1[index1]);
+      }
+      pairStats.merge(chunks[chunk].stats);
+    }
+    overlaps.push_back(selectMatches(rig[pair.c0], rig[pair.c1], pair.bestMatches0, bestMatches1));
+    LOG(INFO) << folly::sformat(
+        "{} and {} matching complete. Overlap fraction: {}. Matches: {}. Calls to ZNCC: {}",
+        rig[pair.c0].id,
+        rig[pair.c1].id,
+        pair.overlap,
+        overlaps.back().matches.size(),
+        pairStats.callsToZncc);
+    stageStats.merge(pairStats);
   }
 
   if (FLAGS_enable_timing) {
-    LOG(INFO) << folly::sformat("Matching stage time: {}", matchTimer.format());
+    LOG(INFO) << folly::sformat(
+        "Matching stage time: {}s. Pairs: {}. Chunks: {}. Calls to ZNCC: {}. ZNCC Time: {}s "
+        "Calls to ProjectCorners: {}. Project Corner Time: {}s",
+        (nowUsIfTiming() - beginUs) / 1e6,
+        pairs.size(),
+        chunks.size(),
+        stageStats.callsToZncc,
+        stageStats.znccUs / 1e6,
+        stageStats.callsToProjectCorners,
+        stageStats.projectCornerUs / 1e6);
   }
 
   return overlaps;
@@ -9,6 +9,7 @@
 #include "source/util/Camera.h"
 
 DECLARE_bool(enable_timing);
+DECLARE_bool(keypoint_grid);
 DECLARE_int32(threads);
 DECLARE_bool(use_nearest);
 DECLARE_double(match_score_threshold);
@@ -16,6 +17,25 @@ DECLARE_double(match_score_threshold);
 namespace fb360_dep {
 namespace calibration {
 
+// Reference ZNCC of two patches, straight from the pixels
+double computeZncc(const Keypoint& corner0, const Keypoint& corner1);
+
+// ZNCC of corner0 against each of corners1[indices1] at once, from the normalized patches
+void computeZnccs(
+    std::vector<double>& scores,
+    const Keypoint& corner0,
+    const std::vector<Keypoint>& corners1,
+    const std::vector<int>& indices1);
+
+// What the patch of corner0 looks like from camera 1, assuming it is at depth0 from camera 0
+bool projectCorner(
+    cv::Mat_<uint8_t>& projection1,
+    const Camera& camera1,
+    const cv::Mat_<uint8_t>& img0,
+    const Camera& camera0,
+    const Keypoint& corner0,
+    const double depth0);
+
 bool getNextDepthSample(
     int& currentDepthSample,
     double& currentDisparity,
@@ -24,6 +44,18 @@ bool getNextDepthSample(
     const Camera::Vector2& corner0Coords,
     const Camera& camera1);
 
+struct DepthSample {
+  double disparity;
+  cv::Rect2f box; // search box in camera 1
+};
+
+// Every depth sample that getNextDepthSample() visits for a corner, in order
+std::vector<DepthSample>
+getDepthSamples(const Camera& camera0, const Camera::Vector2& corner0Coords, const Camera& camera1);
+
+// Grid of corners for the search boxes of findMatches()
+KeypointGrid makeKeypointGrid(const std::vector<Keypoint>& corners);
+
 Overlap findMatches(
     const cv::Mat_<uint8_t>& img0,
     const std::vector<Keypoint>& corners0,
@@ -32,10 +64,33 @@ Overlap findMatches(
     const std::vector<Keypoint>& corners1,
     const Camera& camera1);
 
+// Same, with the grid of corners1 built once per camera by the caller
+Overlap findMatches(
+    const cv::Mat_<uint8_t>& img0,
+    const std::vector<Keypoint>& corners0,
+    const Camera& camera0,
+    const cv::Mat_<uint8_t>& img1,
+    const std::vector<Keypoint>& corners1,
+    const KeypointGrid& grid1,
+    const Camera& camera1);
+
+// Pairs of cameras that findAllMatches() matches, in order
+std::vector<std::array<int, 2>> getMatchingPairs(const Camera::Rig& rig);
+
 std::vector<Overlap> findAllMatches(
     const Camera::Rig& rig,
     const std::vector<cv::Mat_<uint8_t>>& images,
     const std::map<std::string, std::vector<Keypoint>>& allCorners);
 
+// Same, only for the given pairs of camera indices, in their order
+std::vector<Overlap> findAllMatches(
+    const Camera::Rig& rig,
+    const std::vector<cv::Mat_<uint8_t>>& images,
+    const std::map<std::string, std::vector<Keypoint>>& allCorners,
+    const std::vector<std::array<int, 2>>& cameraPairs);
+
+// Flags that the matches of a pair depend on beyond its corners, for keying cached matches
+std::string getMatcherParams();
+
 } // namespace calibration
 } // namespace fb360_dep
@@ -23,6 +23,7 @@
 #include <folly/dynamic.h>
 #include <folly/json.h>
 
+#include "source/calibration/BinaryMatches.h"
 #include "source/calibration/Calibration.h"
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
@@ -289,6 +290,65 @@ std::vector<Overlap> loadOverlaps(const folly::dynamic& parsed) {
   return result;
 }
 
+// Same as loadFeatureMap() and loadOverlaps(), from a binary matches file (see BinaryMatches.h)
+void loadBinaryMatches(
+    FeatureMap& featureMap,
+    std::vector<Overlap>& overlaps,
+    const std::string& path) {
+  // features and overlaps are copied out of the mapping, which is released on return
+  const BinaryMatchesFile file(path);
+  for (const BinaryMatchesFile::Image& image : file.images) {
+    if (!hasCameraIndex(image.image)) {
+      LOG(INFO) << folly::sformat("ignoring image id {}", image.image);
+      continue;
+    }
+    std::vector<Feature>& features = featureMap[image.image];
+    features.reserve(image.cornerCount);
+    for (int i = 0; i < image.cornerCount; ++i) {
+      features.emplace_back(image.corner(i));
+    }
+  }
+
+  CHECK(!featureMap.empty()) << "verify image id format: " << imageIdFormat();
+  LOG(INFO) << folly::sformat("{} images loaded", featureMap.size());
+
+  size_t count = 0;
+  for (const BinaryMatchesFile::Overlap& overlap : file.overlaps) {
+    if (!hasCameraIndex(overlap.images[0]) || !hasCameraIndex(overlap.images[1])) {
+      continue;
+    }
+    overlaps.emplace_back(overlap.images[0], overlap.images[1]);
+    for (int i = 0; i < overlap.matchCount; ++i) {
+      const BinaryMatch& match = overlap.matches[i];
+      if (FLAGS_match_score_threshold == 0 || FLAGS_match_score_threshold <= match.score) {
+        overlaps.back().matches.push_back({{size_t(match.corners[0]), size_t(match.corners[1])}});
+      }
+    }
+    count += 2 * overlaps.back().matches.size();
+  }
+
+  LOG(INFO) << folly::sformat("{} feature observations loaded", count);
+}
+
+// Add the features and matches of a .json or binary matches file
+void loadMatches(FeatureMap& featureMap, std::vector<Overlap>& overlaps, const std::string& path) {
+  FeatureMap newFeatureMap;
+  std::vector<Overlap> newOverlaps;
+  if (isBinaryMatchesFile(path)) {
+    loadBinaryMatches(newFeatureMap, newOverlaps, path);
+  } else {
+    folly::dynamic parsed = parseJsonFile(path);
+    newFeatureMap = loadFeatureMap(parsed);
+    newOverlaps = loadOverlaps(parsed);
+  }
+
+  for (auto& entry : newFeatureMap) {
+    CHECK(!featureMap.count(entry.first)) << "image in several matches files: " << entry.first;
+    featureMap[entry.first] = std::move(entry.second);
+  }
+  overlaps.insert(overlaps.end(), newOverlaps.begin(), newOverlaps.end());
+}
+
 Overlap& findOrAddOverlap(std::vector<Overlap>& overlaps, const ImageId& i0, const ImageId& i1) {
   for (Overlap& overlap : overlaps) {
     if (overlap.images[0] == i0 && overlap.images[1] == i1) {
@@ -1238,9 +1298,12 @@ double geometricCalibration() {
     std::vector<Overlap> overlaps;
 
     if (!FLAGS_matches.empty()) {
-      folly::dynamic parsed = parseJsonFile(FLAGS_matches);
-      featureMap = loadFeatureMap(parsed);
-      overlaps = loadOverlaps(parsed);
+      // Matches files of different frames calibrate together
+      std::vector<std::string> paths;
+      boost::split(paths, FLAGS_matches, boost::is_any_of(","));
+      for (const std::string& path : paths) {
+        loadMatches(featureMap, overlaps, path);
+      }
     } else {
       generateArtificalPoints(featureMap, overlaps, groundTruth);
     }
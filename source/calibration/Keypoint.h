@@ -7,8 +7,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include <folly/dynamic.h>
 
+#include "source/calibration/ZnccKernels.h"
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 
@@ -25,6 +30,7 @@ struct Keypoint {
   double avg;
   double std;
   cv::Mat_<uint8_t> patch;
+  std::vector<float> normalized; // row-major patch, zero-mean and unit-norm or all 0 if flat
 
   Keypoint(
       const Camera::Vector2& coords,
@@ -41,12 +47,14 @@ struct Keypoint {
       }
     }
     initializeAvgStd();
+    initializeNormalized();
   }
 
   // This creates a fake keypoint by directly providing a patch without coords
   Keypoint(cv::Mat_<uint8_t>& interpolatedPatch) : coords(NAN, NAN) {
     interpolatedPatch.copyTo(patch);
     initializeAvgStd();
+    initializeNormalized();
   }
 
   folly::dynamic serialize() const {
@@ -81,6 +89,105 @@ struct Keypoint {
     avg = cvMean[0];
     std = cvStd[0];
   }
+
+  // A flat patch has std 0 and normalizes to zeros, see computeZnccs()
+  void initializeNormalized() {
+    normalized.assign(getAlignedPatchSize(patch.total()), 0);
+    if (std == 0) {
+      return;
+    }
+    const double scale = 1 / (std * std::sqrt(double(patch.total())));
+    for (int y = 0; y < patch.rows; ++y) {
+      for (int x = 0; x < patch.cols; ++x) {
+        normalized[y * patch.cols + x] = float((patch(y, x) - avg) * scale);
+      }
+    }
+  }
+};
+
+// Uniform grid over the coords of the keypoints of an image, for rectangle queries
+// Coords are stored as the float points that cv::Rect2f::contains() tests, so a query finds exactly
+// the keypoints that a linear scan with contains() would, in the same order
+struct KeypointGrid {
+  float cellSize;
+  cv::Point2f origin;
+  int cols = 0;
+  int rows = 0;
+  std::vector<cv::Point2f> points;
+  std::vector<int> cellStarts; // keypoints of cell i are indices[cellStarts[i], cellStarts[i + 1])
+  std::vector<int> indices; // increasing within each cell
+
+  KeypointGrid(const std::vector<Keypoint>& keypoints, const float cellSize)
+      : cellSize(cellSize) {
+    CHECK_GT(cellSize, 0);
+    cv::Point2f end(-INFINITY, -INFINITY);
+    origin = cv::Point2f(INFINITY, INFINITY);
+    for (const Keypoint& keypoint : keypoints) {
+      points.emplace_back(keypoint.coords.x(), keypoint.coords.y());
+      if (std::isfinite(points.back().x) && std::isfinite(points.back().y)) {
+        origin.x = std::min(origin.x, points.back().x);
+        origin.y = std::min(origin.y, points.back().y);
+        end.x = std::max(end.x, points.back().x);
+        end.y = std::max(end.y, points.back().y);
+      }
+    }
+    if (origin.x > end.x) {
+      return; // no keypoints can be inside a box
+    }
+    cols = int((end.x - origin.x) / cellSize) + 1;
+    rows = int((end.y - origin.y) / cellSize) + 1;
+
+    // Counting sort of the keypoints by cell
+    cellStarts.assign(cols * rows + 1, 0);
+    std::vector<int> cells(points.size(), -1);
+    for (int i = 0; i < int(points.size()); ++i) {
+      if (std::isfinite(points[i].x) && std::isfinite(points[i].y)) {
+        cells[i] = cellY(points[i].y) * cols + cellX(points[i].x);
+        ++cellStarts[cells[i] + 1];
+      }
+    }
+    for (int cell = 0; cell < cols * rows; ++cell) {
+      cellStarts[cell + 1] += cellStarts[cell];
+    }
+    indices.resize(cellStarts.back());
+    std::vector<int> fill(cellStarts.begin(), cellStarts.end() - 1);
+    for (int i = 0; i < int(points.size()); ++i) {
+      if (cells[i] >= 0) {
+        indices[fill[cells[i]]++] = i;
+      }
+    }
+  }
+
+  // Indices of the keypoints inside box, in increasing order
+  void query(const cv::Rect2f& box, std::vector<int>& result) const {
+    result.clear();
+    if (cols == 0 || !std::isfinite(box.x) || !std::isfinite(box.y) ||
+        !std::isfinite(box.width) || !std::isfinite(box.height)) {
+      return;
+    }
+    const int xEnd = cellX(box.x + box.width) + 1;
+    const int yEnd = cellY(box.y + box.height) + 1;
+    for (int y = cellY(box.y); y < yEnd; ++y) {
+      for (int x = cellX(box.x); x < xEnd; ++x) {
+        const int cell = y * cols + x;
+        for (int i = cellStarts[cell]; i < cellStarts[cell + 1]; ++i) {
+          if (box.contains(points[indices[i]])) {
+            result.push_back(indices[i]);
+          }
+        }
+      }
+    }
+    std::sort(result.begin(), result.end());
+  }
+
+ private:
+  int cellX(const float x) const {
+    return int(std::min(std::max((x - origin.x) / cellSize, 0.0f), float(cols - 1)));
+  }
+
+  int cellY(const float y) const {
+    return int(std::min(std::max((y - origin.y) / cellSize, 0.0f), float(rows - 1)));
+  }
 };
 
 struct Match {
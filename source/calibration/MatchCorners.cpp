@@ -12,7 +12,9 @@
 
 #include <folly/Format.h>
 
+#include "source/calibration/BinaryMatches.h"
 #include "source/calibration/Calibration.h"
+#include "source/calibration/FeatureCache.h"
 #include "source/calibration/FeatureDetector.h"
 #include "source/calibration/FeatureMatcher.h"
 #include "source/util/FilesystemUtil.h"
@@ -31,12 +33,18 @@ DEFINE_string(
     color_channel,
     "grayscale",
     "color channel. supported channels: grayscale, red, green, blue");
+DEFINE_string(
+    feature_cache,
+    "",
+    "directory of corners and matches kept across runs, only new images are processed (optional)");
 DEFINE_int32(min_features, 1500, "minimum number of features to consider calibration valid");
 DEFINE_int32(octave_count, 4, "number of resolutions to use when looking for features");
 DEFINE_bool(same_scale, false, "match at same scale where feature was found");
 DEFINE_double(scale, 1, "scale at which to perform matching");
 DEFINE_bool(use_nearest, false, "use nearest neighbor during corner matching, default is bilinear");
 
+DECLARE_int32(zncc_window_radius);
+
 using Image = cv::Mat_<uint8_t>;
 using ImageId = std::string;
 
@@ -80,6 +88,44 @@ std::vector<Image> loadSingleChannelImages(const filesystem::path& dir, const Ca
   return singleChannelImages;
 }
 
+static std::vector<Camera::Vector2> getCoords(const std::vector<Keypoint>& corners) {
+  std::vector<Camera::Vector2> coords;
+  for (const Keypoint& corner : corners) {
+    coords.push_back(corner.coords);
+  }
+  return coords;
+}
+
+static std::vector<BinaryMatch> getBinaryMatches(const std::vector<Match>& matches) {
+  std::vector<BinaryMatch> binaryMatches;
+  for (const Match& match : matches) {
+    binaryMatches.push_back({{match.corners[0], match.corners[1]}, match.score});
+  }
+  return binaryMatches;
+}
+
+static void saveBinaryMatches(
+    const filesystem::path& filename,
+    const std::map<ImageId, std::vector<Keypoint>>& allCorners,
+    const std::vector<Overlap>& overlaps,
+    const std::string& imageExt) {
+  BinaryMatchesWriter writer;
+  for (const auto& entry : allCorners) {
+    writer.addImage(getImageFilename(entry.first, FLAGS_frame, imageExt), getCoords(entry.second));
+  }
+  for (const Overlap& overlap : overlaps) {
+    writer.addOverlap(
+        getImageFilename(overlap.images[0], FLAGS_frame, imageExt),
+        getImageFilename(overlap.images[1], FLAGS_frame, imageExt),
+        getBinaryMatches(overlap.matches));
+  }
+  LOG(INFO) << folly::sformat("Saving matches to file: {}", filename.string());
+  if (filename.has_parent_path()) {
+    filesystem::create_directories(filename.parent_path());
+  }
+  writer.save(filename.string());
+}
+
 static void saveMatches(
     const filesystem::path& filename,
     const std::map<ImageId, std::vector<Keypoint>>& allCorners,
@@ -88,6 +134,11 @@ static void saveMatches(
   CHECK(!allCorners.empty());
   const std::string imageExt = filesystem::getFirstExtension(colorDir / allCorners.begin()->first);
 
+  if (isBinaryMatchesFile(filename.string())) {
+    saveBinaryMatches(filename, allCorners, overlaps, imageExt);
+    return;
+  }
+
   folly::dynamic allCornersData = Keypoint::serializeRig(allCorners, FLAGS_frame, imageExt);
 
   folly::dynamic allMatches = folly::dynamic::array;
@@ -187,6 +238,103 @@ static void upscale(
   }
 }
 
+// Whether matches only refer to existing corners, so that a damaged cache entry is a miss
+static bool isInRange(const std::vector<BinaryMatch>& matches, const int count0, const int count1) {
+  for (const BinaryMatch& match : matches) {
+    if (match.corners[0] < 0 || match.corners[0] >= count0 || match.corners[1] < 0 ||
+        match.corners[1] >= count1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Corners and matches of images that an earlier run saw come from the feature cache
+// Corners are keyed by their image, camera and the detector flags, matches by the keys of the
+// corners of their pair and the matcher flags
+void findAllCornersAndMatches(
+    std::map<ImageId, std::vector<Keypoint>>& allCorners,
+    std::vector<Overlap>& overlaps,
+    const Camera::Rig& rig,
+    const std::vector<Image>& images,
+    const FeatureCache& cache) {
+  if (!cache.isEnabled()) {
+    allCorners = findAllCorners(rig, images, FLAGS_use_nearest);
+    overlaps = findAllMatches(rig, images, allCorners);
+    return;
+  }
+
+  // Cached corners only keep their coordinates, patches are sampled again
+  std::vector<uint64_t> cornersKeys;
+  std::vector<std::vector<Camera::Vector2>> cachedCorners(rig.size());
+  std::vector<bool> isCornersCached;
+  for (ssize_t i = 0; i < ssize(rig); ++i) {
+    uint64_t key = hashImage(images[i]);
+    key = hashString(folly::toJson(rig[i].serialize()), key);
+    cornersKeys.push_back(hashString(getDetectorParams(), key));
+    isCornersCached.push_back(cache.loadCorners(cornersKeys[i], cachedCorners[i]));
+  }
+  ThreadPool threadPool(FLAGS_threads);
+  for (ssize_t i = 0; i < ssize(rig); ++i) {
+    if (isCornersCached[i]) {
+      std::vector<Keypoint>& keypoints = allCorners[rig[i].id]; // modify allCorners in main thread
+      const std::vector<Camera::Vector2>& coords = cachedCorners[i];
+      const Image& image = images[i];
+      threadPool.spawn([&keypoints, &coords, &image] {
+        keypoints.reserve(coords.size());
+        for (const Camera::Vector2& corner : coords) {
+          keypoints.emplace_back(corner, image, FLAGS_zncc_window_radius, FLAGS_use_nearest);
+        }
+      });
+    }
+  }
+  threadPool.join();
+  findMissingCorners(allCorners, rig, images, FLAGS_use_nearest);
+  for (ssize_t i = 0; i < ssize(rig); ++i) {
+    if (!isCornersCached[i]) {
+      cache.saveCorners(cornersKeys[i], getCoords(allCorners.at(rig[i].id)));
+    }
+  }
+
+  const std::vector<std::array<int, 2>> pairs = getMatchingPairs(rig);
+  std::vector<uint64_t> matchesKeys;
+  std::vector<std::array<int, 2>> missingPairs;
+  std::vector<int> missingPairIndices;
+  for (ssize_t i = 0; i < ssize(pairs); ++i) {
+    const int c0 = pairs[i][0];
+    const int c1 = pairs[i][1];
+    uint64_t key = hashBytes(&cornersKeys[c0], sizeof(cornersKeys[c0]));
+    key = hashBytes(&cornersKeys[c1], sizeof(cornersKeys[c1]), key);
+    matchesKeys.push_back(hashString(getMatcherParams(), key));
+    overlaps.emplace_back(rig[c0].id, rig[c1].id);
+    std::vector<BinaryMatch> matches;
+    const int count0 = allCorners.at(rig[c0].id).size();
+    const int count1 = allCorners.at(rig[c1].id).size();
+    if (cache.loadMatches(matchesKeys[i], matches) && isInRange(matches, count0, count1)) {
+      for (const BinaryMatch& match : matches) {
+        overlaps.back().matches.emplace_back(match.score, match.corners[0], match.corners[1]);
+      }
+    } else {
+      missingPairs.push_back(pairs[i]);
+      missingPairIndices.push_back(i);
+    }
+  }
+  std::vector<Overlap> missingOverlaps = findAllMatches(rig, images, allCorners, missingPairs);
+  for (ssize_t i = 0; i < ssize(missingOverlaps); ++i) {
+    const int pairIndex = missingPairIndices[i];
+    cache.saveMatches(matchesKeys[pairIndex], getBinaryMatches(missingOverlaps[i].matches));
+    overlaps[pairIndex] = std::move(missingOverlaps[i]);
+  }
+
+  const int cachedCornerCount = std::count(isCornersCached.begin(), isCornersCached.end(), true);
+  LOG(INFO) << folly::sformat(
+      "Feature cache: corners of {} of {} cameras, matches of {} of {} pairs",
+      cachedCornerCount,
+      rig.size(),
+      pairs.size() - missingPairs.size(),
+      pairs.size());
+}
+
 void processScale(
     const float scale,
     const Camera::Rig& rigFull,
@@ -206,9 +354,10 @@ void processScale(
   CHECK(!scaledImages.empty());
   const Camera::Rig rig = rescale(rigFull, scaledImages);
 
-  std::map<ImageId, std::vector<Keypoint>> newCorners =
-      findAllCorners(rig, scaledImages, FLAGS_use_nearest);
-  std::vector<Overlap> newOverlaps = findAllMatches(rig, scaledImages, newCorners);
+  std::map<ImageId, std::vector<Keypoint>> newCorners;
+  std::vector<Overlap> newOverlaps;
+  findAllCornersAndMatches(
+      newCorners, newOverlaps, rig, scaledImages, FeatureCache(FLAGS_feature_cache));
   upscale(newCorners, rigFull, scaledImages);
 
   // matches refer to corners by index, so we need to offset these by the total number
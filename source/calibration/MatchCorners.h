@@ -9,6 +9,7 @@
 
 #include <folly/dynamic.h>
 
+#include "source/calibration/FeatureCache.h"
 #include "source/calibration/Keypoint.h"
 #include "source/util/Camera.h"
 
@@ -19,5 +20,14 @@ cv::Mat_<uint8_t> extractSingleChannelImage(const cv::Mat_<cv::Vec3b>& image);
 
 std::vector<cv::Mat_<uint8_t>> loadChannels(const Camera::Rig& rig);
 
+// findAllCorners() and findAllMatches(), with the entries of cache standing in for what an earlier
+// run found and new entries saved to it
+void findAllCornersAndMatches(
+    std::map<std::string, std::vector<Keypoint>>& allCorners,
+    std::vector<Overlap>& overlaps,
+    const Camera::Rig& rig,
+    const std::vector<cv::Mat_<uint8_t>>& images,
+    const FeatureCache& cache);
+
 } // namespace calibration
 } // namespace fb360_dep
@@ -0,0 +1,119 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/calibration/ZnccKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEP_ZNCC_KERNELS_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace fb360_dep {
+namespace calibration {
+
+void dotProductsScalar(
+    const float* patch,
+    const float* const* candidates,
+    const int count,
+    const int size,
+    float* out) {
+  for (int c = 0; c < count; ++c) {
+    const float* candidate = candidates[c];
+    double dot = 0;
+    for (int i = 0; i < size; ++i) {
+      dot += double(patch[i]) * candidate[i];
+    }
+    out[c] = float(dot);
+  }
+}
+
+#ifdef DEP_ZNCC_KERNELS_AVX2
+
+namespace {
+
+#define DEP_AVX2 __attribute__((target("avx2")))
+
+// Number of candidates that share each load of the patch
+const int kCandidatesPerPass = 4;
+
+DEP_AVX2 inline float horizontalSum(const __m256 v) {
+  const __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  const __m128 sum2 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+  return _mm_cvtss_f32(_mm_add_ss(sum2, _mm_shuffle_ps(sum2, sum2, 1)));
+}
+
+DEP_AVX2 void dotProductsAvx2(
+    const float* patch,
+    const float* const* candidates,
+    const int count,
+    const int size,
+    float* out) {
+  int c = 0;
+  for (; c + kCandidatesPerPass <= count; c += kCandidatesPerPass) {
+    const float* c0 = candidates[c];
+    const float* c1 = candidates[c + 1];
+    const float* c2 = candidates[c + 2];
+    const float* c3 = candidates[c + 3];
+    __m256 dot0 = _mm256_setzero_ps();
+    __m256 dot1 = _mm256_setzero_ps();
+    __m256 dot2 = _mm256_setzero_ps();
+    __m256 dot3 = _mm256_setzero_ps();
+    for (int i = 0; i < size; i += kZnccPatchAlignment) {
+      const __m256 p = _mm256_loadu_ps(patch + i);
+      dot0 = _mm256_add_ps(dot0, _mm256_mul_ps(p, _mm256_loadu_ps(c0 + i)));
+      dot1 = _mm256_add_ps(dot1, _mm256_mul_ps(p, _mm256_loadu_ps(c1 + i)));
+      dot2 = _mm256_add_ps(dot2, _mm256_mul_ps(p, _mm256_loadu_ps(c2 + i)));
+      dot3 = _mm256_add_ps(dot3, _mm256_mul_ps(p, _mm256_loadu_ps(c3 + i)));
+    }
+    out[c] = horizontalSum(dot0);
+    out[c + 1] = horizontalSum(dot1);
+    out[c + 2] = horizontalSum(dot2);
+    out[c + 3] = horizontalSum(dot3);
+  }
+  for (; c < count; ++c) {
+    const float* candidate = candidates[c];
+    __m256 dot = _mm256_setzero_ps();
+    for (int i = 0; i < size; i += kZnccPatchAlignment) {
+      const __m256 p = _mm256_loadu_ps(patch + i);
+      dot = _mm256_add_ps(dot, _mm256_mul_ps(p, _mm256_loadu_ps(candidate + i)));
+    }
+    out[c] = horizontalSum(dot);
+  }
+}
+
+} // namespace
+
+bool hasAvx2ZnccKernels() {
+  static const bool result = __builtin_cpu_supports("avx2");
+  return result;
+}
+
+#else
+
+bool hasAvx2ZnccKernels() {
+  return false;
+}
+
+#endif // DEP_ZNCC_KERNELS_AVX2
+
+void dotProducts(
+    const float* patch,
+    const float* const* candidates,
+    const int count,
+    const int size,
+    float* out) {
+#ifdef DEP_ZNCC_KERNELS_AVX2
+  if (hasAvx2ZnccKernels()) {
+    dotProductsAvx2(patch, candidates, count, size, out);
+    return;
+  }
+#endif
+  dotProductsScalar(patch, candidates, count, size, out);
+}
+
+} // namespace calibration
+} // namespace fb360_dep
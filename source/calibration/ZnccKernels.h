@@ -0,0 +1,46 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+namespace fb360_dep {
+namespace calibration {
+
+// Kernels behind computeZnccs() in FeatureMatcher
+// Keypoint patches are made zero-mean and unit-norm when the keypoint is created, so the ZNCC of
+// two patches is the dot product of their normalized patches. Normalized patches are padded with
+// zeros to a multiple of kZnccPatchAlignment floats, which leaves the dot products unchanged
+// Every kernel has a scalar implementation and, on x86, an AVX2 implementation that is picked at
+// runtime when the CPU supports it
+
+const int kZnccPatchAlignment = 8;
+
+inline int getAlignedPatchSize(const int size) {
+  return (size + kZnccPatchAlignment - 1) / kZnccPatchAlignment * kZnccPatchAlignment;
+}
+
+bool hasAvx2ZnccKernels();
+
+// Dot product of patch with each of count candidates, all size floats, size a multiple of
+// kZnccPatchAlignment
+void dotProducts(
+    const float* patch,
+    const float* const* candidates,
+    const int count,
+    const int size,
+    float* out);
+
+// Reference, accumulates in double precision
+void dotProductsScalar(
+    const float* patch,
+    const float* const* candidates,
+    const int count,
+    const int size,
+    float* out);
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -0,0 +1,197 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/depth_estimation/BatchCost.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "source/depth_estimation/Derp.h"
+#include "source/util/Profiler.h"
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+ImageView3 makeImageView(const cv::Mat_<PixelType>& image) {
+  return {image.data, image.cols, image.rows, int(image.step1()), ColorFormat::unorm16};
+}
+
+ImageView2f makeImageView(const cv::Mat_<cv::Vec2f>& image) {
+  return {
+      reinterpret_cast<const float*>(image.data), image.cols, image.rows, int(image.step1())};
+}
+
+ImageView2s makeImageView(const cv::Mat_<cv::Vec2s>& image, const float scale) {
+  return {reinterpret_cast<const int16_t*>(image.data),
+          image.cols,
+          image.rows,
+          int(image.step1()),
+          scale};
+}
+
+namespace {
+
+// Per thread, so that batches stop allocating once the largest one has been seen
+struct BatchCostScratch {
+  std::vector<float> dirX;
+  std::vector<float> dirY;
+  std::vector<float> dirZ;
+  std::vector<float> depth;
+  std::vector<float> srcX;
+  std::vector<float> srcY;
+  std::vector<float> dstSrcX;
+  std::vector<float> dstSrcY;
+  std::vector<float> ssdBiased;
+  std::vector<float> ssdUnbiased;
+  std::vector<std::pair<float, float>> SSDs;
+};
+
+BatchCostScratch& getBatchCostScratch() {
+  static thread_local BatchCostScratch scratch;
+  return scratch;
+}
+
+} // namespace
+
+void computeCostsBatch(
+    const PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const int y,
+    const std::vector<int>& xs,
+    const std::vector<float>& disparities,
+    std::vector<float>& costs,
+    std::vector<float>& confidences) {
+  const int count = xs.size();
+  CHECK_EQ(ssize(disparities), count);
+  costs.resize(count);
+  confidences.resize(count);
+  static profiler::Counter& numCosts = profiler::Profiler::instance().counter("computeCostsBatch");
+  numCosts.add(count);
+
+  // Points along the pre-computed rays of dst, see dstToWorldPoint()
+  // Every element is written before it is read
+  const cv::Mat_<cv::Vec3f>& rays = pyramidLevel.dstRays(dstIdx);
+  const int numSrcs = pyramidLevel.rigSrc.size();
+  BatchCostScratch& scratch = getBatchCostScratch();
+  std::vector<float>& dirX = scratch.dirX;
+  std::vector<float>& dirY = scratch.dirY;
+  std::vector<float>& dirZ = scratch.dirZ;
+  std::vector<float>& depth = scratch.depth;
+  std::vector<float>& srcX = scratch.srcX;
+  std::vector<float>& srcY = scratch.srcY;
+  std::vector<float>& dstSrcX = scratch.dstSrcX;
+  std::vector<float>& dstSrcY = scratch.dstSrcY;
+  std::vector<float>& ssdBiased = scratch.ssdBiased;
+  std::vector<float>& ssdUnbiased = scratch.ssdUnbiased;
+  std::vector<std::pair<float, float>>& SSDs = scratch.SSDs;
+  for (std::vector<float>* buffer :
+       {&dirX, &dirY, &dirZ, &depth, &srcX, &srcY, &dstSrcX, &dstSrcY}) {
+    buffer->resize(count);
+  }
+  ssdBiased.resize(count * numSrcs);
+  ssdUnbiased.resize(count * numSrcs);
+  SSDs.resize(numSrcs);
+  for (int i = 0; i < count; ++i) {
+    const cv::Vec3f& ray = rays(y, xs[i]);
+    dirX[i] = ray[0];
+    dirY[i] = ray[1];
+    dirZ[i] = ray[2];
+    depth[i] = 1.0f / disparities[i];
+  }
+
+  // Compute SSD between dst and projected src for each src, one batch per src
+  const PyramidLevel<PixelType>::Proj& dstProj =
+      pyramidLevel.dstProj(dstIdx, pyramidLevel.dst2srcIdxs[dstIdx]);
+  const ImageView3 dstView = dstProj.colorView();
+  const ImageView3 dstBiasView = dstProj.colorBiasView();
+  int numSlots = 0;
+  for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+    // No SSD if src = dst, or if src does not overlap dst at all
+    if (srcIdx == pyramidLevel.dst2srcIdxs[dstIdx] ||
+        !pyramidLevel.dstProjOverlaps(dstIdx, srcIdx)) {
+      continue;
+    }
+    const PyramidLevel<PixelType>::Proj& dstSrcProj = pyramidLevel.dstProj(dstIdx, srcIdx);
+    projectToSrc(
+        dstSrcProj.projector,
+        count,
+        dirX.data(),
+        dirY.data(),
+        dirZ.data(),
+        depth.data(),
+        srcX.data(),
+        srcY.data());
+    if (dstSrcProj.projWarpHalf.empty()) {
+      lookupWarp(
+          makeImageView(dstSrcProj.projWarp),
+          count,
+          srcX.data(),
+          srcY.data(),
+          dstSrcX.data(),
+          dstSrcY.data());
+    } else {
+      lookupWarp(
+          makeImageView(dstSrcProj.projWarpHalf, dstSrcProj.projWarpHalfScale),
+          count,
+          srcX.data(),
+          srcY.data(),
+          dstSrcX.data(),
+          dstSrcY.data());
+    }
+    computePatchSSDs(
+        dstView,
+        dstBiasView,
+        dstSrcProj.colorView(),
+        dstSrcProj.colorBiasView(),
+        y,
+        kSearchWindowRadius,
+        count,
+        xs.data(),
+        dstSrcX.data(),
+        dstSrcY.data(),
+        &ssdBiased[numSlots * count],
+        &ssdUnbiased[numSlots * count]);
+    ++numSlots;
+  }
+
+  // Same reduction as computeCost()
+  const cv::Mat_<float>& dstVariance = pyramidLevel.dstVariance(dstIdx);
+  for (int i = 0; i < count; ++i) {
+    int ssdCount = 0;
+    for (int slot = 0; slot < numSlots; ++slot) {
+      const float biased = ssdBiased[slot * count + i];
+      if (!std::isnan(biased)) {
+        SSDs[ssdCount++] = std::make_pair(biased, ssdUnbiased[slot * count + i]);
+      }
+    }
+
+    int keep = kMinOverlappingCams - 1;
+    if (ssdCount < keep) {
+      costs[i] = FLT_MAX; // not enough cameras see this disparity, skip
+      confidences[i] = 0.0f;
+      continue;
+    }
+    keep = std::max<int>(keep, ssdCount - 2);
+    std::nth_element(SSDs.begin(), SSDs.begin() + keep, SSDs.begin() + ssdCount);
+    float cost = 0;
+    for (int j = 0; j < keep; ++j) {
+      cost += SSDs[j].second;
+    }
+    cost /= keep;
+    const float trustCoef = 1.0f / keep;
+    const float confidence = std::max(dstVariance(y, xs[i]), kMinVar);
+    costs[i] = cost * trustCoef / confidence;
+    confidences[i] = confidence;
+  }
+}
+
+} // namespace depth_estimation
+} // namespace fb360_dep
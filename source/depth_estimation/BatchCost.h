@@ -0,0 +1,37 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "source/depth_estimation/CostKernels.h"
+#include "source/depth_estimation/DerpUtil.h"
+#include "source/depth_estimation/PyramidLevel.h"
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+ImageView3 makeImageView(const cv::Mat_<PixelType>& image);
+ImageView2f makeImageView(const cv::Mat_<cv::Vec2f>& image);
+ImageView2s makeImageView(const cv::Mat_<cv::Vec2s>& image, const float scale);
+
+// Batched version of computeCost()
+// Computes (cost, confidence) of all (xs[i], y, disparities[i]) in dst in one go. Each step of
+// computeCost() runs over the whole batch, one src at a time, in single precision SIMD kernels.
+// Results match computeCost() up to floating point precision
+void computeCostsBatch(
+    const PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const int y,
+    const std::vector<int>& xs,
+    const std::vector<float>& disparities,
+    std::vector<float>& costs,
+    std::vector<float>& confidences);
+
+} // namespace depth_estimation
+} // namespace fb360_dep
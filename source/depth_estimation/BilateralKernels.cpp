@@ -0,0 +1,417 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/depth_estimation/BilateralKernels.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEP_BILATERAL_KERNELS_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+namespace {
+
+// exp(-32) ~ 1e-14, i.e. nothing compared to the weight of any reasonably close neighbor
+const float kLutMaxArg = 32.0f;
+const int kLutSize = 4096;
+const float kLutInvStep = (kLutSize - 1) / kLutMaxArg;
+
+// Entries past kLutMaxArg are 0, and there is one more so interpolation never reads past the end
+struct RangeWeightLut {
+  std::array<float, kLutSize + 1> values;
+
+  RangeWeightLut() {
+    for (int i = 0; i < kLutSize - 1; ++i) {
+      values[i] = std::exp(-i / kLutInvStep);
+    }
+    values[kLutSize - 1] = 0;
+    values[kLutSize] = 0;
+  }
+};
+
+const float* getLut() {
+  static const RangeWeightLut lut;
+  return lut.values.data();
+}
+
+inline float lookUp(const float* lut, const float arg) {
+  const float t = std::min(arg, kLutMaxArg) * kLutInvStep;
+  const int i = int(t);
+  const float frac = t - i;
+  return lut[i] + frac * (lut[i + 1] - lut[i]);
+}
+
+// Filters a single pixel, shared by the scalar kernel and the tails of vector rows
+inline void filterPixelLut(
+    const float* lut,
+    const BilateralInput& in,
+    const int radius,
+    const int x,
+    const int y,
+    BilateralOutput& out) {
+  const int center = y * in.step + x;
+  const int outIdx = y * in.cols + x;
+  if (in.mask[center] == 0) {
+    for (int c = 0; c < in.channels; ++c) {
+      out.image[c][outIdx] = in.image[c][center];
+    }
+    return;
+  }
+
+  const float g0 = in.guide[0][center];
+  const float g1 = in.guide[1][center];
+  const float g2 = in.guide[2][center];
+  float sumWeight = 0;
+  float sums[kMaxBilateralChannels] = {0, 0, 0};
+  for (int v = -radius; v <= radius; ++v) {
+    const int rowBegin = center + v * in.step;
+    for (int i = rowBegin - radius; i <= rowBegin + radius; ++i) {
+      if (in.mask[i] == 0) {
+        continue; // masked out values may be NaN, so they can't just get a weight of 0
+      }
+      const float d0 = g0 - in.neighborGuide[0][i];
+      const float d1 = g1 - in.neighborGuide[1][i];
+      const float d2 = g2 - in.neighborGuide[2][i];
+      const float weight = lookUp(lut, d0 * d0 + d1 * d1 + d2 * d2) * in.mask[i];
+      sumWeight += weight;
+      for (int c = 0; c < in.channels; ++c) {
+        sums[c] += weight * in.image[c][i];
+      }
+    }
+  }
+  for (int c = 0; c < in.channels; ++c) {
+    out.image[c][outIdx] = sumWeight != 0 ? sums[c] / sumWeight : in.image[c][center];
+  }
+}
+
+// Gaussian-like blur taps along one axis of a grid, zero outside
+const std::vector<float> kTaps3 = {0.25f, 0.5f, 0.25f};
+const std::vector<float> kTaps5 = {1 / 16.0f, 4 / 16.0f, 6 / 16.0f, 4 / 16.0f, 1 / 16.0f};
+
+// Range weight exp(-dz^2) is a Gaussian of sigma 1 / sqrt(2). Splatting to the nearest cell,
+// blurring with kTaps5 and slicing linearly add up to a variance of 1.25 cells^2
+const float kGridCellZ = std::sqrt(0.5f / 1.25f);
+const int kGridPadZ = 2;
+
+// Spatial support is a box of 2 * radius + 1 pixels. Splatting to the nearest cell, blurring
+// with kTaps3 and slicing linearly add up to a variance of 0.75 cells^2
+float getGridCellSize(const int radius) {
+  const float boxVariance = ((2 * radius + 1) * (2 * radius + 1) - 1) / 12.0f;
+  return std::max(1.0f, std::sqrt(boxVariance / 0.75f));
+}
+
+// Blurs count lines of length size, elements stride floats apart, lines lineStride floats apart
+// Each element has numValues floats
+void blurLines(
+    float* data,
+    const int count,
+    const int lineStride,
+    const int size,
+    const int stride,
+    const int numValues,
+    const std::vector<float>& taps,
+    std::vector<float>& line) {
+  const int half = taps.size() / 2;
+  line.resize(size * numValues);
+  for (int l = 0; l < count; ++l) {
+    float* p = data + l * lineStride;
+    for (int i = 0; i < size; ++i) {
+      std::copy(p + i * stride, p + i * stride + numValues, &line[i * numValues]);
+    }
+    for (int i = 0; i < size; ++i) {
+      float* dst = p + i * stride;
+      std::fill(dst, dst + numValues, 0.0f);
+      for (int k = std::max(-half, -i); k <= std::min(half, size - 1 - i); ++k) {
+        const float* src = &line[(i + k) * numValues];
+        const float tap = taps[k + half];
+        for (int c = 0; c < numValues; ++c) {
+          dst[c] += tap * src[c];
+        }
+      }
+    }
+  }
+}
+
+inline float gridZ(const float* const* guide, const int idx) {
+  static const float kInvSqrt3 = 1.0f / std::sqrt(3.0f);
+  return (guide[0][idx] + guide[1][idx] + guide[2][idx]) * kInvSqrt3;
+}
+
+void filterBandGrid(
+    const BilateralInput& in,
+    const float cellSize,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out) {
+  const int numValues = in.channels + 1; // weighted values and weight
+  const float invCellSize = 1.0f / cellSize;
+
+  // Cells covering the band, the ones around it for slicing and the ones around those for blurring
+  const int cellYBegin = int(std::floor(yBegin * invCellSize)) - 1;
+  const int cellYEnd = int(std::floor((yEnd - 1) * invCellSize)) + 3;
+  const int splatYBegin = std::max(0, int(std::floor((cellYBegin - 0.5f) * cellSize)));
+  const int splatYEnd = std::min(in.rows, int(std::ceil((cellYEnd - 0.5f) * cellSize)) + 1);
+
+  // Range of gray levels of the neighbors being splatted and of the pixels being sliced
+  float zMin = INFINITY;
+  float zMax = -INFINITY;
+  for (int y = splatYBegin; y < splatYEnd; ++y) {
+    const bool isSliced = yBegin <= y && y < yEnd;
+    for (int x = 0; x < in.cols; ++x) {
+      const int idx = y * in.step + x;
+      if (in.mask[idx] != 0) {
+        const float zNeighbor = gridZ(in.neighborGuide, idx);
+        zMin = std::min(zMin, zNeighbor);
+        zMax = std::max(zMax, zNeighbor);
+        if (isSliced) {
+          const float z = gridZ(in.guide, idx);
+          zMin = std::min(zMin, z);
+          zMax = std::max(zMax, z);
+        }
+      }
+    }
+  }
+
+  if (zMin > zMax) { // nothing to filter
+    for (int y = yBegin; y < yEnd; ++y) {
+      for (int x = 0; x < in.cols; ++x) {
+        for (int c = 0; c < in.channels; ++c) {
+          out.image[c][y * in.cols + x] = in.image[c][y * in.step + x];
+        }
+      }
+    }
+    return;
+  }
+
+  const float invCellZ = 1.0f / kGridCellZ;
+  const int nx = int(std::floor((in.cols - 1) * invCellSize)) + 4; // cell -1 is at index 0
+  const int ny = cellYEnd - cellYBegin;
+  const int nz = int((zMax - zMin) * invCellZ) + 2 * kGridPadZ + 2;
+  const int strideZ = numValues;
+  const int strideX = nz * strideZ;
+  const int strideY = nx * strideX;
+  std::vector<float> grid(ny * strideY, 0.0f);
+
+  for (int y = splatYBegin; y < splatYEnd; ++y) {
+    const int cy = int(std::floor(y * invCellSize + 0.5f)) - cellYBegin;
+    if (cy < 0 || cy >= ny) {
+      continue;
+    }
+    for (int x = 0; x < in.cols; ++x) {
+      const int idx = y * in.step + x;
+      if (in.mask[idx] == 0) {
+        continue;
+      }
+      const int cx = int(std::floor(x * invCellSize + 0.5f)) + 1;
+      const int cz = int(std::floor((gridZ(in.neighborGuide, idx) - zMin) * invCellZ + 0.5f));
+      float* cell = &grid[cy * strideY + cx * strideX + (cz + kGridPadZ) * strideZ];
+      for (int c = 0; c < in.channels; ++c) {
+        cell[c] += in.image[c][idx];
+      }
+      cell[in.channels] += 1;
+    }
+  }
+
+  std::vector<float> line;
+  blurLines(grid.data(), ny * nx, strideX, nz, strideZ, numValues, kTaps5, line);
+  for (int cy = 0; cy < ny; ++cy) {
+    blurLines(&grid[cy * strideY], nz, strideZ, nx, strideX, numValues, kTaps3, line);
+  }
+  for (int cx = 0; cx < nx; ++cx) {
+    blurLines(&grid[cx * strideX], nz, strideZ, ny, strideY, numValues, kTaps3, line);
+  }
+
+  // Trilinear interpolation of weighted values and weights
+  for (int y = yBegin; y < yEnd; ++y) {
+    const float gy = y * invCellSize - cellYBegin;
+    const int y0 = int(gy);
+    const float fy = gy - y0;
+    for (int x = 0; x < in.cols; ++x) {
+      const int idx = y * in.step + x;
+      const int outIdx = y * in.cols + x;
+      float sums[kMaxBilateralChannels + 1] = {0, 0, 0, 0};
+      if (in.mask[idx] != 0) {
+        const float gx = x * invCellSize + 1;
+        const int x0 = int(gx);
+        const float fx = gx - x0;
+        const float gz = (gridZ(in.guide, idx) - zMin) * invCellZ + kGridPadZ;
+        const int z0 = int(gz);
+        const float fz = gz - z0;
+        for (int dy = 0; dy <= 1; ++dy) {
+          for (int dx = 0; dx <= 1; ++dx) {
+            for (int dz = 0; dz <= 1; ++dz) {
+              const float weight = (dy ? fy : 1 - fy) * (dx ? fx : 1 - fx) * (dz ? fz : 1 - fz);
+              const float* cell =
+                  &grid[(y0 + dy) * strideY + (x0 + dx) * strideX + (z0 + dz) * strideZ];
+              for (int c = 0; c < numValues; ++c) {
+                sums[c] += weight * cell[c];
+              }
+            }
+          }
+        }
+      }
+      const float sumWeight = sums[in.channels];
+      for (int c = 0; c < in.channels; ++c) {
+        out.image[c][outIdx] = sumWeight > 0 ? sums[c] / sumWeight : in.image[c][idx];
+      }
+    }
+  }
+}
+
+} // namespace
+
+float bilateralRangeWeight(const float arg) {
+  return lookUp(getLut(), arg);
+}
+
+void jointBilateralFilterLutScalar(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out) {
+  const float* lut = getLut();
+  for (int y = yBegin; y < yEnd; ++y) {
+    for (int x = 0; x < in.cols; ++x) {
+      filterPixelLut(lut, in, radius, x, y, out);
+    }
+  }
+}
+
+#ifdef DEP_BILATERAL_KERNELS_AVX2
+
+namespace {
+
+#define DEP_AVX2 __attribute__((target("avx2")))
+
+DEP_AVX2 inline __m256 lookUpAvx2(const float* lut, const __m256 arg) {
+  const __m256 t = _mm256_mul_ps(
+      _mm256_min_ps(arg, _mm256_set1_ps(kLutMaxArg)), _mm256_set1_ps(kLutInvStep));
+  const __m256i i = _mm256_cvttps_epi32(t);
+  const __m256 frac = _mm256_sub_ps(t, _mm256_cvtepi32_ps(i));
+  const __m256 lo = _mm256_i32gather_ps(lut, i, 4);
+  const __m256 hi = _mm256_i32gather_ps(lut + 1, i, 4);
+  return _mm256_add_ps(lo, _mm256_mul_ps(frac, _mm256_sub_ps(hi, lo)));
+}
+
+// 8 consecutive pixels of a row at a time, tails go through filterPixelLut()
+DEP_AVX2 void jointBilateralFilterLutAvx2(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out) {
+  const float* lut = getLut();
+  const int vectorCols = in.cols - in.cols % 8;
+  const __m256 zero = _mm256_setzero_ps();
+  for (int y = yBegin; y < yEnd; ++y) {
+    for (int x = 0; x < vectorCols; x += 8) {
+      const int center = y * in.step + x;
+      const __m256 g0 = _mm256_loadu_ps(in.guide[0] + center);
+      const __m256 g1 = _mm256_loadu_ps(in.guide[1] + center);
+      const __m256 g2 = _mm256_loadu_ps(in.guide[2] + center);
+      __m256 sumWeight = zero;
+      __m256 sums[kMaxBilateralChannels] = {zero, zero, zero};
+      for (int v = -radius; v <= radius; ++v) {
+        const int rowBegin = center + v * in.step;
+        for (int i = rowBegin - radius; i <= rowBegin + radius; ++i) {
+          const __m256 d0 = _mm256_sub_ps(g0, _mm256_loadu_ps(in.neighborGuide[0] + i));
+          const __m256 d1 = _mm256_sub_ps(g1, _mm256_loadu_ps(in.neighborGuide[1] + i));
+          const __m256 d2 = _mm256_sub_ps(g2, _mm256_loadu_ps(in.neighborGuide[2] + i));
+          const __m256 arg = _mm256_add_ps(
+              _mm256_add_ps(_mm256_mul_ps(d0, d0), _mm256_mul_ps(d1, d1)), _mm256_mul_ps(d2, d2));
+          const __m256 mask = _mm256_loadu_ps(in.mask + i);
+          const __m256 weight = _mm256_mul_ps(lookUpAvx2(lut, arg), mask);
+          sumWeight = _mm256_add_ps(sumWeight, weight);
+
+          // Masked out values may be NaN, so they are zeroed rather than just weighted by 0
+          const __m256 isNeighbor = _mm256_cmp_ps(mask, zero, _CMP_NEQ_OQ);
+          for (int c = 0; c < in.channels; ++c) {
+            const __m256 value = _mm256_and_ps(isNeighbor, _mm256_loadu_ps(in.image[c] + i));
+            sums[c] = _mm256_add_ps(sums[c], _mm256_mul_ps(weight, value));
+          }
+        }
+      }
+
+      // Unmasked pixels and pixels without weighted neighbors are left untouched
+      const __m256 filtered = _mm256_and_ps(
+          _mm256_cmp_ps(_mm256_loadu_ps(in.mask + center), zero, _CMP_NEQ_OQ),
+          _mm256_cmp_ps(sumWeight, zero, _CMP_NEQ_OQ));
+      const __m256 one = _mm256_set1_ps(1.0f);
+      const __m256 invSumWeight = _mm256_div_ps(one, _mm256_blendv_ps(one, sumWeight, filtered));
+      for (int c = 0; c < in.channels; ++c) {
+        const __m256 result = _mm256_blendv_ps(
+            _mm256_loadu_ps(in.image[c] + center),
+            _mm256_mul_ps(sums[c], invSumWeight),
+            filtered);
+        _mm256_storeu_ps(out.image[c] + y * in.cols + x, result);
+      }
+    }
+    for (int x = vectorCols; x < in.cols; ++x) {
+      filterPixelLut(lut, in, radius, x, y, out);
+    }
+  }
+}
+
+#undef DEP_AVX2
+
+} // namespace
+
+bool hasAvx2BilateralKernels() {
+  static const bool result = __builtin_cpu_supports("avx2");
+  return result;
+}
+
+#else
+
+bool hasAvx2BilateralKernels() {
+  return false;
+}
+
+#endif // DEP_BILATERAL_KERNELS_AVX2
+
+void jointBilateralFilterLut(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out) {
+#ifdef DEP_BILATERAL_KERNELS_AVX2
+  if (hasAvx2BilateralKernels()) {
+    jointBilateralFilterLutAvx2(in, radius, yBegin, yEnd, out);
+    return;
+  }
+#endif
+  jointBilateralFilterLutScalar(in, radius, yBegin, yEnd, out);
+}
+
+int getBilateralGridBandRows(const int radius) {
+  return std::max(16, int(std::ceil(16 * getGridCellSize(radius))));
+}
+
+void jointBilateralFilterGrid(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out) {
+  const float cellSize = getGridCellSize(radius);
+  const int bandRows = getBilateralGridBandRows(radius);
+  for (int y = yBegin; y < yEnd; y += bandRows) {
+    filterBandGrid(in, cellSize, y, std::min(y + bandRows, yEnd), out);
+  }
+}
+
+} // namespace depth_estimation
+} // namespace fb360_dep
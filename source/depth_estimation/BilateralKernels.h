@@ -0,0 +1,82 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+// Kernels behind generalizedJointBilateralFilter() (see TemporalBilateralFilter.h)
+// They have no OpenCV dependencies: images are planar float views, and the guide colors are
+// pre-scaled so that the range weight of two colors a and b is exp(-|a - b|^2)
+
+// How generalizedJointBilateralFilter() is evaluated
+//   bruteForce: reference implementation, one expf per pixel and neighbor
+//   lut: bruteForce to ~1e-5, with a lookup table instead of expf, 8 pixels at a time on AVX2
+//   grid: bilateral grid approximation, cost independent of the radius
+enum struct BilateralEngine { bruteForce, lut, grid };
+
+const int kMaxBilateralChannels = 3;
+
+// Pointers are to pixel (0, 0) and rows are step floats apart
+// Planes are padded by replicating their edges, so that offsets up to border outside the image
+// are valid, which matches clamping neighbor coordinates to the image
+struct BilateralInput {
+  int cols;
+  int rows;
+  int step;
+  int border;
+  int channels; // of image, at most kMaxBilateralChannels
+  const float* image[kMaxBilateralChannels];
+  const float* guide[3]; // color of the pixel being filtered
+  const float* neighborGuide[3]; // color of its neighbors
+  const float* mask; // 1 = filter and use as neighbor, 0 = leave untouched
+};
+
+// Planar output, rows are cols floats apart
+struct BilateralOutput {
+  float* image[kMaxBilateralChannels];
+};
+
+bool hasAvx2BilateralKernels();
+
+// exp(-arg) through a linearly interpolated table, 0 past its end
+// Relative error is below 1e-5
+float bilateralRangeWeight(const float arg);
+
+// Filters rows [yBegin, yEnd) over a (2 * radius + 1)^2 box of neighbors
+// Needs in.border >= radius
+void jointBilateralFilterLut(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out);
+
+void jointBilateralFilterLutScalar(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out);
+
+// Approximates jointBilateralFilterLut() on a grid of (x, y, color) cells
+// Colors are projected onto the gray axis, so neighbors of equal brightness but different hue
+// get more weight than they would otherwise. Cells cover about radius / 1.3 pixels, rows are
+// processed in bands of about getBilateralGridBandRows(radius) rows, each with its own grid
+void jointBilateralFilterGrid(
+    const BilateralInput& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    BilateralOutput& out);
+
+// Rows in a band of jointBilateralFilterGrid(), i.e. a good unit of parallel work
+int getBilateralGridBandRows(const int radius);
+
+} // namespace depth_estimation
+} // namespace fb360_dep
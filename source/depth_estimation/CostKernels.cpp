@@ -0,0 +1,916 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/depth_estimation/CostKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEP_COST_KERNELS_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+namespace {
+
+// Same as Camera::cameraToSensor() for RECTILINEAR points behind the camera, tan(M_PI / 2)
+const float kRectilinearOutsideFov = 1.633123935319537e16f;
+
+// computeSSD() normalizes by the square of the max pixel value
+const float kSSDScale = 1.0f / (65535.0f * 65535.0f);
+
+// Footprint registers of the AVX2 patch kernel live on the stack, larger radii use the scalar path
+const int kMaxAvx2Radius = 7;
+
+// Patch kernels work on the [0, 65535] scale of unorm16, whatever the format
+const float kHalfScale = 65535.0f;
+const float kUnorm8Scale = 257.0f; // 65535 / 255
+
+// 2^112: half exponent bits shifted into a float are off by the difference of the biases
+const float kHalfExponentScale = 5.192296858534828e33f;
+
+inline int clampInt(const int value, const int lo, const int hi) {
+  return std::min(std::max(value, lo), hi);
+}
+
+float distortFactor(const SrcProjector& proj, const float rSquared) {
+  float result = proj.distortion[2];
+  result = proj.distortion[1] + rSquared * result;
+  result = proj.distortion[0] + rSquared * result;
+  return 1 + rSquared * result;
+}
+
+float distort(const SrcProjector& proj, float r) {
+  r = std::min(r, proj.distortionMax);
+  return distortFactor(proj, r * r) * r;
+}
+
+bool isOutsideFov(const SrcProjector& proj, const float cx, const float cy, const float cz) {
+  if (proj.cosFov == -1) {
+    return false;
+  }
+  if (proj.cosFov == 0) {
+    return cz >= 0;
+  }
+  const float dot = -cz;
+  const float squaredNorm = cx * cx + cy * cy + cz * cz;
+  return dot * std::abs(dot) <= proj.cosFov * std::abs(proj.cosFov) * squaredNorm;
+}
+
+// Camera space to distorted sensor coordinates
+void cameraToSensor(
+    const SrcProjector& proj,
+    const float cx,
+    const float cy,
+    const float cz,
+    float& sx,
+    float& sy) {
+  const float xy = std::sqrt(cx * cx + cy * cy);
+  float r;
+  if (proj.type == ProjectorType::FTHETA) {
+    r = std::atan2(xy, -cz);
+  } else if (proj.type == ProjectorType::RECTILINEAR) {
+    r = -cz <= 0 ? kRectilinearOutsideFov : xy / -cz;
+  } else if (proj.type == ProjectorType::EQUISOLID) {
+    const float norm = std::sqrt(cx * cx + cy * cy + cz * cz);
+    r = 2 * std::sqrt((1 + cz / norm) / 2);
+  } else {
+    // ORTHOGRAPHIC: distortion is applied to the pre-distortion vector directly
+    const float norm = cz < 0 ? std::sqrt(cx * cx + cy * cy + cz * cz) : xy;
+    const float preX = cx / norm;
+    const float preY = cy / norm;
+    const float factor = distortFactor(proj, preX * preX + preY * preY);
+    sx = factor * preX;
+    sy = factor * preY;
+    return;
+  }
+  const float k = distort(proj, r) / xy;
+  sx = k * cx;
+  sy = k * cy;
+}
+
+// Bilinear weights and top-left sample of getPixelBilinear(x, y)
+inline void
+bilinearFootprint(const float x, const float y, int& xi, int& yi, float& xw, float& yw) {
+  const float xf = std::round(x);
+  const float yf = std::round(y);
+  xi = int(xf) - 1;
+  yi = int(yf) - 1;
+  xw = x - xf + 0.5f;
+  yw = y - yf + 0.5f;
+}
+
+// Element type and decoding to the unorm16 scale of each format
+template <ColorFormat kFormat>
+struct ColorTraits;
+
+template <>
+struct ColorTraits<ColorFormat::unorm16> {
+  using Element = uint16_t;
+  static float decode(const uint16_t value) {
+    return value;
+  }
+};
+
+template <>
+struct ColorTraits<ColorFormat::half> {
+  using Element = uint16_t;
+  static float decode(const uint16_t value) {
+    return halfToFloat(value) * kHalfScale;
+  }
+};
+
+template <>
+struct ColorTraits<ColorFormat::unorm8> {
+  using Element = uint8_t;
+  static float decode(const uint8_t value) {
+    return value * kUnorm8Scale;
+  }
+};
+
+// cv_util::bilerp() for a single channel, including the saturate_cast back to uint16 for unorm16,
+// which rounds to nearest even. Weights sum to 1, so the value never leaves [0, 65535]
+template <ColorFormat kFormat>
+inline float bilerpColor(
+    const float p00,
+    const float p01,
+    const float p10,
+    const float p11,
+    const float xw,
+    const float yw) {
+  const float value =
+      (1 - xw) * (1 - yw) * p00 + xw * (1 - yw) * p01 + (1 - xw) * yw * p10 + xw * yw * p11;
+  return kFormat == ColorFormat::unorm16 ? std::nearbyint(value) : value;
+}
+
+template <ColorFormat kFormat>
+inline void loadPixel(const ImageView3& image, const int x, const int y, float (&pixel)[3]) {
+  using Traits = ColorTraits<kFormat>;
+  const typename Traits::Element* const p =
+      static_cast<const typename Traits::Element*>(image.data) + y * image.step + x * 3;
+  for (int c = 0; c < 3; ++c) {
+    pixel[c] = Traits::decode(p[c]);
+  }
+}
+
+// decode(p, value) reads the 2 channels of the warp sample at p
+template <typename View, typename Decode>
+void lookupWarpImpl(
+    const View& warp,
+    const Decode& decode,
+    const int count,
+    const float* srcX,
+    const float* srcY,
+    float* dstSrcX,
+    float* dstSrcY) {
+  // Gathers of 2 floats are not worth vectorizing: the lookup is a small fraction of the patch cost
+  for (int i = 0; i < count; ++i) {
+    if (std::isnan(srcX[i]) || std::isnan(srcY[i])) {
+      dstSrcX[i] = NAN;
+      dstSrcY[i] = NAN;
+      continue;
+    }
+    int xi, yi;
+    float xw, yw;
+    bilinearFootprint(srcX[i], srcY[i], xi, yi, xw, yw);
+    const int x0 = clampInt(xi, 0, warp.cols - 1);
+    const int x1 = clampInt(xi + 1, 0, warp.cols - 1);
+    const int y0 = clampInt(yi, 0, warp.rows - 1);
+    const int y1 = clampInt(yi + 1, 0, warp.rows - 1);
+    float p00[2], p01[2], p10[2], p11[2];
+    decode(warp.data + y0 * warp.step + x0 * 2, p00);
+    decode(warp.data + y0 * warp.step + x1 * 2, p01);
+    decode(warp.data + y1 * warp.step + x0 * 2, p10);
+    decode(warp.data + y1 * warp.step + x1 * 2, p11);
+    float result[2];
+    for (int c = 0; c < 2; ++c) {
+      result[c] = (1 - xw) * (1 - yw) * p00[c] + xw * (1 - yw) * p01[c] +
+          (1 - xw) * yw * p10[c] + xw * yw * p11[c];
+    }
+    // Warp uses opencv coordinate convention
+    dstSrcX[i] = result[0] + 0.5f;
+    dstSrcY[i] = result[1] + 0.5f;
+  }
+}
+
+} // namespace
+
+void projectToSrcScalar(
+    const SrcProjector& proj,
+    const int count,
+    const float* dirX,
+    const float* dirY,
+    const float* dirZ,
+    const float* depth,
+    float* srcX,
+    float* srcY) {
+  const float* const R = proj.rotation;
+  const float* const t = proj.translation;
+  for (int i = 0; i < count; ++i) {
+    srcX[i] = NAN;
+    srcY[i] = NAN;
+    const float cx = (R[0] * dirX[i] + R[1] * dirY[i] + R[2] * dirZ[i]) * depth[i] + t[0];
+    const float cy = (R[3] * dirX[i] + R[4] * dirY[i] + R[5] * dirZ[i]) * depth[i] + t[1];
+    const float cz = (R[6] * dirX[i] + R[7] * dirY[i] + R[8] * dirZ[i]) * depth[i] + t[2];
+    if (isOutsideFov(proj, cx, cy, cz)) {
+      continue;
+    }
+    float sx, sy;
+    cameraToSensor(proj, cx, cy, cz, sx, sy);
+    const float px = proj.focal[0] * sx + proj.principal[0];
+    const float py = proj.focal[1] * sy + proj.principal[1];
+    if (0 <= px && px < proj.resolution[0] && 0 <= py && py < proj.resolution[1]) {
+      srcX[i] = px;
+      srcY[i] = py;
+    }
+  }
+}
+
+void lookupWarp(
+    const ImageView2f& warp,
+    const int count,
+    const float* srcX,
+    const float* srcY,
+    float* dstSrcX,
+    float* dstSrcY) {
+  lookupWarpImpl(
+      warp,
+      [](const float* p, float* value) {
+        value[0] = p[0];
+        value[1] = p[1];
+      },
+      count,
+      srcX,
+      srcY,
+      dstSrcX,
+      dstSrcY);
+}
+
+void lookupWarp(
+    const ImageView2s& warp,
+    const int count,
+    const float* srcX,
+    const float* srcY,
+    float* dstSrcX,
+    float* dstSrcY) {
+  const float scaleInv = 1.0f / warp.scale;
+  lookupWarpImpl(
+      warp,
+      [scaleInv](const int16_t* p, float* value) {
+        if (p[0] == std::numeric_limits<int16_t>::min()) {
+          value[0] = NAN;
+          value[1] = NAN;
+        } else {
+          value[0] = p[0] * scaleInv;
+          value[1] = p[1] * scaleInv;
+        }
+      },
+      count,
+      srcX,
+      srcY,
+      dstSrcX,
+      dstSrcY);
+}
+
+namespace {
+
+template <ColorFormat kFormat>
+void computePatchSSDsScalarImpl(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased) {
+  const int footprint = 2 * radius + 2;
+  std::vector<int> cols(footprint);
+  std::vector<int> rows(footprint);
+  for (int i = 0; i < count; ++i) {
+    if (std::isnan(dstSrcX[i]) || std::isnan(dstSrcY[i])) {
+      ssdBiased[i] = NAN;
+      ssdUnbiased[i] = NAN;
+      continue;
+    }
+    int xi, yi;
+    float xw, yw;
+    bilinearFootprint(dstSrcX[i], dstSrcY[i], xi, yi, xw, yw);
+
+    // Bias of src projected into dst, at the center of the patch
+    float bias[3];
+    {
+      const int x0 = clampInt(xi, 0, dstSrcBias.cols - 1);
+      const int x1 = clampInt(xi + 1, 0, dstSrcBias.cols - 1);
+      const int y0 = clampInt(yi, 0, dstSrcBias.rows - 1);
+      const int y1 = clampInt(yi + 1, 0, dstSrcBias.rows - 1);
+      float p00[3], p01[3], p10[3], p11[3], pDstBias[3];
+      loadPixel<kFormat>(dstSrcBias, x0, y0, p00);
+      loadPixel<kFormat>(dstSrcBias, x1, y0, p01);
+      loadPixel<kFormat>(dstSrcBias, x0, y1, p10);
+      loadPixel<kFormat>(dstSrcBias, x1, y1, p11);
+      loadPixel<kFormat>(dstBias, xs[i], y, pDstBias);
+      for (int c = 0; c < 3; ++c) {
+        bias[c] = pDstBias[c] - bilerpColor<kFormat>(p00[c], p01[c], p10[c], p11[c], xw, yw);
+      }
+    }
+
+    for (int k = 0; k < footprint; ++k) {
+      cols[k] = clampInt(xi - radius + k, 0, dstSrcColor.cols - 1);
+      rows[k] = clampInt(yi - radius + k, 0, dstSrcColor.rows - 1);
+    }
+
+    float biased = 0;
+    float unbiased = 0;
+    for (int dx = -radius; dx <= radius; ++dx) {
+      for (int dy = -radius; dy <= radius; ++dy) {
+        const int kx = dx + radius;
+        const int ky = dy + radius;
+        float pDst[3], p00[3], p01[3], p10[3], p11[3];
+        loadPixel<kFormat>(dstColor, xs[i] + dx, y + dy, pDst);
+        loadPixel<kFormat>(dstSrcColor, cols[kx], rows[ky], p00);
+        loadPixel<kFormat>(dstSrcColor, cols[kx + 1], rows[ky], p01);
+        loadPixel<kFormat>(dstSrcColor, cols[kx], rows[ky + 1], p10);
+        loadPixel<kFormat>(dstSrcColor, cols[kx + 1], rows[ky + 1], p11);
+        float diffBias[3];
+        float diffNoBias[3];
+        for (int c = 0; c < 3; ++c) {
+          const float src = bilerpColor<kFormat>(p00[c], p01[c], p10[c], p11[c], xw, yw);
+          diffBias[c] = pDst[c] - src;
+          diffNoBias[c] = diffBias[c] - bias[c];
+        }
+        biased += diffBias[0] * diffBias[0] + diffBias[1] * diffBias[1] + diffBias[2] * diffBias[2];
+        unbiased += diffNoBias[0] * diffNoBias[0] + diffNoBias[1] * diffNoBias[1] +
+            diffNoBias[2] * diffNoBias[2];
+      }
+    }
+    ssdBiased[i] = biased * kSSDScale;
+    ssdUnbiased[i] = unbiased * kSSDScale;
+  }
+}
+
+} // namespace
+
+int getColorFormatBytes(const ColorFormat format) {
+  return format == ColorFormat::unorm8 ? 1 : 2;
+}
+
+void encodeColors(
+    const uint16_t* values,
+    const int count,
+    const ColorFormat format,
+    void* encoded) {
+  if (format == ColorFormat::unorm16) {
+    std::memcpy(encoded, values, count * sizeof(uint16_t));
+  } else if (format == ColorFormat::half) {
+    uint16_t* const out = static_cast<uint16_t*>(encoded);
+    for (int i = 0; i < count; ++i) {
+      out[i] = floatToHalf(values[i] / kHalfScale);
+    }
+  } else {
+    // 257 is odd, so there are no ties to round
+    uint8_t* const out = static_cast<uint8_t*>(encoded);
+    for (int i = 0; i < count; ++i) {
+      out[i] = (values[i] + 128) / 257;
+    }
+  }
+}
+
+uint16_t floatToHalf(const float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+  if (bits >= 0x477ff000) {
+    return sign | 0x7c00; // rounds to infinity
+  }
+  if (bits < 0x38800000) {
+    // Subnormal half, the mantissa with its implicit bit is shifted into place
+    if (bits < 0x33000000) {
+      return sign; // below half of the smallest subnormal
+    }
+    const int shift = 126 - int(bits >> 23);
+    const uint32_t mantissa = (bits & 0x7fffff) | 0x800000;
+    uint32_t result = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (result & 1))) {
+      ++result;
+    }
+    return sign | result;
+  }
+  // Rebias the exponent from 127 to 15 and round away the low 13 bits of the mantissa
+  bits -= 0x38000000;
+  return sign | ((bits + 0xfff + ((bits >> 13) & 1)) >> 13);
+}
+
+float halfToFloat(const uint16_t value) {
+  const uint32_t bits = uint32_t(value & 0x7fff) << 13;
+  float magnitude;
+  std::memcpy(&magnitude, &bits, sizeof(magnitude));
+  magnitude *= kHalfExponentScale; // also right for subnormals
+  return value & 0x8000 ? -magnitude : magnitude;
+}
+
+void computePatchSSDsScalar(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased) {
+  auto impl = &computePatchSSDsScalarImpl<ColorFormat::unorm16>;
+  if (dstColor.format == ColorFormat::half) {
+    impl = &computePatchSSDsScalarImpl<ColorFormat::half>;
+  } else if (dstColor.format == ColorFormat::unorm8) {
+    impl = &computePatchSSDsScalarImpl<ColorFormat::unorm8>;
+  }
+  impl(
+      dstColor,
+      dstBias,
+      dstSrcColor,
+      dstSrcBias,
+      y,
+      radius,
+      count,
+      xs,
+      dstSrcX,
+      dstSrcY,
+      ssdBiased,
+      ssdUnbiased);
+}
+
+#ifdef DEP_COST_KERNELS_AVX2
+
+namespace {
+
+#define DEP_AVX2 __attribute__((target("avx2")))
+
+// atan2(y, x) for y >= 0, Cephes single precision polynomial, max error ~1e-7 radians
+DEP_AVX2 inline __m256 atan2NonNegativeY(const __m256 y, const __m256 x) {
+  const __m256 signMask = _mm256_set1_ps(-0.0f);
+  const __m256 ax = _mm256_andnot_ps(signMask, x);
+  const __m256 num = _mm256_min_ps(ax, y);
+  const __m256 den = _mm256_max_ps(ax, y);
+  __m256 a = _mm256_div_ps(num, den); // in [0, 1]
+
+  // Reduce to [0, tan(pi / 8)]
+  const __m256 big = _mm256_cmp_ps(a, _mm256_set1_ps(0.4142135623730950f), _CMP_GT_OQ);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  a = _mm256_blendv_ps(a, _mm256_div_ps(_mm256_sub_ps(a, one), _mm256_add_ps(a, one)), big);
+  const __m256 base = _mm256_and_ps(big, _mm256_set1_ps(float(M_PI_4)));
+
+  const __m256 z = _mm256_mul_ps(a, a);
+  __m256 p = _mm256_set1_ps(8.05374449538e-2f);
+  p = _mm256_sub_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(1.38776856032e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(1.99777106478e-1f));
+  p = _mm256_sub_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(3.33329491539e-1f));
+  p = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, z), a), a);
+  __m256 theta = _mm256_add_ps(p, base);
+
+  // Undo the octant reduction
+  const __m256 swapped = _mm256_cmp_ps(y, ax, _CMP_GT_OQ);
+  theta = _mm256_blendv_ps(theta, _mm256_sub_ps(_mm256_set1_ps(float(M_PI_2)), theta), swapped);
+  const __m256 negative = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ);
+  return _mm256_blendv_ps(theta, _mm256_sub_ps(_mm256_set1_ps(float(M_PI)), theta), negative);
+}
+
+DEP_AVX2 void projectToSrcAvx2(
+    const SrcProjector& proj,
+    const int count,
+    const float* dirX,
+    const float* dirY,
+    const float* dirZ,
+    const float* depth,
+    float* srcX,
+    float* srcY) {
+  const int vectorCount = count - count % 8;
+  const float* const R = proj.rotation;
+  const __m256 nan = _mm256_set1_ps(NAN);
+  const __m256 zero = _mm256_setzero_ps();
+  for (int i = 0; i < vectorCount; i += 8) {
+    const __m256 dx = _mm256_loadu_ps(dirX + i);
+    const __m256 dy = _mm256_loadu_ps(dirY + i);
+    const __m256 dz = _mm256_loadu_ps(dirZ + i);
+    const __m256 t = _mm256_loadu_ps(depth + i);
+    __m256 camera[3];
+    for (int row = 0; row < 3; ++row) {
+      __m256 dot = _mm256_mul_ps(_mm256_set1_ps(R[3 * row]), dx);
+      dot = _mm256_add_ps(dot, _mm256_mul_ps(_mm256_set1_ps(R[3 * row + 1]), dy));
+      dot = _mm256_add_ps(dot, _mm256_mul_ps(_mm256_set1_ps(R[3 * row + 2]), dz));
+      camera[row] = _mm256_add_ps(_mm256_mul_ps(dot, t), _mm256_set1_ps(proj.translation[row]));
+    }
+    const __m256 cx = camera[0];
+    const __m256 cy = camera[1];
+    const __m256 cz = camera[2];
+    const __m256 minusZ = _mm256_sub_ps(zero, cz);
+
+    // Lanes that pass the fov test
+    __m256 valid;
+    if (proj.cosFov == -1) {
+      valid = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+    } else if (proj.cosFov == 0) {
+      valid = _mm256_cmp_ps(cz, zero, _CMP_LT_OQ);
+    } else {
+      const __m256 absMinusZ = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), minusZ);
+      const __m256 lhs = _mm256_mul_ps(minusZ, absMinusZ);
+      __m256 squaredNorm = _mm256_mul_ps(cx, cx);
+      squaredNorm = _mm256_add_ps(squaredNorm, _mm256_mul_ps(cy, cy));
+      squaredNorm = _mm256_add_ps(squaredNorm, _mm256_mul_ps(cz, cz));
+      const __m256 rhs =
+          _mm256_mul_ps(_mm256_set1_ps(proj.cosFov * std::abs(proj.cosFov)), squaredNorm);
+      valid = _mm256_cmp_ps(lhs, rhs, _CMP_GT_OQ);
+    }
+
+    const __m256 xy = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(cx, cx), _mm256_mul_ps(cy, cy)));
+    __m256 r;
+    if (proj.type == ProjectorType::FTHETA) {
+      r = atan2NonNegativeY(xy, minusZ);
+    } else {
+      const __m256 behind = _mm256_cmp_ps(minusZ, zero, _CMP_LE_OQ);
+      r = _mm256_blendv_ps(
+          _mm256_div_ps(xy, minusZ), _mm256_set1_ps(kRectilinearOutsideFov), behind);
+    }
+
+    // distort(r) / |xy|
+    r = _mm256_min_ps(r, _mm256_set1_ps(proj.distortionMax));
+    const __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 factor = _mm256_set1_ps(proj.distortion[2]);
+    factor = _mm256_add_ps(_mm256_set1_ps(proj.distortion[1]), _mm256_mul_ps(r2, factor));
+    factor = _mm256_add_ps(_mm256_set1_ps(proj.distortion[0]), _mm256_mul_ps(r2, factor));
+    factor = _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(r2, factor));
+    const __m256 k = _mm256_div_ps(_mm256_mul_ps(factor, r), xy);
+
+    const __m256 px = _mm256_add_ps(
+        _mm256_mul_ps(_mm256_set1_ps(proj.focal[0]), _mm256_mul_ps(k, cx)),
+        _mm256_set1_ps(proj.principal[0]));
+    const __m256 py = _mm256_add_ps(
+        _mm256_mul_ps(_mm256_set1_ps(proj.focal[1]), _mm256_mul_ps(k, cy)),
+        _mm256_set1_ps(proj.principal[1]));
+
+    // Ordered comparisons also reject NAN pixels
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(px, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(px, _mm256_set1_ps(proj.resolution[0]), _CMP_LT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(py, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(py, _mm256_set1_ps(proj.resolution[1]), _CMP_LT_OQ));
+    _mm256_storeu_ps(srcX + i, _mm256_blendv_ps(nan, px, valid));
+    _mm256_storeu_ps(srcY + i, _mm256_blendv_ps(nan, py, valid));
+  }
+  projectToSrcScalar(
+      proj,
+      count - vectorCount,
+      dirX + vectorCount,
+      dirY + vectorCount,
+      dirZ + vectorCount,
+      depth + vectorCount,
+      srcX + vectorCount,
+      srcY + vectorCount);
+}
+
+// halfToFloat() * kHalfScale of the low 16 bits of each lane
+DEP_AVX2 inline __m256 decodeHalf(const __m256i value) {
+  const __m256i magnitudeBits =
+      _mm256_slli_epi32(_mm256_and_si256(value, _mm256_set1_epi32(0x7fff)), 13);
+  const __m256i signBits =
+      _mm256_slli_epi32(_mm256_and_si256(value, _mm256_set1_epi32(0x8000)), 16);
+  const __m256 magnitude = _mm256_mul_ps(
+      _mm256_castsi256_ps(magnitudeBits), _mm256_set1_ps(kHalfExponentScale));
+  return _mm256_mul_ps(
+      _mm256_or_ps(magnitude, _mm256_castsi256_ps(signBits)), _mm256_set1_ps(kHalfScale));
+}
+
+// 8 pixels (x, y) of a 3-channel image, one channel per register, decoded as loadPixel() does
+// Reads 32 bits per channel pair so the last channel of the last pixel is never overread
+template <ColorFormat kFormat>
+DEP_AVX2 inline void gatherPixels(
+    const ImageView3& image,
+    const __m256i x,
+    const __m256i y,
+    __m256 (&channels)[3]) {
+  const __m256i offset = _mm256_add_epi32(
+      _mm256_mullo_epi32(y, _mm256_set1_epi32(image.step)),
+      _mm256_mullo_epi32(x, _mm256_set1_epi32(3)));
+  const int* const base = static_cast<const int*>(image.data);
+  if (kFormat == ColorFormat::unorm8) {
+    // All 3 channels in one 32-bit read, moved back from the end of the image so that it is never
+    // overread, and shifted into place
+    const int maxOffset = std::max((image.rows - 1) * image.step + image.cols * 3 - 4, 0);
+    const __m256i safeOffset = _mm256_min_epi32(offset, _mm256_set1_epi32(maxOffset));
+    const __m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(offset, safeOffset), 3);
+    const __m256i c012 = _mm256_srlv_epi32(_mm256_i32gather_epi32(base, safeOffset, 1), shift);
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const __m256 scale = _mm256_set1_ps(kUnorm8Scale);
+    for (int c = 0; c < 3; ++c) {
+      const __m256i value = _mm256_and_si256(_mm256_srli_epi32(c012, 8 * c), low);
+      channels[c] = _mm256_mul_ps(_mm256_cvtepi32_ps(value), scale);
+    }
+    return;
+  }
+  const __m256i c01 = _mm256_i32gather_epi32(base, offset, 2);
+  const __m256i c12 =
+      _mm256_i32gather_epi32(base, _mm256_add_epi32(offset, _mm256_set1_epi32(1)), 2);
+  const __m256i c0 = _mm256_and_si256(c01, _mm256_set1_epi32(0xffff));
+  const __m256i c1 = _mm256_srli_epi32(c01, 16);
+  const __m256i c2 = _mm256_srli_epi32(c12, 16);
+  if (kFormat == ColorFormat::half) {
+    channels[0] = decodeHalf(c0);
+    channels[1] = decodeHalf(c1);
+    channels[2] = decodeHalf(c2);
+  } else {
+    channels[0] = _mm256_cvtepi32_ps(c0);
+    channels[1] = _mm256_cvtepi32_ps(c1);
+    channels[2] = _mm256_cvtepi32_ps(c2);
+  }
+}
+
+struct BilinearWeights {
+  __m256 w00, w01, w10, w11;
+};
+
+// Same association order as bilerpColor(), so both paths produce identical results
+template <ColorFormat kFormat>
+DEP_AVX2 inline __m256 bilerpColor(
+    const BilinearWeights& w,
+    const __m256 p00,
+    const __m256 p01,
+    const __m256 p10,
+    const __m256 p11) {
+  __m256 value = _mm256_mul_ps(w.w00, p00);
+  value = _mm256_add_ps(value, _mm256_mul_ps(w.w01, p01));
+  value = _mm256_add_ps(value, _mm256_mul_ps(w.w10, p10));
+  value = _mm256_add_ps(value, _mm256_mul_ps(w.w11, p11));
+  if (kFormat != ColorFormat::unorm16) {
+    return value;
+  }
+  return _mm256_round_ps(value, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+
+template <ColorFormat kFormat>
+DEP_AVX2 void computePatchSSDsAvx2Impl(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased) {
+  const int vectorCount = count - count % 8;
+  const int footprint = 2 * radius + 2;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256i zeroi = _mm256_setzero_si256();
+  const __m256i yDst = _mm256_set1_epi32(y);
+  __m256i cols[2 * kMaxAvx2Radius + 2];
+  __m256i rows[2 * kMaxAvx2Radius + 2];
+  for (int i = 0; i < vectorCount; i += 8) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(xs + i));
+    __m256 sx = _mm256_loadu_ps(dstSrcX + i);
+    __m256 sy = _mm256_loadu_ps(dstSrcY + i);
+    const __m256 valid = _mm256_and_ps(
+        _mm256_cmp_ps(sx, sx, _CMP_ORD_Q), _mm256_cmp_ps(sy, sy, _CMP_ORD_Q));
+    sx = _mm256_blendv_ps(zero, sx, valid);
+    sy = _mm256_blendv_ps(zero, sy, valid);
+
+    // round() is half away from zero, floor(v + 0.5) rounds halves up: both pick footprints that
+    // interpolate to the same value, since the weight of the extra sample is 0
+    const __m256 xf = _mm256_round_ps(
+        _mm256_add_ps(sx, half), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    const __m256 yf = _mm256_round_ps(
+        _mm256_add_ps(sy, half), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    const __m256i xi = _mm256_sub_epi32(_mm256_cvttps_epi32(xf), _mm256_set1_epi32(1));
+    const __m256i yi = _mm256_sub_epi32(_mm256_cvttps_epi32(yf), _mm256_set1_epi32(1));
+    const __m256 xw = _mm256_add_ps(_mm256_sub_ps(sx, xf), half);
+    const __m256 yw = _mm256_add_ps(_mm256_sub_ps(sy, yf), half);
+    const __m256 xw1 = _mm256_sub_ps(one, xw);
+    const __m256 yw1 = _mm256_sub_ps(one, yw);
+    BilinearWeights w;
+    w.w00 = _mm256_mul_ps(xw1, yw1);
+    w.w01 = _mm256_mul_ps(xw, yw1);
+    w.w10 = _mm256_mul_ps(xw1, yw);
+    w.w11 = _mm256_mul_ps(xw, yw);
+
+    // Bias of src projected into dst, at the center of the patch
+    __m256 bias[3];
+    {
+      const __m256i maxCol = _mm256_set1_epi32(dstSrcBias.cols - 1);
+      const __m256i maxRow = _mm256_set1_epi32(dstSrcBias.rows - 1);
+      const __m256i x0 = _mm256_min_epi32(_mm256_max_epi32(xi, zeroi), maxCol);
+      const __m256i x1 = _mm256_min_epi32(
+          _mm256_max_epi32(_mm256_add_epi32(xi, _mm256_set1_epi32(1)), zeroi), maxCol);
+      const __m256i y0 = _mm256_min_epi32(_mm256_max_epi32(yi, zeroi), maxRow);
+      const __m256i y1 = _mm256_min_epi32(
+          _mm256_max_epi32(_mm256_add_epi32(yi, _mm256_set1_epi32(1)), zeroi), maxRow);
+      __m256 p00[3], p01[3], p10[3], p11[3], pDst[3];
+      gatherPixels<kFormat>(dstSrcBias, x0, y0, p00);
+      gatherPixels<kFormat>(dstSrcBias, x1, y0, p01);
+      gatherPixels<kFormat>(dstSrcBias, x0, y1, p10);
+      gatherPixels<kFormat>(dstSrcBias, x1, y1, p11);
+      gatherPixels<kFormat>(dstBias, x, yDst, pDst);
+      for (int c = 0; c < 3; ++c) {
+        bias[c] = _mm256_sub_ps(pDst[c], bilerpColor<kFormat>(w, p00[c], p01[c], p10[c], p11[c]));
+      }
+    }
+
+    const __m256i maxCol = _mm256_set1_epi32(dstSrcColor.cols - 1);
+    const __m256i maxRow = _mm256_set1_epi32(dstSrcColor.rows - 1);
+    for (int k = 0; k < footprint; ++k) {
+      const __m256i offset = _mm256_set1_epi32(k - radius);
+      cols[k] = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(xi, offset), zeroi), maxCol);
+      rows[k] = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(yi, offset), zeroi), maxRow);
+    }
+
+    __m256 biased = zero;
+    __m256 unbiased = zero;
+    for (int dx = -radius; dx <= radius; ++dx) {
+      for (int dy = -radius; dy <= radius; ++dy) {
+        const int kx = dx + radius;
+        const int ky = dy + radius;
+        __m256 p00[3], p01[3], p10[3], p11[3], pDst[3];
+        gatherPixels<kFormat>(
+            dstColor,
+            _mm256_add_epi32(x, _mm256_set1_epi32(dx)),
+            _mm256_add_epi32(yDst, _mm256_set1_epi32(dy)),
+            pDst);
+        gatherPixels<kFormat>(dstSrcColor, cols[kx], rows[ky], p00);
+        gatherPixels<kFormat>(dstSrcColor, cols[kx + 1], rows[ky], p01);
+        gatherPixels<kFormat>(dstSrcColor, cols[kx], rows[ky + 1], p10);
+        gatherPixels<kFormat>(dstSrcColor, cols[kx + 1], rows[ky + 1], p11);
+        __m256 squaredBias = zero;
+        __m256 squaredNoBias = zero;
+        for (int c = 0; c < 3; ++c) {
+          const __m256 src = bilerpColor<kFormat>(w, p00[c], p01[c], p10[c], p11[c]);
+          const __m256 diffBias = _mm256_sub_ps(pDst[c], src);
+          const __m256 diffNoBias = _mm256_sub_ps(diffBias, bias[c]);
+          squaredBias = _mm256_add_ps(squaredBias, _mm256_mul_ps(diffBias, diffBias));
+          squaredNoBias = _mm256_add_ps(squaredNoBias, _mm256_mul_ps(diffNoBias, diffNoBias));
+        }
+        biased = _mm256_add_ps(biased, squaredBias);
+        unbiased = _mm256_add_ps(unbiased, squaredNoBias);
+      }
+    }
+    const __m256 scale = _mm256_set1_ps(kSSDScale);
+    const __m256 nan = _mm256_set1_ps(NAN);
+    _mm256_storeu_ps(ssdBiased + i, _mm256_blendv_ps(nan, _mm256_mul_ps(biased, scale), valid));
+    _mm256_storeu_ps(
+        ssdUnbiased + i, _mm256_blendv_ps(nan, _mm256_mul_ps(unbiased, scale), valid));
+  }
+  computePatchSSDsScalarImpl<kFormat>(
+      dstColor,
+      dstBias,
+      dstSrcColor,
+      dstSrcBias,
+      y,
+      radius,
+      count - vectorCount,
+      xs + vectorCount,
+      dstSrcX + vectorCount,
+      dstSrcY + vectorCount,
+      ssdBiased + vectorCount,
+      ssdUnbiased + vectorCount);
+}
+
+DEP_AVX2 void computePatchSSDsAvx2(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased) {
+  auto impl = &computePatchSSDsAvx2Impl<ColorFormat::unorm16>;
+  if (dstColor.format == ColorFormat::half) {
+    impl = &computePatchSSDsAvx2Impl<ColorFormat::half>;
+  } else if (dstColor.format == ColorFormat::unorm8) {
+    impl = &computePatchSSDsAvx2Impl<ColorFormat::unorm8>;
+  }
+  impl(
+      dstColor,
+      dstBias,
+      dstSrcColor,
+      dstSrcBias,
+      y,
+      radius,
+      count,
+      xs,
+      dstSrcX,
+      dstSrcY,
+      ssdBiased,
+      ssdUnbiased);
+}
+
+#undef DEP_AVX2
+
+} // namespace
+
+bool hasAvx2Kernels() {
+  static const bool result = __builtin_cpu_supports("avx2");
+  return result;
+}
+
+#else
+
+bool hasAvx2Kernels() {
+  return false;
+}
+
+#endif // DEP_COST_KERNELS_AVX2
+
+void projectToSrc(
+    const SrcProjector& proj,
+    const int count,
+    const float* dirX,
+    const float* dirY,
+    const float* dirZ,
+    const float* depth,
+    float* srcX,
+    float* srcY) {
+#ifdef DEP_COST_KERNELS_AVX2
+  const bool vectorizable =
+      proj.type == ProjectorType::FTHETA || proj.type == ProjectorType::RECTILINEAR;
+  if (vectorizable && hasAvx2Kernels()) {
+    projectToSrcAvx2(proj, count, dirX, dirY, dirZ, depth, srcX, srcY);
+    return;
+  }
+#endif
+  projectToSrcScalar(proj, count, dirX, dirY, dirZ, depth, srcX, srcY);
+}
+
+void computePatchSSDs(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased) {
+#ifdef DEP_COST_KERNELS_AVX2
+  if (radius <= kMaxAvx2Radius && hasAvx2Kernels()) {
+    computePatchSSDsAvx2(
+        dstColor,
+        dstBias,
+        dstSrcColor,
+        dstSrcBias,
+        y,
+        radius,
+        count,
+        xs,
+        dstSrcX,
+        dstSrcY,
+        ssdBiased,
+        ssdUnbiased);
+    return;
+  }
+#endif
+  computePatchSSDsScalar(
+      dstColor,
+      dstBias,
+      dstSrcColor,
+      dstSrcBias,
+      y,
+      radius,
+      count,
+      xs,
+      dstSrcX,
+      dstSrcY,
+      ssdBiased,
+      ssdUnbiased);
+}
+
+} // namespace depth_estimation
+} // namespace fb360_dep
@@ -0,0 +1,159 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace fb360_dep {
+namespace depth_estimation {
+
+// Structure-of-arrays kernels behind the batched cost engine (see BatchCost.h)
+// They have no OpenCV or Camera dependencies: images are raw views and cameras are flattened
+// into single precision projectors. Every kernel has a scalar implementation and, on x86, an
+// AVX2 implementation that is picked at runtime when the CPU supports it
+
+// Same order as Camera::Type
+enum struct ProjectorType { FTHETA, RECTILINEAR, EQUISOLID, ORTHOGRAPHIC };
+
+// Single precision version of Camera::sees() for points along the rays of a dst camera
+// A point at depth t along the rig space direction dir is, in src camera space,
+//   rotation * dir * t + translation, with translation = rotation * (dst position - src position)
+// focal, principal and resolution are in pixels of the src image being sampled
+struct SrcProjector {
+  ProjectorType type;
+  float rotation[9]; // row-major
+  float translation[3];
+  float focal[2];
+  float principal[2];
+  float resolution[2];
+  float distortion[3];
+  float distortionMax;
+  float cosFov;
+};
+
+// Storage of the colors the patch kernels read, all normalized to [0, 1]
+//   unorm16: 16-bit integers, as PixelType
+//   half: IEEE 754 half precision floats, same size as unorm16 but finer near black
+//   unorm8: 8-bit integers, half the memory and bandwidth of unorm16
+enum struct ColorFormat { unorm16, half, unorm8 };
+
+// Interleaved 3-channel image, step in elements
+// Elements are uint16_t for unorm16 and half, and uint8_t for unorm8
+struct ImageView3 {
+  const void* data;
+  int cols;
+  int rows;
+  int step;
+  ColorFormat format;
+};
+
+// Interleaved 2-channel float image, step in elements
+struct ImageView2f {
+  const float* data;
+  int cols;
+  int rows;
+  int step;
+};
+
+// Interleaved 2-channel 16-bit fixed point image, value = sample / scale, step in elements
+// INT16_MIN marks NAN
+struct ImageView2s {
+  const int16_t* data;
+  int cols;
+  int rows;
+  int step;
+  float scale;
+};
+
+bool hasAvx2Kernels();
+
+int getColorFormatBytes(const ColorFormat format); // per channel
+
+// Converts count unorm16 values to format, rounding to nearest
+void encodeColors(const uint16_t* values, const int count, const ColorFormat format, void* encoded);
+
+// Half precision conversions of finite values, rounding to nearest even
+uint16_t floatToHalf(const float value);
+float halfToFloat(const uint16_t value);
+
+// Projects count points, given as rays and depths, into src
+// Points src does not see are set to NAN
+void projectToSrc(
+    const SrcProjector& projector,
+    const int count,
+    const float* dirX,
+    const float* dirY,
+    const float* dirZ,
+    const float* depth,
+    float* srcX,
+    float* srcY);
+
+void projectToSrcScalar(
+    const SrcProjector& projector,
+    const int count,
+    const float* dirX,
+    const float* dirY,
+    const float* dirZ,
+    const float* depth,
+    float* srcX,
+    float* srcY);
+
+// Bilinear lookup of a src to dst warp (cv_util::getPixelBilinear semantics), converted from
+// OpenCV to pixel corner convention. NAN in, or in the warp, gives NAN out
+void lookupWarp(
+    const ImageView2f& warp,
+    const int count,
+    const float* srcX,
+    const float* srcY,
+    float* dstSrcX,
+    float* dstSrcY);
+
+void lookupWarp(
+    const ImageView2s& warp,
+    const int count,
+    const float* srcX,
+    const float* srcY,
+    float* dstSrcX,
+    float* dstSrcY);
+
+// Biased and unbiased SSD between the (2 * radius + 1)^2 patch of dstColor around (xs[i], y) and
+// the patch of dstSrcColor around (dstSrcX[i], dstSrcY[i]), same as computeSSD()
+// All samples of a patch share the same bilinear weights, so they are read from a single
+// (2 * radius + 2)^2 footprint. Entries with NAN coordinates get NAN SSDs
+// All views have the same format. Interpolated unorm16 samples are rounded to integers, as
+// getPixelBilinear() does, samples of other formats are not
+void computePatchSSDs(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased);
+
+void computePatchSSDsScalar(
+    const ImageView3& dstColor,
+    const ImageView3& dstBias,
+    const ImageView3& dstSrcColor,
+    const ImageView3& dstSrcBias,
+    const int y,
+    const int radius,
+    const int count,
+    const int* xs,
+    const float* dstSrcX,
+    const float* dstSrcY,
+    float* ssdBiased,
+    float* ssdUnbiased);
+
+} // namespace depth_estimation
+} // namespace fb360_dep
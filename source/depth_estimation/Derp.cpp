@@ -7,6 +7,8 @@
 
 #include "source/depth_estimation/Derp.h"
 
+#include <algorithm>
+#include <atomic>
 #include <random>
 
 #include <boost/algorithm/string/predicate.hpp>
@@ -14,8 +16,11 @@
 
 #include <folly/Format.h>
 
+#include "source/depth_estimation/BatchCost.h"
 #include "source/depth_estimation/TemporalBilateralFilter.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/Profiler.h"
+#include "source/util/StackArray.h"
 #include "source/util/ThreadPool.h"
 
 using namespace fb360_dep::cv_util;
@@ -97,9 +102,6 @@ void getPyramidLevelSizes(std::map<int, cv::Size>& sizes, const filesystem::path
   }
 }
 
-// equivalent to TYPE NAME[SIZE] but sized at runtime
-#define STACK_ARRAY(TYPE, NAME, SIZE) TYPE* const NAME = (TYPE*)alloca(sizeof(TYPE) * (SIZE))
-
 std::tuple<float, float> computeCost(
     const PyramidLevel<PixelType>& pyramidLevel,
     const int dstIdx,
@@ -136,12 +138,14 @@ std::tuple<float, float> computeCost(
   //  |______________|       |______________|
   //        dst                    src
 
+  static profiler::Counter& numCosts = profiler::Profiler::instance().counter("computeCost");
+  numCosts.add();
+
   // (1) pDst = (x, y)
-  // (2) get pWorld
+  // (2) get pWorld, as a depth along the pre-computed ray of pDst
   const cv::Mat_<PixelType>& dstColor = pyramidLevel.dstProjColor(dstIdx);
-  const Camera& camDst = pyramidLevel.rigDst[dstIdx];
-  const Camera::Vector3 pWorld =
-      dstToWorldPoint(camDst, x, y, disparity, dstColor.cols, dstColor.rows);
+  const cv::Vec3f& ray = pyramidLevel.dstRays(dstIdx)(y, x);
+  const float depth = 1.0f / disparity;
 
   // Compute SSD between dst and projected src for each src
   using SSDPair = std::pair<float, float>;
@@ -154,26 +158,32 @@ std::tuple<float, float> computeCost(
       continue;
     }
 
-    // (3) get pSrc
-    const Camera& camSrc = pyramidLevel.rigSrc[srcIdx];
-    const cv::Size& srcSize = pyramidLevel.srcColor(srcIdx).size();
-    Camera::Vector2 pSrc;
-    if (!worldToSrcPoint(pSrc, pWorld, camSrc, srcSize.width, srcSize.height)) {
+    // Skip src if it does not overlap dst at all
+    if (!pyramidLevel.dstProjOverlaps(dstIdx, srcIdx)) {
+      continue;
+    }
+
+    // (3) get pSrc, with the pre-computed single precision projector of src
+    // pSrc is within 1e-2 pixels of Camera::pixel(), see DerpTest.TestRayTablesMatchCamera
+    const PyramidLevel<PixelType>::Proj& proj = pyramidLevel.dstProj(dstIdx, srcIdx);
+    float xSrc;
+    float ySrc;
+    projectToSrcScalar(proj.projector, 1, &ray[0], &ray[1], &ray[2], &depth, &xSrc, &ySrc);
+    if (std::isnan(xSrc)) {
       continue;
     }
 
     // Exclude a half-texel band to simulate proper clamp-to-border semantics
     const bool kExcludeHalfTexel = false;
     if (kExcludeHalfTexel) {
-      if (pSrc.x() < 0.5 || srcSize.width - 0.5 < pSrc.x() || pSrc.y() < 0.5 ||
-          srcSize.height - 0.5 < pSrc.y()) {
+      const cv::Size& srcSize = pyramidLevel.srcColor(srcIdx).size();
+      if (xSrc < 0.5 || srcSize.width - 0.5 < xSrc || ySrc < 0.5 || srcSize.height - 0.5 < ySrc) {
         continue;
       }
     }
 
     // (3) -> (4) -> (5) mapping from pre-computed projection warp
-    const cv::Mat_<cv::Vec2f>& dstProjWarp = pyramidLevel.dstProjWarp(dstIdx, srcIdx);
-    const cv::Vec2f pDstSrc = cv_util::getPixelBilinear(dstProjWarp, pSrc.x(), pSrc.y());
+    const cv::Vec2f pDstSrc = proj.warp(xSrc, ySrc);
 
     // Check if pDstSrc is within bounds
     const float xDstSrc = pDstSrc[0] + 0.5; // pDstSrc uses opencv coordinate convention
@@ -188,13 +198,33 @@ std::tuple<float, float> computeCost(
     // bilinearly interpolating the pre-computed projected bias around pDstSrc,
     // because we are grabbing biases from neighboring footprints, but it seems
     // to produce very similar results
-    const cv::Mat_<PixelType>& dstSrcColorBias = pyramidLevel.dstProjColorBias(dstIdx, srcIdx);
-    const PixelType dstSrcBias = cv_util::getPixelBilinear(dstSrcColorBias, xDstSrc, yDstSrc);
-    const PixelType& dstBias = dstColorBias(y, x);
-
-    const cv::Mat_<PixelType>& dstSrcColor = pyramidLevel.dstProjColor(dstIdx, srcIdx);
-    std::pair<float, float> ssd = computeSSD(
-        dstColor, x, y, dstBias, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias, kSearchWindowRadius);
+    std::pair<float, float> ssd;
+    if (proj.colorFormat == ColorFormat::unorm16) {
+      const cv::Mat_<PixelType>& dstSrcColorBias = proj.projColorBias;
+      const PixelType dstSrcBias = cv_util::getPixelBilinear(dstSrcColorBias, xDstSrc, yDstSrc);
+      const PixelType& dstBias = dstColorBias(y, x);
+
+      const cv::Mat_<PixelType>& dstSrcColor = proj.projColor;
+      ssd = computeSSD(
+          dstColor, x, y, dstBias, dstSrcColor, xDstSrc, yDstSrc, dstSrcBias, kSearchWindowRadius);
+    } else {
+      // Packed colors are only read by the patch kernels
+      const PyramidLevel<PixelType>::Proj& dstProj =
+          pyramidLevel.dstProj(dstIdx, pyramidLevel.dst2srcIdxs[dstIdx]);
+      computePatchSSDsScalar(
+          dstProj.colorView(),
+          dstProj.colorBiasView(),
+          proj.colorView(),
+          proj.colorBiasView(),
+          y,
+          kSearchWindowRadius,
+          1,
+          &x,
+          &xDstSrc,
+          &yDstSrc,
+          &ssd.first,
+          &ssd.second);
+    }
     SSDs[ssdCount] = ssd;
     ++ssdCount;
   }
@@ -224,6 +254,55 @@ std::tuple<float, float> computeCost(
   return std::make_tuple(costFinal, confidence);
 }
 
+void insertCostCandidate(
+    CostCandidates& disparities,
+    CostCandidates& costs,
+    const float disparity,
+    const float cost) {
+  // FLT_MAX: not enough cameras see this disparity
+  if (std::isnan(disparity) || std::isnan(cost) || cost == FLT_MAX) {
+    return;
+  }
+
+  // Remove the same disparity if it has a higher cost
+  for (int i = 0; i < kNumCostCandidates && !std::isnan(disparities[i]); ++i) {
+    if (std::fabs(disparities[i] - disparity) <= kCostCandidateTolerance * disparities[i]) {
+      if (costs[i] <= cost) {
+        return;
+      }
+      for (int j = i; j < kNumCostCandidates - 1; ++j) {
+        disparities[j] = disparities[j + 1];
+        costs[j] = costs[j + 1];
+      }
+      disparities[kNumCostCandidates - 1] = NAN;
+      costs[kNumCostCandidates - 1] = NAN;
+      break;
+    }
+  }
+
+  int pos = 0;
+  while (pos < kNumCostCandidates && !std::isnan(disparities[pos]) && costs[pos] <= cost) {
+    ++pos;
+  }
+  if (pos == kNumCostCandidates) {
+    return;
+  }
+  for (int j = kNumCostCandidates - 1; j > pos; --j) {
+    disparities[j] = disparities[j - 1];
+    costs[j] = costs[j - 1];
+  }
+  disparities[pos] = disparity;
+  costs[pos] = cost;
+}
+
+cv::Mat_<CostCandidates> upsampleCostCandidates(
+    const cv::Mat_<CostCandidates>& candidates,
+    const cv::Size& size) {
+  cv::Mat_<CostCandidates> upsampled;
+  cv::resize(candidates, upsampled, size, 0, 0, cv::INTER_NEAREST);
+  return upsampled;
+}
+
 // Creates a cost map where each (x, y) has a cost calculated from all the
 // source cameras
 void computeBruteForceCosts(
@@ -242,7 +321,13 @@ void computeBruteForceCosts(
 
   // Ignore margins if dst = src (won't be able to get entire patch)
   const int radius = kSearchWindowRadius;
+  const bool useBatchCost = pyramidLevel.costEngine == CostEngine::batch;
+  std::vector<int> batchXs;
+  std::vector<float> batchDisparities;
+  std::vector<float> batchCosts;
+  std::vector<float> batchConfidences;
   for (int y = radius; y < costMap.rows - radius; ++y) {
+    batchXs.clear();
     for (int x = radius; x < costMap.cols - radius; ++x) {
       // Ignore if outside FOV or background pixel or foreground is farther than background
       const bool ignore = !pyramidLevel.dstFovMask(dstIdx)(y, x) ||
@@ -250,14 +335,228 @@ void computeBruteForceCosts(
       if (ignore) {
         costMap(y, x) = NAN;
         confidenceMap(y, x) = NAN;
+      } else if (useBatchCost) {
+        batchXs.push_back(x);
       } else {
         std::tie(costMap(y, x), confidenceMap(y, x)) =
             computeCost(pyramidLevel, dstIdx, disparity, x, y);
       }
     }
+
+    if (!batchXs.empty()) {
+      batchDisparities.assign(batchXs.size(), disparity);
+      computeCostsBatch(
+          pyramidLevel, dstIdx, y, batchXs, batchDisparities, batchCosts, batchConfidences);
+      for (ssize_t i = 0; i < ssize(batchXs); ++i) {
+        costMap(y, batchXs[i]) = batchCosts[i];
+        confidenceMap(y, batchXs[i]) = batchConfidences[i];
+      }
+    }
   }
 }
 
+namespace {
+
+// Cost of one of the kNumDepths brute force disparities at a pixel
+struct ProbeCost {
+  int probe;
+  float cost;
+  float confidence;
+};
+
+// Refined probes lie strictly between the coarse neighbors of a minimum, which are at most
+// kAdaptiveProbeStride away on either side
+const int kAdaptiveRefinedPerMinimum = 2 * (kAdaptiveProbeStride - 1);
+const int kAdaptiveRefinedPerPixel = kAdaptiveNumMinima * kAdaptiveRefinedPerMinimum;
+
+// probeCosts are sorted by probe. NAN costs are never lower than their neighbors
+bool isLocalMinimum(const std::vector<ProbeCost>& probeCosts, const int i) {
+  const float cost = probeCosts[i].cost;
+  return (i == 0 || !(probeCosts[i - 1].cost < cost)) &&
+      (i == ssize(probeCosts) - 1 || !(probeCosts[i + 1].cost < cost));
+}
+
+// Probes between the neighbors of the numMinima lowest local minima of the coarse probes
+// Writes them to refined sorted by probe, with NAN costs, and returns how many there are
+int getRefinedProbes(
+    const std::vector<ProbeCost>& coarse,
+    const int numMinima,
+    ProbeCost* refined) {
+  CHECK_GT(numMinima, 0);
+  CHECK_LE(numMinima, kAdaptiveNumMinima);
+
+  // Lowest local minima, sorted by cost
+  int minima[kAdaptiveNumMinima];
+  int numFound = 0;
+  for (int i = 0; i < ssize(coarse); ++i) {
+    const float cost = coarse[i].cost;
+    if (!(cost < FLT_MAX) || !isLocalMinimum(coarse, i) ||
+        (numFound == numMinima && !(cost < coarse[minima[numFound - 1]].cost))) {
+      continue;
+    }
+    int pos = numFound < numMinima ? numFound++ : numFound - 1;
+    for (; pos > 0 && cost < coarse[minima[pos - 1]].cost; --pos) {
+      minima[pos] = minima[pos - 1];
+    }
+    minima[pos] = i;
+  }
+
+  // Neighboring minima share the probes between them, emit each once and in order
+  std::sort(minima, minima + numFound);
+  int numRefined = 0;
+  int nextProbe = 0;
+  for (int m = 0; m < numFound; ++m) {
+    const int i = minima[m];
+    const int begin = std::max(i > 0 ? coarse[i - 1].probe + 1 : coarse[i].probe, nextProbe);
+    const int end = i < ssize(coarse) - 1 ? coarse[i + 1].probe : coarse[i].probe + 1;
+    CHECK_LE(end - begin, kAdaptiveRefinedPerMinimum + 1);
+    for (int probe = begin; probe < end; ++probe) {
+      if (probe != coarse[i].probe) {
+        refined[numRefined++] = {probe, NAN, NAN};
+      }
+    }
+    nextProbe = std::max(nextProbe, end);
+  }
+  return numRefined;
+}
+
+// Probe costs of DisparitySampling::adaptive: the coarse probes have a cost map each, the refined
+// probes of each pixel take kAdaptiveRefinedPerPixel slots of refined, of which numRefined are used
+struct AdaptiveProbeCosts {
+  std::vector<int> coarseProbes;
+  std::vector<cv::Mat_<float>> coarseCosts;
+  std::vector<cv::Mat_<float>> coarseConfidences;
+  std::vector<ProbeCost> refined; // sorted by probe within each pixel
+  cv::Mat_<int> numRefined;
+
+  ProbeCost* getRefined(const int x, const int y) {
+    return &refined[(y * numRefined.cols + x) * kAdaptiveRefinedPerPixel];
+  }
+
+  const ProbeCost* getRefined(const int x, const int y) const {
+    return &refined[(y * numRefined.cols + x) * kAdaptiveRefinedPerPixel];
+  }
+
+  // Coarse and refined probe costs of (x, y), sorted by probe
+  void getProbeCosts(const int x, const int y, std::vector<ProbeCost>& probeCosts) const {
+    const ProbeCost* pixelRefined = getRefined(x, y);
+    const int pixelNumRefined = numRefined(y, x);
+    probeCosts.clear();
+    int r = 0;
+    for (int i = 0; i < ssize(coarseProbes); ++i) {
+      for (; r < pixelNumRefined && pixelRefined[r].probe < coarseProbes[i]; ++r) {
+        probeCosts.push_back(pixelRefined[r]);
+      }
+      probeCosts.push_back({coarseProbes[i], coarseCosts[i](y, x), coarseConfidences[i](y, x)});
+    }
+    probeCosts.insert(probeCosts.end(), pixelRefined + r, pixelRefined + pixelNumRefined);
+  }
+};
+
+// Adaptive sampling (see DisparitySampling): every kAdaptiveProbeStride-th probe everywhere, then
+// every probe around the best local minima of each pixel. Textureless pixels, whose costs are
+// mostly noise, only refine their best minimum
+// Pixels that are ignored or in the margins have no refined probes
+AdaptiveProbeCosts computeAdaptiveProbeCosts(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const std::vector<float>& disparities,
+    const int numThreads) {
+  const cv::Size& size = pyramidLevel.sizeLevel;
+  const int numProbes = disparities.size();
+  AdaptiveProbeCosts probeCosts;
+  std::vector<int>& coarseProbes = probeCosts.coarseProbes;
+  for (int probe = 0; probe < numProbes; probe += kAdaptiveProbeStride) {
+    coarseProbes.push_back(probe);
+  }
+  if (coarseProbes.back() != numProbes - 1) {
+    coarseProbes.push_back(numProbes - 1);
+  }
+
+  ThreadPool threadPool(numThreads);
+  std::vector<cv::Mat_<float>>& costs = probeCosts.coarseCosts;
+  std::vector<cv::Mat_<float>>& confidences = probeCosts.coarseConfidences;
+  costs.resize(coarseProbes.size());
+  confidences.resize(coarseProbes.size());
+  for (int i = 0; i < int(coarseProbes.size()); ++i) {
+    costs[i].create(size);
+    costs[i].setTo(NAN);
+    confidences[i].create(size);
+    confidences[i].setTo(NAN);
+    threadPool.spawn(
+        &computeBruteForceCosts,
+        std::ref(pyramidLevel),
+        dstIdx,
+        disparities[coarseProbes[i]],
+        std::ref(costs[i]),
+        std::ref(confidences[i]));
+  }
+  threadPool.join();
+
+  // Refined probes of a row are evaluated in one go
+  probeCosts.refined.resize(size_t(size.area()) * kAdaptiveRefinedPerPixel);
+  probeCosts.numRefined = cv::Mat_<int>(size, 0);
+  const int margin = kSearchWindowRadius;
+  threadPool.parallelFor(margin, size.height - margin, 1, [&](const int yBegin, const int yEnd) {
+    std::vector<ProbeCost> coarse(coarseProbes.size());
+    std::vector<int> batchXs;
+    std::vector<ProbeCost*> batchRefined;
+    std::vector<float> batchDisparities;
+    std::vector<float> batchCosts;
+    std::vector<float> batchConfidences;
+    for (int y = yBegin; y < yEnd; ++y) {
+      batchXs.clear();
+      batchRefined.clear();
+      batchDisparities.clear();
+      for (int x = margin; x < size.width - margin; ++x) {
+        if (!pyramidLevel.dstFovMask(dstIdx)(y, x) ||
+            !pyramidLevel.dstForegroundMask(dstIdx)(y, x)) {
+          continue;
+        }
+        for (int i = 0; i < int(coarseProbes.size()); ++i) {
+          coarse[i] = {coarseProbes[i], costs[i](y, x), confidences[i](y, x)};
+        }
+        const bool isTextured =
+            pyramidLevel.dstVariance(dstIdx)(y, x) >= pyramidLevel.varNoiseFloor;
+        ProbeCost* refined = probeCosts.getRefined(x, y);
+        const int numRefined =
+            getRefinedProbes(coarse, isTextured ? kAdaptiveNumMinima : 1, refined);
+        probeCosts.numRefined(y, x) = numRefined;
+        for (int r = 0; r < numRefined; ++r) {
+          // Same as computeBruteForceCosts(): foreground must be closer than background
+          const float disparity = disparities[refined[r].probe];
+          if (pyramidLevel.hasForegroundMasks &&
+              !(pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x) < disparity)) {
+            continue; // cost stays NAN
+          }
+          batchXs.push_back(x);
+          batchRefined.push_back(&refined[r]);
+          batchDisparities.push_back(disparity);
+        }
+      }
+
+      if (pyramidLevel.costEngine == CostEngine::batch) {
+        computeCostsBatch(
+            pyramidLevel, dstIdx, y, batchXs, batchDisparities, batchCosts, batchConfidences);
+      } else {
+        batchCosts.resize(batchXs.size());
+        batchConfidences.resize(batchXs.size());
+        for (ssize_t i = 0; i < ssize(batchXs); ++i) {
+          std::tie(batchCosts[i], batchConfidences[i]) =
+              computeCost(pyramidLevel, dstIdx, batchDisparities[i], batchXs[i], y);
+        }
+      }
+      for (ssize_t i = 0; i < ssize(batchXs); ++i) {
+        batchRefined[i]->cost = batchCosts[i];
+        batchRefined[i]->confidence = batchConfidences[i];
+      }
+    }
+  });
+  return probeCosts;
+}
+
+} // namespace
+
 // Brute force: find disparity with lowest cost at each location, typically at
 // coarsest level of the pyramid
 void computeBruteForceDisparity(
@@ -268,6 +567,7 @@ void computeBruteForceDisparity(
     const bool partialCoverage,
     const bool useForegroundMasks,
     const int numThreads) {
+  pyramidLevel.prepareProjections({dstIdx});
   cv::Mat_<float>& dstDisparity = pyramidLevel.dstDisparity(dstIdx);
   cv::Mat_<float>& dstCosts = pyramidLevel.dstCost(dstIdx);
   cv::Mat_<float>& dstConfidences = pyramidLevel.dstConfidence(dstIdx);
@@ -283,11 +583,16 @@ void computeBruteForceDisparity(
     disparities[i] = d;
   }
 
-  // Create a cost map for each possible disparity
+  // Create a cost map for each possible disparity, or only sample some of them
+  const bool isAdaptive = pyramidLevel.disparitySampling == DisparitySampling::adaptive;
+  AdaptiveProbeCosts adaptiveProbeCosts;
+  if (isAdaptive) {
+    adaptiveProbeCosts = computeAdaptiveProbeCosts(pyramidLevel, dstIdx, disparities, numThreads);
+  }
   ThreadPool threadPool(numThreads);
-  std::vector<cv::Mat_<float>> costs(disparities.size());
-  std::vector<cv::Mat_<float>> confidences(disparities.size());
-  for (int iDisparity = 0; iDisparity < int(disparities.size()); ++iDisparity) {
+  std::vector<cv::Mat_<float>> costs(isAdaptive ? 0 : disparities.size());
+  std::vector<cv::Mat_<float>> confidences(costs.size());
+  for (int iDisparity = 0; iDisparity < int(costs.size()); ++iDisparity) {
     costs[iDisparity].create(pyramidLevel.sizeLevel);
     costs[iDisparity].setTo(NAN);
     confidences[iDisparity].create(pyramidLevel.sizeLevel);
@@ -302,10 +607,21 @@ void computeBruteForceDisparity(
   }
   threadPool.join();
 
+  // Local minima of the costs along each ray are the candidates for the level below
+  if (pyramidLevel.useCostCandidates) {
+    pyramidLevel.dstCandidateDisparity(dstIdx).create(pyramidLevel.sizeLevel);
+    pyramidLevel.dstCandidateDisparity(dstIdx).setTo(CostCandidates::all(NAN));
+    pyramidLevel.dstCandidateCost(dstIdx).create(pyramidLevel.sizeLevel);
+    pyramidLevel.dstCandidateCost(dstIdx).setTo(CostCandidates::all(NAN));
+  }
+
   // Get best cost on each location
   // We have one cost per disparity at each location
   // Ignore margins if dst = src (won't be able to get entire patch)
   const int margin = kSearchWindowRadius;
+  std::vector<ProbeCost> probeCosts(costs.size()); // of the current pixel, sorted by probe
+  int64_t numPixels = 0;
+  int64_t numProbeCosts = 0;
   for (int y = margin; y < dstDisparity.rows - margin; ++y) {
     for (int x = margin; x < dstDisparity.cols - margin; ++x) {
       if (!pyramidLevel.dstFovMask(dstIdx)(y, x)) { // outside FOV
@@ -319,15 +635,24 @@ void computeBruteForceDisparity(
         continue;
       }
 
+      if (isAdaptive) {
+        adaptiveProbeCosts.getProbeCosts(x, y, probeCosts);
+      } else {
+        for (int i = 0; i < int(costs.size()); ++i) {
+          probeCosts[i] = {i, costs[i](y, x), confidences[i](y, x)};
+        }
+      }
+      ++numPixels;
+      numProbeCosts += probeCosts.size();
+
       float minCost = FLT_MAX;
       float minCostConfidence = 0;
       int bestDisparityIdx = -1;
-      for (int i = 0; i < int(costs.size()); ++i) {
-        const float cost = costs[i](y, x);
-        if (cost < minCost) {
-          minCost = cost;
-          minCostConfidence = confidences[i](y, x);
-          bestDisparityIdx = i;
+      for (const ProbeCost& probeCost : probeCosts) {
+        if (probeCost.cost < minCost) {
+          minCost = probeCost.cost;
+          minCostConfidence = probeCost.confidence;
+          bestDisparityIdx = probeCost.probe;
         }
       }
       if (bestDisparityIdx == -1) {
@@ -351,8 +676,28 @@ void computeBruteForceDisparity(
       }
       dstCosts(y, x) = minCost;
       dstConfidences(y, x) = minCostConfidence;
+
+      if (pyramidLevel.useCostCandidates) {
+        CostCandidates& candidateDisparity = pyramidLevel.dstCandidateDisparity(dstIdx)(y, x);
+        CostCandidates& candidateCost = pyramidLevel.dstCandidateCost(dstIdx)(y, x);
+        for (int i = 0; i < ssize(probeCosts); ++i) {
+          if (isLocalMinimum(probeCosts, i)) {
+            insertCostCandidate(
+                candidateDisparity,
+                candidateCost,
+                disparities[probeCosts[i].probe],
+                probeCosts[i].cost);
+          }
+        }
+      }
     }
   }
+  if (isAdaptive) {
+    LOG(INFO) << folly::sformat(
+        "Adaptive sampling: {:.1f} of {} disparities per pixel",
+        double(numProbeCosts) / std::max(numPixels, int64_t(1)),
+        kNumDepths);
+  }
 
   // Extend disparities to margin
   if (margin > 0) {
@@ -399,12 +744,129 @@ void computeBruteForceDisparities(
   }
 }
 
+namespace {
+
+// Index of the probe disparity with the lowest cost at each pixel of dst, -1 where none has one
+cv::Mat_<int> bruteForceProbes(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const std::vector<float>& disparities,
+    const int numThreads) {
+  pyramidLevel.prepareProjections({dstIdx});
+  const cv::Size& size = pyramidLevel.sizeLevel;
+  std::vector<cv::Mat_<float>> costs(disparities.size());
+  ThreadPool threadPool(numThreads);
+  for (int i = 0; i < int(disparities.size()); ++i) {
+    threadPool.spawn([&, i] {
+      costs[i].create(size);
+      costs[i].setTo(NAN);
+      cv::Mat_<float> confidences(size, NAN);
+      computeBruteForceCosts(pyramidLevel, dstIdx, disparities[i], costs[i], confidences);
+    });
+  }
+  threadPool.join();
+
+  cv::Mat_<int> best(size, -1);
+  cv::Mat_<float> bestCost(size, FLT_MAX);
+  for (int i = 0; i < int(costs.size()); ++i) {
+    for (int y = 0; y < size.height; ++y) {
+      for (int x = 0; x < size.width; ++x) {
+        if (costs[i](y, x) < bestCost(y, x)) {
+          bestCost(y, x) = costs[i](y, x);
+          best(y, x) = i;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+} // namespace
+
+void reportColorFormatError(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const float minDepthMeters,
+    const float maxDepthMeters,
+    const int numThreads) {
+  std::vector<float> disparities(kNumDepths);
+  for (int i = 0; i < kNumDepths; ++i) {
+    disparities[i] = probeDisparity(i, kNumDepths, 1.0f / maxDepthMeters, 1.0f / minDepthMeters);
+  }
+
+  // Brute force disparities of every dst in the level's format, then in unorm16
+  const ColorFormat format = pyramidLevel.projColorFormat;
+  const int numDsts = pyramidLevel.rigDst.size();
+  std::vector<cv::Mat_<int>> probes(numDsts);
+  std::vector<cv::Mat_<int>> probesReference(numDsts);
+  for (const bool isReference : {false, true}) {
+    pyramidLevel.projColorFormat = isReference ? ColorFormat::unorm16 : format;
+    pyramidLevel.resetProjections();
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      (isReference ? probesReference : probes)[dstIdx] =
+          bruteForceProbes(pyramidLevel, dstIdx, disparities, numThreads);
+    }
+  }
+  pyramidLevel.projColorFormat = format;
+  pyramidLevel.resetProjections();
+
+  int64_t numPixels = 0;
+  int64_t numChanged = 0;
+  double sumError = 0;
+  float maxError = 0;
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    for (int y = 0; y < pyramidLevel.sizeLevel.height; ++y) {
+      for (int x = 0; x < pyramidLevel.sizeLevel.width; ++x) {
+        const int probe = probes[dstIdx](y, x);
+        const int probeReference = probesReference[dstIdx](y, x);
+        if (probe < 0 || probeReference < 0) {
+          continue;
+        }
+        ++numPixels;
+        if (probe != probeReference) {
+          const float error = std::abs(disparities[probe] - disparities[probeReference]);
+          ++numChanged;
+          sumError += error;
+          maxError = std::max(maxError, error);
+        }
+      }
+    }
+  }
+  const double denominator = std::max(numPixels, int64_t(1));
+  LOG(INFO) << folly::sformat(
+      "Color format error at level {}: {} of {} disparities changed ({:.2f}%), "
+      "mean error {:.6f}, max error {:.6f} (1/m)",
+      pyramidLevel.level,
+      numChanged,
+      numPixels,
+      100.0 * numChanged / denominator,
+      sumError / denominator,
+      maxError);
+}
+
+namespace {
+
+// Per thread, so that rows of candidates stop allocating once the largest one has been seen
+struct PingPongScratch {
+  std::vector<int> batchXs;
+  std::vector<float> batchDisparities;
+  std::vector<float> batchCosts;
+  std::vector<float> batchConfidences;
+};
+
+PingPongScratch& getPingPongScratch() {
+  static thread_local PingPongScratch scratch;
+  return scratch;
+}
+
+} // namespace
+
 void pingPongRectangle(
     cv::Mat_<float>& dispRes,
     cv::Mat_<float>& costsRes,
     cv::Mat_<float>& confidencesRes,
     const cv::Mat_<bool>& changed,
     const cv::Mat_<cv::Vec3b>& labImage,
+    const PingPongCandidates& candidates,
     const PyramidLevel<PixelType>& pyramidLevel,
     const int dstIdx,
     const int xBegin,
@@ -417,7 +879,28 @@ void pingPongRectangle(
   const cv::Mat_<float>& dispBackground = pyramidLevel.dstBackgroundDisparity(dstIdx);
   const cv::Mat_<float>& variance = pyramidLevel.dstVariance(dstIdx);
 
+  // Candidates are read through the linear offsets of the level, clamped near the borders
+  const float* dispData = disp[0];
+  const bool* maskFovData = maskFov[0];
+  const bool* changedData = changed[0];
+  const int reach = candidates.reach;
+  std::array<int, PingPongCandidates::kMaxCandidates> allIdxs;
+  for (int i = 0; i < candidates.numCandidates; ++i) {
+    allIdxs[i] = i;
+  }
+  std::array<int, PingPongCandidates::kMaxCandidates> prunedIdxs;
+
+  // The batch engine collects the candidates of a whole row and scores them in one go
+  const bool useBatchCost = pyramidLevel.costEngine == CostEngine::batch;
+  PingPongScratch& scratch = getPingPongScratch();
+  std::vector<int>& batchXs = scratch.batchXs;
+  std::vector<float>& batchDisparities = scratch.batchDisparities;
+  std::vector<float>& batchCosts = scratch.batchCosts;
+  std::vector<float>& batchConfidences = scratch.batchConfidences;
+
   for (int y = yBegin; y < yEnd; ++y) {
+    batchXs.clear();
+    batchDisparities.clear();
     for (int x = xBegin; x < xEnd; ++x) {
       if (!maskFov(y, x)) {
         // Keep value from previous frame
@@ -439,26 +922,39 @@ void pingPongRectangle(
       float bestDisparity = disp(y, x);
       float bestConfidence = confidences(y, x);
 
-      std::vector<std::array<int, 2>> candidateNeighborOffsets;
-      if (kDoColorPruning) {
-        const std::array<int, 2>& startPoint = {{x, y}};
-        candidateNeighborOffsets = prunePingPongCandidates(
-            candidateTemplateOriginal, labImage, startPoint, kColorPruningNumNeighbors);
-      } else {
-        candidateNeighborOffsets = candidateTemplateOriginal;
+      const int* candidateIdxs = allIdxs.data();
+      int numCandidates = candidates.numCandidates;
+      if (pyramidLevel.useColorPruning) {
+        numCandidates = prunePingPongCandidates(
+            candidates, labImage, x, y, kColorPruningNumNeighbors, prunedIdxs);
+        candidateIdxs = prunedIdxs.data();
       }
 
       const float backgroundDisparity =
           pyramidLevel.hasForegroundMasks ? pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x) : 0;
-
-      for (const auto& candidateNeighborOffset : candidateNeighborOffsets) {
-        const int xx = math_util::clamp(x + candidateNeighborOffset[0], 0, disp.cols - 1);
-        const int yy = math_util::clamp(y + candidateNeighborOffset[1], 0, disp.rows - 1);
-        if (maskFov(yy, xx)) { // inside FOV
-          const float d = disp(yy, xx);
+      const bool isInterior =
+          x >= reach && y >= reach && x < disp.cols - reach && y < disp.rows - reach;
+      const int idx = y * disp.cols + x;
+
+      for (int i = 0; i < numCandidates; ++i) {
+        const int candidateIdx = candidateIdxs[i];
+        int idxNeighbor = idx + candidates.linearOffsets[candidateIdx];
+        if (!isInterior) {
+          const std::array<int, 2>& offset = candidates.offsets[candidateIdx];
+          const int xx = math_util::clamp(x + offset[0], 0, disp.cols - 1);
+          const int yy = math_util::clamp(y + offset[1], 0, disp.rows - 1);
+          idxNeighbor = yy * disp.cols + xx;
+        }
+        if (maskFovData[idxNeighbor]) { // inside FOV
+          const float d = dispData[idxNeighbor];
 
           // When using background disparity, foreground pixels must be closer than background
-          if (d >= backgroundDisparity && changed(yy, xx)) {
+          if (d >= backgroundDisparity && changedData[idxNeighbor]) {
+            if (useBatchCost) {
+              batchXs.push_back(x);
+              batchDisparities.push_back(d);
+              continue;
+            }
             const auto costValues = computeCost(pyramidLevel, dstIdx, d, x, y);
             const float cost = std::get<0>(costValues);
             if (cost < bestCost) {
@@ -473,65 +969,206 @@ void pingPongRectangle(
       costsRes(y, x) = bestCost;
       confidencesRes(y, x) = bestConfidence;
     }
+
+    if (!batchXs.empty()) {
+      computeCostsBatch(
+          pyramidLevel, dstIdx, y, batchXs, batchDisparities, batchCosts, batchConfidences);
+
+      // Candidates of a pixel are contiguous and in template order, same tie-breaking as above
+      for (ssize_t i = 0; i < ssize(batchXs); ++i) {
+        const int x = batchXs[i];
+        if (batchCosts[i] < costsRes(y, x)) {
+          dispRes(y, x) = batchDisparities[i];
+          costsRes(y, x) = batchCosts[i];
+          confidencesRes(y, x) = batchConfidences[i];
+        }
+      }
+    }
+  }
+}
+
+// Ping pong state of a single dst
+// Disparities are double buffered: an iteration reads dstDisparity and writes dispRes, then the two
+// are swapped. Changes are tracked per pixel and per tile, and a tile is only processed again if
+// any pixel in its neighborhood changed in the previous iteration
+struct PingPongDst {
+  cv::Mat_<float> dispRes;
+  cv::Mat_<float> confidencesRes;
+  cv::Mat_<bool> changed; // previous iteration
+  cv::Mat_<bool> changedRes; // current iteration
+  cv::Mat_<cv::Vec3b> labImage; // if useColorPruning
+
+  int numTilesX;
+  int numTilesY;
+  std::vector<char> tileChanged; // previous iteration, char so tiles can be written concurrently
+  std::vector<char> tileChangedRes; // current iteration
+  std::vector<int> tileChangedCount;
+  std::vector<char> tileProcessed;
+};
+
+// A tile needs processing if any candidate of its pixels changed in the previous iteration
+// Candidates are at most one tile away as long as tiles are wider than the candidate reach
+bool needsPingPong(const PingPongDst& state, const int tileX, const int tileY) {
+  for (int ty = std::max(tileY - 1, 0); ty <= std::min(tileY + 1, state.numTilesY - 1); ++ty) {
+    for (int tx = std::max(tileX - 1, 0); tx <= std::min(tileX + 1, state.numTilesX - 1); ++tx) {
+      if (state.tileChanged[ty * state.numTilesX + tx]) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void pingPongTile(
+    PingPongDst& state,
+    const PingPongCandidates& candidates,
+    PyramidLevel<PixelType>& pyramidLevel,
+    const int dstIdx,
+    const int tileX,
+    const int tileY) {
+  const cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
+  cv::Mat_<float>& costs = pyramidLevel.dstCost(dstIdx);
+  const int tileIdx = tileY * state.numTilesX + tileX;
+  const int xBegin = tileX * kPingPongTileSize;
+  const int yBegin = tileY * kPingPongTileSize;
+  const int xEnd = std::min(xBegin + kPingPongTileSize, disp.cols);
+  const int yEnd = std::min(yBegin + kPingPongTileSize, disp.rows);
+  const cv::Rect tileRect(xBegin, yBegin, xEnd - xBegin, yEnd - yBegin);
+
+  if (!needsPingPong(state, tileX, tileY)) {
+    // Nothing to propagate: every candidate would be skipped, leaving disparities as they are
+    // (dispRes already holds them, they have not changed since it was last written) with no cost
+    state.changedRes(tileRect).setTo(false);
+    costs(tileRect).setTo(INFINITY);
+    state.tileChangedRes[tileIdx] = false;
+    state.tileChangedCount[tileIdx] = 0;
+    state.tileProcessed[tileIdx] = false;
+    return;
+  }
+
+  // Ignore margins (won't be able to get entire patch)
+  const int radius = kSearchWindowRadius;
+  const int xBeginInner = std::max(xBegin, radius);
+  const int yBeginInner = std::max(yBegin, radius);
+  const int xEndInner = std::min(xEnd, disp.cols - radius);
+  const int yEndInner = std::min(yEnd, disp.rows - radius);
+  if (xBeginInner < xEndInner && yBeginInner < yEndInner) {
+    pingPongRectangle(
+        state.dispRes,
+        costs,
+        state.confidencesRes,
+        state.changed,
+        state.labImage,
+        candidates,
+        pyramidLevel,
+        dstIdx,
+        xBeginInner,
+        yBeginInner,
+        xEndInner,
+        yEndInner);
+  }
+
+  // Pixels outside the FOV are never candidates, and NAN to NAN is not a change
+  const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
+  int count = 0;
+  for (int y = yBegin; y < yEnd; ++y) {
+    for (int x = xBegin; x < xEnd; ++x) {
+      const float d = disp(y, x);
+      const float dRes = state.dispRes(y, x);
+      const bool changed = fovMask(y, x) && d != dRes && !(std::isnan(d) && std::isnan(dRes));
+      state.changedRes(y, x) = changed;
+      count += changed;
+    }
   }
+  state.tileChangedRes[tileIdx] = count > 0;
+  state.tileChangedCount[tileIdx] = count;
+  state.tileProcessed[tileIdx] = true;
 }
 
 void pingPong(PyramidLevel<PixelType>& pyramidLevel, const int iterations, const int numThreads) {
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
-    cv::Mat_<float>& costs = pyramidLevel.dstCost(dstIdx);
-    cv::Mat_<float> dispRes(disp.size());
-    disp.copyTo(dispRes);
-    cv::Mat_<float> costsRes(disp.size(), INFINITY);
-    cv::Mat_<float> confidencesRes(disp.size(), 0);
-    cv::Mat_<bool> changed(disp.size(), true);
-
-    cv::Mat_<cv::Vec3b> labImage;
-    if (kDoColorPruning) {
-      const cv::Mat_<PixelType>& color = pyramidLevel.dstColor(dstIdx);
-      cv::Mat_<cv::Vec4b> imageScaled;
-      cv::Mat_<cv::Vec3b> bgrImage;
-      color.convertTo(imageScaled, CV_8UC4, 255);
-      cv::cvtColor(imageScaled, bgrImage, cv::COLOR_BGRA2BGR);
-      cv::cvtColor(bgrImage, labImage, cv::COLOR_BGR2Lab);
+  if (iterations < 1) {
+    return;
+  }
+  const PingPongCandidates candidates = makePingPongCandidates(pyramidLevel.sizeLevel);
+  CHECK_GT(kPingPongTileSize, candidates.reach);
+  const int numDsts = pyramidLevel.rigDst.size();
+  std::vector<PingPongDst> states(numDsts);
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    PingPongDst& state = states[dstIdx];
+    const cv::Mat_<float>& disp = pyramidLevel.dstDisparity(dstIdx);
+    CHECK(disp.isContinuous() && pyramidLevel.dstFovMask(dstIdx).isContinuous());
+    state.dispRes = disp.clone();
+    state.confidencesRes.create(disp.size());
+    state.confidencesRes.setTo(0);
+    state.changed.create(disp.size());
+    state.changed.setTo(true);
+    state.changedRes.create(disp.size());
+    state.changedRes.setTo(false);
+
+    // Costs are only set where we process a pixel
+    pyramidLevel.dstCost(dstIdx).setTo(INFINITY);
+
+    state.numTilesX = (disp.cols + kPingPongTileSize - 1) / kPingPongTileSize;
+    state.numTilesY = (disp.rows + kPingPongTileSize - 1) / kPingPongTileSize;
+    const int numTiles = state.numTilesX * state.numTilesY;
+    state.tileChanged.assign(numTiles, true);
+    state.tileChangedRes.assign(numTiles, false);
+    state.tileChangedCount.assign(numTiles, 0);
+    state.tileProcessed.assign(numTiles, false);
+
+    if (pyramidLevel.useColorPruning) {
+      state.labImage = computeLabImage(pyramidLevel.dstColor(dstIdx));
     }
+  }
 
-    for (int it = 1; it <= iterations; ++it) {
-      LOG(INFO) << folly::sformat(
-          "-- ping pong: iter {}/{}, {}", it, iterations, pyramidLevel.rigDst[dstIdx].id);
-      const int radius = kSearchWindowRadius;
-      ThreadPool threadPool(numThreads);
-
-      const int edgeX = dispRes.cols;
-      const int edgeY = 1;
-      for (int y = radius; y < dispRes.rows - radius; y += edgeY) {
-        for (int x = radius; x < dispRes.cols - radius; x += edgeX) {
-          threadPool.spawn(
-              &pingPongRectangle,
-              std::ref(dispRes),
-              std::ref(costsRes),
-              std::ref(confidencesRes),
-              std::cref(changed),
-              std::cref(labImage),
-              std::cref(pyramidLevel),
-              dstIdx,
-              x,
-              y,
-              std::min(x + edgeX, dispRes.cols - radius),
-              std::min(y + edgeY, dispRes.rows - radius));
+  // Tiles of all dsts are processed concurrently, as long as their projections fit in memory
+  static profiler::Counter& numChanged =
+      profiler::Profiler::instance().counter("ping pong changed pixels");
+  ThreadPool threadPool(numThreads);
+  for (const std::vector<int>& dstIdxs : pyramidLevel.groupDstsByProjectionBudget()) {
+    pyramidLevel.prepareProjections(dstIdxs);
+    std::vector<std::array<int, 3>> tiles; // dstIdx, tileX, tileY
+    for (const int dstIdx : dstIdxs) {
+      for (int tileY = 0; tileY < states[dstIdx].numTilesY; ++tileY) {
+        for (int tileX = 0; tileX < states[dstIdx].numTilesX; ++tileX) {
+          tiles.push_back({{dstIdx, tileX, tileY}});
         }
       }
-      threadPool.join();
+    }
 
-      changed = disp != dispRes;
-      dispRes.copyTo(disp);
-      costsRes.copyTo(costs);
+    for (int it = 1; it <= iterations; ++it) {
+      threadPool.parallelFor(0, tiles.size(), 1, [&](const int begin, const int end) {
+        for (int i = begin; i < end; ++i) {
+          const std::array<int, 3>& tile = tiles[i];
+          pingPongTile(states[tile[0]], candidates, pyramidLevel, tile[0], tile[1], tile[2]);
+        }
+      });
 
-      const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
-      const int countFov = cv::countNonZero(fovMask);
-      const int count = cv::countNonZero(changed);
-      const float changedPct = 100.0f * count / countFov;
-      LOG(INFO) << std::fixed << std::setprecision(2) << folly::sformat("changed: {}%", changedPct);
+      for (const int dstIdx : dstIdxs) {
+        PingPongDst& state = states[dstIdx];
+        cv::swap(pyramidLevel.dstDisparity(dstIdx), state.dispRes);
+        cv::swap(state.changed, state.changedRes);
+        std::swap(state.tileChanged, state.tileChangedRes);
+
+        const int countFov = cv::countNonZero(pyramidLevel.dstFovMask(dstIdx));
+        int count = 0;
+        int numProcessed = 0;
+        for (int tileIdx = 0; tileIdx < ssize(state.tileChangedCount); ++tileIdx) {
+          count += state.tileChangedCount[tileIdx];
+          numProcessed += state.tileProcessed[tileIdx];
+        }
+        const float changedPct = 100.0f * count / countFov;
+        numChanged.add(count);
+        profiler::Profiler::instance().addSample("ping pong changed pixels", count);
+        LOG(INFO) << folly::sformat(
+            "-- ping pong: iter {}/{}, {}, changed: {:.2f}%, tiles: {}/{}",
+            it,
+            iterations,
+            pyramidLevel.rigDst[dstIdx].id,
+            changedPct,
+            numProcessed,
+            state.tileProcessed.size());
+      }
     }
   }
 }
@@ -541,6 +1178,7 @@ void pingPongPropagation(
     const int iterations,
     const int numThreads,
     const filesystem::path& debugDir) {
+  profiler::ScopedTimer timer("pingPongPropagation");
   if (pyramidLevel.level == pyramidLevel.numLevels - 1) {
     return;
   }
@@ -722,6 +1360,7 @@ void handleDisparityMismatches(
     PyramidLevel<PixelType>& pyramidLevel,
     const int startLevel,
     const int numThreads) {
+  profiler::ScopedTimer timer("handleDisparityMismatches");
   if (pyramidLevel.level > startLevel || pyramidLevel.level == pyramidLevel.numLevels - 1) {
     return;
   }
@@ -752,7 +1391,9 @@ void randomProposal(
     const int y,
     const int numProposals,
     const float minDepthMeters,
-    const float maxDepthMeters) {
+    const float maxDepthMeters,
+    const bool hasCandidates,
+    std::atomic<int64_t>& numCosts) {
   std::default_random_engine engine;
   engine.seed(y * pyramidLevel.level);
   cv::Mat_<float>& dstDisparity = pyramidLevel.dstDisparity(dstIdx);
@@ -790,9 +1431,7 @@ void randomProposal(
     float currCost;
     float currConfidence;
     std::tie(currCost, currConfidence) = computeCost(pyramidLevel, dstIdx, currDisp, x, y);
-
-    // We will refine only if we're getting much better cost
-    const float costThresh = std::fmin(0.5f * currCost, kRandomPropMaxCost);
+    int numPixelCosts = 1;
 
     // When using background, foreground pixels must be closer than background
     const float minDisp = pyramidLevel.hasForegroundMasks
@@ -800,20 +1439,85 @@ void randomProposal(
         : (1.0f / maxDepthMeters);
     const float maxDisp = 1.0f / minDepthMeters;
 
-    float amplitude = (maxDisp - minDisp) / 2.0f;
-    for (int i = 0; i < numProposals; ++i) {
-      float propDisp = std::uniform_real_distribution<float>(
-          std::max(float(minDisp), currDisp - amplitude),
-          std::min(float(maxDisp), currDisp + amplitude))(engine);
-      float propCost;
-      float propConfidence;
-      std::tie(propCost, propConfidence) = computeCost(pyramidLevel, dstIdx, propDisp, x, y);
-      if (propCost < currCost && propCost < costThresh) {
-        currCost = propCost;
-        currDisp = propDisp;
-        currConfidence = propConfidence;
-        amplitude /= 2.0f;
+    // Candidates of the level above are replaced with the best disparities tried here
+    CostCandidates prevCandidates = CostCandidates::all(NAN);
+    CostCandidates candidateDisparity = CostCandidates::all(NAN);
+    CostCandidates candidateCost = CostCandidates::all(NAN);
+    if (pyramidLevel.useCostCandidates) {
+      prevCandidates = pyramidLevel.dstCandidateDisparity(dstIdx)(y, x);
+      insertCostCandidate(candidateDisparity, candidateCost, currDisp, currCost);
+    }
+
+    if (hasCandidates) {
+      // Candidates already won at the level above, any better cost will do
+      for (int i = 0; i < kNumCostCandidates; ++i) {
+        const float propDisp = prevCandidates[i];
+        if (std::isnan(propDisp) || propDisp < minDisp || propDisp > maxDisp ||
+            std::fabs(propDisp - currDisp) <= kCostCandidateTolerance * currDisp) {
+          continue;
+        }
+        float propCost;
+        float propConfidence;
+        std::tie(propCost, propConfidence) = computeCost(pyramidLevel, dstIdx, propDisp, x, y);
+        ++numPixelCosts;
+        insertCostCandidate(candidateDisparity, candidateCost, propDisp, propCost);
+        if (propCost < currCost) {
+          currCost = propCost;
+          currDisp = propDisp;
+          currConfidence = propConfidence;
+        }
       }
+
+      // Candidates are only as precise as the level above, so the random proposals perturb each
+      // of the best disparities tried so far in turn
+      const CostCandidates seeds = candidateDisparity;
+      int numSeeds = 0;
+      while (numSeeds < kNumCostCandidates && !std::isnan(seeds[numSeeds])) {
+        ++numSeeds;
+      }
+      const float amplitude = kCostCandidatePerturbation * (maxDisp - minDisp);
+      for (int i = 0; i < numProposals && numSeeds > 0; ++i) {
+        const float seed = math_util::clamp(seeds[i % numSeeds], minDisp, maxDisp);
+        const float propDisp = std::uniform_real_distribution<float>(
+            std::max(minDisp, seed - amplitude), std::min(maxDisp, seed + amplitude))(engine);
+        float propCost;
+        float propConfidence;
+        std::tie(propCost, propConfidence) = computeCost(pyramidLevel, dstIdx, propDisp, x, y);
+        ++numPixelCosts;
+        insertCostCandidate(candidateDisparity, candidateCost, propDisp, propCost);
+        if (propCost < currCost) {
+          currCost = propCost;
+          currDisp = propDisp;
+          currConfidence = propConfidence;
+        }
+      }
+    } else {
+      // We will refine only if we're getting much better cost
+      const float costThresh = std::fmin(0.5f * currCost, kRandomPropMaxCost);
+
+      float amplitude = (maxDisp - minDisp) / 2.0f;
+      for (int i = 0; i < numProposals; ++i) {
+        float propDisp = std::uniform_real_distribution<float>(
+            std::max(float(minDisp), currDisp - amplitude),
+            std::min(float(maxDisp), currDisp + amplitude))(engine);
+        float propCost;
+        float propConfidence;
+        std::tie(propCost, propConfidence) = computeCost(pyramidLevel, dstIdx, propDisp, x, y);
+        ++numPixelCosts;
+        insertCostCandidate(candidateDisparity, candidateCost, propDisp, propCost);
+        if (propCost < currCost && propCost < costThresh) {
+          currCost = propCost;
+          currDisp = propDisp;
+          currConfidence = propConfidence;
+          amplitude /= 2.0f;
+        }
+      }
+    }
+    numCosts += numPixelCosts;
+
+    if (pyramidLevel.useCostCandidates) {
+      pyramidLevel.dstCandidateDisparity(dstIdx)(y, x) = candidateDisparity;
+      pyramidLevel.dstCandidateCost(dstIdx)(y, x) = candidateCost;
     }
 
     dstDisparity(y, x) = currDisp;
@@ -829,6 +1533,7 @@ void preprocessLevel(
     const bool partialCoverage,
     const bool useForegroundMasks,
     const int numThreads) {
+  profiler::ScopedTimer timer("preprocessLevel");
   if (pyramidLevel.level == pyramidLevel.numLevels - 1) {
     computeBruteForceDisparities(
         pyramidLevel,
@@ -840,6 +1545,106 @@ void preprocessLevel(
   }
 }
 
+std::vector<cv::Mat_<bool>> seedFromPreviousFrame(
+    PyramidLevel<PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<PixelType>>& dstReferenceColors,
+    const std::vector<cv::Mat_<float>>& prevDstDisparities,
+    const float colorChangeThresh,
+    const int numThreads) {
+  profiler::ScopedTimer timer("seedFromPreviousFrame");
+  const int numDsts = pyramidLevel.rigDst.size();
+  CHECK_EQ(ssize(dstReferenceColors), numDsts);
+  CHECK_EQ(ssize(prevDstDisparities), numDsts);
+
+  // Every patch and ping pong candidate that touches a change is recomputed
+  const int dilation =
+      kSearchWindowRadius + makePingPongCandidates(pyramidLevel.sizeLevel).reach;
+  const cv::Mat kernel =
+      cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * dilation + 1, 2 * dilation + 1));
+  const float thresh = colorChangeThresh * cv_util::maxPixelValue(pyramidLevel.dstColor(0));
+
+  std::vector<cv::Mat_<bool>> dstReused(numDsts);
+  std::vector<int> numReused(numDsts, 0);
+  ThreadPool threadPool(numThreads);
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    threadPool.spawn([&, dstIdx] {
+      const cv::Mat_<PixelType>& color = pyramidLevel.dstColor(dstIdx);
+      const cv::Mat_<PixelType>& prevColor = dstReferenceColors[dstIdx];
+      const cv::Mat_<float>& prevDisparity = prevDstDisparities[dstIdx];
+      const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
+      CHECK_EQ(prevColor.size(), color.size());
+      CHECK_EQ(prevDisparity.size(), color.size());
+
+      cv::Mat_<bool> changed(color.size(), false);
+      for (int y = 0; y < color.rows; ++y) {
+        for (int x = 0; x < color.cols; ++x) {
+          if (!fovMask(y, x)) {
+            continue;
+          }
+          float diff = 0;
+          for (int c = 0; c < PixelType::channels; ++c) {
+            diff = std::max(diff, std::abs(float(color(y, x)[c]) - float(prevColor(y, x)[c])));
+          }
+          changed(y, x) = diff > thresh || std::isnan(prevDisparity(y, x));
+        }
+      }
+      cv::dilate(changed, changed, kernel);
+
+      // Unchanged foreground pixels become background, with the previous disparity as background
+      // disparity. Real background pixels keep their own
+      // Note: dst foreground masks are shared with src, so new masks are created
+      const cv::Mat_<bool>& foregroundMask = pyramidLevel.dstForegroundMask(dstIdx);
+      const cv::Mat_<float>& backgroundDisparity = pyramidLevel.dstBackgroundDisparity(dstIdx);
+      cv::Mat_<bool> seededForegroundMask(color.size());
+      cv::Mat_<float> seededBackgroundDisparity = backgroundDisparity.empty()
+          ? cv::Mat_<float>(color.size(), NAN)
+          : backgroundDisparity.clone();
+      cv::Mat_<bool>& reused = dstReused[dstIdx];
+      reused.create(color.size());
+      for (int y = 0; y < color.rows; ++y) {
+        for (int x = 0; x < color.cols; ++x) {
+          seededForegroundMask(y, x) = foregroundMask(y, x) && changed(y, x);
+          reused(y, x) = foregroundMask(y, x) && !changed(y, x);
+          if (reused(y, x)) {
+            seededBackgroundDisparity(y, x) = prevDisparity(y, x);
+            numReused[dstIdx] += fovMask(y, x);
+          }
+        }
+      }
+      pyramidLevel.dstForegroundMask(dstIdx) = seededForegroundMask;
+      pyramidLevel.dstBackgroundDisparity(dstIdx) = seededBackgroundDisparity;
+    });
+  }
+  threadPool.join();
+
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    const int countFov = cv::countNonZero(pyramidLevel.dstFovMask(dstIdx));
+    LOG(INFO) << folly::sformat(
+        "-- temporal warm start: {}, reused: {:.2f}%",
+        pyramidLevel.rigDst[dstIdx].id,
+        100.0f * numReused[dstIdx] / countFov);
+  }
+  return dstReused;
+}
+
+void updateReferenceColors(
+    std::vector<cv::Mat_<PixelType>>& dstReferenceColors,
+    const PyramidLevel<PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<bool>>& dstReused) {
+  const int numDsts = pyramidLevel.rigDst.size();
+  dstReferenceColors.resize(numDsts);
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    // Cloned, since later frames copy into the reference
+    const cv::Mat_<PixelType>& color = pyramidLevel.dstColor(dstIdx);
+    cv::Mat_<PixelType>& reference = dstReferenceColors[dstIdx];
+    if (dstReused.empty() || reference.empty()) {
+      reference = color.clone();
+    } else {
+      color.copyTo(reference, dstReused[dstIdx] == 0);
+    }
+  }
+}
+
 void randomProposals(
     PyramidLevel<PixelType>& pyramidLevel,
     const int numProposals,
@@ -847,13 +1652,31 @@ void randomProposals(
     const float maxDepthMeters,
     const int numThreads,
     const filesystem::path& debugDir) {
-  if (numProposals <= 0 || pyramidLevel.level == pyramidLevel.numLevels - 1) {
+  profiler::ScopedTimer timer("randomProposals");
+  if (pyramidLevel.level == pyramidLevel.numLevels - 1) {
     return;
   }
 
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    LOG(INFO) << folly::sformat("-- random proposals: {}", pyramidLevel.rigDst[dstIdx].id);
+    const bool hasCandidates =
+        pyramidLevel.useCostCandidates && !pyramidLevel.dstCandidateDisparity(dstIdx).empty();
+    if (numProposals <= 0 && !hasCandidates) {
+      continue;
+    }
+    if (pyramidLevel.useCostCandidates && !hasCandidates) {
+      const cv::Size& size = pyramidLevel.sizeLevel;
+      const CostCandidates none = CostCandidates::all(NAN);
+      pyramidLevel.createIfEmpty(pyramidLevel.dstCandidateDisparity(dstIdx), size, none);
+      pyramidLevel.createIfEmpty(pyramidLevel.dstCandidateCost(dstIdx), size, none);
+    }
+
+    LOG(INFO) << folly::sformat(
+        "-- {} proposals: {}",
+        hasCandidates ? "candidate" : "random",
+        pyramidLevel.rigDst[dstIdx].id);
+    pyramidLevel.prepareProjections({dstIdx});
     ThreadPool threadPool(numThreads);
+    std::atomic<int64_t> numCosts(0);
     const cv::Size size = pyramidLevel.dstDisparity(dstIdx).size();
     for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
       threadPool.spawn(
@@ -863,15 +1686,19 @@ void randomProposals(
           y,
           numProposals,
           minDepthMeters,
-          maxDepthMeters);
+          maxDepthMeters,
+          hasCandidates,
+          std::ref(numCosts));
     }
     threadPool.join();
+    LOG(INFO) << folly::sformat("-- {:.2f} costs per pixel", float(numCosts) / size.area());
   }
 
   plotMatches(pyramidLevel, "random_prop", debugDir);
 }
 
 void bilateralFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
+  profiler::ScopedTimer timer("bilateralFilter");
   const float scale = std::pow(kLevelScale, pyramidLevel.level);
   const int spaceRadius =
       std::max(std::ceil(kBilateralSpaceRadiusMax * scale), float(kBilateralSpaceRadiusMin));
@@ -893,7 +1720,8 @@ void bilateralFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads
             kBilateralWeightB,
             kBilateralWeightG,
             kBilateralWeightR,
-            numThreads);
+            numThreads,
+            pyramidLevel.bilateralEngine);
 
     // Only use filtered version on foreground pixels
     disparityFiltered.copyTo(disparity, pyramidLevel.dstForegroundMask(dstIdx));
@@ -901,6 +1729,7 @@ void bilateralFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads
 }
 
 void medianFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
+  profiler::ScopedTimer timer("medianFilter");
   ThreadPool threadPool(numThreads);
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
     threadPool.spawn([&, dstIdx] {
@@ -909,8 +1738,9 @@ void medianFilter(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
       const cv::Mat_<bool>& maskFov = pyramidLevel.dstFovMask(dstIdx);
       const cv::Mat_<bool>& maskFg = pyramidLevel.dstForegroundMask(dstIdx);
       const cv::Mat_<bool> mask = maskFov & maskFg;
-      cv::Mat_<float> disparityFiltered =
-          cv_util::maskedMedianBlur(disparity, bgDisparity, mask, kMedianFilterRadius);
+      const bool ignoreNan = true;
+      cv::Mat_<float> disparityFiltered = cv_util::maskedMedianBlur(
+          disparity, bgDisparity, mask, kMedianFilterRadius, ignoreNan, numThreads);
       disparityFiltered.copyTo(disparity);
     });
   }
@@ -922,6 +1752,7 @@ void saveResults(
     PyramidLevel<PixelType>& pyramidLevel,
     const bool saveDebugImages,
     const std::string& outputFormatsIn) {
+  profiler::ScopedTimer timer("saveResults");
   if (saveDebugImages) {
     LOG(INFO) << folly::sformat("Saving debug images for pyramid level {}...", pyramidLevel.level);
     pyramidLevel.saveDebugImages();
@@ -937,6 +1768,7 @@ void saveResults(
 }
 
 void maskFov(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
+  profiler::ScopedTimer timer("maskFov");
   ThreadPool threadPool(numThreads);
   for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
     threadPool.spawn([&, dstIdx] {
@@ -949,58 +1781,6 @@ void maskFov(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
   threadPool.join();
 }
 
-// Reproject each src camera into each dst camera assuming a depth of infinity
-// At infinity src and dst will align up to translation
-void precomputeProjections(PyramidLevel<PixelType>& pyramidLevel, const int threads) {
-  LOG(INFO) << "Pre-computing projections...";
-  ThreadPool threadPool(threads);
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    // Project to current level dst size
-    const cv::Size& dstSize = pyramidLevel.dstColor(dstIdx).size();
-    Camera camDst = pyramidLevel.rigDst[dstIdx].rescale({dstSize.width, dstSize.height});
-
-    // Project every src to current dst
-    for (int srcIdx = 0; srcIdx < int(pyramidLevel.rigSrc.size()); ++srcIdx) {
-      threadPool.spawn([&, srcIdx] {
-        // Project from current level src size
-        const cv::Size& srcSize = pyramidLevel.srcs[srcIdx].color.size();
-        Camera camSrc = pyramidLevel.rigSrc[srcIdx].rescale({srcSize.width, srcSize.height});
-
-        pyramidLevel.dstProjWarp(dstIdx, srcIdx) = computeWarpDstToSrc(camSrc, camDst);
-        pyramidLevel.dstProjWarpInv(dstIdx, srcIdx) = computeWarpDstToSrc(camDst, camSrc);
-      });
-    }
-    threadPool.join();
-  }
-}
-
-void reprojectColors(PyramidLevel<PixelType>& pyramidLevel, const int numThreads) {
-  LOG(INFO) << "Reprojecting colors...";
-  ThreadPool threadPool(numThreads);
-  for (int dstIdx = 0; dstIdx < int(pyramidLevel.rigDst.size()); ++dstIdx) {
-    // Project every src to current dst
-    for (int srcIdx = 0; srcIdx < int(pyramidLevel.rigSrc.size()); ++srcIdx) {
-      threadPool.spawn([&, srcIdx] {
-        // Project from current level src size
-        const cv::Mat_<PixelType>& srcColor = pyramidLevel.srcColor(srcIdx);
-        cv::Mat_<PixelType>& srcProjColor = pyramidLevel.dstProjColor(dstIdx, srcIdx);
-        if (srcIdx == pyramidLevel.dst2srcIdxs[dstIdx]) {
-          // No projection needed if src = dst
-          srcProjColor = srcColor;
-        } else {
-          const cv::Mat_<cv::Vec2f>& warpDstToSrc = pyramidLevel.dstProjWarpInv(dstIdx, srcIdx);
-          srcProjColor = project(srcColor, warpDstToSrc);
-        }
-
-        // Color bias is just the average over a given area around each pixel
-        pyramidLevel.dstProjColorBias(dstIdx, srcIdx) =
-            colorBias(srcProjColor, kSearchWindowRadius);
-      });
-    }
-    threadPool.join();
-  }
-}
-
 void processLevel(
     PyramidLevel<PixelType>& pyramidLevel,
     const std::string& outputFormats,
@@ -1015,9 +1795,10 @@ void processLevel(
     const int pingPongIterations,
     const int mismatchesStartLevel,
     const bool doBilateralFilter,
-    const int threads) {
+    const int threads,
+    const bool saveOutputs) {
+  profiler::ScopedTimer timer("processLevel");
   LOG(INFO) << folly::sformat("Processing {} level {}", pyramidLevel.frameName, pyramidLevel.level);
-  reprojectColors(pyramidLevel, threads);
   preprocessLevel(pyramidLevel, minDepthM, maxDepthM, partialCoverage, useForegroundMasks, threads);
   randomProposals(pyramidLevel, numRandomProposals, minDepthM, maxDepthM, threads, outputRoot);
   pingPongPropagation(pyramidLevel, pingPongIterations, threads, outputRoot);
@@ -1029,7 +1810,10 @@ void processLevel(
     medianFilter(pyramidLevel, threads);
   }
   maskFov(pyramidLevel, threads);
-  saveResults(pyramidLevel, saveDebugImages, outputFormats);
+  pyramidLevel.logProjectionStats();
+  if (saveOutputs) {
+    saveResults(pyramidLevel, saveDebugImages, outputFormats);
+  }
 }
 
 } // namespace depth_estimation
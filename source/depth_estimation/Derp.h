@@ -22,20 +22,27 @@
 namespace fb360_dep {
 namespace depth_estimation {
 
-// Cost function
-static const int kSearchWindowRadius = 1;
+// Cost function (see also kSearchWindowRadius in DerpUtil.h)
 static const int kNeighborTemplateCode = 0; // defined in ImageUtil::candidateTemplate*
 static const int kMinOverlappingCams = 2;
-static const int kDoColorPruning = false; // only use perceptually similar color neighbors for cost
-static const int kColorPruningNumNeighbors = 25;
+static const int kColorPruningNumNeighbors = 5; // of the ping pong candidates, see useColorPruning
 
 // Brute force
 static const int kNumDepths = 150; // for brute-force step
+static const int kAdaptiveProbeStride = 4; // coarse sweep of DisparitySampling::adaptive
+static const int kAdaptiveNumMinima = 2; // refined per textured pixel, textureless refine 1
+
+// Ping pong propagation
+static const int kPingPongTileSize = 64; // square tiles, sized to stay in cache
 
 // Random proposals
 static const float kRandomPropMaxCost = 5.0;
 static const float kRandomPropHighVarDeviation = 0.1;
 
+// Cost candidates
+static const float kCostCandidateTolerance = 0.01; // relative, closer disparities are the same
+static const float kCostCandidatePerturbation = 0.1; // fraction of the disparity range
+
 // Median filter
 static const int kMedianFilterRadius = 1; // must be 1 or 2
 
@@ -85,6 +92,29 @@ void computeBruteForceDisparities(
     const bool useForegroundMasks,
     const int numThreads = -1);
 
+// Validation of pyramidLevel.projColorFormat: logs how far the brute force disparities of every
+// dst move when projected colors are stored in it instead of unorm16
+// Computes every projection twice, and drops them when done
+void reportColorFormatError(
+    PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const float minDepthMeters,
+    const float maxDepthMeters,
+    const int numThreads = -1);
+
+// Adds (disparity, cost) to the best candidates of a pixel, if it is good enough
+// A disparity within kCostCandidateTolerance of a candidate replaces it only if its cost is lower
+void insertCostCandidate(
+    CostCandidates& disparities,
+    CostCandidates& costs,
+    const float disparity,
+    const float cost);
+
+// Nearest neighbor upsampling of the candidates of the level above, disparities are
+// scale-independent
+cv::Mat_<CostCandidates> upsampleCostCandidates(
+    const cv::Mat_<CostCandidates>& candidates,
+    const cv::Size& size);
+
 void pingPongPropagation(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const int iterations,
@@ -96,10 +126,26 @@ void handleDisparityMismatches(
     const int startLevel,
     const int numThreads = -1);
 
-void precomputeProjections(
+// Temporal warm start: foreground pixels of dst whose color did not change more than
+// colorChangeThresh (in [0, 1]) since their disparity in prevDstDisparities was estimated, at the
+// colors in dstReferenceColors, keep that disparity. They are turned into background, so that
+// brute force, random proposals, propagation and filtering skip them
+// Returns the masks of reused pixels of each dst
+std::vector<cv::Mat_<bool>> seedFromPreviousFrame(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<depth_estimation::PixelType>>& dstReferenceColors,
+    const std::vector<cv::Mat_<float>>& prevDstDisparities,
+    const float colorChangeThresh,
     const int numThreads = -1);
 
+// Keeps dstReferenceColors at the colors each disparity of pyramidLevel was estimated at: pixels
+// that seedFromPreviousFrame() reused keep their reference, so that slow drifts add up until they
+// are estimated again. dstReused is empty when the level was not seeded
+void updateReferenceColors(
+    std::vector<cv::Mat_<depth_estimation::PixelType>>& dstReferenceColors,
+    const PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
+    const std::vector<cv::Mat_<bool>>& dstReused);
+
 void preprocessLevel(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const float minDepthMeters,
@@ -108,10 +154,8 @@ void preprocessLevel(
     const bool useForegroundMasks,
     const int numThreads = -1);
 
-void reprojectColors(
-    PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
-    const int numThreads = -1);
-
+// If the level has cost candidates from the level above, they are proposed instead of random
+// disparities. With useCostCandidates the best proposals are kept for the level below
 void randomProposals(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
     const int numProposals,
@@ -146,7 +190,8 @@ void processLevel(
     const int pingPongIterations,
     const int mismatchesStartLevel,
     const bool doBilateralFilter,
-    const int threads);
+    const int threads,
+    const bool saveOutputs = true);
 
 void saveResults(
     PyramidLevel<depth_estimation::PixelType>& pyramidLevel,
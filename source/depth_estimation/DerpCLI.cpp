@@ -5,7 +5,15 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
 #include <random>
+#include <set>
+#include <sstream>
 
 #include <boost/timer/timer.hpp>
 #include <glog/logging.h>
@@ -14,7 +22,9 @@
 #include <folly/String.h>
 
 #include "source/depth_estimation/Derp.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
 #include "source/depth_estimation/UpsampleDisparityLib.h"
+#include "source/util/Profiler.h"
 
 using namespace fb360_dep;
 using namespace fb360_dep::cv_util;
@@ -26,6 +36,41 @@ const std::string kUsageMessage = R"(
  the appropriate pyramid level widths before execution. See scripts/render/config.py to see
  the assumed widths.
 
+ - By default all frames are processed at a level before moving to the next level, and every level
+ is saved. With --stream_frames each frame goes through all the levels in memory, the next frames
+ are loaded in the background, and only --save_levels are saved.
+
+ - Reprojections of each src into each dst are computed when first needed, and skipped for pairs
+ that do not overlap. Use --projection_budget_mb and --projection_storage=half to bound their
+ memory on large rigs.
+
+ - --proj_color_format=half or unorm8 stores projected colors in half precision or 8 bits, which
+ saves memory and bandwidth in the cost function. The default is set at build time with
+ DEP_PROJ_COLOR_FORMAT. --validate_color_format logs how far the brute force disparities of each
+ level move compared to unorm16, at the cost of computing every projection twice.
+
+ - With --cost_candidates the best disparities of each pixel at a level are proposed at the next
+ level instead of random disparities. Needs --stream_frames, as they are only kept in memory.
+
+ - --bilateral_engine=lut gives the same bilateral filter as brute_force at a fraction of the
+ cost. --bilateral_engine=grid approximates it on a bilateral grid, which only pays off at large
+ radii.
+
+ - With --temporal_warm_start each frame starts from the previous one at every level: only pixels
+ whose color changed by more than --temporal_color_thresh since their disparity was last estimated
+ are estimated again. Every --temporal_keyframe_interval frames, all pixels are.
+
+ - With --job_queue DerpCLI runs as a long-lived worker. It reads jobs from a file, one per line
+ as "first last level_start level_end" (-1 levels as in --level_start and --level_end), and takes
+ each one through its levels as --stream_frames does. The rig, FOV masks and, unless
+ --projection_budget_mb is set, the projection warps of each level are kept from job to job, and
+ the throughput of each job is logged. The queue can be a named pipe (mkfifo) that an orchestrator
+ keeps writing jobs to: the worker stops when it is closed.
+
+ - With --profile a Chrome trace of every frame and level is written to
+ output_root/profile/level_<level>/<frame>.json, with the time spent in each stage, counters such
+ as cost evaluations, and resident memory. Open it in chrome://tracing or ui.perfetto.dev.
+
  - Example:
    ./DerpCLI \
    --input_root=/path/to/ \
@@ -37,13 +82,19 @@ const std::string kUsageMessage = R"(
 
 DEFINE_string(background_disp, "", "path to background disparities");
 DEFINE_string(background_frame, "000000", "background frame (lexical)");
+DEFINE_string(bilateral_engine, "brute_force", "bilateral filter engine (brute_force, lut, grid)");
 DEFINE_string(cameras, "", "comma-separated destinations to render (empty for all)");
 DEFINE_string(color, "", "path to input color images");
+DEFINE_bool(color_pruning, false, "only propagate from neighbors of similar color");
+DEFINE_bool(cost_candidates, false, "propose the best disparities of the level above");
+DEFINE_string(cost_engine, "scalar", "cost evaluation engine (scalar, batch)");
+DEFINE_string(disparity_sampling, "uniform", "brute force disparities (uniform, adaptive)");
 DEFINE_bool(do_bilateral_filter, true, "apply bilateral filter at each level");
 DEFINE_bool(do_median_filter, true, "apply median filter to disparity at each level");
 DEFINE_string(first, "000000", "first frame to process (lexical)");
 DEFINE_string(foreground_masks, "", "path to foreground masks");
 DEFINE_string(input_root, "", "path to input data (required)");
+DEFINE_string(job_queue, "", "file of jobs to run as a long-lived worker (see usage)");
 DEFINE_string(last, "000000", "last frame to process (lexical)");
 DEFINE_int32(level_end, -1, "level to end at (-1 = finest)");
 DEFINE_int32(level_start, -1, "level to start at (-1 = coarsest)");
@@ -55,12 +106,23 @@ DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm
 DEFINE_string(output_root, "", "path to output directory (required)");
 DEFINE_bool(partial_coverage, false, "set to true if no 360 coverage");
 DEFINE_int32(ping_pong_iterations, 1, "number of spatial propagation iterations");
+DEFINE_int32(prefetch_frames, 1, "frames to load ahead of the current one with --stream_frames");
+DEFINE_bool(profile, false, "save a Chrome trace of each frame and level to output_root/profile");
+DEFINE_string(proj_color_format, "", "storage of projected colors (unorm16, half, unorm8)");
+DEFINE_int32(projection_budget_mb, 0, "memory budget for src to dst projections (0 = unlimited)");
+DEFINE_string(projection_storage, "full", "storage of src to dst projection warps (full, half)");
 DEFINE_int32(random_proposals, 2, "number of proposed random disparities before propagation");
 DEFINE_int32(resolution, 2048, "Output resolution (width in pixels)");
 DEFINE_string(rig, "", "path to camera rig .json");
 DEFINE_bool(save_debug_images, false, "if true, save debugging output images");
+DEFINE_string(save_levels, "", "comma-separated levels to save with --stream_frames (empty = end)");
+DEFINE_bool(stream_frames, false, "run each frame through all levels in memory, frame by frame");
+DEFINE_double(temporal_color_thresh, 0.02, "color change in [0, 1] to redo a pixel");
+DEFINE_int32(temporal_keyframe_interval, 30, "frames between full passes (0 = first frame only)");
+DEFINE_bool(temporal_warm_start, false, "start from previous frame where color is static");
 DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_bool(use_foreground_masks, false, "use pre-computed foreground masks");
+DEFINE_bool(validate_color_format, false, "log disparity error of --proj_color_format");
 DEFINE_double(var_high_thresh, 1e-3, "ignore variances higher than this threshold");
 DEFINE_double(var_noise_floor, 4e-5, "noise variance floor on original, full-size images");
 
@@ -87,7 +149,23 @@ void verifyInputs() {
   }
 
   // Check flag values
+  parseBilateralEngine(FLAGS_bilateral_engine);
+  CHECK(FLAGS_cost_engine == "scalar" || FLAGS_cost_engine == "batch")
+      << "Invalid cost engine: " << FLAGS_cost_engine;
+  CHECK(FLAGS_disparity_sampling == "uniform" || FLAGS_disparity_sampling == "adaptive")
+      << "Invalid disparity sampling: " << FLAGS_disparity_sampling;
+  CHECK(!FLAGS_cost_candidates || FLAGS_stream_frames || !FLAGS_job_queue.empty())
+      << "--cost_candidates needs --stream_frames";
+  CHECK_GE(FLAGS_projection_budget_mb, 0);
+  CHECK(FLAGS_projection_storage == "full" || FLAGS_projection_storage == "half")
+      << "Invalid projection storage: " << FLAGS_projection_storage;
+  if (!FLAGS_proj_color_format.empty()) {
+    parseColorFormat(FLAGS_proj_color_format);
+  }
   CHECK_GE(FLAGS_random_proposals, 0);
+  CHECK_GE(FLAGS_prefetch_frames, 0);
+  CHECK_GE(FLAGS_temporal_color_thresh, 0);
+  CHECK_GE(FLAGS_temporal_keyframe_interval, 0);
   CHECK_LE(FLAGS_first, FLAGS_last);
 
   const bool hasColorImages = filesystem::is_directory(FLAGS_color);
@@ -119,6 +197,10 @@ filesystem::path getLevelDisparityDir(const int level) {
   return getImageDir(FLAGS_output_root, ImageType::disparity_levels, level);
 }
 
+filesystem::path getLevelProfileDir(const int level) {
+  return folly::sformat("{}/profile/level_{}", FLAGS_output_root, std::to_string(level));
+}
+
 filesystem::path getLevelColorDir(const int level) {
   return folly::sformat("{}/level_{}", FLAGS_color, std::to_string(level));
 }
@@ -135,9 +217,11 @@ filesystem::path getLevelBackgroundDisparityDir(const int level) {
 void verifyInputImagePaths(
     const Camera::Rig& rigSrc,
     const Camera::Rig& rigDst,
-    const int numLevels) {
-  const int levelStart = FLAGS_level_start >= 0 ? FLAGS_level_start : numLevels - 1;
-  verifyImagePaths(getLevelColorDir(levelStart), rigSrc, FLAGS_first, FLAGS_last);
+    const int numLevels,
+    const int levelStart,
+    const std::string& first,
+    const std::string& last) {
+  verifyImagePaths(getLevelColorDir(levelStart), rigSrc, first, last);
   if (FLAGS_use_foreground_masks) {
     // We need just one background disparity, with one background mask per camera and frame
     verifyImagePaths(
@@ -145,11 +229,11 @@ void verifyInputImagePaths(
         rigDst,
         FLAGS_background_frame,
         FLAGS_background_frame);
-    verifyImagePaths(getLevelForegroundMasksDir(levelStart), rigDst, FLAGS_first, FLAGS_last);
+    verifyImagePaths(getLevelForegroundMasksDir(levelStart), rigDst, first, last);
   }
 
   if (levelStart < numLevels - 1) {
-    verifyImagePaths(getLevelDisparityDir(levelStart + 1), rigDst, FLAGS_first, FLAGS_last);
+    verifyImagePaths(getLevelDisparityDir(levelStart + 1), rigDst, first, last);
   }
 }
 
@@ -174,150 +258,502 @@ int getLevelEnd(const std::map<int, cv::Size>& pyramidLevelSizes) {
   return levelEnd;
 }
 
-int main(int argc, char* argv[]) {
-  system_util::initDep(argc, argv, kUsageMessage);
+// Rig and pyramid data shared by all frames and levels
+struct DerpContext {
+  Camera::Rig rigSrc;
+  Camera::Rig rigDst;
+  std::vector<int> dst2srcIdxs;
+  std::map<int, cv::Size> pyramidLevelSizes;
+  int numLevels;
+  int firstFrame;
+  int numFrames;
+  int widthFullSize;
+  int heightFullSize;
+
+  // Frame independent state of each level, see prepareLevelState()
+  bool cacheProjGeometry = false;
+  std::map<int, std::vector<cv::Mat_<bool>>> dstFovMasks;
+  std::map<int, std::shared_ptr<ProjGeometryCache>> projGeometryCaches;
+};
+
+// Creates the FOV masks, and the projection geometry cache if asked for, of a level
+// They are kept in ctx for the rest of the run
+void prepareLevelState(DerpContext& ctx, const int level) {
+  const cv::Size& sizeLevel = ctx.pyramidLevelSizes.at(level);
+  if (!ctx.dstFovMasks.count(level)) {
+    ctx.dstFovMasks[level] = generateFovMasks(ctx.rigDst, sizeLevel, FLAGS_threads);
+  }
+  if (ctx.cacheProjGeometry && !ctx.projGeometryCaches.count(level)) {
+    ctx.projGeometryCaches[level] =
+        std::make_shared<ProjGeometryCache>(sizeLevel, ctx.rigDst.size(), ctx.rigSrc.size());
+  }
+}
 
-  boost::timer::cpu_timer matchTimer;
-  verifyInputs();
+// Everything a frame reads from disk at a given level
+struct LevelInputs {
+  std::vector<cv::Mat_<PixelType>> colors;
+  std::vector<cv::Mat_<bool>> srcForegroundMasks;
+  std::vector<cv::Mat_<float>> dstBackgroundDisparities;
+  std::vector<cv::Mat_<bool>> dstForegroundMasks;
+  std::vector<cv::Mat_<bool>> dstForegroundMasksCoarse;
+};
+
+// Disparities of the previous frame at a level, and the colors each one was estimated at, for
+// --temporal_warm_start
+struct LevelHistory {
+  std::vector<cv::Mat_<PixelType>> dstReferenceColors;
+  std::vector<cv::Mat_<float>> dstDisps;
+};
+
+// Best disparities of each dst at a level, for --cost_candidates
+struct LevelCandidates {
+  std::vector<cv::Mat_<CostCandidates>> dstDisps;
+  std::vector<cv::Mat_<CostCandidates>> dstCosts;
+};
+
+std::string getFrameName(const DerpContext& ctx, const int iFrame) {
+  return image_util::intToStringZeroPad(ctx.firstFrame + iFrame, 6);
+}
 
-  Camera::Rig rigSrc = Camera::loadRig(FLAGS_rig);
-  const int numSrcs = rigSrc.size();
-  CHECK_GT(numSrcs, 0) << "no source cameras!";
+LevelInputs loadLevelInputs(const DerpContext& ctx, const int level, const int iFrame) {
+  const std::string frameName = getFrameName(ctx, iFrame);
+  const cv::Size& sizeLevel = ctx.pyramidLevelSizes.at(level);
+  LevelInputs inputs;
 
-  Camera::Rig rigDst = filterDestinations(rigSrc, FLAGS_cameras);
-  const int numDsts = rigDst.size();
-  CHECK_GT(numDsts, 0) << "no destination cameras!";
-  const std::vector<int> dst2srcIdxs = mapSrcToDstIndexes(rigSrc, rigDst);
+  // Color
+  inputs.colors =
+      loadLevelImages<PixelType>(FLAGS_color, level, ctx.rigSrc, frameName, FLAGS_threads);
 
-  // Get pyramid level sizes from both the disparity and color directories
-  std::map<int, cv::Size> pyramidLevelSizes;
-  getPyramidLevelSizes(pyramidLevelSizes, FLAGS_color);
-  getPyramidLevelSizes(
-      pyramidLevelSizes, getImageDir(FLAGS_output_root, ImageType::disparity_levels));
-  const int numLevels =
-      FLAGS_num_levels == -1 ? pyramidLevelSizes.rbegin()->first + 1 : FLAGS_num_levels;
+  // Foreground masks
+  inputs.srcForegroundMasks = FLAGS_use_foreground_masks
+      ? loadLevelImages<bool>(FLAGS_foreground_masks, level, ctx.rigSrc, frameName, FLAGS_threads)
+      : cv_util::generateAllPassMasks(sizeLevel, ctx.rigSrc.size());
 
-  // Get largest level smaller or equal to the requested resolution
-  const int levelStart = FLAGS_level_start >= 0 ? FLAGS_level_start : numLevels - 1;
-  const int levelEnd = getLevelEnd(pyramidLevelSizes);
+  // Background disparities
+  inputs.dstBackgroundDisparities.resize(ctx.rigDst.size());
+  if (FLAGS_use_foreground_masks) {
+    inputs.dstBackgroundDisparities = loadLevelImages<float>(
+        FLAGS_background_disp, level, ctx.rigDst, FLAGS_background_frame, FLAGS_threads);
+  }
 
-  CHECK_LE(FLAGS_level_start, numLevels);
-  const int numFrames = std::stoi(FLAGS_last) - std::stoi(FLAGS_first) + 1;
-  verifyInputImagePaths(rigSrc, rigDst, numLevels);
-  filesystem::create_directories(FLAGS_output_root);
+  // Allocate masks but only populate them if needed
+  inputs.dstForegroundMasks.resize(ctx.rigDst.size());
+  inputs.dstForegroundMasksCoarse.resize(ctx.rigDst.size());
+  if (level < ctx.numLevels - 1 && FLAGS_use_foreground_masks) {
+    inputs.dstForegroundMasks = loadLevelImages<bool>(
+        FLAGS_foreground_masks, level, ctx.rigDst, frameName, FLAGS_threads);
+    inputs.dstForegroundMasksCoarse = loadLevelImages<bool>(
+        FLAGS_foreground_masks, level + 1, ctx.rigDst, frameName, FLAGS_threads);
+  }
+  return inputs;
+}
 
-  // These must be computed before normalizing to determine the correct resolutions
-  const Camera& camRef = rigDst[0];
-  const int widthFullSize = camRef.resolution.x();
-  const int heightFullSize = camRef.resolution.y();
+// Runs a frame through a level, starting from the disparities of the level above (ignored at the
+// coarsest level), and returns the disparities of this level
+// history holds the previous frame at this level, and is updated with this one
+// candidates holds the cost candidates of the level above (if any), and is replaced with these
+std::vector<cv::Mat_<float>> processFrameLevel(
+    const DerpContext& ctx,
+    const int level,
+    const int iFrame,
+    const LevelInputs& inputs,
+    const std::vector<cv::Mat_<bool>>& dstFovMasks,
+    const std::vector<cv::Mat_<float>>& dstDispsCoarse,
+    const bool saveOutputs,
+    LevelHistory& history,
+    LevelCandidates& candidates) {
+  PyramidLevel<PixelType> framePyramidLevel(
+      iFrame,
+      getFrameName(ctx, iFrame),
+      ctx.numFrames,
+      level,
+      ctx.numLevels,
+      ctx.pyramidLevelSizes,
+      ctx.rigSrc,
+      ctx.rigDst,
+      ctx.dst2srcIdxs,
+      inputs.colors,
+      inputs.srcForegroundMasks,
+      dstFovMasks,
+      inputs.dstBackgroundDisparities,
+      ctx.widthFullSize,
+      ctx.heightFullSize,
+      FLAGS_color,
+      FLAGS_var_noise_floor,
+      FLAGS_var_high_thresh,
+      FLAGS_use_foreground_masks,
+      FLAGS_output_root,
+      FLAGS_threads);
+  framePyramidLevel.costEngine =
+      FLAGS_cost_engine == "batch" ? CostEngine::batch : CostEngine::scalar;
+  framePyramidLevel.disparitySampling = FLAGS_disparity_sampling == "adaptive"
+      ? DisparitySampling::adaptive
+      : DisparitySampling::uniform;
+  framePyramidLevel.bilateralEngine = parseBilateralEngine(FLAGS_bilateral_engine);
+  framePyramidLevel.useCostCandidates = FLAGS_cost_candidates;
+  framePyramidLevel.useColorPruning = FLAGS_color_pruning;
+
+  // Reprojections are generated on first use
+  framePyramidLevel.projectionStorage =
+      FLAGS_projection_storage == "half" ? ProjectionStorage::half : ProjectionStorage::full;
+  framePyramidLevel.projectionBudgetBytes = size_t(FLAGS_projection_budget_mb) << 20;
+  const auto projGeometryCache = ctx.projGeometryCaches.find(level);
+  if (projGeometryCache != ctx.projGeometryCaches.end()) {
+    framePyramidLevel.projGeometryCache = projGeometryCache->second;
+  }
+  if (!FLAGS_proj_color_format.empty()) {
+    framePyramidLevel.projColorFormat = parseColorFormat(FLAGS_proj_color_format);
+  }
 
-  // Normalize cameras (needed to generate FOV masks and to process frames)
-  Camera::normalizeRig(rigSrc);
-  Camera::normalizeRig(rigDst);
+  const int numDsts = ctx.rigDst.size();
+  if (level < ctx.numLevels - 1) {
+    const std::vector<cv::Mat_<float>> dstDispsNextLevel = upsampleDisparities(
+        ctx.rigDst,
+        dstDispsCoarse,
+        inputs.dstBackgroundDisparities,
+        inputs.dstForegroundMasksCoarse,
+        inputs.dstForegroundMasks,
+        ctx.pyramidLevelSizes.at(level),
+        FLAGS_use_foreground_masks,
+        FLAGS_threads);
+
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      framePyramidLevel.dsts[dstIdx].disparity = dstDispsNextLevel[dstIdx];
+    }
+
+    if (FLAGS_cost_candidates && !candidates.dstDisps.empty()) {
+      const cv::Size& sizeLevel = ctx.pyramidLevelSizes.at(level);
+      for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+        if (candidates.dstDisps[dstIdx].empty()) {
+          continue;
+        }
+        framePyramidLevel.dstCandidateDisparity(dstIdx) =
+            upsampleCostCandidates(candidates.dstDisps[dstIdx], sizeLevel);
+        framePyramidLevel.dstCandidateCost(dstIdx) =
+            upsampleCostCandidates(candidates.dstCosts[dstIdx], sizeLevel);
+      }
+    }
+  }
+
+  // Keyframes are processed from scratch
+  const bool isKeyframe =
+      FLAGS_temporal_keyframe_interval > 0 && iFrame % FLAGS_temporal_keyframe_interval == 0;
+  std::vector<cv::Mat_<bool>> dstReused;
+  if (FLAGS_temporal_warm_start && !history.dstDisps.empty() && !isKeyframe) {
+    dstReused = seedFromPreviousFrame(
+        framePyramidLevel,
+        history.dstReferenceColors,
+        history.dstDisps,
+        FLAGS_temporal_color_thresh,
+        FLAGS_threads);
+  }
+
+  if (FLAGS_validate_color_format) {
+    reportColorFormatError(framePyramidLevel, FLAGS_min_depth_m, FLAGS_max_depth_m, FLAGS_threads);
+  }
 
+  processLevel(
+      framePyramidLevel,
+      FLAGS_output_formats,
+      FLAGS_use_foreground_masks,
+      FLAGS_output_root,
+      FLAGS_random_proposals,
+      FLAGS_partial_coverage,
+      FLAGS_min_depth_m,
+      FLAGS_max_depth_m,
+      FLAGS_do_median_filter,
+      FLAGS_save_debug_images,
+      FLAGS_ping_pong_iterations,
+      FLAGS_mismatches_start_level,
+      FLAGS_do_bilateral_filter,
+      FLAGS_threads,
+      saveOutputs);
+
+  if (FLAGS_profile) {
+    const filesystem::path profileFile =
+        getLevelProfileDir(level) / (getFrameName(ctx, iFrame) + ".json");
+    profiler::Profiler::instance().writeChromeTrace(profileFile);
+    profiler::Profiler::instance().reset();
+  }
+
+  std::vector<cv::Mat_<float>> dstDisps(numDsts);
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    dstDisps[dstIdx] = framePyramidLevel.dstDisparity(dstIdx);
+  }
+
+  if (FLAGS_temporal_warm_start) {
+    updateReferenceColors(history.dstReferenceColors, framePyramidLevel, dstReused);
+    history.dstDisps = dstDisps;
+  }
+
+  if (FLAGS_cost_candidates) {
+    candidates.dstDisps.resize(numDsts);
+    candidates.dstCosts.resize(numDsts);
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      candidates.dstDisps[dstIdx] = framePyramidLevel.dstCandidateDisparity(dstIdx);
+      candidates.dstCosts[dstIdx] = framePyramidLevel.dstCandidateCost(dstIdx);
+    }
+  }
+  return dstDisps;
+}
+
+// Processes all frames at a level before moving to the next one
+// Every level is saved, and the next level reads it back from disk
+void processLevelMajor(const DerpContext& ctx, const int levelStart, const int levelEnd) {
+  boost::timer::cpu_timer matchTimer;
   for (int level = levelStart; level >= levelEnd; --level) {
     // Create level output directories
-    createLevelOutputDirs(FLAGS_output_root, level, rigDst, FLAGS_save_debug_images);
+    createLevelOutputDirs(FLAGS_output_root, level, ctx.rigDst, FLAGS_save_debug_images);
 
     // Create dst FOV masks for current level size
-    const cv::Size& sizeLevel = pyramidLevelSizes.at(level);
+    const cv::Size& sizeLevel = ctx.pyramidLevelSizes.at(level);
     const std::vector<cv::Mat_<bool>> dstFovMasks =
-        generateFovMasks(rigDst, sizeLevel, FLAGS_threads);
+        generateFovMasks(ctx.rigDst, sizeLevel, FLAGS_threads);
 
-    for (int iFrame = 0; iFrame < numFrames; ++iFrame) {
+    LevelHistory history;
+    for (int iFrame = 0; iFrame < ctx.numFrames; ++iFrame) {
       // Load current level data
-      const std::string frameName =
-          image_util::intToStringZeroPad(iFrame + std::stoi(FLAGS_first), 6);
-
-      // Color
-      std::vector<cv::Mat_<PixelType>> colorImagesLevel =
-          loadLevelImages<PixelType>(FLAGS_color, level, rigSrc, frameName, FLAGS_threads);
-
-      // Foreground masks
-      std::vector<cv::Mat_<bool>> srcForegroundMasksLevel = FLAGS_use_foreground_masks
-          ? loadLevelImages<bool>(FLAGS_foreground_masks, level, rigSrc, frameName, FLAGS_threads)
-          : cv_util::generateAllPassMasks(sizeLevel, numSrcs);
-
-      // Background disparities
-      std::vector<cv::Mat_<float>> dstBackgroundDisparitiesLevel(rigDst.size());
-      if (FLAGS_use_foreground_masks) {
-        dstBackgroundDisparitiesLevel = loadLevelImages<float>(
-            FLAGS_background_disp, level, rigDst, FLAGS_background_frame, FLAGS_threads);
+      const LevelInputs inputs = loadLevelInputs(ctx, level, iFrame);
+      std::vector<cv::Mat_<float>> dstDispsCoarse;
+      if (level < ctx.numLevels - 1) {
+        dstDispsCoarse = loadImages<float>(
+            getLevelDisparityDir(level + 1),
+            ctx.rigDst,
+            getFrameName(ctx, iFrame),
+            FLAGS_threads);
       }
-
-      PyramidLevel<PixelType> framePyramidLevel(
-          iFrame,
-          frameName,
-          numFrames,
+      const bool saveOutputs = true;
+      LevelCandidates candidates; // only kept in memory with --stream_frames
+      processFrameLevel(
+          ctx,
           level,
-          numLevels,
-          pyramidLevelSizes,
-          rigSrc,
-          rigDst,
-          dst2srcIdxs,
-          colorImagesLevel,
-          srcForegroundMasksLevel,
+          iFrame,
+          inputs,
           dstFovMasks,
-          dstBackgroundDisparitiesLevel,
-          widthFullSize,
-          heightFullSize,
-          FLAGS_color,
-          FLAGS_var_noise_floor,
-          FLAGS_var_high_thresh,
-          FLAGS_use_foreground_masks,
-          FLAGS_output_root,
-          FLAGS_threads);
+          dstDispsCoarse,
+          saveOutputs,
+          history,
+          candidates);
+    }
 
-      // Generate/link reprojections
-      precomputeProjections(framePyramidLevel, FLAGS_threads);
-
-      if (level < numLevels - 1) {
-        // Allocate masks but only populate them if needed
-        std::vector<cv::Mat_<bool>> dstForegroundMasksLevel(numDsts);
-        std::vector<cv::Mat_<bool>> dstForegroundMasksCoarse(numDsts);
-        if (FLAGS_use_foreground_masks) {
-          dstForegroundMasksLevel = loadLevelImages<bool>(
-              FLAGS_foreground_masks, level, rigDst, frameName, FLAGS_threads);
-          dstForegroundMasksCoarse = loadLevelImages<bool>(
-              FLAGS_foreground_masks, level + 1, rigDst, frameName, FLAGS_threads);
-        }
+    LOG(INFO) << folly::sformat("-- Elapsed time: {}", matchTimer.format());
+  }
+}
 
-        const std::vector<cv::Mat_<float>> dstDispsCoarse =
-            loadImages<float>(getLevelDisparityDir(level + 1), rigDst, frameName, FLAGS_threads);
-
-        const std::vector<cv::Mat_<float>> dstDispsNextLevel = upsampleDisparities(
-            rigDst,
-            dstDispsCoarse,
-            dstBackgroundDisparitiesLevel,
-            dstForegroundMasksCoarse,
-            dstForegroundMasksLevel,
-            sizeLevel,
-            FLAGS_use_foreground_masks,
-            FLAGS_threads);
+std::set<int> getSaveLevels(const int levelEnd) {
+  std::set<int> saveLevels;
+  std::vector<std::string> levels;
+  folly::split(",", FLAGS_save_levels, levels);
+  for (const std::string& level : levels) {
+    if (!level.empty()) {
+      saveLevels.insert(std::stoi(level));
+    }
+  }
+  if (saveLevels.empty()) {
+    saveLevels.insert(levelEnd);
+  }
+  return saveLevels;
+}
 
-        for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
-          framePyramidLevel.dsts[dstIdx].disparity = dstDispsNextLevel[dstIdx];
-        }
-      }
+// Takes each frame through the whole pyramid before moving to the next one
+// Disparities are handed from level to level in memory, only the requested levels are saved, and
+// the inputs of the next frames are loaded while the current one is processed
+void processFramePipelined(DerpContext& ctx, const int levelStart, const int levelEnd) {
+  // FOV masks do not change from frame to frame
+  for (int level = levelStart; level >= levelEnd; --level) {
+    prepareLevelState(ctx, level);
+  }
 
-      processLevel(
-          framePyramidLevel,
-          FLAGS_output_formats,
-          FLAGS_use_foreground_masks,
-          FLAGS_output_root,
-          FLAGS_random_proposals,
-          FLAGS_partial_coverage,
-          FLAGS_min_depth_m,
-          FLAGS_max_depth_m,
-          FLAGS_do_median_filter,
-          FLAGS_save_debug_images,
-          FLAGS_ping_pong_iterations,
-          FLAGS_mismatches_start_level,
-          FLAGS_do_bilateral_filter,
+  const std::set<int> saveLevels = getSaveLevels(levelEnd);
+  for (const int level : saveLevels) {
+    createLevelOutputDirs(FLAGS_output_root, level, ctx.rigDst, FLAGS_save_debug_images);
+  }
+
+  struct FrameInputs {
+    std::map<int, LevelInputs> levels;
+    std::vector<cv::Mat_<float>> dstDispsStart; // level above levelStart, if any
+  };
+  auto loadFrameInputs = [&](const int iFrame) {
+    FrameInputs inputs;
+    for (int level = levelStart; level >= levelEnd; --level) {
+      inputs.levels[level] = loadLevelInputs(ctx, level, iFrame);
+    }
+    if (levelStart < ctx.numLevels - 1) {
+      inputs.dstDispsStart = loadImages<float>(
+          getLevelDisparityDir(levelStart + 1),
+          ctx.rigDst,
+          getFrameName(ctx, iFrame),
           FLAGS_threads);
     }
+    return inputs;
+  };
+
+  std::map<int, LevelHistory> histories;
+
+  // At most prefetch_frames frames are loaded ahead of the one being processed
+  ThreadPool loader;
+  std::deque<std::future<FrameInputs>> prefetched;
+  int iFrameNext = 0;
+  for (int iFrame = 0; iFrame < ctx.numFrames; ++iFrame) {
+    boost::timer::cpu_timer frameTimer;
+    while (iFrameNext < ctx.numFrames && ssize(prefetched) <= FLAGS_prefetch_frames) {
+      prefetched.push_back(
+          loader.async([&loadFrameInputs, iFrameNext] { return loadFrameInputs(iFrameNext); }));
+      ++iFrameNext;
+    }
+    FrameInputs inputs = prefetched.front().get();
+    prefetched.pop_front();
+
+    std::vector<cv::Mat_<float>> dstDisps = inputs.dstDispsStart;
+    LevelCandidates candidates;
+    for (int level = levelStart; level >= levelEnd; --level) {
+      const bool saveOutputs = saveLevels.count(level) > 0;
+      dstDisps = processFrameLevel(
+          ctx,
+          level,
+          iFrame,
+          inputs.levels.at(level),
+          ctx.dstFovMasks.at(level),
+          dstDisps,
+          saveOutputs,
+          histories[level],
+          candidates);
+
+      // Release inputs as soon as they are no longer needed
+      inputs.levels.erase(level);
+    }
 
-    LOG(INFO) << folly::sformat("-- Elapsed time: {}", matchTimer.format());
+    LOG(INFO) << folly::sformat(
+        "-- Frame {} elapsed time: {}", getFrameName(ctx, iFrame), frameTimer.format());
+  }
+}
+
+// A --job_queue line: frames [first, last] through levels levelStart down to levelEnd
+struct DerpJob {
+  std::string first;
+  std::string last;
+  int levelStart;
+  int levelEnd;
+};
+
+bool parseJob(const std::string& line, DerpJob& job) {
+  std::istringstream stream(line);
+  std::string extra;
+  if (!(stream >> job.first >> job.last >> job.levelStart >> job.levelEnd) || stream >> extra) {
+    return false;
+  }
+  for (const std::string& frame : {job.first, job.last}) {
+    if (!std::all_of(frame.begin(), frame.end(), [](const char c) { return std::isdigit(c); })) {
+      return false;
+    }
+  }
+  return !job.first.empty() && std::stoi(job.first) <= std::stoi(job.last);
+}
+
+// Runs the jobs of --job_queue as they come, until the queue is closed
+void processJobQueue(DerpContext& ctx) {
+  std::ifstream queue(FLAGS_job_queue);
+  CHECK(queue) << "Cannot open job queue " << FLAGS_job_queue;
+  const int levelEndDefault = getLevelEnd(ctx.pyramidLevelSizes);
+  int numJobs = 0;
+  std::string line;
+  while (std::getline(queue, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    DerpJob job;
+    if (!parseJob(line, job)) {
+      LOG(ERROR) << "Skipping invalid job: " << line;
+      continue;
+    }
+    const int levelStart = job.levelStart >= 0 ? job.levelStart : ctx.numLevels - 1;
+    const int levelEnd = job.levelEnd >= 0 ? job.levelEnd : levelEndDefault;
+    if (levelStart >= ctx.numLevels || levelStart < levelEnd) {
+      LOG(ERROR) << "Skipping job with invalid levels: " << line;
+      continue;
+    }
+
+    boost::timer::cpu_timer jobTimer;
+    ctx.firstFrame = std::stoi(job.first);
+    ctx.numFrames = std::stoi(job.last) - ctx.firstFrame + 1;
+    verifyInputImagePaths(ctx.rigSrc, ctx.rigDst, ctx.numLevels, levelStart, job.first, job.last);
+    processFramePipelined(ctx, levelStart, levelEnd);
+
+    // Throughput in frames and dst pixels, over all levels
+    const double seconds = jobTimer.elapsed().wall * 1e-9;
+    double numPixels = 0;
+    for (int level = levelStart; level >= levelEnd; --level) {
+      numPixels += double(ctx.pyramidLevelSizes.at(level).area()) * ctx.rigDst.size();
+    }
+    numPixels *= ctx.numFrames;
+    LOG(INFO) << folly::sformat(
+        "-- Job {} (frames {}-{}, levels {}-{}): {:.2f} s, {:.3f} frames/s, {:.2f} Mpixels/s",
+        ++numJobs,
+        job.first,
+        job.last,
+        levelStart,
+        levelEnd,
+        seconds,
+        ctx.numFrames / seconds,
+        numPixels / seconds / 1e6);
+  }
+  LOG(INFO) << folly::sformat("-- Job queue closed after {} jobs", numJobs);
+}
+
+int main(int argc, char* argv[]) {
+  system_util::initDep(argc, argv, kUsageMessage);
+
+  boost::timer::cpu_timer matchTimer;
+  verifyInputs();
+  profiler::Profiler::instance().setEnabled(FLAGS_profile);
+
+  DerpContext ctx;
+  ctx.rigSrc = Camera::loadRig(FLAGS_rig);
+  const int numSrcs = ctx.rigSrc.size();
+  CHECK_GT(numSrcs, 0) << "no source cameras!";
+
+  ctx.rigDst = filterDestinations(ctx.rigSrc, FLAGS_cameras);
+  const int numDsts = ctx.rigDst.size();
+  CHECK_GT(numDsts, 0) << "no destination cameras!";
+  ctx.dst2srcIdxs = mapSrcToDstIndexes(ctx.rigSrc, ctx.rigDst);
+
+  // Get pyramid level sizes from both the disparity and color directories
+  getPyramidLevelSizes(ctx.pyramidLevelSizes, FLAGS_color);
+  getPyramidLevelSizes(
+      ctx.pyramidLevelSizes, getImageDir(FLAGS_output_root, ImageType::disparity_levels));
+  ctx.numLevels =
+      FLAGS_num_levels == -1 ? ctx.pyramidLevelSizes.rbegin()->first + 1 : FLAGS_num_levels;
+
+  // Get largest level smaller or equal to the requested resolution
+  const int levelStart = FLAGS_level_start >= 0 ? FLAGS_level_start : ctx.numLevels - 1;
+  const int levelEnd = getLevelEnd(ctx.pyramidLevelSizes);
+
+  CHECK_LE(FLAGS_level_start, ctx.numLevels);
+  ctx.firstFrame = std::stoi(FLAGS_first);
+  ctx.numFrames = std::stoi(FLAGS_last) - ctx.firstFrame + 1;
+  if (FLAGS_job_queue.empty()) {
+    verifyInputImagePaths(
+        ctx.rigSrc, ctx.rigDst, ctx.numLevels, levelStart, FLAGS_first, FLAGS_last);
+  }
+  filesystem::create_directories(FLAGS_output_root);
+
+  // These must be computed before normalizing to determine the correct resolutions
+  const Camera& camRef = ctx.rigDst[0];
+  ctx.widthFullSize = camRef.resolution.x();
+  ctx.heightFullSize = camRef.resolution.y();
+
+  // Normalize cameras (needed to generate FOV masks and to process frames)
+  Camera::normalizeRig(ctx.rigSrc);
+  Camera::normalizeRig(ctx.rigDst);
+
+  if (!FLAGS_job_queue.empty()) {
+    // Projection warps of every level stay in memory, which a projection budget rules out
+    ctx.cacheProjGeometry = FLAGS_projection_budget_mb == 0;
+    processJobQueue(ctx);
+  } else if (FLAGS_stream_frames) {
+    processFramePipelined(ctx, levelStart, levelEnd);
+  } else {
+    processLevelMajor(ctx, levelStart, levelEnd);
   }
 
   LOG(INFO) << folly::sformat("-- TOTAL: {}", matchTimer.format());
@@ -7,30 +7,11 @@
 
 #include "source/depth_estimation/DerpUtil.h"
 
-#include <queue>
 #include <vector>
 
 namespace fb360_dep {
 namespace depth_estimation {
 
-class PointDistance {
- public:
-  std::array<int, 2> m_point;
-  double m_distance;
-  PointDistance(std::array<int, 2> point, double distance) {
-    m_point = point;
-    m_distance = distance;
-  }
-};
-
-bool operator>(const PointDistance& ptDist1, const PointDistance& ptDist2) {
-  return ptDist1.m_distance > ptDist2.m_distance;
-}
-
-bool operator<(const PointDistance& ptDist1, const PointDistance& ptDist2) {
-  return ptDist1.m_distance < ptDist2.m_distance;
-}
-
 // Get the world point associated with (x, y, disparity) in the disparity map,
 // at the given level, using normalized camera objects.
 Camera::Vector3 dstToWorldPoint(
@@ -70,6 +51,52 @@ bool worldToSrcPoint(
   return true;
 }
 
+cv::Mat_<cv::Vec3f> computeDstRays(const Camera& camDst, const int dstW, const int dstH) {
+  cv::Mat_<cv::Vec3f> rays(dstH, dstW);
+  for (int y = 0; y < dstH; ++y) {
+    for (int x = 0; x < dstW; ++x) {
+      Camera::Vector2 p((x + 0.5) / dstW, (y + 0.5) / dstH);
+      if (!camDst.isNormalized()) {
+        p = p.cwiseProduct(camDst.resolution);
+      }
+      const Camera::Vector3 dir = camDst.rig(p).direction();
+      rays(y, x) = cv::Vec3f(dir.x(), dir.y(), dir.z());
+    }
+  }
+  return rays;
+}
+
+SrcProjector makeSrcProjector(
+    const Camera& camSrc,
+    const Camera& camDst,
+    const int srcW,
+    const int srcH) {
+  SrcProjector proj;
+  proj.type = ProjectorType(int(camSrc.type));
+  const Camera::Vector3 translation = camSrc.rotation * (camDst.position - camSrc.position);
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      proj.rotation[3 * row + col] = camSrc.rotation(row, col);
+    }
+    proj.translation[row] = translation[row];
+  }
+
+  // De-normalize to current src level, same as worldToSrcPoint()
+  const Camera::Vector2 scale =
+      camSrc.isNormalized() ? Camera::Vector2(srcW, srcH) : Camera::Vector2(1, 1);
+  for (int i = 0; i < 2; ++i) {
+    proj.focal[i] = camSrc.focal[i] * scale[i];
+    proj.principal[i] = camSrc.principal[i] * scale[i];
+    proj.resolution[i] = camSrc.resolution[i] * scale[i];
+  }
+  for (int i = 0; i < 3; ++i) {
+    proj.distortion[i] = camSrc.getDistortion()[i];
+  }
+  proj.distortionMax = camSrc.getDistortionMax();
+  proj.cosFov = camSrc.cosFov;
+  return proj;
+}
+
 std::vector<int> mapSrcToDstIndexes(const Camera::Rig& rigSrc, const Camera::Rig& rigDst) {
   std::vector<int> dst2srcIdxs(rigDst.size());
   for (int dstIdx = 0; dstIdx < int(rigDst.size()); ++dstIdx) {
@@ -85,39 +112,68 @@ std::vector<int> mapSrcToDstIndexes(const Camera::Rig& rigSrc, const Camera::Rig
   return dst2srcIdxs;
 }
 
-std::vector<std::array<int, 2>> prunePingPongCandidates(
-    const std::vector<std::array<int, 2>>& pingPongCandidateOffsets,
+PingPongCandidates makePingPongCandidates(const cv::Size& size) {
+  PingPongCandidates candidates;
+  candidates.numCandidates = candidateTemplateOriginal.size();
+  CHECK_LE(candidates.numCandidates, PingPongCandidates::kMaxCandidates);
+  candidates.reach = 0;
+  for (int i = 0; i < candidates.numCandidates; ++i) {
+    const std::array<int, 2>& offset = candidateTemplateOriginal[i];
+    candidates.offsets[i] = offset;
+    candidates.linearOffsets[i] = offset[1] * size.width + offset[0];
+    candidates.reach =
+        std::max(candidates.reach, std::max(std::abs(offset[0]), std::abs(offset[1])));
+  }
+  return candidates;
+}
+
+int prunePingPongCandidates(
+    const PingPongCandidates& candidates,
     const cv::Mat_<cv::Vec3b>& labImage,
-    const std::array<int, 2>& startPoint,
-    const size_t numNeighbors) {
-  std::priority_queue<PointDistance> closestPointDistances;
-  std::vector<std::array<int, 2>> closestPointOffsets(numNeighbors);
-  const cv::Vec3b basePixel = labImage(startPoint[1], startPoint[0]);
-  for (const auto& pingPongCandidateOffset : pingPongCandidateOffsets) {
-    const std::array<int, 2>& curPoint = {
-        {startPoint[0] + pingPongCandidateOffset[0], startPoint[1] + pingPongCandidateOffset[1]}};
-    if (curPoint[0] < 0 || curPoint[0] > labImage.cols - 1 || curPoint[1] < 0 ||
-        curPoint[1] > labImage.rows - 1) {
-      continue;
+    const int x,
+    const int y,
+    const int numNeighbors,
+    std::array<int, PingPongCandidates::kMaxCandidates>& indices) {
+  // Squared distances in Lab, which fit in an int
+  const int reach = candidates.reach;
+  const bool isInterior =
+      x >= reach && y >= reach && x < labImage.cols - reach && y < labImage.rows - reach;
+  const cv::Vec3b* center = &labImage(y, x);
+  std::array<int, PingPongCandidates::kMaxCandidates> distances;
+  for (int i = 0; i < candidates.numCandidates; ++i) {
+    const cv::Vec3b& pixel = isInterior
+        ? center[candidates.linearOffsets[i]]
+        : labImage(
+              math_util::clamp(y + candidates.offsets[i][1], 0, labImage.rows - 1),
+              math_util::clamp(x + candidates.offsets[i][0], 0, labImage.cols - 1));
+    int distance = 0;
+    for (int c = 0; c < 3; ++c) {
+      const int diff = int(pixel[c]) - int((*center)[c]);
+      distance += diff * diff;
     }
+    distances[i] = distance;
+  }
 
-    const cv::Vec3b& curPixel = labImage(curPoint[1], curPoint[0]);
-    const PointDistance curPointDistance =
-        PointDistance(pingPongCandidateOffset, cv::norm(basePixel, curPixel, cv::NORM_L2));
-    if (closestPointDistances.size() < numNeighbors) {
-      closestPointDistances.push(curPointDistance);
-    } else if (curPointDistance < closestPointDistances.top()) {
-      closestPointDistances.pop();
-      closestPointDistances.push(curPointDistance);
+  // A candidate is kept if fewer than numNeighbors candidates rank before it
+  int count = 0;
+  for (int i = 0; i < candidates.numCandidates; ++i) {
+    int rank = 0;
+    for (int j = 0; j < candidates.numCandidates; ++j) {
+      rank += distances[j] < distances[i] || (distances[j] == distances[i] && j < i);
+    }
+    if (rank < numNeighbors) {
+      indices[count++] = i;
     }
   }
+  return count;
+}
 
-  for (size_t i = 0; i < numNeighbors; ++i) {
-    PointDistance closestPointDistance = closestPointDistances.top();
-    closestPointDistances.pop();
-    closestPointOffsets[i] = closestPointDistance.m_point;
-  }
-  return closestPointOffsets;
+cv::Mat_<cv::Vec3b> computeLabImage(const cv::Mat_<PixelType>& color) {
+  cv::Mat_<cv::Vec3b> bgr;
+  color.convertTo(bgr, CV_8U, 255.0f / cv_util::maxPixelValue(color));
+  cv::Mat_<cv::Vec3b> lab;
+  cv::cvtColor(bgr, lab, cv::COLOR_BGR2Lab);
+  return lab;
 }
 
 // Compute biased and ubiased SSD
@@ -207,6 +263,24 @@ cv::Mat_<PixelType> colorBias(const cv::Mat_<PixelType>& color, const int blurRa
   return cv_util::blur(color, blurRadius);
 }
 
+ColorFormat parseColorFormat(const std::string& name) {
+  if (name == "half") {
+    return ColorFormat::half;
+  } else if (name == "unorm8") {
+    return ColorFormat::unorm8;
+  }
+  CHECK_EQ(name, "unorm16") << "Invalid color format: " << name;
+  return ColorFormat::unorm16;
+}
+
+cv::Mat packColors(const cv::Mat_<PixelType>& color, const ColorFormat format) {
+  cv::Mat packed(color.size(), format == ColorFormat::unorm8 ? CV_8UC3 : CV_16UC3);
+  for (int y = 0; y < color.rows; ++y) {
+    encodeColors(color.ptr<uint16_t>(y), color.cols * 3, format, packed.ptr(y));
+  }
+  return packed;
+}
+
 // Computes per-channel variance [0, 1]
 // var = E[(X - mu)^2] = E[X^2] - E[X]^2
 cv::Mat computeRgbVariance(const cv::Mat& image, const int windowRadius) {
@@ -248,8 +322,7 @@ static bool isOutsideImageCircle(
   return cam.isOutsideImageCircle(p);
 }
 
-static bool
-isOutsideImageCircle(const Camera& cam, const int x, const int y, const cv::Size& size) {
+bool isOutsideImageCircle(const Camera& cam, const int x, const int y, const cv::Size& size) {
   Camera::Vector2 ignored;
   return isOutsideImageCircle(cam, x, y, size, ignored);
 }
@@ -9,6 +9,7 @@
 
 #include <vector>
 
+#include "source/depth_estimation/CostKernels.h"
 #include "source/util/Camera.h"
 #include "source/util/CvUtil.h"
 #include "source/util/ImageTypes.h"
@@ -24,6 +25,37 @@ const float kScaleDisparityPlot = 255.0f;
 const float kScaleCostPlot = 255.0f / 100.0f;
 const float kScaleConfidencePlot = 255.0f * 100.0f;
 
+// How computeCost() is evaluated
+//   scalar: one (x, y, disparity) at a time
+//   batch: rows of (x, disparity) pairs at a time, in single precision SIMD (see BatchCost.h)
+enum struct CostEngine { scalar, batch };
+
+// Which of the kNumDepths disparities brute force evaluates at each pixel
+//   uniform: all of them
+//   adaptive: a coarse sweep, then the disparities around the best local minima of each pixel,
+//     fewer on textureless pixels. About a third of the cost evaluations
+enum struct DisparitySampling { uniform, adaptive };
+
+// How PyramidLevel stores the projection warps of each (dst, src) pair
+//   full: 2 floats per src pixel
+//   half: 2 16-bit fixed point values per src pixel, 1/16 pixel precision for 2K dsts
+enum struct ProjectionStorage { full, half };
+
+// Build default of how PyramidLevel stores projected colors and biases (see ColorFormat), e.g.
+// cmake -DDEP_PROJ_COLOR_FORMAT=half
+#ifndef DEP_PROJ_COLOR_FORMAT
+#define DEP_PROJ_COLOR_FORMAT unorm16
+#endif
+const ColorFormat kDefaultProjColorFormat = ColorFormat::DEP_PROJ_COLOR_FORMAT;
+
+// Best disparities of a pixel and their costs, by increasing cost (NAN = unused)
+// They are handed from level to level to replace random proposals, see insertCostCandidate()
+const int kNumCostCandidates = 3;
+using CostCandidates = cv::Vec<float, kNumCostCandidates>;
+
+// Cost function patches are (2 * kSearchWindowRadius + 1)^2
+const int kSearchWindowRadius = 1;
+
 const std::vector<float> kRgbWeights = {0.3333f, 0.3334f, 0.3333f};
 
 // Use variance corresponding to 8 bit rounding error
@@ -58,13 +90,49 @@ bool worldToSrcPoint(
     const int srcW,
     const int srcH);
 
+// Unit rays of dst through the center of each pixel of a dstW x dstH image
+// The point at disparity d of pixel (x, y) is camDst.position + rays(y, x) / d, same as
+// dstToWorldPoint()
+cv::Mat_<cv::Vec3f> computeDstRays(const Camera& camDst, const int dstW, const int dstH);
+
+// Flattens src into a single precision projector for points along the rays of dst, same as
+// worldToSrcPoint() (see projectToSrc())
+// srcW and srcH are the dimensions of the src image at the current level
+SrcProjector makeSrcProjector(
+    const Camera& camSrc,
+    const Camera& camDst,
+    const int srcW,
+    const int srcH);
+
 std::vector<int> mapSrcToDstIndexes(const Camera::Rig& rigSrc, const Camera::Rig& rigDst);
 
-std::vector<std::array<int, 2>> prunePingPongCandidates(
-    const std::vector<std::array<int, 2>>& pingPongCandidateOffsets,
+// Ping pong candidates of a level: the offsets of candidateTemplateOriginal, and the same offsets
+// in elements of a continuous image of the level, so that pixels at least reach away from the
+// borders need no clamping. Computed once per level, nothing is allocated per pixel
+struct PingPongCandidates {
+  static const int kMaxCandidates = 9;
+  int numCandidates;
+  int reach; // max distance of a candidate along x or y
+  std::array<std::array<int, 2>, kMaxCandidates> offsets;
+  std::array<int, kMaxCandidates> linearOffsets;
+};
+
+PingPongCandidates makePingPongCandidates(const cv::Size& size);
+
+// Writes the indices of the numNeighbors candidates of (x, y) closest to it in color to indices,
+// in template order, and returns how many there are. Ties go to the earlier candidate, and
+// candidates outside the image are clamped to its border
+// labImage must be continuous and of the size of candidates, see computeLabImage()
+int prunePingPongCandidates(
+    const PingPongCandidates& candidates,
     const cv::Mat_<cv::Vec3b>& labImage,
-    const std::array<int, 2>& startPoint,
-    const size_t numNeighbors);
+    const int x,
+    const int y,
+    const int numNeighbors,
+    std::array<int, PingPongCandidates::kMaxCandidates>& indices);
+
+// 8-bit Lab version of color, for prunePingPongCandidates()
+cv::Mat_<cv::Vec3b> computeLabImage(const cv::Mat_<PixelType>& color);
 
 std::pair<float, float> computeSSD(
     const cv::Mat_<PixelType>& dstColor,
@@ -94,10 +162,19 @@ cv::Mat_<PixelType> project(
 
 cv::Mat_<PixelType> colorBias(const cv::Mat_<PixelType>& color, const int blurRadius);
 
+// unorm16, half or unorm8
+ColorFormat parseColorFormat(const std::string& name);
+
+// Interleaved copy of color in format, CV_16UC3 for half and CV_8UC3 for unorm8
+cv::Mat packColors(const cv::Mat_<PixelType>& color, const ColorFormat format);
+
 cv::Mat computeRgbVariance(const cv::Mat& image, const int windowRadius);
 
 cv::Mat_<float> computeImageVariance(const cv::Mat& image);
 
+// Whether the center of pixel (x, y) of a size image of cam is outside its image circle
+bool isOutsideImageCircle(const Camera& cam, const int x, const int y, const cv::Size& size);
+
 std::vector<cv::Mat_<bool>>
 generateFovMasks(const Camera::Rig& rig, const cv::Size& size, const int threads);
 
@@ -11,6 +11,7 @@
 
 #include "source/depth_estimation/DerpUtil.h"
 #include "source/util/Camera.h"
+#include "source/util/CvUtil.h"
 #include "source/util/ImageTypes.h"
 #include "source/util/ImageUtil.h"
 
@@ -29,11 +30,15 @@ const std::string kUsageMessage = R"(
      --output=/path/to/output \
      --first=000000 \
      --last=000000
+
+   - With --fill_radius, foreground disparities are first extended over the nans within that many
+   pixels, each nan taking the disparity of the nearest valid foreground pixel.
  )";
 
 DEFINE_string(background_disp, "", "path to background disparity directory (required)");
 DEFINE_string(background_frame, "000000", "background frame to process (lexical)");
 DEFINE_string(cameras, "", "destination cameras");
+DEFINE_double(fill_radius, 0, "fill foreground nans from valid pixels this close (0 = no fill)");
 DEFINE_string(first, "000000", "first frame to process (lexical)");
 DEFINE_string(foreground_disp, "", "path to foreground disparity directory (required)");
 DEFINE_string(last, "000000", "last frame to process (lexical)");
@@ -47,9 +52,17 @@ void layerDisparities(
     const filesystem::path& outputPath) {
   CHECK(foregroundImage.size() == backgroundImage.size())
       << "Background and foreground images must be of the same size!";
+  const cv::Mat_<float> foregroundFilled = FLAGS_fill_radius > 0
+      ? cv_util::fillFromNearestValid(
+            foregroundImage,
+            foregroundImage > 0,
+            foregroundImage != foregroundImage,
+            FLAGS_fill_radius,
+            FLAGS_threads)
+      : foregroundImage;
   cv::Mat_<float> mask(foregroundImage.size());
-  cv::threshold(foregroundImage, mask, 0.0, 1.0, cv::THRESH_BINARY);
-  cv::Mat_<float> layerImage = foregroundImage.mul(mask) + backgroundImage.mul(1 - mask);
+  cv::threshold(foregroundFilled, mask, 0.0, 1.0, cv::THRESH_BINARY);
+  cv::Mat_<float> layerImage = foregroundFilled.mul(mask) + backgroundImage.mul(1 - mask);
   cv_util::imwriteExceptionOnFail(outputPath, layerImage * 255);
 }
 
@@ -60,6 +73,7 @@ int main(int argc, char* argv[]) {
   CHECK_NE(FLAGS_background_disp, "");
   CHECK_NE(FLAGS_foreground_disp, "");
   CHECK_LE(FLAGS_first, FLAGS_last);
+  CHECK_GE(FLAGS_fill_radius, 0);
 
   const Camera::Rig rigSrc = Camera::loadRig(FLAGS_rig);
   Camera::Rig rigDst = image_util::filterDestinations(rigSrc, FLAGS_cameras);
@@ -7,19 +7,62 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "source/depth_estimation/BilateralKernels.h"
+#include "source/depth_estimation/DerpUtil.h"
 #include "source/util/CvUtil.h"
 #include "source/util/FilesystemUtil.h"
 #include "source/util/ImageTypes.h"
 #include "source/util/ImageUtil.h"
+#include "source/util/Profiler.h"
 #include "source/util/SystemUtil.h"
 #include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 namespace depth_estimation {
 
+// Frame independent part of the projection of a src into a dst, it only depends on the rig and
+// the level size
+struct ProjGeometry {
+  cv::Mat_<cv::Vec2f> warpDstToSrc; // to project src colors into dst, empty if src = dst
+  cv::Mat_<cv::Vec2f> warpSrcToDst; // empty if src = dst
+  cv::Mat_<cv::Vec3f> rays; // src = dst only, see computeDstRays()
+  SrcProjector projector; // src != dst only
+};
+
+// Projection geometry of every (dst, src) pair of a level size, computed on first use and shared
+// by the levels of every frame that point to it (see PyramidLevel::projGeometryCache). Thread safe
+struct ProjGeometryCache {
+  struct Entry {
+    std::mutex mutex; // held while computing
+    bool ready = false;
+    ProjGeometry geometry;
+  };
+
+  cv::Size size;
+  int numSrcs;
+  std::vector<std::unique_ptr<Entry>> entries;
+
+  ProjGeometryCache(const cv::Size& sizeIn, const int numDsts, const int numSrcsIn)
+      : size(sizeIn), numSrcs(numSrcsIn) {
+    for (int i = 0; i < numDsts * numSrcs; ++i) {
+      entries.emplace_back(new Entry);
+    }
+  }
+
+  Entry& entry(const int dstId, const int srcId) {
+    return *entries[dstId * numSrcs + srcId];
+  }
+};
+
 template <typename PixelType>
 struct PyramidLevel {
   struct Src {
@@ -40,13 +83,83 @@ struct PyramidLevel {
     cv::Mat_<bool> fovMask;
     cv::Mat_<bool> foregroundMask;
     cv::Mat_<float> backgroundDisparity;
+
+    // Empty unless useCostCandidates, see CostCandidates
+    cv::Mat_<CostCandidates> candidateDisparity;
+    cv::Mat_<CostCandidates> candidateCost;
   };
 
+  // Projection of a src into a dst assuming a depth of infinity, see dstProj()
   struct Proj {
+    // Maps src pixels to dst pixels, in one of two storages (see ProjectionStorage)
     cv::Mat_<cv::Vec2f> projWarp;
-    cv::Mat_<cv::Vec2f> projWarpInv;
+    cv::Mat_<cv::Vec2s> projWarpHalf; // fixed point, kProjWarpHalfInvalid where unseen
+    float projWarpHalfScale = 0;
+
+    // Projected colors and their biases, as PixelType for unorm16, packed otherwise (see
+    // ColorFormat). Packed projections only keep the packed copies
+    ColorFormat colorFormat = ColorFormat::unorm16;
     cv::Mat_<PixelType> projColor;
     cv::Mat_<PixelType> projColorBias;
+    cv::Mat projColorPacked;
+    cv::Mat projColorBiasPacked;
+
+    // src = dst: rays of dst through each pixel, see computeDstRays()
+    // src != dst: single precision projection of points along those rays into src
+    cv::Mat_<cv::Vec3f> rays;
+    SrcProjector projector;
+
+    // Same as getPixelBilinear() on the warp, whatever the storage
+    cv::Vec2f warp(const float x, const float y) const {
+      if (projWarpHalf.empty()) {
+        return cv_util::getPixelBilinear(projWarp, x, y);
+      }
+      const float xf = std::round(x);
+      const float yf = std::round(y);
+      const int xi = xf;
+      const int yi = yf;
+      return cv_util::bilerp(
+          decodeWarpHalf(cv_util::clampToEdge(projWarpHalf, xi - 1, yi - 1)),
+          decodeWarpHalf(cv_util::clampToEdge(projWarpHalf, xi, yi - 1)),
+          decodeWarpHalf(cv_util::clampToEdge(projWarpHalf, xi - 1, yi)),
+          decodeWarpHalf(cv_util::clampToEdge(projWarpHalf, xi, yi)),
+          x - xf + 0.5f,
+          y - yf + 0.5f);
+    }
+
+    cv::Vec2f decodeWarpHalf(const cv::Vec2s& value) const {
+      if (value[0] == kProjWarpHalfInvalid) {
+        return cv::Vec2f(NAN, NAN);
+      }
+      return cv::Vec2f(value[0] / projWarpHalfScale, value[1] / projWarpHalfScale);
+    }
+
+    // Views for the patch kernels, whatever the format
+    ImageView3 colorView() const {
+      return makeColorView(colorFormat == ColorFormat::unorm16 ? projColor : projColorPacked);
+    }
+
+    ImageView3 colorBiasView() const {
+      return makeColorView(
+          colorFormat == ColorFormat::unorm16 ? projColorBias : projColorBiasPacked);
+    }
+
+    ImageView3 makeColorView(const cv::Mat& mat) const {
+      return {mat.data, mat.cols, mat.rows, int(mat.step1()), colorFormat};
+    }
+  };
+
+  static const int16_t kProjWarpHalfInvalid = std::numeric_limits<int16_t>::min();
+
+  // Projections are computed on first use, and dropped by prepareProjections() when they do not
+  // fit in the memory budget
+  struct ProjSlot {
+    std::mutex mutex; // held while computing
+    std::atomic<bool> ready{false};
+    bool overlaps; // pairs that do not overlap are never computed
+    size_t bytes = 0;
+    uint64_t lastUse = 0; // generation of prepareProjections()
+    Proj proj;
   };
 
   // if first frame is 000039, frameIdx = 0, frameName = 000039
@@ -75,7 +188,7 @@ struct PyramidLevel {
 
   std::vector<Src> srcs;
   std::vector<Dst> dsts;
-  std::vector<Proj> projs;
+  std::vector<std::unique_ptr<ProjSlot>> projSlots;
 
   filesystem::path srcColorsPath; // in case we want to load full-size images
   int widthFullSize;
@@ -89,6 +202,26 @@ struct PyramidLevel {
 
   int numThreads;
 
+  CostEngine costEngine = CostEngine::scalar;
+  DisparitySampling disparitySampling = DisparitySampling::uniform;
+  BilateralEngine bilateralEngine = BilateralEngine::bruteForce;
+
+  // Keep the best disparities of each pixel, to use as proposals at the next level
+  bool useCostCandidates = false;
+
+  // Only propagate from the ping pong candidates closest in color, see prunePingPongCandidates()
+  bool useColorPruning = false;
+
+  ProjectionStorage projectionStorage = ProjectionStorage::full;
+  ColorFormat projColorFormat = kDefaultProjColorFormat;
+  std::shared_ptr<ProjGeometryCache> projGeometryCache; // null = computed with each projection
+  size_t projectionBudgetBytes = 0; // 0 = unlimited
+  std::atomic<size_t> projectionBytes{0};
+  std::atomic<size_t> projectionPeakBytes{0};
+  std::atomic<int> projectionComputeCount{0};
+  int projectionEvictCount = 0;
+  uint64_t projectionGeneration = 0;
+
   PyramidLevel(
       const int frameIdxIn,
       const std::string& frameNameIn,
@@ -159,7 +292,14 @@ struct PyramidLevel {
       dsts.push_back(dst);
     }
 
-    projs.resize(numDsts * numSrcs);
+    // Overlap is estimated at infinity, on the full size cameras
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+        projSlots.emplace_back(new ProjSlot);
+        projSlots.back()->overlaps =
+            srcIdx == dst2srcIdxs[dstIdx] || rigDst[dstIdx].overlap(rigSrc[srcIdx]) > 0;
+      }
+    }
 
     createLevelMats();
     computeVariances();
@@ -349,6 +489,22 @@ struct PyramidLevel {
     return const_cast<PyramidLevel<PixelType>*>(this)->dstConfidence(dstId);
   }
 
+  cv::Mat_<CostCandidates>& dstCandidateDisparity(const int dstId) {
+    return dsts[dstId].candidateDisparity;
+  }
+
+  const cv::Mat_<CostCandidates>& dstCandidateDisparity(const int dstId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstCandidateDisparity(dstId);
+  }
+
+  cv::Mat_<CostCandidates>& dstCandidateCost(const int dstId) {
+    return dsts[dstId].candidateCost;
+  }
+
+  const cv::Mat_<CostCandidates>& dstCandidateCost(const int dstId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstCandidateCost(dstId);
+  }
+
   cv::Mat_<int>& dstOverlap(const int dstId) {
     return dsts[dstId].overlap;
   }
@@ -366,52 +522,283 @@ struct PyramidLevel {
     return getDstSrcIdx(dstId, dst2srcIdxs[dstId]);
   }
 
-  cv::Mat_<cv::Vec2f>& dstProjWarp(const int dstId, const int srcId) {
-    return projs[getDstSrcIdx(dstId, srcId)].projWarp;
+  bool dstProjOverlaps(const int dstId, const int srcId) const {
+    return projSlots[getDstSrcIdx(dstId, srcId)]->overlaps;
+  }
+
+  // Projection of src into dst, computed on first use. Thread safe
+  // Empty if src and dst do not overlap
+  // With a budget, projections outside the dsts of the last prepareProjections() CHECK that they
+  // fit: nothing can be dropped to make room while other threads may be reading projections
+  const Proj& dstProj(const int dstId, const int srcId) {
+    ProjSlot& slot = *projSlots[getDstSrcIdx(dstId, srcId)];
+    if (!slot.ready.load(std::memory_order_acquire)) {
+      computeProj(slot, dstId, srcId);
+    }
+    return slot.proj;
   }
 
-  const cv::Mat_<cv::Vec2f>& dstProjWarp(const int dstId, const int srcId) const {
-    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjWarp(dstId, srcId);
+  const Proj& dstProj(const int dstId, const int srcId) const {
+    return const_cast<PyramidLevel<PixelType>*>(this)->dstProj(dstId, srcId);
   }
 
-  cv::Mat_<cv::Vec2f>& dstProjWarpInv(const int dstId, const int srcId) {
-    return projs[getDstSrcIdx(dstId, srcId)].projWarpInv;
+  const cv::Mat_<PixelType>& dstProjColor(const int dstId, const int srcId) const {
+    return dstProj(dstId, srcId).projColor;
   }
 
-  const cv::Mat_<cv::Vec2f>& dstProjWarpInv(const int dstId, const int srcId) const {
-    return const_cast<PyramidLevel*>(this)->dstProjWarpInv(dstId, srcId);
+  const cv::Mat_<PixelType>& dstProjColorBias(const int dstId, const int srcId) const {
+    return dstProj(dstId, srcId).projColorBias;
   }
 
-  cv::Mat_<PixelType>& dstProjColor(const int dstId, const int srcId) {
-    return projs[getDstSrcIdx(dstId, srcId)].projColor;
+  const cv::Mat_<cv::Vec3f>& dstRays(const int dstId) const {
+    return dstProj(dstId, dst2srcIdxs[dstId]).rays;
   }
 
-  const cv::Mat_<PixelType>& dstProjColor(const int dstId, const int srcId) const {
-    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColor(dstId, srcId);
+  const cv::Mat_<PixelType>& dstProjColor(const int dstId) const {
+    return dstProjColor(dstId, dst2srcIdxs[dstId]);
   }
 
-  cv::Mat_<PixelType>& dstProjColorBias(const int dstId, const int srcId) {
-    return projs[getDstSrcIdx(dstId, srcId)].projColorBias;
+  const cv::Mat_<PixelType>& dstProjColorBias(const int dstId) const {
+    return dstProjColorBias(dstId, dst2srcIdxs[dstId]);
   }
 
-  const cv::Mat_<PixelType>& dstProjColorBias(const int dstId, const int srcId) const {
-    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColorBias(dstId, srcId);
+  void computeProj(ProjSlot& slot, const int dstId, const int srcId) {
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    if (slot.ready.load(std::memory_order_relaxed)) {
+      return; // another thread got here first
+    }
+
+    profiler::ScopedTimer timer("computeProj");
+    Proj& proj = slot.proj;
+    if (slot.overlaps) {
+      const cv::Mat_<PixelType>& color = srcColor(srcId);
+      const ProjGeometry geometry = getProjGeometry(dstId, srcId);
+      size_t colorBytes = 0;
+      if (srcId == dst2srcIdxs[dstId]) {
+        // No projection needed if src = dst
+        proj.projColor = color;
+        proj.rays = geometry.rays;
+      } else {
+        // Project from current level src size to current level dst size
+        proj.projColor = project(color, geometry.warpDstToSrc);
+        setProjWarp(proj, geometry.warpSrcToDst, dstColor(dstId).size());
+        proj.projector = geometry.projector;
+        colorBytes = proj.projColor.total() * proj.projColor.elemSize();
+      }
+
+      // Color bias is just the average over a given area around each pixel
+      proj.projColorBias = colorBias(proj.projColor, kSearchWindowRadius);
+
+      proj.colorFormat = projColorFormat;
+      if (projColorFormat != ColorFormat::unorm16) {
+        proj.projColorPacked = packColors(proj.projColor, projColorFormat);
+        proj.projColorBiasPacked = packColors(proj.projColorBias, projColorFormat);
+        proj.projColor.release();
+        proj.projColorBias.release();
+        colorBytes = 0;
+      }
+
+      slot.bytes = colorBytes + proj.projColorBias.total() * proj.projColorBias.elemSize() +
+          proj.projColorPacked.total() * proj.projColorPacked.elemSize() +
+          proj.projColorBiasPacked.total() * proj.projColorBiasPacked.elemSize() +
+          proj.projWarp.total() * proj.projWarp.elemSize() +
+          proj.projWarpHalf.total() * proj.projWarpHalf.elemSize() +
+          proj.rays.total() * proj.rays.elemSize();
+      const size_t bytes = projectionBytes += slot.bytes;
+      const bool isPrepared = projectionGeneration > 0 && slot.lastUse == projectionGeneration;
+      CHECK(projectionBudgetBytes == 0 || isPrepared || bytes <= projectionBudgetBytes)
+          << folly::sformat(
+                 "projection of dst {} from src {} goes over the budget of {} bytes: {} bytes, "
+                 "call prepareProjections() first",
+                 dstId,
+                 srcId,
+                 projectionBudgetBytes,
+                 bytes);
+      size_t peak = projectionPeakBytes.load();
+      while (bytes > peak && !projectionPeakBytes.compare_exchange_weak(peak, bytes)) {
+      }
+      ++projectionComputeCount;
+    }
+    slot.lastUse = projectionGeneration;
+    slot.ready.store(true, std::memory_order_release);
   }
 
-  cv::Mat_<PixelType>& dstProjColor(const int dstId) {
-    return projs[getDstSrcIdx(dstId)].projColor;
+  ProjGeometry computeProjGeometry(const int dstId, const int srcId) const {
+    ProjGeometry geometry;
+    const cv::Size& srcSize = srcColor(srcId).size();
+    if (srcId == dst2srcIdxs[dstId]) {
+      geometry.rays = computeDstRays(rigDst[dstId], srcSize.width, srcSize.height);
+      return geometry;
+    }
+    const cv::Size& dstSize = dstColor(dstId).size();
+    const Camera camDst = rigDst[dstId].rescale({dstSize.width, dstSize.height});
+    const Camera camSrc = rigSrc[srcId].rescale({srcSize.width, srcSize.height});
+
+    // The inverse warp is only needed to project colors
+    geometry.warpDstToSrc = image_util::computeWarpDstToSrc(camDst, camSrc);
+    geometry.warpSrcToDst = image_util::computeWarpDstToSrc(camSrc, camDst);
+    geometry.projector =
+        makeSrcProjector(rigSrc[srcId], rigDst[dstId], srcSize.width, srcSize.height);
+    return geometry;
+  }
+
+  // From projGeometryCache if there is one. Mats are shared, not copied
+  ProjGeometry getProjGeometry(const int dstId, const int srcId) const {
+    if (!projGeometryCache) {
+      return computeProjGeometry(dstId, srcId);
+    }
+    CHECK_EQ(projGeometryCache->size, sizeLevel);
+    CHECK_EQ(projGeometryCache->entries.size(), projSlots.size());
+    ProjGeometryCache::Entry& entry = projGeometryCache->entry(dstId, srcId);
+    std::lock_guard<std::mutex> lock(entry.mutex);
+    if (!entry.ready) {
+      entry.geometry = computeProjGeometry(dstId, srcId);
+      entry.ready = true;
+    }
+    return entry.geometry;
   }
 
-  const cv::Mat_<PixelType>& dstProjColor(const int dstId) const {
-    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColor(dstId);
+  void setProjWarp(Proj& proj, const cv::Mat_<cv::Vec2f>& warp, const cv::Size& dstSize) {
+    if (projectionStorage == ProjectionStorage::full) {
+      proj.projWarp = warp;
+      return;
+    }
+
+    // Warped coordinates fall within dst, which bounds the fixed point range
+    proj.projWarpHalfScale =
+        std::numeric_limits<int16_t>::max() / float(std::max(dstSize.width, dstSize.height) + 1);
+    proj.projWarpHalf.create(warp.size());
+    for (int y = 0; y < warp.rows; ++y) {
+      for (int x = 0; x < warp.cols; ++x) {
+        const cv::Vec2f& w = warp(y, x);
+        if (std::isnan(w[0]) || std::isnan(w[1])) {
+          proj.projWarpHalf(y, x) = cv::Vec2s(kProjWarpHalfInvalid, kProjWarpHalfInvalid);
+        } else {
+          proj.projWarpHalf(y, x) = cv::Vec2s(
+              std::lround(w[0] * proj.projWarpHalfScale),
+              std::lround(w[1] * proj.projWarpHalfScale));
+        }
+      }
+    }
   }
 
-  cv::Mat_<PixelType>& dstProjColorBias(const int dstId) {
-    return projs[getDstSrcIdx(dstId)].projColorBias;
+  // Upper bound on the memory of a projection, before it is computed
+  size_t estimateProjBytes(const int dstId, const int srcId) const {
+    if (!dstProjOverlaps(dstId, srcId)) {
+      return 0;
+    }
+    const size_t colorBytes = dstColor(dstId).total() * 3 * getColorFormatBytes(projColorFormat);
+    if (srcId == dst2srcIdxs[dstId]) {
+      // Bias and rays, and a packed copy of the color, which is otherwise shared with src
+      const size_t packedBytes = projColorFormat == ColorFormat::unorm16 ? 0 : colorBytes;
+      return colorBytes + packedBytes + dstColor(dstId).total() * sizeof(cv::Vec3f);
+    }
+    const size_t warpBytes = projectionStorage == ProjectionStorage::full ? sizeof(cv::Vec2f)
+                                                                          : sizeof(cv::Vec2s);
+    return 2 * colorBytes + srcColor(srcId).total() * warpBytes;
   }
 
-  const cv::Mat_<PixelType>& dstProjColorBias(const int dstId) const {
-    return const_cast<PyramidLevel<PixelType>*>(this)->dstProjColorBias(dstId);
+  size_t estimateDstProjBytes(const int dstId) const {
+    size_t bytes = 0;
+    for (int srcIdx = 0; srcIdx < int(rigSrc.size()); ++srcIdx) {
+      bytes += estimateProjBytes(dstId, srcIdx);
+    }
+    return bytes;
+  }
+
+  // Splits dsts into consecutive groups whose projections fit in the budget together
+  // A dst that does not fit on its own gets a group of its own
+  std::vector<std::vector<int>> groupDstsByProjectionBudget() const {
+    std::vector<std::vector<int>> groups(1);
+    size_t groupBytes = 0;
+    for (int dstIdx = 0; dstIdx < int(rigDst.size()); ++dstIdx) {
+      const size_t bytes = estimateDstProjBytes(dstIdx);
+      if (projectionBudgetBytes > 0 && !groups.back().empty() &&
+          groupBytes + bytes > projectionBudgetBytes) {
+        groups.emplace_back();
+        groupBytes = 0;
+      }
+      groups.back().push_back(dstIdx);
+      groupBytes += bytes;
+    }
+    return groups;
+  }
+
+  // Makes room for, and computes, the projections of dstIdxs
+  // Projections of other dsts are dropped, least recently prepared first, until everything fits
+  // in the budget. Projections of dstIdxs are always kept, so a working set larger than the budget
+  // goes over it. Not thread safe: call between passes, when no projection is in use
+  void prepareProjections(const std::vector<int>& dstIdxs) {
+    ++projectionGeneration;
+    std::vector<int> pairs;
+    size_t needed = projectionBytes;
+    for (const int dstIdx : dstIdxs) {
+      for (int srcIdx = 0; srcIdx < int(rigSrc.size()); ++srcIdx) {
+        const int pairIdx = getDstSrcIdx(dstIdx, srcIdx);
+        projSlots[pairIdx]->lastUse = projectionGeneration;
+        if (!projSlots[pairIdx]->ready && projSlots[pairIdx]->overlaps) {
+          pairs.push_back(pairIdx);
+          needed += estimateProjBytes(dstIdx, srcIdx);
+        }
+      }
+    }
+
+    if (projectionBudgetBytes > 0) {
+      std::vector<ProjSlot*> evictable;
+      for (std::unique_ptr<ProjSlot>& slot : projSlots) {
+        if (slot->ready && slot->lastUse < projectionGeneration) {
+          evictable.push_back(slot.get());
+        }
+      }
+      std::sort(evictable.begin(), evictable.end(), [](const ProjSlot* a, const ProjSlot* b) {
+        return a->lastUse < b->lastUse;
+      });
+      for (ProjSlot* slot : evictable) {
+        if (needed <= projectionBudgetBytes) {
+          break;
+        }
+        needed -= slot->bytes;
+        projectionBytes -= slot->bytes;
+        slot->proj = Proj();
+        slot->bytes = 0;
+        slot->ready = false;
+        ++projectionEvictCount;
+      }
+    }
+
+    // Compute pairs in parallel, so that the first user does not do it one pair at a time
+    ThreadPool threadPool(numThreads);
+    for (const int pairIdx : pairs) {
+      threadPool.spawn([&, pairIdx] {
+        const int numSrcs = rigSrc.size();
+        computeProj(*projSlots[pairIdx], pairIdx / numSrcs, pairIdx % numSrcs);
+      });
+    }
+    threadPool.join();
+  }
+
+  // Drops every projection, e.g. to recompute them in another format. Not thread safe
+  void resetProjections() {
+    for (std::unique_ptr<ProjSlot>& slot : projSlots) {
+      slot->proj = Proj();
+      slot->bytes = 0;
+      slot->ready = false;
+    }
+    projectionBytes = 0;
+  }
+
+  void logProjectionStats() const {
+    int numOverlapping = 0;
+    for (const std::unique_ptr<ProjSlot>& slot : projSlots) {
+      numOverlapping += slot->overlaps;
+    }
+    LOG(INFO) << folly::sformat(
+        "Projections: {} of {} pairs overlap, {} computed, {} evicted, peak memory: {:.1f} MB",
+        numOverlapping,
+        projSlots.size(),
+        projectionComputeCount.load(),
+        projectionEvictCount,
+        projectionPeakBytes / 1048576.0);
   }
 
   void saveDstImage(const int dstIdx, const ImageType imageType, const float scale = 1.0f) {
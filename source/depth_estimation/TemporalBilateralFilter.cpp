@@ -7,6 +7,10 @@
 
 #include "source/depth_estimation/TemporalBilateralFilter.h"
 
+#include <future>
+#include <mutex>
+
+#include <boost/timer/timer.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -26,6 +30,12 @@ static const int kTemporalSpaceRadiusMax = 1; // at finest level of the pyramid
 const std::string kUsageMessage = R"(
   - Runs temporal filter across disparity frames using corresponding color frames as guides.
 
+  - Each input frame is loaded once, ahead of time, and kept while it is in the temporal window.
+
+  - With --recursive each frame is instead blended with a running average of the frames before
+  it, in a single pass that only keeps a few images per camera in memory, whatever the length of
+  the shot. Frames only see their past, and --decay sets how fast the history fades.
+
   - Example:
     ./TemporalBilateralFilter \
     --input_root=/path/to/ \
@@ -37,6 +47,7 @@ const std::string kUsageMessage = R"(
 
 DEFINE_string(color, "", "color directory");
 DEFINE_string(cameras, "", "destination cameras");
+DEFINE_double(decay, -1, "history decay with --recursive (-1 = time_radius / (time_radius + 1))");
 DEFINE_string(disparity, "", "disparity directory");
 DEFINE_string(first, "000000", "first frame to process (lexical)");
 DEFINE_string(foreground_masks, "", "foreground masks directory");
@@ -45,6 +56,7 @@ DEFINE_string(last, "000000", "last frame to process (lexical)");
 DEFINE_int32(level, 0, "pyramid level being processed");
 DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm supported)");
 DEFINE_string(output_root, "", "output root directory (required)");
+DEFINE_bool(recursive, false, "causal recursive filter, constant memory whatever time_radius");
 DEFINE_int32(resolution, 2048, "8192, 4096, 2048, 1024, 512, 256");
 DEFINE_string(rig, "", "path to camera rig .json (required)");
 DEFINE_double(sigma, 0.01, "spatio-temporal smoothing");
@@ -117,14 +129,8 @@ void populateMinMaxFrame(
   lastFrameIdx = std::min(localLastFrameIdx, lastFrameIdx);
 }
 
-void filterFrame(const int curFrameIdx, const Camera::Rig& rigDst) {
-  const size_t numDsts = rigDst.size();
-
-  std::vector<std::vector<cv::Mat_<depth_estimation::PixelType>>> colorFrames(numDsts);
-  std::vector<std::vector<cv::Mat_<float>>> disparities(numDsts);
-  std::vector<std::vector<cv::Mat_<bool>>> masks(numDsts);
-
-  const Camera& camRef = rigDst[0];
+// Frames of the temporal window around curFrameIdx that exist in every input directory
+std::pair<int, int> getFrameWindow(const Camera& camRef, const int curFrameIdx) {
   int firstFrameIdx = 0;
   int lastFrameIdx = INT_MAX;
   populateMinMaxFrame(FLAGS_color, FLAGS_level, camRef, curFrameIdx, firstFrameIdx, lastFrameIdx);
@@ -134,51 +140,234 @@ void filterFrame(const int curFrameIdx, const Camera::Rig& rigDst) {
     populateMinMaxFrame(
         FLAGS_foreground_masks, FLAGS_level, camRef, curFrameIdx, firstFrameIdx, lastFrameIdx);
   }
+  return std::make_pair(firstFrameIdx, lastFrameIdx);
+}
 
-  for (int frameIdx = firstFrameIdx; frameIdx <= lastFrameIdx; ++frameIdx) {
+double getWallSeconds(const boost::timer::cpu_timer& timer) {
+  return timer.elapsed().wall * 1e-9;
+}
+
+// Inputs of a frame for every dst, with foreground masks combined with the FOV masks
+struct FrameInputs {
+  std::vector<cv::Mat_<PixelType>> colors;
+  std::vector<cv::Mat_<float>> disparities;
+  std::vector<cv::Mat_<bool>> masks;
+};
+
+// Sliding window of loaded frames
+// Each frame is loaded once, in the background, and dropped when the window moves past it
+class FrameCache {
+ public:
+  FrameCache(const Camera::Rig& rigDst, const std::vector<cv::Mat_<bool>>& fovMasks)
+      : rigDst(rigDst), fovMasks(fovMasks) {}
+
+  // Starts loading frameIdx, unless it is already loaded or loading
+  void prefetch(const int frameIdx) {
+    if (frames.count(frameIdx) == 0) {
+      frames[frameIdx] = loader.async([this, frameIdx] { return load(frameIdx); }).share();
+    }
+  }
+
+  // Waits for frameIdx to be loaded
+  const FrameInputs& get(const int frameIdx) {
+    prefetch(frameIdx);
+    return frames.at(frameIdx).get();
+  }
+
+  void evictBefore(const int frameIdx) {
+    frames.erase(frames.begin(), frames.lower_bound(frameIdx));
+  }
+
+  // Time spent loading frames since the last call, in the background or not
+  double takeLoadSeconds() {
+    std::lock_guard<std::mutex> lock(mutex);
+    const double result = loadSeconds;
+    loadSeconds = 0;
+    return result;
+  }
+
+ private:
+  FrameInputs load(const int frameIdx) {
+    boost::timer::cpu_timer timer;
     const std::string frameName = image_util::intToStringZeroPad(frameIdx, 6);
-    const std::vector<cv::Mat_<PixelType>> colorImages =
+    FrameInputs inputs;
+    inputs.colors =
         loadLevelImages<PixelType>(FLAGS_color, FLAGS_level, rigDst, frameName, FLAGS_threads);
-    const std::vector<cv::Mat_<float>> disparitiesImages =
+    inputs.disparities =
         loadLevelImages<float>(FLAGS_disparity, FLAGS_level, rigDst, frameName, FLAGS_threads);
-
-    std::map<int, cv::Size> sizes;
-    getPyramidLevelSizes(sizes, FLAGS_color);
-    const std::vector<cv::Mat_<bool>> foregroundMaskImages = FLAGS_use_foreground_masks
+    inputs.masks = FLAGS_use_foreground_masks
         ? loadLevelImages<bool>(
               FLAGS_foreground_masks, FLAGS_level, rigDst, frameName, FLAGS_threads)
-        : cv_util::generateAllPassMasks(sizes.at(FLAGS_level), numDsts);
-    const std::vector<cv::Mat_<bool>> fovMaskImages =
-        generateFovMasks(rigDst, sizes.at(FLAGS_level), FLAGS_threads);
-
-    for (size_t camIdx = 0; camIdx < numDsts; ++camIdx) {
-      colorFrames[camIdx].push_back(colorImages[camIdx]);
-      disparities[camIdx].push_back(disparitiesImages[camIdx]);
-      masks[camIdx].push_back(foregroundMaskImages[camIdx] & fovMaskImages[camIdx]);
+        : cv_util::generateAllPassMasks(fovMasks[0].size(), rigDst.size());
+    for (ssize_t dstIdx = 0; dstIdx < ssize(rigDst); ++dstIdx) {
+      inputs.masks[dstIdx] = inputs.masks[dstIdx] & fovMasks[dstIdx];
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    loadSeconds += getWallSeconds(timer);
+    return inputs;
+  }
+
+  const Camera::Rig& rigDst;
+  const std::vector<cv::Mat_<bool>>& fovMasks;
+  std::map<int, std::shared_future<FrameInputs>> frames;
+  std::mutex mutex;
+  double loadSeconds = 0;
+  ThreadPool loader; // destroyed first, so loads in flight are done before the rest
+};
+
+int getSpaceRadius() {
+  const float scale = std::pow(depth_estimation::kLevelScale, FLAGS_level);
+  return FLAGS_space_radius == -1
+      ? std::max(std::ceil(kTemporalSpaceRadiusMax * scale), float(kTemporalSpaceRadiusMin))
+      : FLAGS_space_radius;
+}
+
+void saveDisparities(
+    const std::vector<cv::Mat_<float>>& disparities,
+    const Camera::Rig& rigDst,
+    const int frameIdx) {
+  ThreadPool threadPool(FLAGS_threads);
+  for (ssize_t camIdx = 0; camIdx < ssize(rigDst); ++camIdx) {
+    threadPool.spawn([&, camIdx] {
+      saveDisparity(FLAGS_output_formats, disparities[camIdx], rigDst[camIdx].id, frameIdx);
+    });
+  }
+  threadPool.join();
+}
+
+void logFrameTimes(
+    const int frameIdx,
+    const double waitSeconds,
+    const double loadSeconds,
+    const double filterSeconds,
+    const double saveSeconds) {
+  LOG(INFO) << folly::sformat(
+      "-- Frame {}: waited {:.2f}s for inputs (loads took {:.2f}s), filtered in {:.2f}s, "
+      "saved in {:.2f}s",
+      frameIdx,
+      waitSeconds,
+      loadSeconds,
+      filterSeconds,
+      saveSeconds);
+}
+
+void filterFrame(
+    const int curFrameIdx,
+    const int lastFrameIdx,
+    const Camera::Rig& rigDst,
+    FrameCache& frameCache) {
+  const ssize_t numDsts = rigDst.size();
+
+  boost::timer::cpu_timer waitTimer;
+  const std::pair<int, int> window = getFrameWindow(rigDst[0], curFrameIdx);
+  frameCache.evictBefore(window.first);
+  std::vector<std::vector<cv::Mat_<depth_estimation::PixelType>>> colorFrames(numDsts);
+  std::vector<std::vector<cv::Mat_<float>>> disparities(numDsts);
+  std::vector<std::vector<cv::Mat_<bool>>> masks(numDsts);
+  for (int frameIdx = window.first; frameIdx <= window.second; ++frameIdx) {
+    const FrameInputs& inputs = frameCache.get(frameIdx);
+    for (ssize_t camIdx = 0; camIdx < numDsts; ++camIdx) {
+      colorFrames[camIdx].push_back(inputs.colors[camIdx]);
+      disparities[camIdx].push_back(inputs.disparities[camIdx]);
+      masks[camIdx].push_back(inputs.masks[camIdx]);
+    }
+  }
+  const double waitSeconds = getWallSeconds(waitTimer);
+
+  // Frames entering the next window are loaded while this one is filtered
+  if (curFrameIdx < lastFrameIdx) {
+    const std::pair<int, int> nextWindow = getFrameWindow(rigDst[0], curFrameIdx + 1);
+    for (int frameIdx = nextWindow.first; frameIdx <= nextWindow.second; ++frameIdx) {
+      frameCache.prefetch(frameIdx);
     }
   }
 
   LOG(INFO) << "Filtering images...";
-  for (size_t camIdx = 0; camIdx < numDsts; ++camIdx) {
-    cv::Mat_<float> disparity;
-    const float scale = std::pow(depth_estimation::kLevelScale, FLAGS_level);
-    const int spaceRadius = FLAGS_space_radius == -1
-        ? std::max(std::ceil(kTemporalSpaceRadiusMax * scale), float(kTemporalSpaceRadiusMin))
-        : FLAGS_space_radius;
-    temporalJointBilateralFilter(
-        colorFrames[camIdx],
-        disparities[camIdx],
-        masks[camIdx],
-        curFrameIdx - firstFrameIdx,
-        FLAGS_sigma,
-        spaceRadius,
-        FLAGS_weight_b,
-        FLAGS_weight_g,
-        FLAGS_weight_b,
-        disparity,
-        FLAGS_threads);
-
-    saveDisparity(FLAGS_output_formats, disparity, rigDst[camIdx].id, curFrameIdx);
+  boost::timer::cpu_timer filterTimer;
+  const int spaceRadius = getSpaceRadius();
+  std::vector<cv::Mat_<float>> results(numDsts);
+  ThreadPool threadPool(FLAGS_threads);
+  for (ssize_t camIdx = 0; camIdx < numDsts; ++camIdx) {
+    threadPool.spawn([&, camIdx] {
+      temporalJointBilateralFilter(
+          colorFrames[camIdx],
+          disparities[camIdx],
+          masks[camIdx],
+          curFrameIdx - window.first,
+          FLAGS_sigma,
+          spaceRadius,
+          FLAGS_weight_b,
+          FLAGS_weight_g,
+          FLAGS_weight_b,
+          results[camIdx],
+          FLAGS_threads);
+    });
+  }
+  threadPool.join();
+  const double filterSeconds = getWallSeconds(filterTimer);
+
+  boost::timer::cpu_timer saveTimer;
+  saveDisparities(results, rigDst, curFrameIdx);
+  logFrameTimes(
+      curFrameIdx,
+      waitSeconds,
+      frameCache.takeLoadSeconds(),
+      filterSeconds,
+      getWallSeconds(saveTimer));
+}
+
+// Single pass over the frames with a RecursiveTemporalFilter per camera
+void filterStream(
+    const int firstFrameIdx,
+    const int lastFrameIdx,
+    const Camera::Rig& rigDst,
+    FrameCache& frameCache) {
+  const ssize_t numDsts = rigDst.size();
+  const float decay =
+      FLAGS_decay >= 0 ? FLAGS_decay : FLAGS_time_radius / (FLAGS_time_radius + 1.0f);
+  std::vector<RecursiveTemporalFilter<PixelType>> filters(
+      numDsts,
+      RecursiveTemporalFilter<PixelType>(
+          FLAGS_sigma,
+          getSpaceRadius(),
+          decay,
+          FLAGS_weight_b,
+          FLAGS_weight_g,
+          FLAGS_weight_b));
+
+  for (int frameIdx = firstFrameIdx; frameIdx <= lastFrameIdx; ++frameIdx) {
+    boost::timer::cpu_timer waitTimer;
+    frameCache.evictBefore(frameIdx);
+    const FrameInputs& inputs = frameCache.get(frameIdx);
+    const double waitSeconds = getWallSeconds(waitTimer);
+    if (frameIdx < lastFrameIdx) {
+      frameCache.prefetch(frameIdx + 1);
+    }
+
+    boost::timer::cpu_timer filterTimer;
+    std::vector<cv::Mat_<float>> results(numDsts);
+    ThreadPool threadPool(FLAGS_threads);
+    for (ssize_t camIdx = 0; camIdx < numDsts; ++camIdx) {
+      threadPool.spawn([&, camIdx] {
+        results[camIdx] = filters[camIdx].filter(
+            inputs.colors[camIdx],
+            inputs.disparities[camIdx],
+            inputs.masks[camIdx],
+            FLAGS_threads);
+      });
+    }
+    threadPool.join();
+    const double filterSeconds = getWallSeconds(filterTimer);
+
+    boost::timer::cpu_timer saveTimer;
+    saveDisparities(results, rigDst, frameIdx);
+    logFrameTimes(
+        frameIdx,
+        waitSeconds,
+        frameCache.takeLoadSeconds(),
+        filterSeconds,
+        getWallSeconds(saveTimer));
   }
 }
 
@@ -188,6 +377,7 @@ int main(int argc, char** argv) {
   CHECK_NE(FLAGS_rig, "");
   CHECK_NE(FLAGS_input_root, "");
   CHECK_NE(FLAGS_output_root, "");
+  CHECK_LT(FLAGS_decay, 1);
 
   if (FLAGS_color.empty()) {
     FLAGS_color = getImageDir(FLAGS_input_root, ImageType::color_levels).string();
@@ -205,7 +395,21 @@ int main(int argc, char** argv) {
 
   // Necessary for generating FOV masks
   Camera::normalizeRig(rigDst);
-  for (int frameIdx = std::stoi(FLAGS_first); frameIdx <= std::stoi(FLAGS_last); ++frameIdx) {
-    filterFrame(frameIdx, rigDst);
+
+  // Level size and FOV masks do not change from frame to frame
+  std::map<int, cv::Size> sizes;
+  getPyramidLevelSizes(sizes, FLAGS_color);
+  const std::vector<cv::Mat_<bool>> fovMasks =
+      generateFovMasks(rigDst, sizes.at(FLAGS_level), FLAGS_threads);
+
+  FrameCache frameCache(rigDst, fovMasks);
+  const int firstFrameIdx = std::stoi(FLAGS_first);
+  const int lastFrameIdx = std::stoi(FLAGS_last);
+  if (FLAGS_recursive) {
+    filterStream(firstFrameIdx, lastFrameIdx, rigDst, frameCache);
+    return EXIT_SUCCESS;
+  }
+  for (int frameIdx = firstFrameIdx; frameIdx <= lastFrameIdx; ++frameIdx) {
+    filterFrame(frameIdx, lastFrameIdx, rigDst, frameCache);
   }
 }
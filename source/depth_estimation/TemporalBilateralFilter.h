@@ -15,6 +15,7 @@
 #include <glog/logging.h>
 #include <Eigen/Geometry>
 
+#include "source/depth_estimation/BilateralKernels.h"
 #include "source/util/CvUtil.h"
 #include "source/util/MathUtil.h"
 #include "source/util/SystemUtil.h"
@@ -23,6 +24,108 @@
 namespace fb360_dep {
 namespace depth_estimation {
 
+inline BilateralEngine parseBilateralEngine(const std::string& name) {
+  if (name == "lut") {
+    return BilateralEngine::lut;
+  } else if (name == "grid") {
+    return BilateralEngine::grid;
+  }
+  CHECK_EQ(name, "brute_force") << "Invalid bilateral engine: " << name;
+  return BilateralEngine::bruteForce;
+}
+
+// Planar float copy of mat, each plane scaled and padded by replicating its edges
+inline std::vector<cv::Mat_<float>>
+getBilateralPlanes(const cv::Mat& mat, const std::vector<float>& scales, const int border) {
+  std::vector<cv::Mat> planes;
+  cv::split(mat, planes);
+  CHECK_EQ(planes.size(), scales.size());
+  std::vector<cv::Mat_<float>> result(planes.size());
+  for (int c = 0; c < int(planes.size()); ++c) {
+    cv::Mat_<float> plane;
+    planes[c].convertTo(plane, CV_32F, scales[c]);
+    cv::copyMakeBorder(plane, result[c], border, border, border, border, cv::BORDER_REPLICATE);
+  }
+  return result;
+}
+
+// generalizedJointBilateralFilter() through the kernels of BilateralKernels.h
+template <typename TPixel, typename TGuide>
+cv::Mat_<TPixel> generalizedJointBilateralFilterKernels(
+    const cv::Mat_<TPixel>& image,
+    const cv::Mat_<TGuide>& guide,
+    const cv::Mat_<TGuide>& neighborTGuide,
+    const cv::Mat_<bool>& mask,
+    const int radius,
+    const float sigma,
+    const float weight0,
+    const float weight1,
+    const float weight2,
+    const int numThreads,
+    const BilateralEngine engine) {
+  const int channels = cv::DataType<TPixel>::channels;
+  static_assert(channels <= kMaxBilateralChannels, "too many channels");
+  CHECK_EQ(guide.channels(), 3);
+
+  // Range weight becomes exp(-|a - b|^2)
+  const float weights[3] = {weight0, weight1, weight2};
+  std::vector<float> guideScales(3);
+  std::vector<float> neighborTGuideScales(3);
+  for (int c = 0; c < 3; ++c) {
+    const float weightScale = std::sqrt(weights[c] / (6.0f * math_util::square(sigma)));
+    guideScales[c] = weightScale / cv_util::maxPixelValue(guide);
+    neighborTGuideScales[c] = weightScale / cv_util::maxPixelValue(neighborTGuide);
+  }
+
+  const int border = engine == BilateralEngine::lut ? radius : 0;
+  const std::vector<cv::Mat_<float>> imagePlanes =
+      getBilateralPlanes(image, std::vector<float>(channels, 1.0f), border);
+  const std::vector<cv::Mat_<float>> guidePlanes = getBilateralPlanes(guide, guideScales, border);
+  const std::vector<cv::Mat_<float>> neighborTGuidePlanes =
+      &neighborTGuide == &guide ? guidePlanes
+                                : getBilateralPlanes(neighborTGuide, neighborTGuideScales, border);
+  const std::vector<cv::Mat_<float>> maskPlanes =
+      getBilateralPlanes(mask != 0, {1.0f / 255.0f}, border);
+
+  BilateralInput in;
+  in.cols = image.cols;
+  in.rows = image.rows;
+  in.step = image.cols + 2 * border;
+  in.border = border;
+  in.channels = channels;
+  for (int c = 0; c < channels; ++c) {
+    in.image[c] = &imagePlanes[c](border, border);
+  }
+  for (int c = 0; c < 3; ++c) {
+    in.guide[c] = &guidePlanes[c](border, border);
+    in.neighborGuide[c] = &neighborTGuidePlanes[c](border, border);
+  }
+  in.mask = &maskPlanes[0](border, border);
+
+  std::vector<cv::Mat> destPlanes(channels);
+  BilateralOutput out;
+  for (int c = 0; c < channels; ++c) {
+    destPlanes[c].create(image.size(), CV_32F);
+    out.image[c] = destPlanes[c].ptr<float>();
+  }
+
+  ThreadPool threadPool(numThreads);
+  if (engine == BilateralEngine::grid) {
+    const int bandRows = getBilateralGridBandRows(radius);
+    threadPool.parallelFor(0, image.rows, bandRows, [&](const int yBegin, const int yEnd) {
+      jointBilateralFilterGrid(in, radius, yBegin, yEnd, out);
+    });
+  } else {
+    threadPool.parallelFor(0, image.rows, 1, [&](const int yBegin, const int yEnd) {
+      jointBilateralFilterLut(in, radius, yBegin, yEnd, out);
+    });
+  }
+
+  cv::Mat_<TPixel> dest;
+  cv::merge(destPlanes, dest);
+  return dest;
+}
+
 // helper for jointBilateralFilter and jointBilateralUpsampling. call one of
 // those instead of this. when computing the bilateral weight, two colors are
 // compared. the generalization is that the color for the current pixel comes
@@ -35,6 +138,7 @@ namespace depth_estimation {
 // guide and neighborGuide should be cv::Mats of type CV_32FC3, CV_16UC3 or CV_8UC3
 // weightR, weightG, and weightB control how much weight is on each color
 // channel in computing color differences for bilateral weight.
+// engine picks the implementation, see BilateralEngine
 template <typename TPixel, typename TGuide>
 cv::Mat_<TPixel> generalizedJointBilateralFilter(
     const cv::Mat_<TPixel>& image, // Either float, Vec2f or Vec3f
@@ -46,22 +150,43 @@ cv::Mat_<TPixel> generalizedJointBilateralFilter(
     const float weight0 = 1.0f,
     const float weight1 = 1.0f,
     const float weight2 = 1.0f,
-    const int numThreads = -1) {
+    const int numThreads = -1,
+    const BilateralEngine engine = BilateralEngine::bruteForce) {
   CHECK_EQ(guide.size(), neighborTGuide.size());
   CHECK_EQ(image.size(), guide.size());
   CHECK_EQ(guide.size(), mask.size());
 
+  if (engine != BilateralEngine::bruteForce) {
+    return generalizedJointBilateralFilterKernels(
+        image,
+        guide,
+        neighborTGuide,
+        mask,
+        radius,
+        sigma,
+        weight0,
+        weight1,
+        weight2,
+        numThreads,
+        engine);
+  }
+
   const TPixel zero = 0.0;
+  const float guideFactor = 1 / cv_util::maxPixelValue(guide);
+  const float neighborTGuideFactor = 1 / cv_util::maxPixelValue(neighborTGuide);
 
   cv::Mat_<TPixel> dest(image.size());
   ThreadPool threadPool(numThreads);
   const int edgeX = image.cols;
   const int edgeY = 1;
-  for (int yBegin = 0; yBegin < image.rows; yBegin += edgeY) {
-    for (int xBegin = 0; xBegin < image.cols; xBegin += edgeX) {
-      const int xEnd = std::min(xBegin + edgeX, image.cols);
-      const int yEnd = std::min(yBegin + edgeY, image.rows);
-      threadPool.spawn([&, xBegin, yBegin, xEnd, yEnd] {
+  threadPool.parallelForTiles(
+      0,
+      0,
+      image.cols,
+      image.rows,
+      edgeX,
+      edgeY,
+      [&](const int xBegin, const int yBegin, const int xEnd, const int yEnd) {
         for (int y = yBegin; y < yEnd; ++y) {
           for (int x = xBegin; x < xEnd; ++x) {
             if (!mask(y, x)) {
@@ -73,9 +198,6 @@ cv::Mat_<TPixel> generalizedJointBilateralFilter(
             float sumWeight = 0.0f;
             TPixel weightedAvg = zero;
 
-            const float guideFactor = 1 / cv_util::maxPixelValue(guide);
-            const float neighborTGuideFactor = 1 / cv_util::maxPixelValue(neighborTGuide);
-
             for (int v = -radius; v <= radius; ++v) {
               for (int u = -radius; u <= radius; ++u) {
                 const int sampleX = math_util::clamp(x + u, 0, image.cols - 1);
@@ -116,9 +238,6 @@ cv::Mat_<TPixel> generalizedJointBilateralFilter(
           }
         }
       });
-    }
-  }
-  threadPool.join();
   return dest;
 }
 
@@ -195,23 +314,132 @@ static void temporalJointBilateralFilter(
 
   result = cv::Mat(images[frameOffset].size(), CV_32FC1);
   ThreadPool threadPool(numThreads);
-  for (int y = 0; y < result.rows; ++y) {
-    threadPool.spawn(
-        &temporalJointBilateralFilterCol<T>,
-        std::ref(guides),
-        std::ref(images),
-        std::ref(masks),
-        frameOffset,
-        sigma,
-        spatialRadius,
-        weight0,
-        weight1,
-        weight2,
-        std::ref(result),
-        y);
-  }
-  threadPool.join();
+  threadPool.parallelFor(0, result.rows, 1, [&](const int yBegin, const int yEnd) {
+    for (int y = yBegin; y < yEnd; ++y) {
+      temporalJointBilateralFilterCol<T>(
+          guides,
+          images,
+          masks,
+          frameOffset,
+          sigma,
+          spatialRadius,
+          weight0,
+          weight1,
+          weight2,
+          result,
+          y);
+    }
+  });
 }
 
+// causal, recursive alternative to temporalJointBilateralFilter() for streams of frames.
+// keeps a running weighted sum of past disparities and of their weights per pixel. each frame
+// adds its own disparity with weight 1 to the running sums of the previous frame, averaged over
+// a (2 * spatialRadius + 1)^2 window with the same color weights as
+// temporalJointBilateralFilter() and scaled by decay. the average fades out when no neighbor
+// has a similar color, so history is dropped where the scene changes. static pixels converge
+// to an average over about 1 / (1 - decay) frames.
+// memory is a few images per camera, whatever the length of the stream, and every frame is
+// only needed while it is filtered. unmasked pixels are left untouched and restart their sums.
+template <typename T>
+class RecursiveTemporalFilter {
+ public:
+  RecursiveTemporalFilter(
+      const float sigma,
+      const int spatialRadius,
+      const float decay,
+      const float weight0,
+      const float weight1,
+      const float weight2)
+      : sigma(sigma),
+        spatialRadius(spatialRadius),
+        decay(decay),
+        weights{weight0, weight1, weight2} {
+    CHECK_GE(decay, 0);
+    CHECK_LT(decay, 1);
+  }
+
+  // Filters the next frame of the stream
+  cv::Mat_<float> filter(
+      const cv::Mat_<T>& guide,
+      const cv::Mat_<float>& disparity,
+      const cv::Mat_<bool>& mask,
+      const int numThreads = -1) {
+    CHECK_GE(guide.channels(), 3);
+    CHECK_EQ(guide.size(), disparity.size());
+    CHECK_EQ(guide.size(), mask.size());
+
+    cv::Mat_<float> result(disparity.size());
+    cv::Mat_<float> nextSumDisparity(disparity.size());
+    cv::Mat_<float> nextSumWeight(disparity.size());
+    const bool hasHistory = !prevGuide.empty();
+    if (hasHistory) {
+      CHECK_EQ(prevGuide.size(), guide.size());
+    }
+    const float maxImageValue = cv_util::maxPixelValue(guide);
+
+    ThreadPool threadPool(numThreads);
+    threadPool.parallelFor(0, result.rows, 1, [&](const int yBegin, const int yEnd) {
+      for (int y = yBegin; y < yEnd; ++y) {
+        for (int x = 0; x < result.cols; ++x) {
+          if (!mask(y, x)) {
+            result(y, x) = disparity(y, x);
+            nextSumDisparity(y, x) = 0;
+            nextSumWeight(y, x) = 0;
+            continue;
+          }
+
+          // Running sums of the previous frame around (x, y), weighted by color similarity
+          float carriedDisparity = 0;
+          float carriedWeight = 0;
+          float sumColorWeight = 0;
+          if (hasHistory) {
+            const T referenceColor = guide(y, x);
+            for (int v = -spatialRadius; v <= spatialRadius; ++v) {
+              for (int u = -spatialRadius; u <= spatialRadius; ++u) {
+                const int sampleX = math_util::clamp(x + u, 0, result.cols - 1);
+                const int sampleY = math_util::clamp(y + v, 0, result.rows - 1);
+                const float prevWeight = sumWeight(sampleY, sampleX);
+                if (prevWeight == 0) {
+                  continue;
+                }
+                const T sampleColor = prevGuide(sampleY, sampleX);
+                float weightedDiff = 0; // BGR
+                for (int c = 0; c < 3; ++c) {
+                  weightedDiff += weights[c] *
+                      math_util::square((referenceColor[c] - sampleColor[c]) / maxImageValue);
+                }
+                const float weight = expf(-weightedDiff / math_util::square(sigma));
+                carriedDisparity += weight * sumDisparity(sampleY, sampleX);
+                carriedWeight += weight * prevWeight;
+                sumColorWeight += weight;
+              }
+            }
+          }
+          const float scale = decay / std::max(sumColorWeight, 1.0f);
+          nextSumDisparity(y, x) = disparity(y, x) + scale * carriedDisparity;
+          nextSumWeight(y, x) = 1 + scale * carriedWeight;
+          result(y, x) = nextSumDisparity(y, x) / nextSumWeight(y, x);
+        }
+      }
+    });
+
+    prevGuide = guide.clone();
+    sumDisparity = nextSumDisparity;
+    sumWeight = nextSumWeight;
+    return result;
+  }
+
+ private:
+  const float sigma;
+  const int spatialRadius;
+  const float decay;
+  const float weights[3];
+
+  cv::Mat_<T> prevGuide;
+  cv::Mat_<float> sumDisparity; // weighted sum of past disparities
+  cv::Mat_<float> sumWeight; // 0 = no history
+};
+
 } // namespace depth_estimation
 } // namespace fb360_dep
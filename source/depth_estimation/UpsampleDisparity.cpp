@@ -18,6 +18,9 @@ const char* kUsage = R"(
     --output=/path/to/video/output/disparity_full_size \
     --frame=000000 \
     --background_disp=/path/to/background/disparity_full_size
+
+  - With --tile_size, upscaling, hole filling and filtering are done one output tile at a time on
+    all cameras at once, which bounds the memory used on top of the inputs and outputs.
 )";
 
 #include "source/depth_estimation/UpsampleDisparityLib.h"
@@ -34,6 +37,7 @@ using namespace fb360_dep::depth_estimation;
 
 DEFINE_string(background_disp, "", "background disparity directory (output resolution)");
 DEFINE_string(background_frame, "000000", "background frame (lexical)");
+DEFINE_string(bilateral_engine, "brute_force", "bilateral filter engine (brute_force, lut, grid)");
 DEFINE_string(cameras, "", "destination cameras");
 DEFINE_string(color, "", "color directory (output resolution)");
 DEFINE_string(disparity, "", "disparity directory (input resolution) (required)");
@@ -47,6 +51,7 @@ DEFINE_string(output_formats, "", "saved formats, comma separated (exr, png, pfm
 DEFINE_int32(resolution, -1, "output resolution width in pixels (required)");
 DEFINE_string(rig, "", "path to camera rig .json");
 DEFINE_double(sigma, 0.05, "bilateral filter color difference sigma");
+DEFINE_int32(tile_size, 0, "fused upsampling output tile size in pixels (0 = not tiled)");
 DEFINE_int32(threads, -1, "number of threads (-1 = auto, 0 = none)");
 DEFINE_double(weight_b, 0.5, "bilateral filter blue channel weight");
 DEFINE_double(weight_g, 0.5, "bilateral filter green channel weight");
@@ -58,6 +63,8 @@ void verifyInputs() {
   CHECK_NE(FLAGS_disparity, "");
   CHECK_NE(FLAGS_output, "");
   CHECK_NE(FLAGS_resolution, -1);
+  CHECK_GE(FLAGS_tile_size, 0);
+  parseBilateralEngine(FLAGS_bilateral_engine);
 }
 
 void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const std::string& frame) {
@@ -101,10 +108,45 @@ void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const s
       ? image_util::loadImages<bool>(FLAGS_foreground_masks_out, rigDst, frame, FLAGS_threads)
       : cv_util::generateAllPassMasks(sizeUp, int(rigDst.size()));
 
-  std::vector<cv::Mat_<float>> dispsUp = upsampleDisparities(
-      rigDst, disps, backgroundDispsUp, masks, masksUp, sizeUp, useForegroundMasks, FLAGS_threads);
-  for (ssize_t i = 0; i < ssize(rigDst); ++i) {
-    if (!FLAGS_color.empty()) {
+  std::vector<cv::Mat_<float>> dispsUp;
+  if (FLAGS_tile_size > 0) {
+    std::vector<cv::Mat> colorsUp;
+    for (const cv::Mat_<PixelType>& color : colors) {
+      colorsUp.push_back(cv_util::resizeImage(color, sizeUp));
+    }
+    LOG(INFO) << folly::sformat(
+        "Upsampling to {}x{} in {}x{} tiles...",
+        sizeUp.width,
+        sizeUp.height,
+        FLAGS_tile_size,
+        FLAGS_tile_size);
+    dispsUp = upsampleDisparitiesTiled(
+        rigDst,
+        disps,
+        backgroundDispsUp,
+        masks,
+        masksUp,
+        colorsUp,
+        sizeUp,
+        useForegroundMasks,
+        FLAGS_sigma,
+        FLAGS_weight_b,
+        FLAGS_weight_g,
+        FLAGS_weight_r,
+        parseBilateralEngine(FLAGS_bilateral_engine),
+        FLAGS_tile_size,
+        FLAGS_threads);
+  } else {
+    dispsUp = upsampleDisparities(
+        rigDst,
+        disps,
+        backgroundDispsUp,
+        masks,
+        masksUp,
+        sizeUp,
+        useForegroundMasks,
+        FLAGS_threads);
+    for (ssize_t i = 0; i < ssize(rigDst) && !FLAGS_color.empty(); ++i) {
       const int radius = getRadius(masks[i].size(), sizeUp);
       LOG(INFO) << folly::sformat(
           "Applying filter with radius {} to {}x{} disparity to {}...",
@@ -123,9 +165,12 @@ void upsampleFrame(const Camera::Rig& rigSrc, const Camera::Rig& rigDst, const s
           FLAGS_weight_b,
           FLAGS_weight_g,
           FLAGS_weight_r,
-          FLAGS_threads);
+          FLAGS_threads,
+          parseBilateralEngine(FLAGS_bilateral_engine));
     }
+  }
 
+  for (ssize_t i = 0; i < ssize(rigDst); ++i) {
     LOG(INFO) << "Saving output images...";
     for (const std::string& ext : outputFormats) {
       const std::string frameFn = ext[0] == '.' ? frame + ext : frame + '.' + ext;
@@ -7,7 +7,8 @@
 
 #include "source/depth_estimation/UpsampleDisparityLib.h"
 
-#include <utility>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include <glog/logging.h>
@@ -15,72 +16,32 @@
 #include <opencv2/imgproc.hpp>
 
 #include "DerpUtil.h"
+#include "source/depth_estimation/BilateralKernels.h"
+#include "source/depth_estimation/TemporalBilateralFilter.h"
 #include "source/util/Camera.h"
+#include "source/util/CvUtil.h"
 #include "source/util/MathUtil.h"
 #include "source/util/ThreadPool.h"
 
 namespace fb360_dep {
 namespace depth_estimation {
 
-// Clock-wise outward spiral starting at (0, 0) of diameter w
-static std::vector<std::pair<int, int>> spiral(const int w) {
-  int x = 0;
-  int y = 0;
-  int dx = 0; // 1: right, -1: left, 0: don't move
-  int dy = -1;
-  int t = w;
-  int samples = t * t;
-  std::vector<std::pair<int, int>> locs;
-  for (int i = 0; i < samples; ++i) {
-    const bool isValidX = (-w / 2 <= x) && (x <= w / 2);
-    const bool isValidY = (-w / 2 <= y) && (y <= w / 2);
-    if (isValidX && isValidY) {
-      locs.push_back(std::make_pair(x, y));
-    }
-    const bool isCorner = x == y;
-    const bool isEdgeLeftX = (x < 0) && (x == -y);
-    const bool isEdgeRightX = (x > 0) && (x == 1 - y);
-    if (isCorner || isEdgeLeftX || isEdgeRightX) {
-      // Rotate 90 degrees and switch direction of x
-      t = dx;
-      dx = -dy;
-      dy = t;
-    }
-    x += dx;
-    y += dy;
-  }
-  return locs;
-}
-
 static cv::Mat_<float> replaceNans(
     const cv::Mat_<float>& dispUp,
     const cv::Mat_<float>& bgDispUp,
     const cv::Mat_<bool>& maskUp,
     const int radius) {
+  const cv::Mat_<bool> valid = dispUp > 0;
   cv::Mat_<bool> maskNan(maskUp.size());
   maskUp.copyTo(maskNan);
-  maskNan.setTo(false, dispUp > 0); // true = NAN inside mask
-  std::vector<cv::Point> nanLocs;
-  cv::findNonZero(maskNan, nanLocs);
-  cv::Mat_<float> dispOut(dispUp.size());
-  dispUp.copyTo(dispOut);
-  const std::vector<std::pair<int, int>> spiralLocs = spiral(radius * 2 + 1);
-  for (const cv::Point& p : nanLocs) {
-    // Find valid pixel in neighborhood
-    for (const auto& loc : spiralLocs) {
-      const int xx = math_util::clamp(p.x + loc.first, 0, maskNan.cols - 1);
-      const int yy = math_util::clamp(p.y + loc.second, 0, maskNan.rows - 1);
-      const float d = dispUp(yy, xx);
-      if (d > 0) {
-        dispOut(p.y, p.x) = d;
-        break;
-      }
-    }
-  }
+  maskNan.setTo(false, valid); // true = NAN inside mask
+
+  // Take the nearest valid pixel within radius, both in Euclidean distance
+  cv::Mat_<float> dispOut = cv_util::fillFromNearestValid(dispUp, valid, maskNan, radius);
 
   for (int y = 0; y < dispOut.rows; ++y) {
     for (int x = 0; x < dispOut.cols; ++x) {
-      if (std::isnan(dispOut(y, x)) || dispOut(y, x) == 0) {
+      if ((std::isnan(dispOut(y, x)) || dispOut(y, x) == 0) && !bgDispUp.empty()) {
         dispOut(y, x) = bgDispUp(y, x);
       }
     }
@@ -180,5 +141,302 @@ std::vector<cv::Mat_<float>> upsampleDisparities(
   return dispsUp;
 }
 
+// Inputs of one camera for upsampleDisparitiesTiled()
+struct TiledCamera {
+  const Camera* cam; // normalized
+  cv::Mat_<float> dispSmall; // NAN outside the input resolution mask, or no NANs for Lanczos
+  cv::Mat_<float> bgDispUp;
+  cv::Mat_<bool> maskUpIn;
+  cv::Mat colorUp;
+  float guideScales[3];
+  float sigma;
+  float weights[3];
+};
+
+static cv::Rect expandRect(const cv::Rect& rect, const int radius) {
+  return cv::Rect(
+      rect.x - radius, rect.y - radius, rect.width + 2 * radius, rect.height + 2 * radius);
+}
+
+// Steps 2) to 4) of upsampleDisparityInPlace() for the output pixels in rect
+// Only reads the nearest neighbor upsample within radius of rect, which holds every valid pixel
+// replaceNans() can pick
+static cv::Mat_<float> upsampleForegroundRect(
+    const TiledCamera& tc,
+    const cv::Size& sizeUp,
+    const int radius,
+    const cv::Rect& rect) {
+  const cv::Rect nearRect = expandRect(rect, radius) & cv::Rect(cv::Point(0, 0), sizeUp);
+  const cv::Mat_<float>& disp = tc.dispSmall;
+
+  // Same source pixels as cv::resize(INTER_NEAREST)
+  const double ifx = 1.0 / (double(sizeUp.width) / disp.cols);
+  const double ify = 1.0 / (double(sizeUp.height) / disp.rows);
+  cv::Mat_<float> dispNear(nearRect.size());
+  cv::Mat_<bool> maskNear(nearRect.size());
+  for (int y = 0; y < nearRect.height; ++y) {
+    const int yUp = nearRect.y + y;
+    const int ySmall = std::min(cvFloor(yUp * ify), disp.rows - 1);
+    for (int x = 0; x < nearRect.width; ++x) {
+      const int xUp = nearRect.x + x;
+      const int xSmall = std::min(cvFloor(xUp * ifx), disp.cols - 1);
+      maskNear(y, x) = tc.maskUpIn(yUp, xUp) && !isOutsideImageCircle(*tc.cam, xUp, yUp, sizeUp);
+      dispNear(y, x) = maskNear(y, x) ? disp(ySmall, xSmall) : NAN;
+    }
+  }
+
+  const cv::Mat_<bool> validNear = dispNear > 0;
+  const cv::Mat_<float> filledNear =
+      cv_util::fillFromNearestValid(dispNear, validNear, maskNear & ~validNear, radius, 0);
+  const cv::Rect rectNear = rect - nearRect.tl();
+  cv::Mat_<float> dispUp = filledNear(rectNear).clone();
+  for (int y = 0; y < rect.height; ++y) {
+    for (int x = 0; x < rect.width; ++x) {
+      float& d = dispUp(y, x);
+      if ((std::isnan(d) || d == 0) && !tc.bgDispUp.empty()) {
+        d = tc.bgDispUp(rect.y + y, rect.x + x);
+      }
+    }
+  }
+  return dispUp;
+}
+
+// Source pixels and weights of cv::resize(INTER_LANCZOS4) along one axis
+static void getLanczosTaps(
+    const int dst,
+    const int srcSize,
+    const int dstSize,
+    int srcs[8],
+    float weights[8]) {
+  const double src = (dst + 0.5) * srcSize / dstSize - 0.5;
+  const int first = cvFloor(src) - 3;
+  const double frac = src - cvFloor(src);
+  double sum = 0;
+  double w[8];
+  for (int i = 0; i < 8; ++i) {
+    const double t = (frac + 3 - i) * M_PI;
+    w[i] = std::abs(t) < 1e-6 ? 1 : 4 * std::sin(t) * std::sin(t / 4) / (t * t);
+    sum += w[i];
+  }
+  for (int i = 0; i < 8; ++i) {
+    srcs[i] = math_util::clamp(first + i, 0, srcSize - 1);
+    weights[i] = w[i] / sum;
+  }
+}
+
+// The Lanczos upsample of upsampleDisparityInPlace() for the output pixels in rect
+static cv::Mat_<float>
+upsampleLanczosRect(const TiledCamera& tc, const cv::Size& sizeUp, const cv::Rect& rect) {
+  const cv::Mat_<float>& disp = tc.dispSmall;
+  std::vector<int> xSrcs(8 * rect.width);
+  std::vector<float> xWeights(8 * rect.width);
+  for (int x = 0; x < rect.width; ++x) {
+    getLanczosTaps(rect.x + x, disp.cols, sizeUp.width, &xSrcs[8 * x], &xWeights[8 * x]);
+  }
+
+  // Horizontal pass over the source rows the vertical pass reads
+  int ySrcs[8];
+  float yWeights[8];
+  getLanczosTaps(rect.y, disp.rows, sizeUp.height, ySrcs, yWeights);
+  const int ySrcBegin = ySrcs[0];
+  getLanczosTaps(rect.br().y - 1, disp.rows, sizeUp.height, ySrcs, yWeights);
+  const int ySrcEnd = ySrcs[7] + 1;
+  cv::Mat_<float> rows(ySrcEnd - ySrcBegin, rect.width);
+  for (int y = ySrcBegin; y < ySrcEnd; ++y) {
+    for (int x = 0; x < rect.width; ++x) {
+      float sum = 0;
+      for (int i = 0; i < 8; ++i) {
+        sum += xWeights[8 * x + i] * disp(y, xSrcs[8 * x + i]);
+      }
+      rows(y - ySrcBegin, x) = sum;
+    }
+  }
+
+  cv::Mat_<float> dispUp(rect.size(), 0.0f);
+  for (int y = 0; y < rect.height; ++y) {
+    getLanczosTaps(rect.y + y, disp.rows, sizeUp.height, ySrcs, yWeights);
+    for (int i = 0; i < 8; ++i) {
+      const float* row = rows.ptr<float>(ySrcs[i] - ySrcBegin);
+      float* out = dispUp.ptr<float>(y);
+      for (int x = 0; x < rect.width; ++x) {
+        out[x] += yWeights[i] * row[x];
+      }
+    }
+  }
+  return dispUp;
+}
+
+// Region [rect - border, rect + border] of mat, with pixels outside the image replicated
+static cv::Mat getPaddedRect(const cv::Mat& mat, const cv::Rect& rect, const int border) {
+  // A ROI reads its real neighbors before replicating
+  cv::Mat padded;
+  cv::copyMakeBorder(mat(rect), padded, border, border, border, border, cv::BORDER_REPLICATE);
+  return padded;
+}
+
+// Upsamples, fills and filters one output tile into dispUp
+static void upsampleTile(
+    const TiledCamera& tc,
+    const cv::Size& sizeUp,
+    const bool useForegroundMasks,
+    const int radius,
+    const BilateralEngine engine,
+    const cv::Rect& tile,
+    cv::Mat_<float>& dispUp) {
+  const auto upsampleRect = [&](const cv::Rect& rect) {
+    return useForegroundMasks ? upsampleForegroundRect(tc, sizeUp, radius, rect)
+                              : upsampleLanczosRect(tc, sizeUp, rect);
+  };
+  if (tc.colorUp.empty()) {
+    upsampleRect(tile).copyTo(dispUp(tile));
+    return;
+  }
+
+  // Filter reads the upsample within radius of the tile, clamped to the image
+  const cv::Rect haloRect = expandRect(tile, radius);
+  const cv::Rect rect = haloRect & cv::Rect(cv::Point(0, 0), sizeUp);
+  cv::Mat_<float> dispPlane;
+  cv::copyMakeBorder(
+      upsampleRect(rect),
+      dispPlane,
+      rect.y - haloRect.y,
+      haloRect.br().y - rect.br().y,
+      rect.x - haloRect.x,
+      haloRect.br().x - rect.br().x,
+      cv::BORDER_REPLICATE);
+
+  // Other engines filter the tile and its halo as a whole image. Pixels of the halo outside the
+  // image replicate its edges, just like the filter clamps neighbors to the image, so the tile
+  // gets the same result as in the whole image (up to the cells of the grid engine)
+  if (engine != BilateralEngine::lut) {
+    cv::Mat_<cv::Vec3f> colorPlane;
+    getPaddedRect(tc.colorUp, tile, radius)
+        .convertTo(colorPlane, CV_32FC3, 1 / cv_util::maxPixelValue(tc.colorUp));
+    const cv::Mat_<bool> maskPlane = getPaddedRect(tc.maskUpIn, tile, radius);
+    const cv::Mat_<float> filtered = generalizedJointBilateralFilter<float, cv::Vec3f>(
+        dispPlane,
+        colorPlane,
+        colorPlane,
+        maskPlane,
+        radius,
+        tc.sigma,
+        tc.weights[0],
+        tc.weights[1],
+        tc.weights[2],
+        0,
+        engine);
+    filtered(cv::Rect(radius, radius, tile.width, tile.height)).copyTo(dispUp(tile));
+    return;
+  }
+
+  const std::vector<float> guideScales(tc.guideScales, tc.guideScales + 3);
+  const std::vector<cv::Mat_<float>> guidePlanes =
+      getBilateralPlanes(getPaddedRect(tc.colorUp, tile, radius), guideScales, 0);
+  const std::vector<cv::Mat_<float>> maskPlanes =
+      getBilateralPlanes(getPaddedRect(tc.maskUpIn, tile, radius) != 0, {1.0f / 255.0f}, 0);
+
+  BilateralInput in;
+  in.cols = tile.width;
+  in.rows = tile.height;
+  in.step = tile.width + 2 * radius;
+  in.border = radius;
+  in.channels = 1;
+  in.image[0] = &dispPlane(radius, radius);
+  for (int c = 0; c < 3; ++c) {
+    in.guide[c] = &guidePlanes[c](radius, radius);
+    in.neighborGuide[c] = in.guide[c];
+  }
+  in.mask = &maskPlanes[0](radius, radius);
+
+  cv::Mat_<float> filtered(tile.size());
+  BilateralOutput out;
+  out.image[0] = filtered.ptr<float>();
+  jointBilateralFilterLut(in, radius, 0, tile.height, out);
+  filtered.copyTo(dispUp(tile));
+}
+
+std::vector<cv::Mat_<float>> upsampleDisparitiesTiled(
+    const Camera::Rig& rigIn,
+    const std::vector<cv::Mat_<float>>& disps,
+    const std::vector<cv::Mat_<float>>& bgDispsUp,
+    const std::vector<cv::Mat_<bool>>& masks,
+    const std::vector<cv::Mat_<bool>>& masksUpIn,
+    const std::vector<cv::Mat>& colorsUp,
+    const cv::Size& sizeUp,
+    const bool useForegroundMasks,
+    const float sigma,
+    const float weight0,
+    const float weight1,
+    const float weight2,
+    const BilateralEngine engine,
+    const int tileSize,
+    const int threads) {
+  CHECK_EQ(disps.size(), masks.size());
+  CHECK_EQ(disps.size(), masksUpIn.size());
+  CHECK(colorsUp.empty() || colorsUp.size() == disps.size());
+  CHECK_GT(tileSize, 0);
+
+  Camera::Rig rig = Camera::Rig(rigIn);
+  Camera::normalizeRig(rig);
+  const std::vector<cv::Mat_<bool>> fovMasks =
+      depth_estimation::generateFovMasks(rig, disps[0].size(), threads);
+  const int radius = getRadius(disps[0].size(), sizeUp);
+  const float weights[3] = {weight0, weight1, weight2};
+
+  // Everything at the input resolution is prepared up front
+  std::vector<TiledCamera> tiledCams(disps.size());
+  std::vector<cv::Mat_<float>> dispsUp(disps.size());
+  for (int i = 0; i < int(disps.size()); ++i) {
+    TiledCamera& tc = tiledCams[i];
+    tc.cam = &rig[i];
+    tc.dispSmall = disps[i].clone();
+    if (useForegroundMasks) {
+      tc.dispSmall.setTo(NAN, (fovMasks[i] & masks[i]) == 0);
+    } else {
+      // OpenCV doesn't handle NaNs when resizing
+      const float minDisp = 1e-4;
+      tc.dispSmall.setTo(minDisp, disps[i] != disps[i]);
+    }
+    tc.bgDispUp = bgDispsUp[i];
+    CHECK(tc.bgDispUp.empty() || tc.bgDispUp.size() == sizeUp);
+    tc.maskUpIn = masksUpIn[i];
+    if (tc.maskUpIn.size() != sizeUp) {
+      LOG(WARNING) << "Warning: Desired resolution does not match mask resolution: " << sizeUp
+                   << " vs. " << tc.maskUpIn.size() << ". Rescaling mask to " << sizeUp;
+      tc.maskUpIn = cv_util::resizeImage(masksUpIn[i], sizeUp, cv::INTER_NEAREST);
+    }
+    if (!colorsUp.empty()) {
+      tc.colorUp = colorsUp[i];
+      CHECK_EQ(tc.colorUp.size(), sizeUp);
+      CHECK_EQ(tc.colorUp.channels(), 3);
+      tc.sigma = sigma;
+      for (int c = 0; c < 3; ++c) {
+        tc.weights[c] = weights[c];
+        // Range weight becomes exp(-|a - b|^2), as in generalizedJointBilateralFilter()
+        tc.guideScales[c] = std::sqrt(weights[c] / (6.0f * math_util::square(sigma))) /
+            cv_util::maxPixelValue(tc.colorUp);
+      }
+    }
+    dispsUp[i].create(sizeUp);
+  }
+
+  const int tilesX = (sizeUp.width + tileSize - 1) / tileSize;
+  const int tilesY = (sizeUp.height + tileSize - 1) / tileSize;
+  const int tilesPerCam = tilesX * tilesY;
+  const int numTiles = tilesPerCam * int(disps.size());
+  ThreadPool threadPool(threads);
+  threadPool.parallelFor(0, numTiles, 1, [&](const int begin, const int end) {
+    for (int t = begin; t < end; ++t) {
+      const int i = t / tilesPerCam;
+      const int x = (t % tilesPerCam) % tilesX * tileSize;
+      const int y = (t % tilesPerCam) / tilesX * tileSize;
+      const cv::Rect tile(
+          x, y, std::min(tileSize, sizeUp.width - x), std::min(tileSize, sizeUp.height - y));
+      upsampleTile(tiledCams[i], sizeUp, useForegroundMasks, radius, engine, tile, dispsUp[i]);
+    }
+  });
+  return dispsUp;
+}
+
 } // namespace depth_estimation
 } // namespace fb360_dep
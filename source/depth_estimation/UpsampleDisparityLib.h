@@ -10,6 +10,7 @@
 #include <opencv2/core.hpp>
 #include <opencv2/core/types.hpp>
 
+#include "source/depth_estimation/BilateralKernels.h"
 #include "source/util/Camera.h"
 #include "source/util/ImageUtil.h"
 
@@ -28,5 +29,27 @@ std::vector<cv::Mat_<float>> upsampleDisparities(
     const bool useForegroundMasks,
     const int threads = -1);
 
+// upsampleDisparities() followed, if colorsUp is not empty, by the joint bilateral filter of
+// UpsampleDisparity: radius getRadius(), guided by colorsUp, over masksUpIn, with engine
+// Resizing, NAN filling and filtering are fused, one tileSize x tileSize output tile at a time, and
+// the tiles of all cameras run in parallel, so besides the inputs and outputs only a few tiles
+// per thread are kept in memory
+std::vector<cv::Mat_<float>> upsampleDisparitiesTiled(
+    const Camera::Rig& rig,
+    const std::vector<cv::Mat_<float>>& disps,
+    const std::vector<cv::Mat_<float>>& bgDispsUp,
+    const std::vector<cv::Mat_<bool>>& masks,
+    const std::vector<cv::Mat_<bool>>& masksUpIn,
+    const std::vector<cv::Mat>& colorsUp,
+    const cv::Size& sizeUp,
+    const bool useForegroundMasks,
+    const float sigma,
+    const float weight0,
+    const float weight1,
+    const float weight2,
+    const BilateralEngine engine,
+    const int tileSize = 256,
+    const int threads = -1);
+
 } // namespace depth_estimation
 } // namespace fb360_dep
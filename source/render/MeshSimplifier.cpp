@@ -16,10 +16,11 @@
 
 #include <map>
 #include <set>
-#include <thread>
 
 #include <folly/Format.h>
 
+#include "source/util/ThreadPool.h"
+
 using namespace fb360_dep;
 using namespace fb360_dep::render;
 
@@ -55,28 +56,23 @@ MeshSimplifier::MeshSimplifier(
   LOG(INFO) << folly::sformat("Getting {} vertexes...", vertexesIn.rows());
 
   vertexes.resize(vertexesIn.rows());
-  std::vector<std::thread> threads;
+  ThreadPool threadPool(numThreads);
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * vertexesIn.rows() / numThreads;
     const int end = (i + 1) * vertexesIn.rows() / numThreads;
-    threads.emplace_back(&MeshSimplifier::loadVertexes, this, vertexesIn, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::loadVertexes, this, std::cref(vertexesIn), begin, end);
   }
+  threadPool.join();
 
   LOG(INFO) << folly::sformat("Getting {} faces...", facesIn.rows());
 
   faces.resize(facesIn.rows());
-  threads.clear();
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * facesIn.rows() / numThreads;
     const int end = (i + 1) * facesIn.rows() / numThreads;
-    threads.emplace_back(&MeshSimplifier::loadFaces, this, facesIn, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::loadFaces, this, std::cref(facesIn), begin, end);
   }
+  threadPool.join();
 }
 
 Eigen::MatrixXd MeshSimplifier::getVertexes() {
@@ -204,17 +200,15 @@ void MeshSimplifier::computeSubError(const int begin, const int end) {
 }
 
 void MeshSimplifier::computeInitialQuadrics() {
-  std::vector<std::thread> threads;
+  ThreadPool threadPool(numThreads);
 
   LOG(INFO) << "Computing quadrics...";
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * faces.size() / numThreads;
     const int end = (i + 1) * faces.size() / numThreads;
-    threads.emplace_back(&MeshSimplifier::computeSubQuadrics, this, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::computeSubQuadrics, this, begin, end);
   }
+  threadPool.join();
 
   LOG(INFO) << "Accumulating quadrics...";
   for (auto& face : faces) {
@@ -224,15 +218,12 @@ void MeshSimplifier::computeInitialQuadrics() {
   }
 
   LOG(INFO) << "Updating faces costs...";
-  threads.clear();
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * faces.size() / numThreads;
     const int end = (i + 1) * faces.size() / numThreads;
-    threads.emplace_back(&MeshSimplifier::computeSubError, this, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::computeSubError, this, begin, end);
   }
+  threadPool.join();
 }
 
 // Remove from the list all faces that have been marked as deleted
@@ -316,15 +307,13 @@ void MeshSimplifier::identifySubBoundaries(const int begin, const int end) {
 }
 
 void MeshSimplifier::identifyBoundaries() {
-  std::vector<std::thread> threads;
+  ThreadPool threadPool(numThreads);
   for (int i = 0; i < numThreads; ++i) {
     const int begin = i * vertexes.size() / numThreads;
     const int end = (i + 1) * vertexes.size() / numThreads;
-    threads.emplace_back(&MeshSimplifier::identifySubBoundaries, this, begin, end);
-  }
-  for (std::thread& thread : threads) {
-    thread.join();
+    threadPool.spawn(&MeshSimplifier::identifySubBoundaries, this, begin, end);
   }
+  threadPool.join();
 }
 
 double MeshSimplifier::getThreshold(const float strictness) {
@@ -0,0 +1,18 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace fb360_dep {
+
+// Number of calls to operator new so far, by any thread of the test binary
+// AllocationCounter.cpp replaces the global operator new to count them
+int64_t getAllocationCount();
+
+} // namespace fb360_dep
@@ -0,0 +1,65 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "source/depth_estimation/PyramidLevel.h"
+#include "source/test/TestRig.h"
+
+namespace fb360_dep {
+
+// In-memory pyramid level of the first numCams cameras of testRigJson (-1 = all), with smooth
+// random colors so that interpolated samples differ from their neighbors
+inline std::unique_ptr<depth_estimation::PyramidLevel<depth_estimation::PixelType>>
+makeTestPyramidLevel(const cv::Size& size, const int numCams = -1) {
+  using namespace depth_estimation;
+  Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  if (numCams >= 0) {
+    CHECK_GT(numCams, 0);
+    CHECK_LE(numCams, int(rig.size()));
+    rig.resize(numCams);
+  }
+  const int widthFullSize = rig[0].resolution.x();
+  const int heightFullSize = rig[0].resolution.y();
+  Camera::normalizeRig(rig);
+
+  const int numRigCams = rig.size();
+  cv::RNG rng(1);
+  std::vector<cv::Mat_<PixelType>> colors(numRigCams);
+  for (cv::Mat_<PixelType>& color : colors) {
+    color.create(size);
+    rng.fill(color, cv::RNG::UNIFORM, 0, 65535);
+    cv::GaussianBlur(color, color, cv::Size(3, 3), 0);
+  }
+  const std::vector<cv::Mat_<bool>> masks = cv_util::generateAllPassMasks(size, numRigCams);
+  return std::unique_ptr<PyramidLevel<PixelType>>(new PyramidLevel<PixelType>(
+      0,
+      "000000",
+      1,
+      0,
+      1,
+      {{0, size}},
+      rig,
+      rig,
+      mapSrcToDstIndexes(rig, rig),
+      colors,
+      masks,
+      masks,
+      std::vector<cv::Mat_<float>>(numRigCams),
+      widthFullSize,
+      heightFullSize,
+      "",
+      4e-5,
+      1e-3,
+      false,
+      "",
+      -1));
+}
+
+} // namespace fb360_dep
@@ -0,0 +1,218 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/calibration/BinaryMatches.h"
+#include "source/calibration/FeatureCache.h"
+#include "source/calibration/FeatureDetector.h"
+#include "source/calibration/FeatureMatcher.h"
+#include "source/calibration/MatchCorners.h"
+#include "source/test/TestRig.h"
+#include "source/util/FilesystemUtil.h"
+
+DECLARE_int32(max_corners);
+
+namespace fb360_dep {
+namespace calibration {
+
+struct FeatureCacheTest : ::testing::Test {
+  void SetUp() override {
+    dir = filesystem::temp_directory_path() / filesystem::unique_path("feature_cache_%%%%%%");
+  }
+
+  void TearDown() override {
+    filesystem::remove_all(dir);
+  }
+
+  filesystem::path dir;
+};
+
+TEST_F(FeatureCacheTest, TestBinaryMatchesRoundTrip) {
+  // Names of lengths that need padding and a pair with no matches
+  const std::vector<Camera::Vector2> corners0 = {{1.5, 2.25}, {1e-9, 3000}, {-1, 0.125}};
+  const std::vector<Camera::Vector2> corners1 = {{7, 8}};
+  const std::vector<BinaryMatch> matches = {{{0, 0}, 0.9}, {{2, 0}, 0.75}};
+  BinaryMatchesWriter writer;
+  writer.addImage("cam0/000000.png", corners0);
+  writer.addImage("cam10/000000.png", corners1);
+  writer.addImage("c", {});
+  writer.addOverlap("cam0/000000.png", "cam10/000000.png", matches);
+  writer.addOverlap("cam0/000000.png", "c", {});
+  filesystem::create_directories(dir);
+  const std::string path = (dir / "matches.bin").string();
+  ASSERT_TRUE(isBinaryMatchesFile(path));
+  writer.save(path);
+
+  const BinaryMatchesFile file(path);
+  ASSERT_EQ(file.images.size(), 3u);
+  EXPECT_EQ(file.images[0].image, "cam0/000000.png");
+  EXPECT_EQ(file.images[1].image, "cam10/000000.png");
+  EXPECT_EQ(file.images[2].image, "c");
+  ASSERT_EQ(file.images[0].cornerCount, int(corners0.size()));
+  for (int i = 0; i < int(corners0.size()); ++i) {
+    EXPECT_EQ(file.images[0].corner(i), corners0[i]);
+  }
+  ASSERT_EQ(file.images[1].cornerCount, 1);
+  EXPECT_EQ(file.images[1].corner(0), corners1[0]);
+  EXPECT_EQ(file.images[2].cornerCount, 0);
+
+  ASSERT_EQ(file.overlaps.size(), 2u);
+  EXPECT_EQ(file.overlaps[0].images[0], "cam0/000000.png");
+  EXPECT_EQ(file.overlaps[0].images[1], "cam10/000000.png");
+  ASSERT_EQ(file.overlaps[0].matchCount, int(matches.size()));
+  for (int i = 0; i < int(matches.size()); ++i) {
+    EXPECT_EQ(file.overlaps[0].matches[i].corners[0], matches[i].corners[0]);
+    EXPECT_EQ(file.overlaps[0].matches[i].corners[1], matches[i].corners[1]);
+    EXPECT_EQ(file.overlaps[0].matches[i].score, matches[i].score);
+  }
+  EXPECT_EQ(file.overlaps[1].images[1], "c");
+  EXPECT_EQ(file.overlaps[1].matchCount, 0);
+  EXPECT_FALSE(isBinaryMatchesFile((dir / "matches.json").string()));
+}
+
+TEST_F(FeatureCacheTest, TestCacheRoundTrip) {
+  const FeatureCache cache(dir.string());
+  ASSERT_TRUE(cache.isEnabled());
+  const std::vector<Camera::Vector2> corners = {{10.25, 20.5}, {30, 40}};
+  const std::vector<BinaryMatch> matches = {{{1, 0}, 0.8}};
+
+  std::vector<Camera::Vector2> loadedCorners;
+  std::vector<BinaryMatch> loadedMatches;
+  EXPECT_FALSE(cache.loadCorners(1, loadedCorners));
+  EXPECT_FALSE(cache.loadMatches(1, loadedMatches));
+  cache.saveCorners(1, corners);
+  cache.saveMatches(1, matches);
+  ASSERT_TRUE(cache.loadCorners(1, loadedCorners));
+  EXPECT_EQ(loadedCorners, corners);
+  ASSERT_TRUE(cache.loadMatches(1, loadedMatches));
+  ASSERT_EQ(loadedMatches.size(), 1u);
+  EXPECT_EQ(loadedMatches[0].corners[0], 1);
+  EXPECT_EQ(loadedMatches[0].score, 0.8);
+  EXPECT_FALSE(cache.loadCorners(2, loadedCorners));
+
+  const FeatureCache disabled("");
+  EXPECT_FALSE(disabled.isEnabled());
+  disabled.saveCorners(1, corners);
+  EXPECT_FALSE(disabled.loadCorners(1, loadedCorners));
+}
+
+TEST_F(FeatureCacheTest, TestUnreadableEntriesAreMisses) {
+  const FeatureCache cache(dir.string());
+  const std::vector<Camera::Vector2> corners = {{10.25, 20.5}, {30, 40}};
+  const std::vector<BinaryMatch> matches = {{{1, 0}, 0.8}};
+  cache.saveCorners(1, corners);
+  cache.saveMatches(1, matches);
+
+  // Cut every entry short
+  for (const filesystem::directory_entry& entry : filesystem::directory_iterator(dir)) {
+    filesystem::resize_file(entry.path(), filesystem::file_size(entry.path()) - 4);
+  }
+  std::vector<Camera::Vector2> loadedCorners;
+  std::vector<BinaryMatch> loadedMatches;
+  EXPECT_FALSE(cache.loadCorners(1, loadedCorners));
+  EXPECT_FALSE(cache.loadMatches(1, loadedMatches));
+
+  // Saving again replaces them
+  cache.saveCorners(1, corners);
+  cache.saveMatches(1, matches);
+  ASSERT_TRUE(cache.loadCorners(1, loadedCorners));
+  EXPECT_EQ(loadedCorners, corners);
+  ASSERT_TRUE(cache.loadMatches(1, loadedMatches));
+  EXPECT_EQ(loadedMatches.size(), 1u);
+
+  // Not a binary matches file at all
+  std::string error;
+  const filesystem::path garbage = dir / "garbage.bin";
+  std::ofstream(garbage.string()) << "garbage";
+  EXPECT_FALSE(BinaryMatchesFile::tryLoad(garbage.string(), error));
+  EXPECT_FALSE(error.empty());
+}
+
+TEST_F(FeatureCacheTest, TestCachedRunsMatchUncachedRun) {
+  // Rig and images of FeatureMatcherTest.TestFindAllMatchesMatchesPairs
+  Camera::Rig rig;
+  std::vector<cv::Mat_<uint8_t>> images;
+  cv::RNG rng(1);
+  for (const Camera& camera : Camera::loadRigFromJsonString(testRigJson)) {
+    if (rig.size() < 4) {
+      rig.push_back(camera.rescale(camera.resolution / 8));
+      images.emplace_back(rig.back().resolution.y(), rig.back().resolution.x());
+      rng.fill(images.back(), cv::RNG::UNIFORM, 0, 256);
+      cv::GaussianBlur(images.back(), images.back(), cv::Size(5, 5), 0);
+    }
+  }
+  const int maxCorners = FLAGS_max_corners;
+  FLAGS_max_corners = 300;
+  const std::map<std::string, std::vector<Keypoint>> expectedCorners =
+      findAllCorners(rig, images, false);
+  const std::vector<Overlap> expected = findAllMatches(rig, images, expectedCorners);
+
+  // Fill the cache, read everything from it, then only the corners, whose patches are sampled
+  // again from their coordinates
+  const FeatureCache cache(dir.string());
+  const std::vector<std::string> runs = {"empty", "cached", "corners only"};
+  std::vector<std::map<std::string, std::vector<Keypoint>>> allCorners(runs.size());
+  std::vector<std::vector<Overlap>> overlaps(runs.size());
+  for (int run = 0; run < int(runs.size()); ++run) {
+    if (runs[run] == "corners only") {
+      for (const filesystem::directory_entry& entry : filesystem::directory_iterator(dir)) {
+        if (entry.path().string().find(".matches") != std::string::npos) {
+          filesystem::remove(entry.path());
+        }
+      }
+    }
+    findAllCornersAndMatches(allCorners[run], overlaps[run], rig, images, cache);
+  }
+  FLAGS_max_corners = maxCorners;
+
+  for (int run = 0; run < int(runs.size()); ++run) {
+    for (const auto& entry : expectedCorners) {
+      const std::vector<Keypoint>& corners = allCorners[run].at(entry.first);
+      ASSERT_EQ(corners.size(), entry.second.size()) << runs[run];
+      for (int i = 0; i < int(corners.size()); ++i) {
+        EXPECT_EQ(corners[i].coords, entry.second[i].coords) << runs[run];
+      }
+    }
+    ASSERT_EQ(overlaps[run].size(), expected.size()) << runs[run];
+    for (int i = 0; i < int(expected.size()); ++i) {
+      const Overlap& overlap = overlaps[run][i];
+      EXPECT_EQ(overlap.images, expected[i].images) << runs[run];
+      ASSERT_EQ(overlap.matches.size(), expected[i].matches.size()) << runs[run] << " " << i;
+      for (int m = 0; m < int(expected[i].matches.size()); ++m) {
+        EXPECT_EQ(overlap.matches[m].corners, expected[i].matches[m].corners) << runs[run];
+        EXPECT_EQ(overlap.matches[m].score, expected[i].matches[m].score) << runs[run];
+      }
+    }
+  }
+}
+
+TEST_F(FeatureCacheTest, TestHashImage) {
+  cv::Mat_<uint8_t> image(40, 60);
+  cv::RNG rng(1);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+
+  // Only the pixels count, not the layout in memory
+  const cv::Mat_<uint8_t> roi = image(cv::Rect(5, 5, 30, 20));
+  EXPECT_EQ(hashImage(roi), hashImage(roi.clone()));
+  EXPECT_NE(hashImage(roi), hashImage(image));
+  EXPECT_NE(hashImage(image.reshape(1, 60)), hashImage(image));
+
+  cv::Mat_<uint8_t> changed = image.clone();
+  ++changed(39, 59);
+  EXPECT_NE(hashImage(changed), hashImage(image));
+  EXPECT_NE(hashImage(image, 1), hashImage(image));
+  EXPECT_NE(hashString("c", hashString("ab")), hashString("bc", hashString("a")));
+}
+
+} // namespace calibration
+} // namespace fb360_dep
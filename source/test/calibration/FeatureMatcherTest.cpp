@@ -0,0 +1,174 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/calibration/FeatureDetector.h"
+#include "source/calibration/FeatureMatcher.h"
+#include "source/test/TestRig.h"
+
+DECLARE_int32(max_corners);
+
+namespace fb360_dep {
+namespace calibration {
+
+struct FeatureMatcherTest : ::testing::Test {};
+
+// Smooth corner of a bright quadrant at (x, y) in a 33 x 33 patch
+static cv::Mat_<uint8_t> makeCornerPatch(const double x, const double y) {
+  cv::Mat_<uint8_t> patch(33, 33);
+  for (int row = 0; row < patch.rows; ++row) {
+    for (int col = 0; col < patch.cols; ++col) {
+      const double sx = 1 / (1 + std::exp(-1.5 * (col + 0.5 - x)));
+      const double sy = 1 / (1 + std::exp(-1.5 * (row + 0.5 - y)));
+      patch(row, col) = cv::saturate_cast<uint8_t>(40 + 170 * sx * sy);
+    }
+  }
+  return patch;
+}
+
+TEST(FeatureMatcherTest, TestHasCornerNearMatchesFindScaledCorners) {
+  std::vector<cv::Mat_<uint8_t>> patches;
+  for (const double shift : {0.0, 0.2, 0.4, 1.0, 3.0, 10.0}) {
+    patches.push_back(makeCornerPatch(16.5 + shift, 16.5 - shift / 2));
+  }
+  patches.push_back(cv::Mat_<uint8_t>(33, 33, uint8_t(100)));
+
+  // Patches of a textured image around its own corners
+  cv::Mat_<uint8_t> image(200, 300);
+  cv::RNG rng(1);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+  cv::GaussianBlur(image, image, cv::Size(0, 0), 2);
+  const std::vector<Camera::Vector2> corners = findScaledCorners(1, image, cv::Mat_<uint8_t>());
+  for (int i = 0; i < int(corners.size()) && int(patches.size()) < 50; ++i) {
+    const cv::Rect patch(int(corners[i].x()) - 16, int(corners[i].y()) - 16, 33, 33);
+    if ((patch & cv::Rect(0, 0, image.cols, image.rows)) == patch) {
+      patches.push_back(image(patch).clone());
+    }
+  }
+
+  const Camera::Vector2 center(16.5, 16.5);
+  for (const double tolerance : {0.5, 2.0}) {
+    for (int i = 0; i < int(patches.size()); ++i) {
+      bool expected = false;
+      for (const Camera::Vector2& corner : findScaledCorners(1, patches[i], cv::Mat_<uint8_t>())) {
+        expected = expected || (corner - center).norm() <= tolerance;
+      }
+      EXPECT_EQ(hasCornerNear(patches[i], center, tolerance), expected)
+          << "tolerance " << tolerance << " patch " << i;
+    }
+  }
+  EXPECT_TRUE(hasCornerNear(patches[0], center, 0.5));
+  EXPECT_FALSE(hasCornerNear(patches[5], center, 0.5));
+}
+
+TEST(FeatureMatcherTest, TestProjectCornerMatchesExactWarp) {
+  // Camera 0 and the camera that overlaps it most
+  const Camera::Rig rig = Camera::loadRigFromJsonString(testRigJson);
+  int best = 1;
+  for (int i = 2; i < int(rig.size()); ++i) {
+    if (rig[0].overlap(rig[i]) > rig[0].overlap(rig[best])) {
+      best = i;
+    }
+  }
+  const Camera camera0 = rig[0].rescale(rig[0].resolution / 4);
+  const Camera camera1 = rig[best].rescale(rig[best].resolution / 4);
+  cv::Mat_<uint8_t> img0(camera0.resolution.y(), camera0.resolution.x());
+  cv::RNG rng(1);
+  rng.fill(img0, cv::RNG::UNIFORM, 0, 256);
+  cv::GaussianBlur(img0, img0, cv::Size(0, 0), 3);
+
+  const int kRadius = 16;
+  int projected = 0;
+  for (int y = kRadius; y < img0.rows - kRadius; y += 23) {
+    for (int x = kRadius; x < img0.cols - kRadius; x += 23) {
+      const Keypoint corner0(Camera::Vector2(x + 0.25, y + 0.75), img0, kRadius, false);
+      for (const double depth : {1.0, 10.0}) {
+        cv::Mat_<uint8_t> actual;
+        if (!projectCorner(actual, camera1, img0, camera0, corner0, depth)) {
+          continue;
+        }
+
+        // Every pixel mapped exactly in double precision
+        const Camera::Vector3 world = camera0.rig(corner0.coords, depth);
+        Camera::Vector2 corner1;
+        ASSERT_TRUE(camera1.sees(world, corner1));
+        const double depth1 = (world - camera1.position).norm();
+        double maxError = 0;
+        for (int yOffset = -kRadius; yOffset <= kRadius; ++yOffset) {
+          for (int xOffset = -kRadius; xOffset <= kRadius; ++xOffset) {
+            const Camera::Vector2 pixel1 = corner1 + Camera::Vector2(xOffset, yOffset);
+            Camera::Vector2 pixel0;
+            if (camera0.sees(camera1.rig(pixel1, depth1), pixel0)) {
+              const double expected = cv_util::getPixelBilinear(img0, pixel0.x(), pixel0.y());
+              const double error = actual(yOffset + kRadius, xOffset + kRadius) - expected;
+              maxError = std::max(maxError, std::abs(error));
+            }
+          }
+        }
+        EXPECT_LE(maxError, 2) << "corner " << x << " " << y << " depth " << depth;
+        ++projected;
+      }
+    }
+  }
+  EXPECT_GT(projected, 0);
+}
+
+TEST(FeatureMatcherTest, TestFindAllMatchesMatchesPairs) {
+  // Enough corners for several chunks per pair
+  Camera::Rig rig;
+  std::vector<cv::Mat_<uint8_t>> images;
+  std::map<std::string, std::vector<Keypoint>> allCorners;
+  cv::RNG rng(1);
+  const int maxCorners = FLAGS_max_corners;
+  FLAGS_max_corners = 300;
+  for (const Camera& camera : Camera::loadRigFromJsonString(testRigJson)) {
+    if (rig.size() < 4) {
+      rig.push_back(camera.rescale(camera.resolution / 8));
+      images.emplace_back(rig.back().resolution.y(), rig.back().resolution.x());
+      rng.fill(images.back(), cv::RNG::UNIFORM, 0, 256);
+      cv::GaussianBlur(images.back(), images.back(), cv::Size(5, 5), 0);
+      allCorners[rig.back().id] = findCorners(rig.back(), images.back(), false);
+    }
+  }
+  FLAGS_max_corners = maxCorners;
+
+  const int threads = FLAGS_threads;
+  FLAGS_threads = 8;
+  const std::vector<Overlap> overlaps = findAllMatches(rig, images, allCorners);
+  FLAGS_threads = threads;
+
+  int i = 0;
+  for (int c0 = 0; c0 < int(rig.size()); ++c0) {
+    for (int c1 = c0 + 1; c1 < int(rig.size()); ++c1) {
+      const Overlap expected = findMatches(
+          images[c0],
+          allCorners[rig[c0].id],
+          rig[c0],
+          images[c1],
+          allCorners[rig[c1].id],
+          rig[c1]);
+      ASSERT_LT(i, int(overlaps.size()));
+      EXPECT_EQ(overlaps[i].images, expected.images);
+      ASSERT_EQ(overlaps[i].matches.size(), expected.matches.size()) << c0 << " " << c1;
+      for (int m = 0; m < int(expected.matches.size()); ++m) {
+        EXPECT_EQ(overlaps[i].matches[m].corners, expected.matches[m].corners);
+        EXPECT_EQ(overlaps[i].matches[m].score, expected.matches[m].score);
+      }
+      ++i;
+    }
+  }
+  EXPECT_EQ(i, int(overlaps.size()));
+}
+
+} // namespace calibration
+} // namespace fb360_dep
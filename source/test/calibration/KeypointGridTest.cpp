@@ -0,0 +1,63 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/calibration/Keypoint.h"
+
+namespace fb360_dep {
+namespace calibration {
+
+struct KeypointGridTest : ::testing::Test {};
+
+TEST(KeypointGridTest, TestQueryMatchesScan) {
+  const cv::Mat_<uint8_t> image(150, 200, uint8_t(128));
+  cv::RNG rng(1);
+  std::vector<Keypoint> keypoints;
+  for (int i = 0; i < 500; ++i) {
+    const Camera::Vector2 coords(rng.uniform(1.0, 198.0), rng.uniform(1.0, 148.0));
+    keypoints.emplace_back(coords, image, 1, true);
+  }
+  keypoints.emplace_back(keypoints[7].coords, image, 1, true); // same coords twice
+
+  for (const float cellSize : {1.0f, 17.0f, 1000.0f}) {
+    const KeypointGrid grid(keypoints, cellSize);
+    std::vector<int> actual;
+    for (int i = 0; i < 200; ++i) {
+      // Boxes of all sizes, partly or entirely outside the keypoints
+      const cv::Rect2f box(
+          rng.uniform(-50.0f, 250.0f),
+          rng.uniform(-50.0f, 200.0f),
+          rng.uniform(0.0f, 80.0f),
+          rng.uniform(0.0f, 80.0f));
+      std::vector<int> expected;
+      for (int index = 0; index < int(keypoints.size()); ++index) {
+        const cv::Point2f point(keypoints[index].coords.x(), keypoints[index].coords.y());
+        if (box.contains(point)) {
+          expected.push_back(index);
+        }
+      }
+      grid.query(box, actual);
+      EXPECT_EQ(actual, expected) << "cell size " << cellSize << " box " << box;
+    }
+
+    grid.query(cv::Rect2f(NAN, 0, 10, 10), actual);
+    EXPECT_TRUE(actual.empty());
+  }
+
+  // No keypoints
+  const KeypointGrid empty(std::vector<Keypoint>(), 10);
+  std::vector<int> actual;
+  empty.query(cv::Rect2f(0, 0, 100, 100), actual);
+  EXPECT_TRUE(actual.empty());
+}
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -0,0 +1,110 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/calibration/FeatureMatcher.h"
+#include "source/calibration/ZnccKernels.h"
+
+DECLARE_bool(custom_zncc);
+
+namespace fb360_dep {
+namespace calibration {
+
+struct ZnccKernelsTest : ::testing::Test {
+  // Keypoints with the default 33 x 33 patches over a smooth random image, so that patches are
+  // correlated without being equal
+  void SetUp() override {
+    cv::Mat_<uint8_t> image(200, 300);
+    cv::RNG rng(1);
+    rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(image, image, cv::Size(0, 0), 3);
+    for (int i = 0; i < 50; ++i) {
+      const Camera::Vector2 coords(rng.uniform(20.0, 280.0), rng.uniform(20.0, 180.0));
+      keypoints.emplace_back(coords, image, kRadius, false);
+    }
+  }
+
+  static const int kRadius = 16;
+  std::vector<Keypoint> keypoints;
+};
+
+TEST_F(ZnccKernelsTest, TestDotProductsMatchScalar) {
+  const int size = int(keypoints[0].normalized.size());
+  ASSERT_EQ(size % kZnccPatchAlignment, 0);
+  std::vector<const float*> candidates;
+  for (const Keypoint& keypoint : keypoints) {
+    candidates.push_back(keypoint.normalized.data());
+  }
+  // Every count of candidates left over after the passes of the vector kernel
+  for (int count = 0; count <= 9; ++count) {
+    std::vector<float> expected(count);
+    dotProductsScalar(candidates[0], candidates.data() + 1, count, size, expected.data());
+    std::vector<float> actual(count);
+    dotProducts(candidates[0], candidates.data() + 1, count, size, actual.data());
+    for (int i = 0; i < count; ++i) {
+      EXPECT_NEAR(actual[i], expected[i], 1e-5) << "count " << count << " candidate " << i;
+    }
+  }
+}
+
+TEST_F(ZnccKernelsTest, TestZnccsMatchReference) {
+  std::vector<int> indices;
+  for (int i = 0; i < int(keypoints.size()); ++i) {
+    indices.push_back(i);
+  }
+  const bool customZncc = FLAGS_custom_zncc;
+  for (const bool custom : {false, true}) {
+    FLAGS_custom_zncc = custom;
+    std::vector<double> scores;
+    computeZnccs(scores, keypoints[3], keypoints, indices);
+    ASSERT_EQ(scores.size(), keypoints.size());
+    for (int i = 0; i < int(keypoints.size()); ++i) {
+      const double expected = computeZncc(keypoints[3], keypoints[i]);
+      EXPECT_NEAR(scores[i], expected, 1e-5 * std::max(1.0, std::abs(expected)))
+          << "custom " << custom << " keypoint " << i;
+    }
+    EXPECT_NEAR(scores[3], 1, 1e-5); // both formulas give 1 for a patch against itself
+  }
+  FLAGS_custom_zncc = customZncc;
+}
+
+TEST_F(ZnccKernelsTest, TestFlatPatchesMatchReference) {
+  const cv::Mat_<uint8_t> flatImage(200, 300, uint8_t(100));
+  std::vector<Keypoint> corners1 = {keypoints[0], keypoints[1]};
+  corners1.emplace_back(Camera::Vector2(100, 100), flatImage, kRadius, false);
+  const Keypoint& flat = corners1.back();
+  ASSERT_EQ(flat.std, 0);
+  const bool customZncc = FLAGS_custom_zncc;
+  for (const bool custom : {false, true}) {
+    FLAGS_custom_zncc = custom;
+    for (const Keypoint& corner0 : {keypoints[0], flat}) {
+      std::vector<double> scores;
+      computeZnccs(scores, corner0, corners1, {0, 1, 2});
+      for (int i = 0; i < int(corners1.size()); ++i) {
+        const double expected = computeZncc(corner0, corners1[i]);
+        if (std::isnan(expected)) {
+          EXPECT_TRUE(std::isnan(scores[i])) << "custom " << custom << " keypoint " << i;
+        } else {
+          EXPECT_NEAR(scores[i], expected, 1e-5 * std::max(1.0, std::abs(expected)))
+              << "custom " << custom << " keypoint " << i;
+        }
+      }
+    }
+  }
+
+  // The custom formula scores a flat patch 0 against a textured one
+  FLAGS_custom_zncc = true;
+  EXPECT_EQ(computeZncc(flat, keypoints[0]), 0);
+  FLAGS_custom_zncc = customZncc;
+}
+
+} // namespace calibration
+} // namespace fb360_dep
@@ -0,0 +1,186 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+
+struct BilateralFilterTest : ::testing::Test {
+  // Two noisy regions split by a diagonal edge, in the guide and in the image, and a sparse mask
+  // Not a multiple of the vector width
+  void SetUp() override {
+    const cv::Size size(301, 131);
+    cv::RNG rng(1);
+    guide.create(size);
+    image.create(size);
+    image2.create(size);
+    mask.create(size);
+    for (int y = 0; y < size.height; ++y) {
+      for (int x = 0; x < size.width; ++x) {
+        const bool isLeft = x + y / 2 < size.width / 2;
+        for (int c = 0; c < 3; ++c) {
+          guide(y, x)[c] = (isLeft ? 0.3f : 0.7f) * 65535 + rng.uniform(0, 2000) + 1000 * c;
+        }
+        image(y, x) = (isLeft ? 1.0f : 2.0f) + rng.uniform(0.0f, 0.2f);
+        image2(y, x) = cv::Vec2f(image(y, x), 3 - image(y, x));
+        mask(y, x) = rng.uniform(0.0f, 1.0f) < 0.9f;
+      }
+    }
+  }
+
+  template <typename TPixel>
+  cv::Mat_<TPixel> filter(
+      const cv::Mat_<TPixel>& input,
+      const int radius,
+      const float sigma,
+      const BilateralEngine engine) {
+    return generalizedJointBilateralFilter<TPixel, cv::Vec3w>(
+        input, guide, guide, mask, radius, sigma, 0.5f, 1.0f, 1.0f, -1, engine);
+  }
+
+  cv::Mat_<cv::Vec3w> guide;
+  cv::Mat_<float> image;
+  cv::Mat_<cv::Vec2f> image2;
+  cv::Mat_<bool> mask;
+};
+
+TEST_F(BilateralFilterTest, TestRangeWeight) {
+  for (float arg = 0; arg < 30; arg += 0.0173f) {
+    EXPECT_NEAR(bilateralRangeWeight(arg), std::exp(-arg), 1e-5f * std::exp(-arg)) << arg;
+  }
+  EXPECT_EQ(bilateralRangeWeight(1000), 0);
+}
+
+TEST_F(BilateralFilterTest, TestLutMatchesBruteForce) {
+  for (const int radius : {1, 3, 6}) {
+    for (const float sigma : {0.005f, 0.05f}) {
+      const cv::Mat_<float> expected = filter(image, radius, sigma, BilateralEngine::bruteForce);
+      const cv::Mat_<float> actual = filter(image, radius, sigma, BilateralEngine::lut);
+      EXPECT_LT(cv::norm(actual, expected, cv::NORM_INF), 1e-4) << radius << " " << sigma;
+    }
+  }
+
+  // Multiple channels are filtered with the same weights
+  const cv::Mat_<cv::Vec2f> expected = filter(image2, 3, 0.05f, BilateralEngine::bruteForce);
+  const cv::Mat_<cv::Vec2f> actual = filter(image2, 3, 0.05f, BilateralEngine::lut);
+  EXPECT_LT(cv::norm(actual, expected, cv::NORM_INF), 1e-4);
+}
+
+TEST_F(BilateralFilterTest, TestNanOutsideMask) {
+  // Disparities outside the FOV are NaN
+  cv::Mat_<float> holes = image.clone();
+  for (int y = 0; y < image.rows; ++y) {
+    for (int x = 0; x < image.cols; ++x) {
+      if (!mask(y, x)) {
+        holes(y, x) = NAN;
+      }
+    }
+  }
+
+  const cv::Mat_<float> expected = filter(holes, 3, 0.05f, BilateralEngine::bruteForce);
+  for (const BilateralEngine engine : {BilateralEngine::lut, BilateralEngine::grid}) {
+    const cv::Mat_<float> actual = filter(holes, 3, 0.05f, engine);
+    const float tolerance = engine == BilateralEngine::lut ? 1e-4 : 0.1;
+    for (int y = 0; y < image.rows; ++y) {
+      for (int x = 0; x < image.cols; ++x) {
+        if (mask(y, x)) {
+          ASSERT_TRUE(std::isfinite(actual(y, x))) << x << " " << y;
+          ASSERT_NEAR(actual(y, x), expected(y, x), tolerance) << x << " " << y;
+        } else {
+          ASSERT_TRUE(std::isnan(actual(y, x))) << x << " " << y;
+        }
+      }
+    }
+  }
+}
+
+TEST_F(BilateralFilterTest, TestLutKernelsMatch) {
+  const cv::Mat_<float> expected = filter(image, 4, 0.05f, BilateralEngine::lut);
+
+  // Scalar kernel on the same planes as filter()
+  const int radius = 4;
+  const float scale = std::sqrt(1 / (6 * math_util::square(0.05f))) / 65535;
+  const std::vector<float> scales = {std::sqrt(0.5f) * scale, scale, scale};
+  const std::vector<cv::Mat_<float>> guidePlanes = getBilateralPlanes(guide, scales, radius);
+  const std::vector<cv::Mat_<float>> imagePlanes = getBilateralPlanes(image, {1.0f}, radius);
+  const std::vector<cv::Mat_<float>> maskPlanes =
+      getBilateralPlanes(mask != 0, {1.0f / 255.0f}, radius);
+  BilateralInput in;
+  in.cols = image.cols;
+  in.rows = image.rows;
+  in.step = image.cols + 2 * radius;
+  in.border = radius;
+  in.channels = 1;
+  in.image[0] = &imagePlanes[0](radius, radius);
+  for (int c = 0; c < 3; ++c) {
+    in.guide[c] = &guidePlanes[c](radius, radius);
+    in.neighborGuide[c] = in.guide[c];
+  }
+  in.mask = &maskPlanes[0](radius, radius);
+
+  cv::Mat_<float> actual(image.size());
+  BilateralOutput out;
+  out.image[0] = actual.ptr<float>();
+  jointBilateralFilterLutScalar(in, radius, 0, image.rows, out);
+  EXPECT_LT(cv::norm(actual, expected, cv::NORM_INF), 1e-5);
+}
+
+TEST_F(BilateralFilterTest, TestGridApproximatesBruteForce) {
+  // Error is relative to the step of 1 across the edge
+  for (const int radius : {2, 5, 12}) {
+    const cv::Mat_<float> expected = filter(image, radius, 0.05f, BilateralEngine::bruteForce);
+    const cv::Mat_<float> actual = filter(image, radius, 0.05f, BilateralEngine::grid);
+    EXPECT_LT(cv::norm(actual, expected, cv::NORM_INF), 0.1) << radius;
+    EXPECT_LT(cv::norm(actual, expected, cv::NORM_L1) / image.total(), 0.01) << radius;
+
+    // Unmasked pixels are untouched
+    for (int y = 0; y < image.rows; ++y) {
+      for (int x = 0; x < image.cols; ++x) {
+        if (!mask(y, x)) {
+          ASSERT_EQ(actual(y, x), image(y, x));
+        }
+      }
+    }
+  }
+}
+
+TEST_F(BilateralFilterTest, TestRecursiveTemporalFilter) {
+  const float decay = 0.9f;
+  RecursiveTemporalFilter<cv::Vec3w> recursiveFilter(0.01f, 1, decay, 0.5f, 1.0f, 1.0f);
+  const cv::Mat_<bool> allPass(image.size(), true);
+
+  // First frame has no history
+  const cv::Mat_<float> first = recursiveFilter.filter(guide, image, allPass);
+  EXPECT_EQ(cv::norm(first, image, cv::NORM_INF), 0);
+
+  // Static colors average the flickering disparities of the frames so far
+  const cv::Mat_<float> flicker = image + 1;
+  cv::Mat_<float> result;
+  for (int frame = 1; frame < 100; ++frame) {
+    result = recursiveFilter.filter(guide, frame % 2 ? flicker : image, mask);
+  }
+  const cv::Point p(10, 10);
+  ASSERT_TRUE(mask(p));
+  EXPECT_NEAR(result(p), image(p) + 0.5f, 0.1f);
+  for (int y = 0; y < image.rows; ++y) {
+    for (int x = 0; x < image.cols; ++x) {
+      if (!mask(y, x)) {
+        ASSERT_EQ(result(y, x), image(y, x));
+      }
+    }
+  }
+
+  // New colors start over
+  const cv::Mat_<cv::Vec3w> newGuide = cv::Scalar::all(65535) - guide;
+  const cv::Mat_<float> restarted = recursiveFilter.filter(newGuide, flicker, allPass);
+  EXPECT_NEAR(restarted(p), flicker(p), 1e-3);
+}
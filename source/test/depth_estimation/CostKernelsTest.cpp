@@ -0,0 +1,365 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/depth_estimation/CostKernels.h"
+
+using namespace fb360_dep::depth_estimation;
+
+struct CostKernelsTest : ::testing::Test {};
+
+static SrcProjector makeTestProjector(const ProjectorType type) {
+  // Camera looking down -z, rotated 30 degrees around y, 10 cm away from dst
+  const float c = std::cos(M_PI / 6);
+  const float s = std::sin(M_PI / 6);
+  return {type,
+          {c, 0, s, 0, 1, 0, -s, 0, c},
+          {0.1f, -0.02f, 0.03f},
+          {300, 300},
+          {512, 384},
+          {1024, 768},
+          {-0.01f, 0.002f, 0},
+          INFINITY,
+          type == ProjectorType::FTHETA ? -1.0f : 0.0f};
+}
+
+static std::vector<uint16_t> makeRandomImage(const int cols, const int rows, std::mt19937& rng) {
+  std::uniform_int_distribution<int> value(0, 65535);
+  std::vector<uint16_t> image(cols * rows * 3);
+  for (uint16_t& v : image) {
+    v = value(rng);
+  }
+  return image;
+}
+
+// Interleaved 3-channel image of cols x rows pixels in format, as raw bytes
+static std::vector<uint8_t> encodeImage(
+    const std::vector<uint16_t>& image,
+    const ColorFormat format) {
+  std::vector<uint8_t> encoded(image.size() * getColorFormatBytes(format));
+  encodeColors(image.data(), image.size(), format, encoded.data());
+  return encoded;
+}
+
+static ImageView3 makeView(
+    const std::vector<uint8_t>& encoded,
+    const int cols,
+    const int rows,
+    const ColorFormat format) {
+  return {encoded.data(), cols, rows, cols * 3, format};
+}
+
+TEST_F(CostKernelsTest, TestProjectToSrc) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(-1, 1);
+  std::uniform_real_distribution<float> disparity(0.01f, 2.0f);
+  const int kCount = 1003; // not a multiple of the vector width
+  std::vector<float> dirX(kCount), dirY(kCount), dirZ(kCount), depth(kCount);
+  for (int i = 0; i < kCount; ++i) {
+    const float x = unit(rng);
+    const float y = unit(rng);
+    const float z = unit(rng) - 0.5f;
+    const float norm = std::sqrt(x * x + y * y + z * z);
+    dirX[i] = x / norm;
+    dirY[i] = y / norm;
+    dirZ[i] = z / norm;
+    depth[i] = 1 / disparity(rng);
+  }
+
+  for (const ProjectorType type : {ProjectorType::FTHETA, ProjectorType::RECTILINEAR}) {
+    const SrcProjector proj = makeTestProjector(type);
+    std::vector<float> srcX(kCount), srcY(kCount), expectedX(kCount), expectedY(kCount);
+    projectToSrc(
+        proj,
+        kCount,
+        dirX.data(),
+        dirY.data(),
+        dirZ.data(),
+        depth.data(),
+        srcX.data(),
+        srcY.data());
+    projectToSrcScalar(
+        proj,
+        kCount,
+        dirX.data(),
+        dirY.data(),
+        dirZ.data(),
+        depth.data(),
+        expectedX.data(),
+        expectedY.data());
+
+    int numSeen = 0;
+    for (int i = 0; i < kCount; ++i) {
+      // Points right on the sensor edge may go either way
+      if (std::isnan(expectedX[i]) != std::isnan(srcX[i])) {
+        continue;
+      }
+      if (!std::isnan(expectedX[i])) {
+        ++numSeen;
+        EXPECT_NEAR(srcX[i], expectedX[i], 1e-2) << i;
+        EXPECT_NEAR(srcY[i], expectedY[i], 1e-2) << i;
+      }
+    }
+    EXPECT_GT(numSeen, kCount / 10);
+  }
+}
+
+TEST_F(CostKernelsTest, TestComputePatchSSDs) {
+  std::mt19937 rng(2);
+  const int kCols = 37;
+  const int kRows = 29;
+  const std::vector<uint16_t> dst = makeRandomImage(kCols, kRows, rng);
+  const std::vector<uint16_t> dstBias = makeRandomImage(kCols, kRows, rng);
+  const std::vector<uint16_t> dstSrc = makeRandomImage(kCols, kRows, rng);
+  const std::vector<uint16_t> dstSrcBias = makeRandomImage(kCols, kRows, rng);
+  const ImageView3 dstView = {dst.data(), kCols, kRows, kCols * 3};
+  const ImageView3 dstBiasView = {dstBias.data(), kCols, kRows, kCols * 3};
+  const ImageView3 dstSrcView = {dstSrc.data(), kCols, kRows, kCols * 3};
+  const ImageView3 dstSrcBiasView = {dstSrcBias.data(), kCols, kRows, kCols * 3};
+
+  // Coordinates cover the borders, where samples are clamped, and unseen points
+  std::uniform_real_distribution<float> coordX(-1, kCols + 1);
+  std::uniform_real_distribution<float> coordY(-1, kRows + 1);
+  for (const int radius : {1, 2}) {
+    const int y = kRows / 2;
+    const int kCount = 2 * (kCols - 2 * radius) + 3;
+    std::vector<int> xs(kCount);
+    std::vector<float> dstSrcX(kCount), dstSrcY(kCount);
+    for (int i = 0; i < kCount; ++i) {
+      xs[i] = radius + i % (kCols - 2 * radius);
+      dstSrcX[i] = i % 11 == 0 ? NAN : coordX(rng);
+      dstSrcY[i] = coordY(rng);
+    }
+
+    std::vector<float> biased(kCount), unbiased(kCount);
+    std::vector<float> expectedBiased(kCount), expectedUnbiased(kCount);
+    computePatchSSDs(
+        dstView,
+        dstBiasView,
+        dstSrcView,
+        dstSrcBiasView,
+        y,
+        radius,
+        kCount,
+        xs.data(),
+        dstSrcX.data(),
+        dstSrcY.data(),
+        biased.data(),
+        unbiased.data());
+    computePatchSSDsScalar(
+        dstView,
+        dstBiasView,
+        dstSrcView,
+        dstSrcBiasView,
+        y,
+        radius,
+        kCount,
+        xs.data(),
+        dstSrcX.data(),
+        dstSrcY.data(),
+        expectedBiased.data(),
+        expectedUnbiased.data());
+
+    for (int i = 0; i < kCount; ++i) {
+      if (std::isnan(dstSrcX[i])) {
+        EXPECT_TRUE(std::isnan(biased[i]) && std::isnan(unbiased[i])) << i;
+        continue;
+      }
+      // Same operations in the same order, and samples round the same way
+      EXPECT_EQ(biased[i], expectedBiased[i]) << i;
+      EXPECT_EQ(unbiased[i], expectedUnbiased[i]) << i;
+    }
+  }
+}
+
+TEST_F(CostKernelsTest, TestComputePatchSSDsIdentical) {
+  // Patch against itself, at integer pixel centers, has zero cost
+  std::mt19937 rng(3);
+  const int kCols = 16;
+  const int kRows = 8;
+  const std::vector<uint16_t> image = makeRandomImage(kCols, kRows, rng);
+  const ImageView3 view = {image.data(), kCols, kRows, kCols * 3};
+  const int y = 4;
+  std::vector<int> xs;
+  std::vector<float> dstSrcX, dstSrcY;
+  for (int x = 1; x < kCols - 1; ++x) {
+    xs.push_back(x);
+    dstSrcX.push_back(x + 0.5f);
+    dstSrcY.push_back(y + 0.5f);
+  }
+  const int count = xs.size();
+  std::vector<float> biased(count), unbiased(count);
+  computePatchSSDs(
+      view,
+      view,
+      view,
+      view,
+      y,
+      1,
+      count,
+      xs.data(),
+      dstSrcX.data(),
+      dstSrcY.data(),
+      biased.data(),
+      unbiased.data());
+  for (int i = 0; i < count; ++i) {
+    EXPECT_EQ(biased[i], 0) << i;
+    EXPECT_EQ(unbiased[i], 0) << i;
+  }
+}
+
+TEST_F(CostKernelsTest, TestLookupWarpHalf) {
+  // Fixed point warp is within half a step of the float warp it was rounded from
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> value(-0.5f, 255.5f);
+  const int kCols = 24;
+  const int kRows = 16;
+  const float kScale = 127.0f;
+  std::vector<float> warp(kCols * kRows * 2);
+  std::vector<int16_t> warpHalf(warp.size());
+  for (int i = 0; i < int(warp.size()); ++i) {
+    warp[i] = (i / 2) % 13 == 0 ? NAN : value(rng);
+    warpHalf[i] =
+        std::isnan(warp[i]) ? std::numeric_limits<int16_t>::min() : std::lround(warp[i] * kScale);
+  }
+  const ImageView2f view = {warp.data(), kCols, kRows, kCols * 2};
+  const ImageView2s viewHalf = {warpHalf.data(), kCols, kRows, kCols * 2, kScale};
+
+  std::uniform_real_distribution<float> coordX(-1, kCols + 1);
+  std::uniform_real_distribution<float> coordY(-1, kRows + 1);
+  const int kCount = 101;
+  std::vector<float> srcX(kCount), srcY(kCount);
+  for (int i = 0; i < kCount; ++i) {
+    srcX[i] = coordX(rng);
+    srcY[i] = coordY(rng);
+  }
+  std::vector<float> x(kCount), y(kCount), xHalf(kCount), yHalf(kCount);
+  lookupWarp(view, kCount, srcX.data(), srcY.data(), x.data(), y.data());
+  lookupWarp(viewHalf, kCount, srcX.data(), srcY.data(), xHalf.data(), yHalf.data());
+  for (int i = 0; i < kCount; ++i) {
+    ASSERT_EQ(std::isnan(x[i]), std::isnan(xHalf[i])) << i;
+    if (!std::isnan(x[i])) {
+      EXPECT_NEAR(xHalf[i], x[i], 0.5f / kScale) << i;
+      EXPECT_NEAR(yHalf[i], y[i], 0.5f / kScale) << i;
+    }
+  }
+}
+
+TEST_F(CostKernelsTest, TestHalfConversions) {
+  // Every finite half goes through float and back unchanged
+  for (int value = 0; value < 65536; ++value) {
+    if ((value & 0x7c00) == 0x7c00) {
+      continue; // infinity and NAN
+    }
+    ASSERT_EQ(floatToHalf(halfToFloat(value)), value) << value;
+  }
+  EXPECT_EQ(halfToFloat(0x3c00), 1.0f);
+  EXPECT_EQ(halfToFloat(0x0001), std::ldexp(1.0f, -24)); // smallest subnormal
+  EXPECT_EQ(floatToHalf(1.0f + std::ldexp(1.0f, -11)), 0x3c00); // tie to even
+  EXPECT_EQ(floatToHalf(1.0f + 3 * std::ldexp(1.0f, -11)), 0x3c02);
+  EXPECT_EQ(floatToHalf(65520.0f), 0x7c00);
+
+  // Encoded unorm16 values are within half a step of the format
+  for (int value = 0; value < 65536; ++value) {
+    const uint16_t v = value;
+    uint16_t half;
+    uint8_t unorm8;
+    encodeColors(&v, 1, ColorFormat::half, &half);
+    encodeColors(&v, 1, ColorFormat::unorm8, &unorm8);
+    ASSERT_LE(std::abs(halfToFloat(half) * 65535.0f - v), std::ldexp(float(v), -11) + 1e-3f) << v;
+    ASSERT_LE(std::abs(unorm8 * 257.0f - v), 257 / 2.0f) << v;
+  }
+}
+
+TEST_F(CostKernelsTest, TestComputePatchSSDsColorFormats) {
+  // Vector and scalar kernels agree in every format, and quantized formats stay close to unorm16
+  std::mt19937 rng(5);
+  const int kCols = 37;
+  const int kRows = 29;
+  std::vector<std::vector<uint16_t>> images;
+  for (int i = 0; i < 4; ++i) {
+    images.push_back(makeRandomImage(kCols, kRows, rng));
+  }
+  const int kRadius = 1;
+  const int y = kRows / 2;
+  const int kCount = 3 * (kCols - 2 * kRadius) + 5;
+  std::vector<int> xs(kCount);
+  std::vector<float> dstSrcX(kCount), dstSrcY(kCount);
+  std::uniform_real_distribution<float> coordX(-1, kCols + 1);
+  std::uniform_real_distribution<float> coordY(-1, kRows + 1);
+  for (int i = 0; i < kCount; ++i) {
+    xs[i] = kRadius + i % (kCols - 2 * kRadius);
+    dstSrcX[i] = i % 11 == 0 ? NAN : coordX(rng);
+    dstSrcY[i] = coordY(rng);
+  }
+
+  std::vector<float> reference(kCount), referenceUnbiased(kCount);
+  for (const ColorFormat format : {ColorFormat::unorm16, ColorFormat::half, ColorFormat::unorm8}) {
+    std::vector<std::vector<uint8_t>> encoded;
+    std::vector<ImageView3> views;
+    for (const std::vector<uint16_t>& image : images) {
+      encoded.push_back(encodeImage(image, format));
+    }
+    for (const std::vector<uint8_t>& image : encoded) {
+      views.push_back(makeView(image, kCols, kRows, format));
+    }
+
+    std::vector<float> biased(kCount), unbiased(kCount);
+    std::vector<float> expectedBiased(kCount), expectedUnbiased(kCount);
+    computePatchSSDs(
+        views[0],
+        views[1],
+        views[2],
+        views[3],
+        y,
+        kRadius,
+        kCount,
+        xs.data(),
+        dstSrcX.data(),
+        dstSrcY.data(),
+        biased.data(),
+        unbiased.data());
+    computePatchSSDsScalar(
+        views[0],
+        views[1],
+        views[2],
+        views[3],
+        y,
+        kRadius,
+        kCount,
+        xs.data(),
+        dstSrcX.data(),
+        dstSrcY.data(),
+        expectedBiased.data(),
+        expectedUnbiased.data());
+    if (format == ColorFormat::unorm16) {
+      reference = expectedBiased;
+      referenceUnbiased = expectedUnbiased;
+    }
+
+    // unorm8 steps are 1/255, half steps are at most 1/2048 in [0, 1]
+    const float tolerance = format == ColorFormat::unorm8 ? 0.05f : 0.005f;
+    for (int i = 0; i < kCount; ++i) {
+      if (std::isnan(dstSrcX[i])) {
+        EXPECT_TRUE(std::isnan(biased[i]) && std::isnan(unbiased[i])) << i;
+        continue;
+      }
+      // Same operations in the same order, and samples round the same way
+      EXPECT_EQ(biased[i], expectedBiased[i]) << i;
+      EXPECT_EQ(unbiased[i], expectedUnbiased[i]) << i;
+      EXPECT_NEAR(expectedBiased[i], reference[i], tolerance * reference[i]) << i;
+      EXPECT_NEAR(expectedUnbiased[i], referenceUnbiased[i], tolerance * referenceUnbiased[i])
+          << i;
+    }
+  }
+}
@@ -5,8 +5,19 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <memory>
+#include <numeric>
+#include <tuple>
+
 #include <gtest/gtest.h>
 
+#include "source/depth_estimation/BatchCost.h"
+#include "source/depth_estimation/Derp.h"
+#include "source/test/AllocationCounter.h"
+#include "source/test/TestPyramidLevel.h"
 #include "source/test/TestRig.h"
 #include "source/util/ImageUtil.h"
 
@@ -24,4 +35,493 @@ TEST_F(DerpTest, TestUtilFilterDestinations) {
   EXPECT_TRUE(filtered[2].id == testRig[0].id);
 }
 
+TEST_F(DerpTest, TestBatchCostMatchesScalar) {
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+  const PyramidLevel<PixelType>& pyramidLevel = *level;
+
+  int numCompared = 0;
+  int numMismatches = 0;
+  for (const int dstIdx : {0, 5, 11}) {
+    for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; y += 7) {
+      std::vector<int> xs;
+      std::vector<float> disparities;
+      for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+        for (const float disparity : {0.05f, 0.5f, 1.5f}) {
+          xs.push_back(x);
+          disparities.push_back(disparity);
+        }
+      }
+      std::vector<float> costs;
+      std::vector<float> confidences;
+      computeCostsBatch(pyramidLevel, dstIdx, y, xs, disparities, costs, confidences);
+      ASSERT_EQ(costs.size(), xs.size());
+      for (ssize_t i = 0; i < ssize(xs); ++i) {
+        float cost;
+        float confidence;
+        std::tie(cost, confidence) = computeCost(pyramidLevel, dstIdx, disparities[i], xs[i], y);
+        EXPECT_EQ(confidences[i], confidence);
+        ++numCompared;
+
+        // Patch SSDs are exact, but the AVX2 projections can differ from the scalar ones in the
+        // last bits. That flips the rounding of a few samples, or points right on the edge of a src
+        if (std::abs(costs[i] - cost) > 1e-4f * std::abs(cost)) {
+          ++numMismatches;
+        }
+      }
+    }
+  }
+  EXPECT_LT(numMismatches, numCompared / 100) << numMismatches << " of " << numCompared;
+}
+
+TEST_F(DerpTest, TestProjectionCache) {
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const std::unique_ptr<PyramidLevel<PixelType>> full = makeTestPyramidLevel(size);
+  const std::unique_ptr<PyramidLevel<PixelType>> half = makeTestPyramidLevel(size);
+  half->projectionStorage = ProjectionStorage::half;
+
+  // Budget for about one dst at a time
+  const int numDsts = full->rigDst.size();
+  half->projectionBudgetBytes = half->estimateDstProjBytes(0) * 3 / 2;
+  EXPECT_GT(half->groupDstsByProjectionBudget().size(), 1);
+
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    half->prepareProjections({dstIdx});
+    EXPECT_LE(
+        half->projectionBytes.load(),
+        std::max(half->projectionBudgetBytes, half->estimateDstProjBytes(dstIdx)));
+
+    for (int srcIdx = 0; srcIdx < int(full->rigSrc.size()); ++srcIdx) {
+      // Pairs that do not overlap are never computed
+      if (!full->dstProjOverlaps(dstIdx, srcIdx)) {
+        EXPECT_TRUE(full->dstProj(dstIdx, srcIdx).projColor.empty());
+        continue;
+      }
+      if (srcIdx == full->dst2srcIdxs[dstIdx]) {
+        continue;
+      }
+
+      // Half storage stays within its fixed point precision
+      const PyramidLevel<PixelType>::Proj& projFull = full->dstProj(dstIdx, srcIdx);
+      const PyramidLevel<PixelType>::Proj& projHalf = half->dstProj(dstIdx, srcIdx);
+      EXPECT_TRUE(projHalf.projWarp.empty());
+      const float tolerance = 1.0f / projHalf.projWarpHalfScale;
+      for (float y = 0; y < size.height; y += 3.7f) {
+        for (float x = 0; x < size.width; x += 3.3f) {
+          const cv::Vec2f expected = projFull.warp(x, y);
+          const cv::Vec2f actual = projHalf.warp(x, y);
+          ASSERT_EQ(std::isnan(expected[0]), std::isnan(actual[0])) << x << " " << y;
+          if (!std::isnan(expected[0])) {
+            EXPECT_NEAR(actual[0], expected[0], tolerance);
+            EXPECT_NEAR(actual[1], expected[1], tolerance);
+          }
+        }
+      }
+    }
+  }
+  EXPECT_GT(half->projectionEvictCount, 0);
+  EXPECT_LT(half->projectionPeakBytes.load(), full->projectionPeakBytes.load());
+}
+
+TEST_F(DerpTest, TestProjColorFormats) {
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const std::unique_ptr<PyramidLevel<PixelType>> reference = makeTestPyramidLevel(size);
+  const int dstIdx = 3;
+  reference->projColorFormat = ColorFormat::unorm16;
+  reference->prepareProjections({dstIdx});
+
+  for (const ColorFormat format : {ColorFormat::half, ColorFormat::unorm8}) {
+    const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+    level->projColorFormat = format;
+    level->prepareProjections({dstIdx});
+    EXPECT_LE(level->projectionBytes.load(), level->estimateDstProjBytes(dstIdx));
+    if (format == ColorFormat::unorm8) {
+      EXPECT_LT(level->projectionBytes.load(), reference->projectionBytes.load());
+    }
+
+    int numCompared = 0;
+    int numMismatches = 0;
+    double sumError = 0;
+    for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; y += 5) {
+      std::vector<int> xs;
+      std::vector<float> disparities;
+      for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+        xs.push_back(x);
+        disparities.push_back(0.5f);
+      }
+      std::vector<float> costs;
+      std::vector<float> confidences;
+      computeCostsBatch(*level, dstIdx, y, xs, disparities, costs, confidences);
+      for (ssize_t i = 0; i < ssize(xs); ++i) {
+        // Scalar and batch engines read the same packed colors
+        const float cost = std::get<0>(computeCost(*level, dstIdx, disparities[i], xs[i], y));
+        if (std::abs(costs[i] - cost) > 1e-4f * std::abs(cost)) {
+          ++numMismatches;
+        }
+
+        // Quantization moves costs a little
+        const float expected =
+            std::get<0>(computeCost(*reference, dstIdx, disparities[i], xs[i], y));
+        if (cost != FLT_MAX && expected != FLT_MAX) {
+          sumError += std::abs(cost - expected) / expected;
+          ++numCompared;
+        }
+      }
+    }
+    ASSERT_GT(numCompared, 0);
+    EXPECT_LT(numMismatches, numCompared / 100) << numMismatches << " of " << numCompared;
+    EXPECT_LT(sumError / numCompared, format == ColorFormat::half ? 5e-3 : 5e-2) << int(format);
+  }
+}
+
+TEST_F(DerpTest, TestProjGeometryCache) {
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const std::unique_ptr<PyramidLevel<PixelType>> reference = makeTestPyramidLevel(size);
+  reference->projColorFormat = ColorFormat::unorm16;
+  const int numDsts = reference->rigDst.size();
+  const int numSrcs = reference->rigSrc.size();
+  const auto cache = std::make_shared<ProjGeometryCache>(size, numDsts, numSrcs);
+
+  // Two frames through the same cache, the second one reuses the warps of the first
+  std::vector<std::unique_ptr<PyramidLevel<PixelType>>> frames;
+  for (int frame = 0; frame < 2; ++frame) {
+    frames.push_back(makeTestPyramidLevel(size));
+    frames.back()->projColorFormat = ColorFormat::unorm16;
+    frames.back()->projGeometryCache = cache;
+  }
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    reference->prepareProjections({dstIdx});
+    for (const auto& level : frames) {
+      level->prepareProjections({dstIdx});
+    }
+    for (int srcIdx = 0; srcIdx < numSrcs; ++srcIdx) {
+      if (!reference->dstProjOverlaps(dstIdx, srcIdx)) {
+        continue;
+      }
+      const PyramidLevel<PixelType>::Proj& expected = reference->dstProj(dstIdx, srcIdx);
+      const PyramidLevel<PixelType>::Proj& first = frames[0]->dstProj(dstIdx, srcIdx);
+      const PyramidLevel<PixelType>::Proj& second = frames[1]->dstProj(dstIdx, srcIdx);
+      EXPECT_EQ(cv::norm(first.projColor, expected.projColor, cv::NORM_INF), 0);
+      if (srcIdx == reference->dst2srcIdxs[dstIdx]) {
+        EXPECT_EQ(cv::norm(first.rays, expected.rays, cv::NORM_INF), 0);
+        EXPECT_EQ(second.rays.data, first.rays.data);
+      } else {
+        EXPECT_EQ(cv::norm(first.projWarp, expected.projWarp, cv::NORM_INF), 0);
+        EXPECT_EQ(second.projWarp.data, first.projWarp.data);
+      }
+    }
+  }
+}
+
+TEST_F(DerpTest, TestSeedFromPreviousFrame) {
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+  PyramidLevel<PixelType>& pyramidLevel = *level;
+  const int numDsts = pyramidLevel.rigDst.size();
+
+  // Previous frame only differs in a square of dst 0
+  const cv::Rect changedRect(40, 20, 8, 8);
+  std::vector<cv::Mat_<PixelType>> prevColors(numDsts);
+  std::vector<cv::Mat_<float>> prevDisparities(numDsts);
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    prevColors[dstIdx] = pyramidLevel.dstColor(dstIdx).clone();
+    prevDisparities[dstIdx] = cv::Mat_<float>(size, 0.25f);
+  }
+  prevColors[0](changedRect) = cv::Scalar::all(0);
+  const cv::Mat_<bool> srcForegroundMask = pyramidLevel.srcForegroundMask(0).clone();
+
+  const std::vector<cv::Mat_<bool>> reused =
+      seedFromPreviousFrame(pyramidLevel, prevColors, prevDisparities, 0.01f);
+
+  for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+    const cv::Mat_<bool>& foregroundMask = pyramidLevel.dstForegroundMask(dstIdx);
+    const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
+    for (int y = 0; y < size.height; ++y) {
+      for (int x = 0; x < size.width; ++x) {
+        if (!fovMask(y, x)) {
+          continue;
+        }
+        // Changes are grown to cover the patches and ping pong candidates around them
+        const int margin = kSearchWindowRadius + 2;
+        const bool inChange = dstIdx == 0 && changedRect.x - margin <= x &&
+            x < changedRect.br().x + margin && changedRect.y - margin <= y &&
+            y < changedRect.br().y + margin;
+        ASSERT_EQ(foregroundMask(y, x), inChange) << dstIdx << " " << x << " " << y;
+        ASSERT_EQ(reused[dstIdx](y, x), !inChange) << dstIdx << " " << x << " " << y;
+        if (!inChange) {
+          EXPECT_EQ(pyramidLevel.dstBackgroundDisparity(dstIdx)(y, x), 0.25f);
+        }
+      }
+    }
+  }
+
+  // Src masks are left alone
+  EXPECT_EQ(cv::countNonZero(pyramidLevel.srcForegroundMask(0) != srcForegroundMask), 0);
+}
+
+TEST_F(DerpTest, TestSeedFromPreviousFrameDrift) {
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const float thresh = 0.01f;
+  std::vector<cv::Mat_<PixelType>> referenceColors;
+  std::vector<cv::Mat_<float>> disparities;
+
+  // Colors drift by 0.6 of the threshold per frame. Pixels are reused at frame 1, but not at frame
+  // 2: their disparities were estimated at the colors of frame 0
+  for (int frame = 0; frame < 3; ++frame) {
+    const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+    PyramidLevel<PixelType>& pyramidLevel = *level;
+    const int numDsts = pyramidLevel.rigDst.size();
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      pyramidLevel.dstColor(dstIdx) = cv::Scalar::all(30000 + frame * 0.6f * thresh * 65535);
+    }
+    if (frame == 0) {
+      updateReferenceColors(referenceColors, pyramidLevel, {});
+      disparities.assign(numDsts, cv::Mat_<float>(size, 0.25f));
+      continue;
+    }
+
+    const std::vector<cv::Mat_<bool>> reused =
+        seedFromPreviousFrame(pyramidLevel, referenceColors, disparities, thresh);
+    for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+      const cv::Mat_<bool>& fovMask = pyramidLevel.dstFovMask(dstIdx);
+      const int numExpected = frame == 1 ? cv::countNonZero(fovMask) : 0;
+      EXPECT_EQ(cv::countNonZero(reused[dstIdx] & fovMask), numExpected) << frame << " " << dstIdx;
+    }
+    updateReferenceColors(referenceColors, pyramidLevel, reused);
+  }
+}
+
+TEST_F(DerpTest, TestRayTablesMatchCamera) {
+  // Ray tables and single precision projectors against dstToWorldPoint() and worldToSrcPoint()
+  using namespace depth_estimation;
+  const cv::Size size(96, 64);
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+  const PyramidLevel<PixelType>& pyramidLevel = *level;
+
+  int numCompared = 0;
+  int numFlips = 0;
+  for (const int dstIdx : {0, 7}) {
+    const Camera& camDst = pyramidLevel.rigDst[dstIdx];
+    const cv::Mat_<cv::Vec3f>& rays = pyramidLevel.dstRays(dstIdx);
+    ASSERT_EQ(rays.size(), size);
+    for (int srcIdx = 0; srcIdx < int(pyramidLevel.rigSrc.size()); ++srcIdx) {
+      if (srcIdx == pyramidLevel.dst2srcIdxs[dstIdx] ||
+          !pyramidLevel.dstProjOverlaps(dstIdx, srcIdx)) {
+        continue;
+      }
+      const SrcProjector& projector = pyramidLevel.dstProj(dstIdx, srcIdx).projector;
+      for (int y = 0; y < size.height; y += 3) {
+        for (int x = 0; x < size.width; x += 3) {
+          for (const float disparity : {0.01f, 0.3f, 2.0f}) {
+            const Camera::Vector3 expectedWorld =
+                dstToWorldPoint(camDst, x, y, disparity, size.width, size.height);
+            const cv::Vec3f& ray = rays(y, x);
+            const float depth = 1.0f / disparity;
+            for (int i = 0; i < 3; ++i) {
+              EXPECT_NEAR(camDst.position[i] + ray[i] * depth, expectedWorld[i], 1e-5 * depth);
+            }
+
+            Camera::Vector2 expectedSrc;
+            const bool expectedSeen = worldToSrcPoint(
+                expectedSrc, expectedWorld, pyramidLevel.rigSrc[srcIdx], size.width, size.height);
+            float xSrc;
+            float ySrc;
+            projectToSrcScalar(projector, 1, &ray[0], &ray[1], &ray[2], &depth, &xSrc, &ySrc);
+            ++numCompared;
+
+            // Points right on the edge of src may go either way
+            if (expectedSeen != !std::isnan(xSrc)) {
+              ++numFlips;
+            } else if (expectedSeen) {
+              EXPECT_NEAR(xSrc, expectedSrc.x(), 1e-2);
+              EXPECT_NEAR(ySrc, expectedSrc.y(), 1e-2);
+            }
+          }
+        }
+      }
+    }
+  }
+  EXPECT_GT(numCompared, 0);
+  EXPECT_LT(numFlips, numCompared / 100) << numFlips << " of " << numCompared;
+}
+
+TEST_F(DerpTest, TestInsertCostCandidate) {
+  using namespace depth_estimation;
+  CostCandidates disparities = CostCandidates::all(NAN);
+  CostCandidates costs = CostCandidates::all(NAN);
+
+  // Kept sorted by cost, unusable costs are ignored
+  insertCostCandidate(disparities, costs, 0.5f, 3.0f);
+  insertCostCandidate(disparities, costs, 0.1f, 1.0f);
+  insertCostCandidate(disparities, costs, 0.2f, FLT_MAX);
+  insertCostCandidate(disparities, costs, 0.3f, NAN);
+  EXPECT_EQ(disparities[0], 0.1f);
+  EXPECT_EQ(disparities[1], 0.5f);
+  EXPECT_TRUE(std::isnan(disparities[2]));
+
+  // The same disparity only replaces a candidate with a lower cost
+  insertCostCandidate(disparities, costs, 0.5f * (1 + kCostCandidateTolerance / 2), 4.0f);
+  EXPECT_EQ(costs[1], 3.0f);
+  insertCostCandidate(disparities, costs, 0.5f * (1 + kCostCandidateTolerance / 2), 0.5f);
+  EXPECT_EQ(costs[0], 0.5f);
+  EXPECT_EQ(disparities[1], 0.1f);
+  EXPECT_TRUE(std::isnan(disparities[2]));
+
+  // Worst candidates fall off the end
+  for (int i = 0; i < kNumCostCandidates; ++i) {
+    insertCostCandidate(disparities, costs, 1.0f + i, 0.1f * i);
+  }
+  for (int i = 0; i < kNumCostCandidates; ++i) {
+    EXPECT_EQ(disparities[i], 1.0f + i);
+    EXPECT_EQ(costs[i], 0.1f * i);
+  }
+}
+
+TEST_F(DerpTest, TestBruteForceCostCandidates) {
+  using namespace depth_estimation;
+  const cv::Size size(48, 32);
+  const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+  PyramidLevel<PixelType>& pyramidLevel = *level;
+  pyramidLevel.useCostCandidates = true;
+  const int dstIdx = 0;
+  computeBruteForceDisparity(pyramidLevel, dstIdx, 0.5f, 1e4f, true, false);
+
+  // Best candidate is the brute force disparity
+  const cv::Mat_<CostCandidates>& disparities = pyramidLevel.dstCandidateDisparity(dstIdx);
+  const cv::Mat_<CostCandidates>& costs = pyramidLevel.dstCandidateCost(dstIdx);
+  ASSERT_EQ(disparities.size(), size);
+  int numCandidates = 0;
+  for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
+    for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+      if (!pyramidLevel.dstFovMask(dstIdx)(y, x) || std::isnan(disparities(y, x)[0])) {
+        continue;
+      }
+      EXPECT_EQ(disparities(y, x)[0], pyramidLevel.dstDisparity(dstIdx)(y, x)) << x << " " << y;
+      EXPECT_EQ(costs(y, x)[0], pyramidLevel.dstCost(dstIdx)(y, x)) << x << " " << y;
+      for (int i = 1; i < kNumCostCandidates && !std::isnan(disparities(y, x)[i]); ++i) {
+        EXPECT_LE(costs(y, x)[i - 1], costs(y, x)[i]);
+        ++numCandidates;
+      }
+    }
+  }
+  EXPECT_GT(numCandidates, 0);
+}
+
+TEST_F(DerpTest, TestAdaptiveDisparitySampling) {
+  using namespace depth_estimation;
+  const cv::Size size(48, 32);
+  std::vector<std::unique_ptr<PyramidLevel<PixelType>>> levels;
+  for (const auto sampling : {DisparitySampling::uniform, DisparitySampling::adaptive}) {
+    levels.push_back(makeTestPyramidLevel(size));
+    levels.back()->disparitySampling = sampling;
+    levels.back()->useCostCandidates = true;
+  }
+  const int dstIdx = 0;
+  for (const auto& level : levels) {
+    computeBruteForceDisparity(*level, dstIdx, 0.5f, 1e4f, true, false);
+  }
+
+  // Adaptive probes are a subset of the uniform ones, so their best cost is never lower
+  // Test colors are noise, so how often both find the same minimum says little here
+  const PyramidLevel<PixelType>& uniform = *levels[0];
+  const PyramidLevel<PixelType>& adaptive = *levels[1];
+  int numCompared = 0;
+  int numMatches = 0;
+  for (int y = kSearchWindowRadius; y < size.height - kSearchWindowRadius; ++y) {
+    for (int x = kSearchWindowRadius; x < size.width - kSearchWindowRadius; ++x) {
+      if (!uniform.dstFovMask(dstIdx)(y, x) || uniform.dstCost(dstIdx)(y, x) == FLT_MAX) {
+        continue;
+      }
+      ++numCompared;
+      const float disparity = adaptive.dstDisparity(dstIdx)(y, x);
+      const float cost = adaptive.dstCost(dstIdx)(y, x);
+      EXPECT_GE(cost, uniform.dstCost(dstIdx)(y, x)) << x << " " << y;
+      if (cost < FLT_MAX) {
+        EXPECT_EQ(cost, std::get<0>(computeCost(adaptive, dstIdx, disparity, x, y)));
+      }
+      if (disparity == uniform.dstDisparity(dstIdx)(y, x)) {
+        ++numMatches;
+      }
+
+      // Best candidate is still the chosen disparity
+      const CostCandidates& candidates = adaptive.dstCandidateDisparity(dstIdx)(y, x);
+      if (!std::isnan(candidates[0])) {
+        EXPECT_EQ(candidates[0], disparity) << x << " " << y;
+      }
+    }
+  }
+  ASSERT_GT(numCompared, 0);
+  EXPECT_GT(numMatches, 0);
+}
+
+TEST_F(DerpTest, TestPrunePingPongCandidates) {
+  using namespace depth_estimation;
+  const cv::Size size(13, 9);
+  cv::Mat_<cv::Vec3b> lab(size);
+  cv::RNG rng(1);
+  rng.fill(lab, cv::RNG::UNIFORM, 0, 4); // few values, so that there are ties
+  const PingPongCandidates candidates = makePingPongCandidates(size);
+  ASSERT_EQ(candidates.numCandidates, int(candidateTemplateOriginal.size()));
+
+  std::array<int, PingPongCandidates::kMaxCandidates> indices;
+  for (int y = 0; y < size.height; ++y) {
+    for (int x = 0; x < size.width; ++x) {
+      // Closest first, earlier first among equals, then back to template order
+      std::vector<int> distances;
+      for (const std::array<int, 2>& offset : candidateTemplateOriginal) {
+        const int xx = math_util::clamp(x + offset[0], 0, size.width - 1);
+        const int yy = math_util::clamp(y + offset[1], 0, size.height - 1);
+        const cv::Vec3i diff = cv::Vec3i(lab(yy, xx)) - cv::Vec3i(lab(y, x));
+        distances.push_back(diff.dot(diff));
+      }
+      std::vector<int> expected(distances.size());
+      std::iota(expected.begin(), expected.end(), 0);
+      std::stable_sort(expected.begin(), expected.end(), [&](const int a, const int b) {
+        return distances[a] < distances[b];
+      });
+      expected.resize(kColorPruningNumNeighbors);
+      std::sort(expected.begin(), expected.end());
+
+      const int count = prunePingPongCandidates(
+          candidates, lab, x, y, kColorPruningNumNeighbors, indices);
+      ASSERT_EQ(count, kColorPruningNumNeighbors);
+      EXPECT_EQ(std::vector<int>(indices.begin(), indices.begin() + count), expected)
+          << x << " " << y;
+    }
+  }
+}
+
+TEST_F(DerpTest, TestPingPongAllocations) {
+  using namespace depth_estimation;
+  const cv::Size size(128, 96);
+  for (const CostEngine engine : {CostEngine::scalar, CostEngine::batch}) {
+    for (const bool useColorPruning : {false, true}) {
+      const std::unique_ptr<PyramidLevel<PixelType>> level = makeTestPyramidLevel(size);
+      level->numLevels = 2; // ping pong skips the coarsest level
+      level->costEngine = engine;
+      level->useColorPruning = useColorPruning;
+      const int numDsts = level->rigDst.size();
+      cv::RNG rng(1);
+      for (int dstIdx = 0; dstIdx < numDsts; ++dstIdx) {
+        rng.fill(level->dstDisparity(dstIdx), cv::RNG::UNIFORM, 0.1f, 1.0f);
+      }
+
+      // Once projections and per thread scratch are in place, allocations do not depend on the
+      // number of pixels
+      pingPongPropagation(*level, 1, 0);
+      const int64_t before = getAllocationCount();
+      pingPongPropagation(*level, 2, 0);
+      const int64_t numAllocations = getAllocationCount() - before;
+      EXPECT_LT(numAllocations, size.area() * numDsts / 100)
+          << "engine " << int(engine) << " color pruning " << useColorPruning;
+    }
+  }
+}
+
 } // namespace fb360_dep
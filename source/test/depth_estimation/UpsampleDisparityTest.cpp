@@ -0,0 +1,152 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/depth_estimation/TemporalBilateralFilter.h"
+#include "source/depth_estimation/UpsampleDisparityLib.h"
+#include "source/test/TestRig.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::depth_estimation;
+
+struct UpsampleDisparityTest : ::testing::Test {
+  // Random disparities with NANs, sparse masks and a color edge for two cameras
+  // Output size is not a multiple of the input size nor of the tile size
+  void SetUp() override {
+    rig = Camera::loadRigFromJsonString(testRigJson);
+    rig.resize(2);
+    cv::RNG rng(1);
+    for (int i = 0; i < int(rig.size()); ++i) {
+      cv::Mat_<float> disp(size);
+      cv::Mat_<bool> mask(size);
+      for (int y = 0; y < size.height; ++y) {
+        for (int x = 0; x < size.width; ++x) {
+          disp(y, x) = rng.uniform(0.0f, 1.0f) < 0.05f ? NAN : rng.uniform(0.1f, 1.0f);
+          mask(y, x) = rng.uniform(0.0f, 1.0f) < 0.8f;
+        }
+      }
+      cv::Mat_<float> bgDispUp(sizeUp);
+      cv::Mat_<bool> maskUp(sizeUp);
+      cv::Mat_<cv::Vec3f> colorUp(sizeUp);
+      for (int y = 0; y < sizeUp.height; ++y) {
+        for (int x = 0; x < sizeUp.width; ++x) {
+          bgDispUp(y, x) = rng.uniform(0.01f, 0.1f);
+          maskUp(y, x) = rng.uniform(0.0f, 1.0f) < 0.9f;
+          const float gray = x < y ? 0.3f : 0.7f;
+          colorUp(y, x) = cv::Vec3f(gray, gray, gray) + cv::Vec3f::all(rng.uniform(0.0f, 0.05f));
+        }
+      }
+      disps.push_back(disp);
+      masks.push_back(mask);
+      bgDispsUp.push_back(bgDispUp);
+      masksUp.push_back(maskUp);
+      colorsUp.push_back(colorUp);
+    }
+  }
+
+  // What UpsampleDisparity does without tiles, with the default engine
+  std::vector<cv::Mat_<float>> upsample(const bool useForegroundMasks, const bool useColor) {
+    std::vector<cv::Mat_<float>> dispsUp =
+        upsampleDisparities(rig, disps, bgDispsUp, masks, masksUp, sizeUp, useForegroundMasks);
+    for (int i = 0; useColor && i < int(rig.size()); ++i) {
+      dispsUp[i] = generalizedJointBilateralFilter<float, cv::Vec3f>(
+          dispsUp[i],
+          colorsUp[i],
+          colorsUp[i],
+          masksUp[i],
+          getRadius(size, sizeUp),
+          kSigma,
+          0.5f,
+          0.5f,
+          1.0f);
+    }
+    return dispsUp;
+  }
+
+  std::vector<cv::Mat_<float>> upsampleTiled(
+      const bool useForegroundMasks,
+      const bool useColor,
+      const BilateralEngine engine) {
+    std::vector<cv::Mat> colors;
+    if (useColor) {
+      colors.assign(colorsUp.begin(), colorsUp.end());
+    }
+    return upsampleDisparitiesTiled(
+        rig,
+        disps,
+        bgDispsUp,
+        masks,
+        masksUp,
+        colors,
+        sizeUp,
+        useForegroundMasks,
+        kSigma,
+        0.5f,
+        0.5f,
+        1.0f,
+        engine,
+        kTileSize);
+  }
+
+  // Largest difference between a and b, infinite if they are not NAN at the same pixels
+  static double getMaxDifference(const cv::Mat_<float>& a, const cv::Mat_<float>& b) {
+    double result = 0;
+    for (int y = 0; y < a.rows; ++y) {
+      for (int x = 0; x < a.cols; ++x) {
+        if (std::isnan(a(y, x)) != std::isnan(b(y, x))) {
+          return INFINITY;
+        }
+        if (!std::isnan(a(y, x))) {
+          result = std::max(result, double(std::abs(a(y, x) - b(y, x))));
+        }
+      }
+    }
+    return result;
+  }
+
+  static constexpr float kSigma = 0.05f;
+  static const int kTileSize = 32;
+  const cv::Size size{40, 30};
+  const cv::Size sizeUp{161, 123};
+  Camera::Rig rig;
+  std::vector<cv::Mat_<float>> disps;
+  std::vector<cv::Mat_<bool>> masks;
+  std::vector<cv::Mat_<float>> bgDispsUp;
+  std::vector<cv::Mat_<bool>> masksUp;
+  std::vector<cv::Mat_<cv::Vec3f>> colorsUp;
+};
+
+TEST_F(UpsampleDisparityTest, TestTiledMatchesUntiled) {
+  // Without background disparities, NANs outside the masks reach the filter
+  const std::vector<cv::Mat_<float>> bgDispsUpIn = bgDispsUp;
+  for (const bool useBackground : {true, false}) {
+    bgDispsUp = useBackground ? bgDispsUpIn : std::vector<cv::Mat_<float>>(rig.size());
+    for (const bool useForegroundMasks : {true, false}) {
+      for (const bool useColor : {false, true}) {
+        const std::vector<cv::Mat_<float>> expected = upsample(useForegroundMasks, useColor);
+        for (const BilateralEngine engine : {BilateralEngine::bruteForce, BilateralEngine::lut}) {
+          const std::vector<cv::Mat_<float>> actual =
+              upsampleTiled(useForegroundMasks, useColor, engine);
+          ASSERT_EQ(actual.size(), expected.size());
+          for (int i = 0; i < int(expected.size()); ++i) {
+            ASSERT_EQ(actual[i].size(), sizeUp);
+            // Nearest neighbor, NAN filling and the brute force filter are exact, Lanczos weights
+            // and the lut engine are not
+            const bool isExact = useForegroundMasks && engine == BilateralEngine::bruteForce;
+            EXPECT_LE(getMaxDifference(actual[i], expected[i]), isExact ? 0 : 1e-4)
+                << "background " << useBackground << " foreground " << useForegroundMasks
+                << " color " << useColor << " engine " << int(engine) << " camera " << i;
+          }
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,105 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <climits>
+#include <cmath>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "source/util/CvUtil.h"
+
+using namespace fb360_dep;
+
+struct DistanceTransformTest : ::testing::Test {
+  // Nearest valid pixel by brute force, ties broken by smallest x, then smallest y
+  static void nearestBruteForce(
+      const cv::Mat_<bool>& valid,
+      const int x,
+      const int y,
+      int& nearest,
+      int& squaredDistance) {
+    nearest = distance_util::kNoValidPixel;
+    squaredDistance = INT_MAX;
+    for (int xx = 0; xx < valid.cols; ++xx) {
+      for (int yy = 0; yy < valid.rows; ++yy) {
+        const int d = (x - xx) * (x - xx) + (y - yy) * (y - yy);
+        if (valid(yy, xx) && d < squaredDistance) {
+          nearest = yy * valid.cols + xx;
+          squaredDistance = d;
+        }
+      }
+    }
+  }
+};
+
+TEST_F(DistanceTransformTest, TestNearestMatchesBruteForce) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(0, 1);
+  for (const float density : {0.0f, 0.002f, 0.05f, 0.5f}) {
+    // Sparse points on a grid have many equally near valid pixels
+    cv::Mat_<bool> valid(37, 71);
+    for (int y = 0; y < valid.rows; ++y) {
+      for (int x = 0; x < valid.cols; ++x) {
+        valid(y, x) = density == 0.05f ? x % 6 == 0 && y % 4 == 0 : unit(rng) < density;
+      }
+    }
+    cv::Mat_<int> nearest;
+    cv::Mat_<int> squaredDistances;
+    cv_util::nearestValidPixels(valid, nearest, squaredDistances);
+    for (int y = 0; y < valid.rows; ++y) {
+      for (int x = 0; x < valid.cols; ++x) {
+        int expectedNearest;
+        int expectedSquaredDistance;
+        nearestBruteForce(valid, x, y, expectedNearest, expectedSquaredDistance);
+        ASSERT_EQ(nearest(y, x), expectedNearest) << density << " " << x << " " << y;
+        ASSERT_EQ(squaredDistances(y, x), expectedSquaredDistance) << x << " " << y;
+      }
+    }
+  }
+}
+
+TEST_F(DistanceTransformTest, TestFillFromNearestValid) {
+  cv::Mat_<float> mat(5, 7, NAN);
+  mat(2, 1) = 1;
+  mat(2, 5) = 2;
+  const cv::Mat_<bool> valid = mat == mat;
+  cv::Mat_<bool> fill = mat != mat;
+  fill(0, 0) = false;
+  const cv::Mat_<float> filled = cv_util::fillFromNearestValid(mat, valid, fill, 2.5f);
+  EXPECT_EQ(filled(2, 2), 1); // nearest
+  EXPECT_EQ(filled(2, 3), 1); // tied, smallest x
+  EXPECT_EQ(filled(0, 4), 2); // 2 pixels away
+  EXPECT_TRUE(std::isnan(filled(0, 3))); // sqrt(8) pixels away
+  EXPECT_TRUE(std::isnan(filled(0, 0))); // not filled
+  EXPECT_EQ(filled(2, 5), 2); // valid
+}
+
+TEST_F(DistanceTransformTest, TestFillIsEuclidean) {
+  const int x = 5;
+  const int y = 5;
+
+  // Nearer, even though it is in an outer square ring around (x, y)
+  cv::Mat_<float> mat(15, 15, NAN);
+  mat(y + 3, x + 3) = 1; // sqrt(18) away
+  mat(y, x + 4) = 2; // 4 away
+  const cv::Mat_<bool> valid = mat == mat;
+  const cv::Mat_<bool> fill = mat != mat;
+  EXPECT_EQ(cv_util::fillFromNearestValid(mat, valid, fill, 5.0f)(y, x), 2);
+
+  // Corners of the square of side 2 * radius + 1 around (x, y) are past radius
+  cv::Mat_<float> corner(15, 15, NAN);
+  corner(y + 4, x + 4) = 1;
+  const cv::Mat_<bool> validCorner = corner == corner;
+  const cv::Mat_<bool> fillCorner = corner != corner;
+  const cv::Mat_<float> filled4 =
+      cv_util::fillFromNearestValid(corner, validCorner, fillCorner, 4.0f);
+  const cv::Mat_<float> filled6 =
+      cv_util::fillFromNearestValid(corner, validCorner, fillCorner, 6.0f);
+  EXPECT_TRUE(std::isnan(filled4(y, x)));
+  EXPECT_EQ(filled6(y, x), 1);
+}
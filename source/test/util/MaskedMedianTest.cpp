@@ -0,0 +1,112 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/util/CvUtil.h"
+#include "source/util/MaskedMedian.h"
+
+using namespace fb360_dep;
+using namespace fb360_dep::median_util;
+
+struct MaskedMedianTest : ::testing::Test {
+  // Disparity-like values with NANs, zeros, repeated and negative values, and a sparse mask
+  // Width is not a multiple of the vector width
+  void SetUp() override {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(0, 1);
+    values.resize(kCols * kRows);
+    mask.resize(kCols * kRows);
+    background.resize(kCols * kRows);
+    for (int i = 0; i < kCols * kRows; ++i) {
+      const float r = unit(rng);
+      if (r < 0.05f) {
+        values[i] = NAN;
+      } else if (r < 0.1f) {
+        values[i] = 0;
+      } else if (r < 0.3f) {
+        values[i] = 0.25f;
+      } else if (r < 0.35f) {
+        values[i] = -unit(rng);
+      } else {
+        values[i] = unit(rng) * 100;
+      }
+      mask[i] = unit(rng) < 0.85f;
+      background[i] = unit(rng);
+    }
+  }
+
+  MaskedImage getImage(const bool hasBackground) const {
+    return {values.data(), mask.data(), hasBackground ? background.data() : nullptr, kCols, kRows,
+            true};
+  }
+
+  static const int kCols = 133;
+  static const int kRows = 41;
+  std::vector<float> values;
+  std::vector<uint8_t> mask;
+  std::vector<float> background;
+};
+
+TEST_F(MaskedMedianTest, TestKernelsMatchSort) {
+  for (const bool hasBackground : {false, true}) {
+    const MaskedImage in = getImage(hasBackground);
+    for (int radius = 1; radius <= 4; ++radius) {
+      std::vector<float> expected(kCols * kRows);
+      maskedMedianRowsSort(in, radius, 0, kRows, expected.data());
+      for (const MedianKernel kernel : {MedianKernel::network, MedianKernel::histogram}) {
+        std::vector<float> actual(kCols * kRows);
+        maskedMedianRows(in, radius, 0, kRows, actual.data(), kernel);
+        for (int i = 0; i < kCols * kRows; ++i) {
+          ASSERT_EQ(std::memcmp(&actual[i], &expected[i], sizeof(float)), 0)
+              << "radius " << radius << " kernel " << int(kernel) << " pixel " << i << ": "
+              << actual[i] << " vs " << expected[i];
+        }
+      }
+    }
+  }
+}
+
+TEST_F(MaskedMedianTest, TestSort) {
+  // 3 x 3 image: median of the 4 included values around the center is the mean of the middle two
+  const std::vector<float> image = {1, NAN, 5, 0, 2, 100, 7, 3, 4};
+  const std::vector<uint8_t> imageMask = {1, 1, 1, 1, 1, 0, 0, 1, 0};
+  const std::vector<float> imageBackground(9, -1);
+  const MaskedImage in = {image.data(), imageMask.data(), imageBackground.data(), 3, 3, true};
+  std::vector<float> out(9);
+  maskedMedianRowsSort(in, 1, 0, 3, out.data());
+  EXPECT_EQ(out[4], 2.5f); // 1, 5, 2, 3
+  EXPECT_EQ(out[5], -1); // outside the mask
+  EXPECT_EQ(out[0], 1.5f); // 1, 2
+}
+
+TEST_F(MaskedMedianTest, TestMaskedMedianBlur) {
+  const cv::Mat_<float> mat(kRows, kCols, values.data());
+  const cv::Mat_<bool> matMask(kRows, kCols, reinterpret_cast<bool*>(mask.data()));
+  const cv::Mat_<float> matBackground(kRows, kCols, background.data());
+  const cv::Mat_<float> blurred = cv_util::maskedMedianBlur(mat, matBackground, matMask, 2);
+
+  std::vector<float> expected(kCols * kRows);
+  maskedMedianRowsSort(getImage(true), 2, 0, kRows, expected.data());
+  for (int i = 0; i < kCols * kRows; ++i) {
+    ASSERT_EQ(blurred(i / kCols, i % kCols), expected[i]) << i;
+  }
+
+  // No background
+  const cv::Mat_<float> blurredNoBackground =
+      cv_util::maskedMedianBlur(mat, cv::Mat_<float>(), matMask, 2);
+  for (int i = 0; i < kCols * kRows; ++i) {
+    if (!mask[i]) {
+      ASSERT_EQ(blurredNoBackground(i / kCols, i % kCols), 0) << i;
+    }
+  }
+}
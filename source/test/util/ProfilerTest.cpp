@@ -0,0 +1,80 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <folly/FileUtil.h>
+#include <folly/json.h>
+
+#include "source/util/Profiler.h"
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+
+struct ProfilerTest : ::testing::Test {
+  void TearDown() override {
+    profiler::Profiler::instance().setEnabled(false);
+    profiler::Profiler::instance().reset();
+  }
+};
+
+TEST_F(ProfilerTest, TestCounterIsThreadSafe) {
+  profiler::Profiler& profiler = profiler::Profiler::instance();
+  profiler::Counter& counter = profiler.counter("test counter");
+
+  // Nothing is counted while disabled
+  counter.add();
+  EXPECT_EQ(counter.total(), 0);
+
+  profiler.setEnabled(true);
+  ThreadPool threadPool(4);
+  threadPool.parallelFor(0, 100000, 100, [&](const int begin, const int end) {
+    for (int i = begin; i < end; ++i) {
+      counter.add(2);
+    }
+  });
+  EXPECT_EQ(counter.total(), 200000);
+  EXPECT_EQ(&profiler.counter("test counter"), &counter);
+
+  profiler.reset();
+  EXPECT_EQ(counter.total(), 0);
+}
+
+TEST_F(ProfilerTest, TestChromeTrace) {
+  profiler::Profiler& profiler = profiler::Profiler::instance();
+  profiler.setEnabled(true);
+  { profiler::ScopedTimer timer("outer"); }
+  profiler.addSample("sample", 42);
+  profiler.counter("calls").add(3);
+
+  const filesystem::path filename = filesystem::temp_directory_path() /
+      filesystem::unique_path("ProfilerTest-%%%%-%%%%/trace.json");
+  profiler.writeChromeTrace(filename);
+  std::string json;
+  ASSERT_TRUE(folly::readFile(filename.string().c_str(), json));
+  filesystem::remove_all(filename.parent_path());
+
+  const folly::dynamic trace = folly::parseJson(json);
+  bool hasScope = false;
+  bool hasSample = false;
+  for (const folly::dynamic& event : trace["traceEvents"]) {
+    if (event["name"] == "outer") {
+      hasScope = true;
+      EXPECT_EQ(event["ph"], "X");
+      EXPECT_GE(event["dur"].asInt(), 0);
+    } else if (event["name"] == "sample") {
+      hasSample = true;
+      EXPECT_EQ(event["ph"], "C");
+      EXPECT_EQ(event["args"]["value"].asDouble(), 42);
+    }
+  }
+  EXPECT_TRUE(hasScope);
+  EXPECT_TRUE(hasSample);
+  EXPECT_EQ(trace["otherData"]["counters"]["calls"].asInt(), 3);
+}
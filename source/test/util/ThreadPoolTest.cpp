@@ -0,0 +1,124 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "source/util/ThreadPool.h"
+
+using namespace fb360_dep;
+
+struct ThreadPoolTest : ::testing::Test {};
+
+static void addTo(std::atomic<int>& sum, const int value) {
+  sum += value;
+}
+
+TEST_F(ThreadPoolTest, TestSpawnJoin) {
+  for (const int maxThreads : {-1, 0, 1, 3}) {
+    ThreadPool threadPool(maxThreads);
+    std::atomic<int> sum(0);
+    for (int i = 1; i <= 1000; ++i) {
+      threadPool.spawn(&addTo, std::ref(sum), i);
+    }
+    threadPool.join();
+    EXPECT_EQ(sum, 1000 * 1001 / 2) << "maxThreads: " << maxThreads;
+  }
+}
+
+TEST_F(ThreadPoolTest, TestMaxThreads) {
+  const int kMaxThreads = 2;
+  ThreadPool threadPool(kMaxThreads);
+  std::atomic<int> running(0);
+  std::atomic<int> maxRunning(0);
+  for (int i = 0; i < 64; ++i) {
+    threadPool.spawn([&] {
+      const int now = ++running;
+      int prev = maxRunning;
+      while (now > prev && !maxRunning.compare_exchange_weak(prev, now)) {
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      --running;
+    });
+  }
+  threadPool.join();
+  EXPECT_LE(maxRunning, kMaxThreads);
+}
+
+TEST_F(ThreadPoolTest, TestNested) {
+  ThreadPool threadPool;
+  std::atomic<int> count(0);
+  const int kOuter = 4 * getThreadCount();
+  for (int i = 0; i < kOuter; ++i) {
+    threadPool.spawn([&] {
+      ThreadPool inner;
+      for (int j = 0; j < 100; ++j) {
+        inner.spawn([&] { ++count; });
+      }
+      inner.join();
+    });
+  }
+  threadPool.join();
+  EXPECT_EQ(count, kOuter * 100);
+}
+
+TEST_F(ThreadPoolTest, TestAsync) {
+  ThreadPool threadPool;
+  std::vector<std::future<int>> futures;
+  for (int i = 0; i < 100; ++i) {
+    futures.push_back(threadPool.async([i] { return i * i; }));
+  }
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(futures[i].get(), i * i);
+  }
+}
+
+TEST_F(ThreadPoolTest, TestParallelForTiles) {
+  const int kWidth = 37;
+  const int kHeight = 23;
+  std::vector<std::atomic<int>> visits(kWidth * kHeight);
+  for (std::atomic<int>& visit : visits) {
+    visit = 0;
+  }
+  ThreadPool threadPool;
+  threadPool.parallelForTiles(
+      1, 2, kWidth, kHeight, 8, 5, [&](int xBegin, int yBegin, int xEnd, int yEnd) {
+        for (int y = yBegin; y < yEnd; ++y) {
+          for (int x = xBegin; x < xEnd; ++x) {
+            ++visits[y * kWidth + x];
+          }
+        }
+      });
+  for (int y = 0; y < kHeight; ++y) {
+    for (int x = 0; x < kWidth; ++x) {
+      EXPECT_EQ(visits[y * kWidth + x], (x >= 1 && y >= 2) ? 1 : 0) << x << ", " << y;
+    }
+  }
+
+  std::atomic<int> sum(0);
+  threadPool.parallelFor(0, 1000, 64, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      sum += i;
+    }
+  });
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+}
+
+TEST_F(ThreadPoolTest, TestException) {
+  ThreadPool threadPool;
+  for (int i = 0; i < 10; ++i) {
+    threadPool.spawn([i] {
+      if (i == 5) {
+        throw std::runtime_error("task failed");
+      }
+    });
+  }
+  EXPECT_THROW(threadPool.join(), std::runtime_error);
+}
@@ -18,7 +18,9 @@
 
 #include <folly/Format.h>
 
+#include "source/util/DistanceTransform.h"
 #include "source/util/FilesystemUtil.h"
+#include "source/util/MaskedMedian.h"
 #include "source/util/MathUtil.h"
 #include "source/util/RawUtil.h"
 #include "source/util/SystemUtil.h"
@@ -332,55 +334,101 @@ inline cv::Mat_<bool> dilate(const cv::Mat_<bool>& mat, const int dilateRadius =
   return matDilated;
 }
 
+// Median of the neighbors of each pixel inside mask, see median_util::MaskedImage
+// Pixels outside mask are set to background, or to 0 if background is empty
 inline cv::Mat_<float> maskedMedianBlur(
     const cv::Mat_<float>& mat,
     const cv::Mat_<float>& background,
     const cv::Mat_<bool>& mask,
     const int radius,
-    const bool ignoreNan = true) {
-  cv::Mat_<float> blurred(mat.size(), 0.0);
+    const bool ignoreNan = true,
+    const int numThreads = -1) {
+  CHECK_EQ(mat.size(), mask.size());
+  if (!background.empty()) {
+    CHECK_EQ(mat.size(), background.size());
+  }
+
+  // Kernels need continuous images
+  const cv::Mat_<float> values = mat.isContinuous() ? mat : mat.clone();
+  const cv::Mat_<bool> maskValues = mask.isContinuous() ? mask : mask.clone();
+  const cv::Mat_<float> backgroundValues =
+      background.empty() || background.isContinuous() ? background : background.clone();
+  const median_util::MaskedImage in = {
+      values.ptr<float>(),
+      maskValues.ptr<uint8_t>(),
+      backgroundValues.empty() ? nullptr : backgroundValues.ptr<float>(),
+      mat.cols,
+      mat.rows,
+      ignoreNan};
+
+  cv::Mat_<float> blurred(mat.size());
+  const median_util::MedianKernel kernel = median_util::getMedianKernel(radius, ignoreNan);
+  const int kRowsPerTask = 8;
+  ThreadPool threadPool(numThreads);
+  threadPool.parallelFor(0, mat.rows, kRowsPerTask, [&](const int yBegin, const int yEnd) {
+    median_util::maskedMedianRows(in, radius, yBegin, yEnd, blurred.ptr<float>(), kernel);
+  });
+  return blurred;
+}
+
+// Nearest pixel where valid is true of each pixel, as the index y * cols + x, and the squared
+// distance to it, see distance_util. Pixels get distance_util::kNoValidPixel and INT_MAX if
+// there are no valid pixels
+inline void nearestValidPixels(
+    const cv::Mat_<bool>& valid,
+    cv::Mat_<int>& nearest,
+    cv::Mat_<int>& squaredDistances,
+    const int numThreads = -1) {
+  // Kernels need continuous images
+  const cv::Mat_<bool> validValues = valid.isContinuous() ? valid : valid.clone();
+  cv::Mat_<int> nearestRows(valid.size());
+  nearest.create(valid.size());
+  squaredDistances.create(valid.size());
+
+  const int kColsPerTask = 64;
+  const int kRowsPerTask = 8;
+  ThreadPool threadPool(numThreads);
+  threadPool.parallelFor(0, valid.cols, kColsPerTask, [&](const int xBegin, const int xEnd) {
+    distance_util::nearestValidInColumns(
+        validValues.ptr<uint8_t>(), valid.cols, valid.rows, xBegin, xEnd, nearestRows.ptr<int>());
+  });
+  threadPool.parallelFor(0, valid.rows, kRowsPerTask, [&](const int yBegin, const int yEnd) {
+    distance_util::nearestValidInRows(
+        nearestRows.ptr<int>(),
+        valid.cols,
+        yBegin,
+        yEnd,
+        nearest.ptr<int>(),
+        squaredDistances.ptr<int>());
+  });
+}
+
+// Pixels of mat where fill is true take the value of their nearest pixel where valid is true,
+// if it is at most maxDistance away, and keep their own value otherwise
+template <typename T>
+inline cv::Mat_<T> fillFromNearestValid(
+    const cv::Mat_<T>& mat,
+    const cv::Mat_<bool>& valid,
+    const cv::Mat_<bool>& fill,
+    const float maxDistance,
+    const int numThreads = -1) {
+  CHECK_EQ(mat.size(), valid.size());
+  CHECK_EQ(mat.size(), fill.size());
+  cv::Mat_<int> nearest;
+  cv::Mat_<int> squaredDistances;
+  nearestValidPixels(valid, nearest, squaredDistances, numThreads);
+
+  cv::Mat_<T> filled = mat.clone();
+  const float maxSquaredDistance = maxDistance * maxDistance;
   for (int y = 0; y < mat.rows; ++y) {
     for (int x = 0; x < mat.cols; ++x) {
-      std::vector<float> values;
-      if (!mask(y, x)) {
-        if (!background.empty()) {
-          blurred(y, x) = background(y, x);
-        }
-        continue;
-      }
-      for (int yy = y - radius; yy <= y + radius; ++yy) {
-        for (int xx = x - radius; xx <= x + radius; ++xx) {
-          // Ignore out of bounds
-          if (0 > yy || yy >= mat.rows || 0 > xx || xx >= mat.cols) {
-            continue;
-          }
-
-          // Ignore outside mask
-          if (!mask(yy, xx)) {
-            continue;
-          }
-
-          // Ignore NAN values if specified to do so
-          if (ignoreNan && (std::isnan(mat(yy, xx)) || mat(yy, xx) == 0)) {
-            continue;
-          }
-
-          values.push_back(mat(yy, xx));
-        }
-      }
-
-      if (values.size() != 0) {
-        const size_t n = values.size() / 2;
-        std::partial_sort(values.begin(), values.begin() + n + 1, values.end());
-        if (values.size() % 2 == 1) {
-          blurred(y, x) = values[n];
-        } else {
-          blurred(y, x) = (values[n - 1] + values[n]) / 2.0;
-        }
+      if (fill(y, x) && nearest(y, x) != distance_util::kNoValidPixel &&
+          squaredDistances(y, x) <= maxSquaredDistance) {
+        filled(y, x) = mat(nearest(y, x) / mat.cols, nearest(y, x) % mat.cols);
       }
     }
   }
-  return blurred;
+  return filled;
 }
 
 // Convert a BGR(A) cv::Mat to a RGBA vector<uint8_t>
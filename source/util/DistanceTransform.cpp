@@ -0,0 +1,136 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/DistanceTransform.h"
+
+#include <climits>
+#include <vector>
+
+namespace fb360_dep {
+namespace distance_util {
+
+namespace {
+
+// x coordinate where the parabolas (x - p)^2 + fp and (x - q)^2 + fq meet, p < q, as an exact
+// fraction so that equal crossings compare equal
+struct Crossing {
+  int64_t num;
+  int64_t den; // > 0
+};
+
+inline Crossing getCrossing(const int p, const int64_t fp, const int q, const int64_t fq) {
+  return {(fq + int64_t(q) * q) - (fp + int64_t(p) * p), 2 * int64_t(q - p)};
+}
+
+inline bool isLessEqual(const Crossing& a, const Crossing& b) {
+  return a.num * b.den <= b.num * a.den;
+}
+
+inline bool isLess(const Crossing& a, const int x) {
+  return a.num < x * a.den;
+}
+
+} // namespace
+
+void nearestValidInColumns(
+    const uint8_t* valid,
+    const int cols,
+    const int rows,
+    const int xBegin,
+    const int xEnd,
+    int* nearestRows) {
+  // Nearest valid row above, walking down the rows so that memory is read in order
+  for (int x = xBegin; x < xEnd; ++x) {
+    nearestRows[x] = valid[x] ? 0 : kNoValidPixel;
+  }
+  for (int y = 1; y < rows; ++y) {
+    const uint8_t* validRow = valid + y * cols;
+    const int* above = nearestRows + (y - 1) * cols;
+    int* row = nearestRows + y * cols;
+    for (int x = xBegin; x < xEnd; ++x) {
+      row[x] = validRow[x] ? y : above[x];
+    }
+  }
+
+  // Nearest valid row below, and the nearer of the two, with ties going up
+  std::vector<int> below(cols, kNoValidPixel);
+  for (int y = rows - 1; y >= 0; --y) {
+    const uint8_t* validRow = valid + y * cols;
+    int* row = nearestRows + y * cols;
+    for (int x = xBegin; x < xEnd; ++x) {
+      if (validRow[x]) {
+        below[x] = y;
+      }
+      if (below[x] != kNoValidPixel && (row[x] == kNoValidPixel || below[x] - y < y - row[x])) {
+        row[x] = below[x];
+      }
+    }
+  }
+}
+
+void nearestValidInRows(
+    const int* nearestRows,
+    const int cols,
+    const int yBegin,
+    const int yEnd,
+    int* nearest,
+    int* squaredDistances) {
+  std::vector<int> columns(cols); // of the parabolas in the lower envelope
+  std::vector<int64_t> heights(cols);
+  std::vector<Crossing> starts(cols); // where each parabola enters the envelope
+  for (int y = yBegin; y < yEnd; ++y) {
+    const int* row = nearestRows + y * cols;
+
+    // Lower envelope of the parabolas (x - q)^2 + (y - row[q])^2 of the columns with valid pixels
+    // A parabola that only touches the envelope at a crossing is dropped in favor of the one to
+    // its left
+    int k = -1;
+    for (int q = 0; q < cols; ++q) {
+      if (row[q] == kNoValidPixel) {
+        continue;
+      }
+      const int64_t fq = int64_t(y - row[q]) * (y - row[q]);
+      Crossing start = {0, 1};
+      while (k >= 0) {
+        start = getCrossing(columns[k], heights[k], q, fq);
+        if (k == 0 || !isLessEqual(start, starts[k])) {
+          break;
+        }
+        --k;
+      }
+      ++k;
+      columns[k] = q;
+      heights[k] = fq;
+      starts[k] = start;
+    }
+
+    int* nearestRow = nearest + y * cols;
+    int* squaredDistanceRow = squaredDistances + y * cols;
+    if (k < 0) {
+      for (int x = 0; x < cols; ++x) {
+        nearestRow[x] = kNoValidPixel;
+        squaredDistanceRow[x] = INT_MAX;
+      }
+      continue;
+    }
+
+    // At a crossing the parabola to the left wins
+    const int last = k;
+    k = 0;
+    for (int x = 0; x < cols; ++x) {
+      while (k < last && isLess(starts[k + 1], x)) {
+        ++k;
+      }
+      const int q = columns[k];
+      nearestRow[x] = row[q] * cols + q;
+      squaredDistanceRow[x] = int((x - q) * (x - q) + heights[k]);
+    }
+  }
+}
+
+} // namespace distance_util
+} // namespace fb360_dep
@@ -0,0 +1,48 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace fb360_dep {
+namespace distance_util {
+
+// Kernels behind cv_util::nearestValidPixels()
+// Exact Euclidean distance transform with the nearest valid pixel of every pixel, after
+// Felzenszwalb and Huttenlocher: a pass down the columns finds the nearest valid pixel of each
+// column, and a lower envelope of parabolas per row picks the nearest of those. Both passes are
+// linear in the number of pixels
+// Equally near valid pixels are broken by smallest x, then smallest y, so the nearest pixel
+// within distance d of a pixel only depends on the valid pixels within distance d of it
+// Images are continuous and row-major, cols x rows pixels
+
+const int kNoValidPixel = -1;
+
+// For columns [xBegin, xEnd), the row of the nearest valid pixel in the same column, or
+// kNoValidPixel if the column has none
+void nearestValidInColumns(
+    const uint8_t* valid,
+    const int cols,
+    const int rows,
+    const int xBegin,
+    const int xEnd,
+    int* nearestRows);
+
+// For rows [yBegin, yEnd), the index y * cols + x of the nearest valid pixel and the squared
+// distance to it, or kNoValidPixel and INT_MAX if there are no valid pixels
+// nearestRows is the output of nearestValidInColumns() over all columns
+void nearestValidInRows(
+    const int* nearestRows,
+    const int cols,
+    const int yBegin,
+    const int yEnd,
+    int* nearest,
+    int* squaredDistances);
+
+} // namespace distance_util
+} // namespace fb360_dep
@@ -0,0 +1,372 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/MaskedMedian.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DEP_MEDIAN_KERNELS_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace fb360_dep {
+namespace median_util {
+
+namespace {
+
+inline bool isIncluded(const MaskedImage& in, const int idx) {
+  if (!in.mask[idx]) {
+    return false;
+  }
+  const float value = in.values[idx];
+  return !in.ignoreNan || !(std::isnan(value) || value == 0);
+}
+
+inline float getBackground(const MaskedImage& in, const int idx) {
+  return in.background ? in.background[idx] : 0.0f;
+}
+
+// Median of the first n values, which are reordered
+inline float median(float* values, const int n) {
+  if (n == 0) {
+    return 0;
+  }
+  const int half = n / 2;
+  std::partial_sort(values, values + half + 1, values + n);
+  return n % 2 == 1 ? values[half] : (values[half - 1] + values[half]) / 2.0f;
+}
+
+// values needs room for (2 * radius + 1)^2 floats
+inline float filterPixelSort(
+    const MaskedImage& in,
+    const int radius,
+    const int x,
+    const int y,
+    float* values) {
+  if (!in.mask[y * in.cols + x]) {
+    return getBackground(in, y * in.cols + x);
+  }
+  int n = 0;
+  for (int yy = std::max(y - radius, 0); yy <= std::min(y + radius, in.rows - 1); ++yy) {
+    for (int xx = std::max(x - radius, 0); xx <= std::min(x + radius, in.cols - 1); ++xx) {
+      const int idx = yy * in.cols + xx;
+      if (isIncluded(in, idx)) {
+        values[n++] = in.values[idx];
+      }
+    }
+  }
+  return median(values, n);
+}
+
+// Order preserving 16-bit key of a float: top bits of its IEEE representation, with negative
+// values flipped so that they sort first
+inline int getKey(const float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+  return bits >> 16;
+}
+
+// Counts of keys in the window, fine bins grouped 256 at a time in coarse bins
+struct KeyHistogram {
+  std::vector<int> fine = std::vector<int>(1 << 16, 0);
+  std::vector<int> coarse = std::vector<int>(1 << 8, 0);
+  int count = 0;
+
+  void update(const int key, const int delta) {
+    fine[key] += delta;
+    coarse[key >> 8] += delta;
+    count += delta;
+  }
+
+  // Key of the value of the given rank, and the rank of that value among the ones with that key
+  std::pair<int, int> find(int rank) const {
+    int coarseBin = 0;
+    while (rank >= coarse[coarseBin]) {
+      rank -= coarse[coarseBin++];
+    }
+    int key = coarseBin << 8;
+    while (rank >= fine[key]) {
+      rank -= fine[key++];
+    }
+    return std::make_pair(key, rank);
+  }
+};
+
+} // namespace
+
+void maskedMedianRowsSort(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out) {
+  std::vector<float> values((2 * radius + 1) * (2 * radius + 1));
+  for (int y = yBegin; y < yEnd; ++y) {
+    for (int x = 0; x < in.cols; ++x) {
+      out[y * in.cols + x] = filterPixelSort(in, radius, x, y, values.data());
+    }
+  }
+}
+
+void maskedMedianRowsHistogram(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out) {
+  KeyHistogram histogram;
+  std::vector<float> values((2 * radius + 1) * (2 * radius + 1));
+
+  // Value of the given rank in the window around (x, y)
+  auto findValue = [&](const int x, const int y, const int rank) {
+    const std::pair<int, int> keyRank = histogram.find(rank);
+    int n = 0;
+    for (int yy = std::max(y - radius, 0); yy <= std::min(y + radius, in.rows - 1); ++yy) {
+      for (int xx = std::max(x - radius, 0); xx <= std::min(x + radius, in.cols - 1); ++xx) {
+        const int idx = yy * in.cols + xx;
+        if (isIncluded(in, idx) && getKey(in.values[idx]) == keyRank.first) {
+          values[n++] = in.values[idx];
+        }
+      }
+    }
+    std::nth_element(values.begin(), values.begin() + keyRank.second, values.begin() + n);
+    return values[keyRank.second];
+  };
+
+  for (int y = yBegin; y < yEnd; ++y) {
+    const int yFirst = std::max(y - radius, 0);
+    const int yLast = std::min(y + radius, in.rows - 1);
+    auto updateColumn = [&](const int x, const int delta) {
+      if (0 <= x && x < in.cols) {
+        for (int yy = yFirst; yy <= yLast; ++yy) {
+          const int idx = yy * in.cols + x;
+          if (isIncluded(in, idx)) {
+            histogram.update(getKey(in.values[idx]), delta);
+          }
+        }
+      }
+    };
+
+    for (int x = 0; x < radius; ++x) {
+      updateColumn(x, 1);
+    }
+    for (int x = 0; x < in.cols; ++x) {
+      updateColumn(x + radius, 1);
+      updateColumn(x - radius - 1, -1);
+
+      const int idx = y * in.cols + x;
+      if (!in.mask[idx]) {
+        out[idx] = getBackground(in, idx);
+      } else if (histogram.count == 0) {
+        out[idx] = 0;
+      } else {
+        const int lo = (histogram.count - 1) / 2;
+        const int hi = histogram.count / 2;
+        const float loValue = findValue(x, y, lo);
+        out[idx] = lo == hi ? loValue : (loValue + findValue(x, y, hi)) / 2.0f;
+      }
+    }
+
+    // Leave the histogram empty for the next row
+    for (int x = in.cols - radius - 1; x < in.cols; ++x) {
+      updateColumn(x, -1);
+    }
+  }
+}
+
+#ifdef DEP_MEDIAN_KERNELS_AVX2
+
+namespace {
+
+#define DEP_AVX2 __attribute__((target("avx2")))
+
+const int kMaxNetworkSize = (2 * kMaxNetworkRadius + 1) * (2 * kMaxNetworkRadius + 1);
+
+// Batcher's odd-even merge sort of the next power of 2 elements, without the comparators that
+// involve elements past size: those are +inf and already in place
+std::vector<std::pair<int, int>> getSortingNetwork(const int size) {
+  int n = 1;
+  while (n < size) {
+    n *= 2;
+  }
+  std::vector<std::pair<int, int>> network;
+  for (int p = 1; p < n; p *= 2) {
+    for (int k = p; k >= 1; k /= 2) {
+      for (int j = k % p; j <= n - 1 - k; j += 2 * k) {
+        for (int i = 0; i <= std::min(k - 1, n - j - k - 1); ++i) {
+          const int a = i + j;
+          const int b = i + j + k;
+          if (a / (2 * p) == b / (2 * p) && b < size) {
+            network.emplace_back(a, b);
+          }
+        }
+      }
+    }
+  }
+  return network;
+}
+
+const std::vector<std::pair<int, int>>& getNetwork(const int radius) {
+  static const std::vector<std::pair<int, int>> networks[kMaxNetworkRadius + 1] = {
+      {}, getSortingNetwork(9), getSortingNetwork(25)};
+  return networks[radius];
+}
+
+// 8 consecutive pixels of a row at a time, the ones too close to the left and right edges go
+// through filterPixelSort()
+DEP_AVX2 void maskedMedianRowsNetworkAvx2(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out) {
+  const int size = (2 * radius + 1) * (2 * radius + 1);
+  const std::vector<std::pair<int, int>>& network = getNetwork(radius);
+  std::vector<float> values(size);
+  __m256 sorted[kMaxNetworkSize];
+
+  const __m256 inf = _mm256_set1_ps(INFINITY);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const int xVectorEnd = in.cols - radius - 8;
+  for (int y = yBegin; y < yEnd; ++y) {
+    int x = 0;
+    for (; x < radius; ++x) {
+      out[y * in.cols + x] = filterPixelSort(in, radius, x, y, values.data());
+    }
+    for (; x <= xVectorEnd; x += 8) {
+      __m256 count = zero;
+      int k = 0;
+      for (int yy = y - radius; yy <= y + radius; ++yy) {
+        if (yy < 0 || yy >= in.rows) {
+          for (int xx = -radius; xx <= radius; ++xx) {
+            sorted[k++] = inf;
+          }
+          continue;
+        }
+        for (int xx = x - radius; xx <= x + radius; ++xx) {
+          const int idx = yy * in.cols + xx;
+          const __m256 value = _mm256_loadu_ps(in.values + idx);
+          const __m128i mask8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in.mask + idx));
+          __m256 included = _mm256_castsi256_ps(
+              _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(mask8), _mm256_setzero_si256()));
+          if (in.ignoreNan) {
+            // Ordered and not equal: neither NAN nor 0
+            included = _mm256_and_ps(included, _mm256_cmp_ps(value, zero, _CMP_NEQ_OQ));
+          }
+          sorted[k++] = _mm256_blendv_ps(inf, value, included);
+          count = _mm256_add_ps(count, _mm256_and_ps(included, one));
+        }
+      }
+
+      for (const std::pair<int, int>& comparator : network) {
+        const __m256 a = sorted[comparator.first];
+        const __m256 b = sorted[comparator.second];
+        sorted[comparator.first] = _mm256_min_ps(a, b);
+        sorted[comparator.second] = _mm256_max_ps(a, b);
+      }
+
+      // Ranks of the two middle values, equal for odd counts
+      const __m256 loRank = _mm256_floor_ps(_mm256_mul_ps(_mm256_sub_ps(count, one), half));
+      const __m256 hiRank = _mm256_floor_ps(_mm256_mul_ps(count, half));
+      __m256 lo = zero;
+      __m256 hi = zero;
+      for (int rank = 0; rank < size; ++rank) {
+        const __m256 rankValue = _mm256_set1_ps(rank);
+        lo = _mm256_blendv_ps(lo, sorted[rank], _mm256_cmp_ps(loRank, rankValue, _CMP_EQ_OQ));
+        hi = _mm256_blendv_ps(hi, sorted[rank], _mm256_cmp_ps(hiRank, rankValue, _CMP_EQ_OQ));
+      }
+      const __m256 median = _mm256_blendv_ps(
+          _mm256_mul_ps(_mm256_add_ps(lo, hi), half),
+          zero,
+          _mm256_cmp_ps(count, zero, _CMP_EQ_OQ));
+
+      const int idx = y * in.cols + x;
+      const __m128i mask8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in.mask + idx));
+      const __m256 masked = _mm256_castsi256_ps(
+          _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(mask8), _mm256_setzero_si256()));
+      const __m256 background = in.background ? _mm256_loadu_ps(in.background + idx) : zero;
+      _mm256_storeu_ps(out + idx, _mm256_blendv_ps(background, median, masked));
+    }
+    for (; x < in.cols; ++x) {
+      out[y * in.cols + x] = filterPixelSort(in, radius, x, y, values.data());
+    }
+  }
+}
+
+#undef DEP_AVX2
+
+} // namespace
+
+bool hasAvx2MedianKernels() {
+  static const bool result = __builtin_cpu_supports("avx2");
+  return result;
+}
+
+#else
+
+bool hasAvx2MedianKernels() {
+  return false;
+}
+
+#endif // DEP_MEDIAN_KERNELS_AVX2
+
+void maskedMedianRowsNetwork(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out) {
+#ifdef DEP_MEDIAN_KERNELS_AVX2
+  if (1 <= radius && radius <= kMaxNetworkRadius && hasAvx2MedianKernels()) {
+    maskedMedianRowsNetworkAvx2(in, radius, yBegin, yEnd, out);
+    return;
+  }
+#endif
+  maskedMedianRowsSort(in, radius, yBegin, yEnd, out);
+}
+
+MedianKernel getMedianKernel(const int radius, const bool ignoreNan) {
+  if (!ignoreNan || radius < 1) {
+    return MedianKernel::sort;
+  }
+  if (radius <= kMaxNetworkRadius) {
+    // Histograms only pay off from radius 3 on
+    return hasAvx2MedianKernels() ? MedianKernel::network : MedianKernel::sort;
+  }
+  return MedianKernel::histogram;
+}
+
+void maskedMedianRows(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out,
+    const MedianKernel kernel) {
+  switch (kernel) {
+    case MedianKernel::network:
+      maskedMedianRowsNetwork(in, radius, yBegin, yEnd, out);
+      return;
+    case MedianKernel::histogram:
+      maskedMedianRowsHistogram(in, radius, yBegin, yEnd, out);
+      return;
+    case MedianKernel::sort:
+      maskedMedianRowsSort(in, radius, yBegin, yEnd, out);
+      return;
+  }
+}
+
+} // namespace median_util
+} // namespace fb360_dep
@@ -0,0 +1,79 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace fb360_dep {
+namespace median_util {
+
+// Kernels behind cv_util::maskedMedianBlur()
+// The median of a pixel is taken over the (2 * radius + 1)^2 neighbors that are inside the image
+// and the mask, and, with ignoreNan, that are neither NAN nor 0. An even number of values gives
+// the mean of the two middle ones, and no values give 0. Pixels outside the mask get their
+// background value, or 0 if there is no background
+// All kernels give the same result, bit for bit
+
+// Continuous, row-major images of cols x rows pixels
+struct MaskedImage {
+  const float* values;
+  const uint8_t* mask;
+  const float* background; // nullptr = no background
+  int cols;
+  int rows;
+  bool ignoreNan;
+};
+
+// Sorting networks cover radius 1 and 2, the histogram kernel any radius
+enum struct MedianKernel { sort, network, histogram };
+
+const int kMaxNetworkRadius = 2;
+
+bool hasAvx2MedianKernels();
+
+// Picks the fastest kernel for radius and ignoreNan
+MedianKernel getMedianKernel(const int radius, const bool ignoreNan);
+
+// Filters rows [yBegin, yEnd) into out, which is cols floats per row
+void maskedMedianRows(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out,
+    const MedianKernel kernel);
+
+// Reference: neighbors of each pixel are gathered and partially sorted
+void maskedMedianRowsSort(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out);
+
+// Full sorting network over the neighbors of 8 pixels at a time, with excluded neighbors set to
+// +inf so they sort last. Needs radius <= kMaxNetworkRadius, and AVX2 (sort is used otherwise)
+void maskedMedianRowsNetwork(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out);
+
+// Sliding window histogram of the top 16 bits of the values, with two levels so finding a rank
+// costs at most 512 bins. The values of the bin holding the median are then gathered and
+// partially sorted. Needs ignoreNan
+void maskedMedianRowsHistogram(
+    const MaskedImage& in,
+    const int radius,
+    const int yBegin,
+    const int yEnd,
+    float* out);
+
+} // namespace median_util
+} // namespace fb360_dep
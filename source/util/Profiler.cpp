@@ -0,0 +1,185 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "source/util/Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include <glog/logging.h>
+
+#include <folly/FileUtil.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+namespace fb360_dep {
+namespace profiler {
+
+int getThreadIdx() {
+  static std::atomic<int> nextThreadIdx(0);
+  thread_local const int threadIdx = nextThreadIdx++;
+  return threadIdx;
+}
+
+int64_t Counter::total() const {
+  int64_t total = 0;
+  for (const Shard& shard : shards) {
+    total += shard.value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void Counter::reset() {
+  for (Shard& shard : shards) {
+    shard.value.store(0, std::memory_order_relaxed);
+  }
+}
+
+// Resident set size, 0 where unsupported
+static int64_t getResidentBytes() {
+#ifdef WIN32
+  return 0;
+#else
+  std::ifstream statm("/proc/self/statm");
+  int64_t sizePages = 0;
+  int64_t residentPages = 0;
+  if (!(statm >> sizePages >> residentPages)) {
+    return 0;
+  }
+  return residentPages * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Peak resident set size of the process so far, 0 where unsupported
+static int64_t getPeakResidentBytes() {
+#ifdef WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return int64_t(usage.ru_maxrss) * 1024; // kilobytes on Linux
+#endif
+}
+
+static int64_t getSteadyUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static const int64_t kStartUs = getSteadyUs();
+
+Profiler::Profiler() {}
+
+Profiler& Profiler::instance() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Counter& Profiler::counter(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<Counter>& slot = counters[name];
+  if (!slot) {
+    slot.reset(new Counter(enabled));
+  }
+  return *slot;
+}
+
+int64_t Profiler::nowUs() const {
+  return getSteadyUs() - kStartUs;
+}
+
+void Profiler::addScope(const std::string& name, const int64_t beginUs, const int64_t endUs) {
+  if (!isEnabled()) {
+    return;
+  }
+  const int threadIdx = getThreadIdx();
+  std::lock_guard<std::mutex> lock(mutex);
+  events.push_back({name, 'X', beginUs, endUs - beginUs, threadIdx, 0});
+}
+
+void Profiler::addSample(const std::string& name, const double value) {
+  if (!isEnabled()) {
+    return;
+  }
+  const int64_t timeUs = nowUs();
+  std::lock_guard<std::mutex> lock(mutex);
+  events.push_back({name, 'C', timeUs, 0, 0, value});
+}
+
+void Profiler::sampleMemory() {
+  if (!isEnabled()) {
+    return;
+  }
+  const int64_t residentBytes = getResidentBytes();
+  const int64_t peakBytes = getPeakResidentBytes();
+  addSample("resident memory (MB)", residentBytes / double(1 << 20));
+  std::lock_guard<std::mutex> lock(mutex);
+  peakResidentBytes = std::max({peakResidentBytes, residentBytes, peakBytes});
+}
+
+void Profiler::writeChromeTrace(const filesystem::path& filename) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  folly::dynamic traceEvents = folly::dynamic::array;
+  for (const Event& event : events) {
+    folly::dynamic traceEvent = folly::dynamic::object("name", event.name)(
+        "ph", std::string(1, event.phase))("ts", event.timeUs)("pid", 0)("tid", event.threadIdx);
+    if (event.phase == 'X') {
+      traceEvent["dur"] = event.durationUs;
+    } else {
+      traceEvent["args"] = folly::dynamic::object("value", event.value);
+    }
+    traceEvents.push_back(traceEvent);
+  }
+
+  folly::dynamic counterTotals = folly::dynamic::object;
+  for (const auto& entry : counters) {
+    counterTotals[entry.first] = entry.second->total();
+  }
+
+  folly::dynamic trace = folly::dynamic::object("traceEvents", traceEvents)(
+      "displayTimeUnit", "ms")(
+      "otherData",
+      folly::dynamic::object("counters", counterTotals)("peakResidentBytes", peakResidentBytes));
+  if (filename.has_parent_path()) {
+    filesystem::create_directories(filename.parent_path());
+  }
+  CHECK(folly::writeFile(folly::toPrettyJson(trace), filename.string().c_str()))
+      << "Cannot write profile to " << filename;
+}
+
+void Profiler::reset() {
+  std::lock_guard<std::mutex> lock(mutex);
+  events.clear();
+  for (auto& entry : counters) {
+    entry.second->reset();
+  }
+  peakResidentBytes = 0;
+}
+
+ScopedTimer::ScopedTimer(const std::string& name)
+    : name(name),
+      beginUs(Profiler::instance().isEnabled() ? Profiler::instance().nowUs() : -1) {}
+
+ScopedTimer::~ScopedTimer() {
+  if (beginUs >= 0) {
+    Profiler& profiler = Profiler::instance();
+    profiler.addScope(name, beginUs, profiler.nowUs());
+    profiler.sampleMemory();
+  }
+}
+
+} // namespace profiler
+} // namespace fb360_dep
@@ -0,0 +1,120 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "source/util/FilesystemUtil.h"
+
+namespace fb360_dep {
+namespace profiler {
+
+// Small dense index of the calling thread, assigned on first use
+int getThreadIdx();
+
+// Event count that many threads can bump at once
+// Each thread adds to its own cache line, lines are only summed up when the total is read
+class Counter {
+ public:
+  explicit Counter(const std::atomic<bool>& enabled) : enabled(enabled) {}
+
+  void add(const int64_t value = 1) {
+    if (enabled.load(std::memory_order_relaxed)) {
+      shards[getThreadIdx() % kNumShards].value.fetch_add(value, std::memory_order_relaxed);
+    }
+  }
+
+  int64_t total() const;
+  void reset();
+
+ private:
+  static const int kNumShards = 32;
+  struct Shard {
+    std::atomic<int64_t> value{0};
+    char padding[64 - sizeof(std::atomic<int64_t>)]; // values of two shards never share a line
+  };
+
+  const std::atomic<bool>& enabled;
+  std::array<Shard, kNumShards> shards;
+};
+
+// Process-wide instrumentation: timed scopes, counters, sampled values and resident memory
+// Everything recorded between two resets is written out as a Chrome trace, which can be opened in
+// chrome://tracing or https://ui.perfetto.dev
+// Off by default, in which case timers and counters only cost a branch
+class Profiler {
+ public:
+  static Profiler& instance();
+
+  void setEnabled(const bool enabledIn) {
+    enabled.store(enabledIn, std::memory_order_relaxed);
+  }
+
+  bool isEnabled() const {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  // Counters are never destroyed, so call sites can keep a static reference
+  Counter& counter(const std::string& name);
+
+  void addScope(const std::string& name, const int64_t beginUs, const int64_t endUs);
+
+  // Value of a quantity at this point in time, e.g. pixels changed by an iteration
+  void addSample(const std::string& name, const double value);
+
+  // Resident memory of the process at this point in time, and peak so far
+  void sampleMemory();
+
+  // Counter totals and peak resident memory are stored in "otherData"
+  void writeChromeTrace(const filesystem::path& filename) const;
+
+  // Clears events and counters, e.g. between frames
+  void reset();
+
+  // Microseconds since the process started profiling
+  int64_t nowUs() const;
+
+ private:
+  Profiler();
+
+  struct Event {
+    std::string name;
+    char phase; // X = complete scope, C = counter sample
+    int64_t timeUs;
+    int64_t durationUs;
+    int threadIdx;
+    double value;
+  };
+
+  std::atomic<bool> enabled{false};
+  mutable std::mutex mutex;
+  std::vector<Event> events;
+  std::map<std::string, std::unique_ptr<Counter>> counters;
+  int64_t peakResidentBytes = 0;
+};
+
+// Times the enclosing scope, if profiling is enabled
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(const std::string& name);
+  ~ScopedTimer();
+
+ private:
+  const std::string name;
+  const int64_t beginUs; // -1 if profiling is disabled
+};
+
+} // namespace profiler
+} // namespace fb360_dep
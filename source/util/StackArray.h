@@ -0,0 +1,14 @@
+/**
+ * Copyright 2004-present Facebook. All Rights Reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <alloca.h>
+
+// equivalent to TYPE NAME[SIZE] but sized at runtime
+// Lives until the calling function returns, so only for small sizes with a known bound
+#define STACK_ARRAY(TYPE, NAME, SIZE) TYPE* const NAME = (TYPE*)alloca(sizeof(TYPE) * (SIZE))
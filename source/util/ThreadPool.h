@@ -7,7 +7,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -19,13 +27,170 @@ inline int getThreadCount() {
   return std::max<int>(1, std::thread::hardware_concurrency());
 }
 
+// Persistent set of worker threads, created once and shared by every ThreadPool in the process
+//
+// Each worker owns a deque of tasks. A worker pushes and pops at the back of its own deque (LIFO,
+// cache friendly for nested work) and, when it runs dry, steals from the front of the injection
+// queue and of the other workers' deques (FIFO, oldest and usually largest work first). Tasks
+// submitted from threads outside the pool go to the injection queue
+class WorkStealingPool {
+ public:
+  using Task = std::function<void()>;
+
+  static WorkStealingPool& instance() {
+    static WorkStealingPool pool(getThreadCount());
+    return pool;
+  }
+
+  explicit WorkStealingPool(const int numWorkers) : queues(numWorkers) {
+    for (int i = 0; i < numWorkers; ++i) {
+      workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  int getNumWorkers() const {
+    return workers.size();
+  }
+
+  void submit(Task task) {
+    const int self = currentWorkerIndex();
+    TaskQueue& queue = self >= 0 ? queues[self] : injection;
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      ++numQueued;
+    }
+    wakeup.notify_one();
+  }
+
+  // Runs a single queued task on the calling thread, if there is one
+  // Threads that wait for their own tasks use this to help instead of blocking, which also makes
+  // nested parallelism (tasks that spawn and join tasks) deadlock free
+  bool tryRunPendingTask() {
+    Task task;
+    if (!popTask(currentWorkerIndex(), task)) {
+      return false;
+    }
+    task();
+    return true;
+  }
+
+ private:
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Index of the calling thread in this pool, -1 if it is not one of its workers
+  int currentWorkerIndex() const {
+    return currentPool() == this ? currentIndex() : -1;
+  }
+
+  static const WorkStealingPool*& currentPool() {
+    static thread_local const WorkStealingPool* pool = nullptr;
+    return pool;
+  }
+
+  static int& currentIndex() {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  static bool popBack(TaskQueue& queue, Task& task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+  }
+
+  static bool popFront(TaskQueue& queue, Task& task) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    return true;
+  }
+
+  bool popTask(const int self, Task& task) {
+    bool found = self >= 0 && popBack(queues[self], task);
+    found = found || popFront(injection, task);
+    const int numQueues = queues.size();
+    for (int i = 1; !found && i <= numQueues; ++i) {
+      const int victim = (std::max(self, 0) + i) % numQueues;
+      found = victim != self && popFront(queues[victim], task);
+    }
+    if (found) {
+      --numQueued;
+    }
+    return found;
+  }
+
+  void workerLoop(const int index) {
+    currentPool() = this;
+    currentIndex() = index;
+    while (true) {
+      Task task;
+      if (popTask(index, task)) {
+        task();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMutex);
+      wakeup.wait(lock, [this] { return stopping || numQueued > 0; });
+      if (stopping && numQueued <= 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<TaskQueue> queues;
+  TaskQueue injection;
+  std::vector<std::thread> workers;
+
+  std::mutex sleepMutex;
+  std::condition_variable wakeup;
+  std::atomic<int> numQueued{0};
+  bool stopping = false;
+};
+
+// Group of tasks that run on the shared WorkStealingPool
+// spawn() never creates a thread: it queues the task, and at most maxThreads tasks of the group
+// are in flight at any time. join() waits for all of them, running queued work while it waits,
+// and rethrows the first exception thrown by a task. maxThreads = 0 runs every task inline
 struct ThreadPool {
-  ThreadPool(const int maxThreadsFlag) {
+  ThreadPool(const int maxThreadsFlag) : state(std::make_shared<State>()) {
     maxThreads = ThreadPool::getThreadCountFromFlag(maxThreadsFlag);
   }
-  ThreadPool() {
+  ThreadPool() : state(std::make_shared<State>()) {
     maxThreads = ThreadPool::getThreadCountFromFlag(-1);
   }
+  ~ThreadPool() {
+    waitUntil([this] { return state->pending == 0; });
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
   static int getThreadCountFromFlag(const int maxThreadsFlag) {
     return (maxThreadsFlag < 0) ? getThreadCount() : maxThreadsFlag;
   }
@@ -37,21 +202,122 @@ struct ThreadPool {
     if (maxThreads == 0) {
       fn(std::forward<Args>(args)...);
     } else {
-      if (int(threads.size()) == maxThreads) {
-        join();
-      }
-      threads.emplace_back(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      // Arguments are copied, same as std::thread: use std::ref/std::cref to pass references
+      submit(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...));
     }
   }
   void join() {
-    for (std::thread& thread : threads) {
-      thread.join();
+    waitUntil([this] { return state->pending == 0; });
+    std::exception_ptr exception;
+    std::swap(exception, state->exception);
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+
+  // Runs fn() on the pool and returns a future with its result
+  template <class Fn>
+  auto async(Fn&& fn) -> std::future<decltype(fn())> {
+    using Result = decltype(fn());
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
+    std::future<Result> future = task->get_future();
+    if (maxThreads == 0) {
+      (*task)();
+    } else {
+      submit([task] { (*task)(); });
     }
-    threads.clear();
+    return future;
+  }
+
+  // Calls fn(chunkBegin, chunkEnd) for consecutive chunks of [begin, end) of at most grainSize
+  // elements, and waits for all of them
+  template <class Fn>
+  void parallelFor(const int begin, const int end, const int grainSize, Fn fn) {
+    const int grain = std::max(grainSize, 1);
+    for (int chunkBegin = begin; chunkBegin < end; chunkBegin += grain) {
+      const int chunkEnd = std::min(chunkBegin + grain, end);
+      spawn([&fn, chunkBegin, chunkEnd] { fn(chunkBegin, chunkEnd); });
+    }
+    join();
+  }
+
+  // Calls fn(xBegin, yBegin, xEnd, yEnd) for every tileWidth x tileHeight tile of the rectangle
+  // [xBegin, xEnd) x [yBegin, yEnd), and waits for all of them
+  template <class Fn>
+  void parallelForTiles(
+      const int xBegin,
+      const int yBegin,
+      const int xEnd,
+      const int yEnd,
+      const int tileWidth,
+      const int tileHeight,
+      Fn fn) {
+    const int edgeX = std::max(tileWidth, 1);
+    const int edgeY = std::max(tileHeight, 1);
+    for (int y = yBegin; y < yEnd; y += edgeY) {
+      for (int x = xBegin; x < xEnd; x += edgeX) {
+        const int xTileEnd = std::min(x + edgeX, xEnd);
+        const int yTileEnd = std::min(y + edgeY, yEnd);
+        spawn([&fn, x, y, xTileEnd, yTileEnd] { fn(x, y, xTileEnd, yTileEnd); });
+      }
+    }
+    join();
   }
 
  private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending = 0;
+    std::exception_ptr exception;
+  };
+
+  template <class Task>
+  void submit(Task&& task) {
+    // Honor maxThreads by keeping at most that many tasks of this group in flight
+    waitUntil([this] { return state->pending < maxThreads; });
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      ++state->pending;
+    }
+    std::shared_ptr<State> groupState = state;
+    WorkStealingPool::instance().submit([groupState, task]() mutable {
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(groupState->mutex);
+        if (!groupState->exception) {
+          groupState->exception = std::current_exception();
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(groupState->mutex);
+        --groupState->pending;
+      }
+      groupState->done.notify_all();
+    });
+  }
+
+  // Helps the pool while waiting, so a pool thread that joins a nested group never idles on it
+  template <class Predicate>
+  void waitUntil(Predicate predicate) {
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (predicate()) {
+          return;
+        }
+      }
+      if (WorkStealingPool::instance().tryRunPendingTask()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->done.wait(lock, predicate);
+      return;
+    }
+  }
+
   int maxThreads;
-  std::vector<std::thread> threads;
+  std::shared_ptr<State> state;
 };
 } // namespace fb360_dep